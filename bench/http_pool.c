@@ -0,0 +1,124 @@
+#include "app/http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Per-request latency of a cold handle (fresh easy handle, no share, no
+ * connection reuse) versus the warm pool used by the lyrics providers.
+ *
+ * Usage: http_pool [URL] [COUNT]
+ */
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static size_t discard_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  (void)ptr;
+  (void)userdata;
+  return size * nmemb;
+}
+
+static int cold_get(const char *url) {
+  CURL *curl = curl_easy_init();
+  CURLcode res;
+
+  if (!curl) {
+    return -1;
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_cb);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "csong/0.1.0");
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  res = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+  return res == CURLE_OK ? 0 : -1;
+}
+
+static int warm_get(const char *url) {
+  http_buffer buf;
+  long code = 0;
+  int result = http_get(url, &buf, &code);
+  http_buffer_free(&buf);
+  return result;
+}
+
+static void report(const char *label, double *samples, int count, int failed) {
+  double total = 0.0;
+  int i;
+
+  if (count == 0) {
+    printf("%-6s no successful requests (%d failed)\n", label, failed);
+    return;
+  }
+  for (i = 0; i < count; i++) {
+    total += samples[i];
+  }
+  qsort(samples, (size_t)count, sizeof(*samples), compare_double);
+  printf("%-6s n=%d failed=%d min=%.1fms median=%.1fms mean=%.1fms "
+         "max=%.1fms\n",
+         label, count, failed, samples[0], samples[count / 2],
+         total / count, samples[count - 1]);
+}
+
+static void run(const char *label, int (*get)(const char *), const char *url,
+                int count) {
+  double *samples = (double *)calloc((size_t)count, sizeof(*samples));
+  int ok = 0;
+  int failed = 0;
+  int i;
+
+  if (!samples) {
+    return;
+  }
+  for (i = 0; i < count; i++) {
+    double start = now_ms();
+    if (get(url) == 0) {
+      samples[ok++] = now_ms() - start;
+    } else {
+      failed++;
+    }
+  }
+  report(label, samples, ok, failed);
+  free(samples);
+}
+
+int main(int argc, char **argv) {
+  const char *url = "https://lrclib.net/api/get?track_name=Houdini&"
+                    "artist_name=Dua%20Lipa";
+  int count = 10;
+
+  if (argc > 1) {
+    url = argv[1];
+  }
+  if (argc > 2) {
+    count = atoi(argv[2]);
+    if (count <= 0) {
+      count = 10;
+    }
+  }
+
+  if (http_init() != 0) {
+    fprintf(stderr, "http init failed\n");
+    return 1;
+  }
+
+  printf("url: %s\n", url);
+  run("cold", cold_get, url, count);
+  warm_get(url);
+  run("warm", warm_get, url, count);
+
+  http_shutdown();
+  return 0;
+}
@@ -0,0 +1,228 @@
+#include "app/json_stream.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define JSMN_STATIC
+#include "jsmn.h"
+
+/*
+ * Parses a synthetic lrclib /api/search payload with the previous
+ * two-pass jsmn approach (token array plus an unescaped copy of every
+ * lyrics string) and with the streaming extractor fed in network-sized
+ * chunks.
+ *
+ * Usage: json_stream [RESULTS] [ITERATIONS]
+ */
+
+#define CHUNK_SIZE 16384
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const char *text) {
+  size_t add = strlen(text);
+  if (*len + add + 1 > *cap) {
+    while (*len + add + 1 > *cap) {
+      *cap = *cap ? *cap * 2 : 65536;
+    }
+    *buf = (char *)realloc(*buf, *cap);
+    if (!*buf) {
+      exit(1);
+    }
+  }
+  memcpy(*buf + *len, text, add + 1);
+  *len += add;
+}
+
+/* Roughly 60 lines per song, escaped the way lrclib sends them. */
+static char *build_payload(int results, size_t *out_len) {
+  char *buf = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  char line[256];
+  int r;
+  int l;
+
+  append(&buf, &len, &cap, "[");
+  for (r = 0; r < results; r++) {
+    snprintf(line, sizeof(line),
+             "%s{\"id\":%d,\"trackName\":\"Song \\u00e9 %d\","
+             "\"artistName\":\"Artist\",\"albumName\":\"Album\","
+             "\"duration\":%d.0,\"instrumental\":false,\"plainLyrics\":\"",
+             r ? "," : "", 1000 + r, r, 180 + r);
+    append(&buf, &len, &cap, line);
+    for (l = 0; l < 60; l++) {
+      snprintf(line, sizeof(line),
+               "This is lyric line %d of result %d, \\\"quoted\\\"\\n", l, r);
+      append(&buf, &len, &cap, line);
+    }
+    append(&buf, &len, &cap, "\",\"syncedLyrics\":\"");
+    for (l = 0; l < 60; l++) {
+      snprintf(line, sizeof(line),
+               "[%02d:%02d.%02d] This is lyric line %d of result %d\\n",
+               l / 20, (l * 3) % 60, l % 100, l, r);
+      append(&buf, &len, &cap, line);
+    }
+    append(&buf, &len, &cap, "\"}");
+  }
+  append(&buf, &len, &cap, "]");
+  *out_len = len;
+  return buf;
+}
+
+static int tok_next(const jsmntok_t *tokens, int index) {
+  int i = index + 1;
+  int count = tokens[index].size;
+
+  if (tokens[index].type == JSMN_OBJECT) {
+    for (; count > 0; count--) {
+      i = tok_next(tokens, tok_next(tokens, i));
+    }
+  } else if (tokens[index].type == JSMN_ARRAY) {
+    for (; count > 0; count--) {
+      i = tok_next(tokens, i);
+    }
+  }
+  return i;
+}
+
+static int tok_is(const char *json, const jsmntok_t *tok, const char *key) {
+  size_t len = strlen(key);
+  return tok->type == JSMN_STRING && (size_t)(tok->end - tok->start) == len &&
+         strncmp(json + tok->start, key, len) == 0;
+}
+
+static int legacy_parse(const char *json, double target, char **out_text) {
+  jsmn_parser parser;
+  jsmntok_t *tokens;
+  char *best = NULL;
+  double best_diff = 1e9;
+  int count;
+  int i = 1;
+  int item;
+
+  jsmn_init(&parser);
+  count = jsmn_parse(&parser, json, strlen(json), NULL, 0);
+  if (count <= 0) {
+    return -1;
+  }
+  tokens = (jsmntok_t *)calloc((size_t)count, sizeof(*tokens));
+  if (!tokens) {
+    return -1;
+  }
+  jsmn_init(&parser);
+  jsmn_parse(&parser, json, strlen(json), tokens, (unsigned int)count);
+
+  for (item = 0; item < tokens[0].size; item++) {
+    int k = i + 1;
+    int fields = tokens[i].size;
+    double diff = 1e6;
+    char *synced = NULL;
+
+    for (; fields > 0; fields--) {
+      const jsmntok_t *value = &tokens[k + 1];
+      if (tok_is(json, &tokens[k], "duration")) {
+        diff = fabs(target - strtod(json + value->start, NULL));
+      } else if (value->type == JSMN_STRING &&
+                 (tok_is(json, &tokens[k], "syncedLyrics") ||
+                  tok_is(json, &tokens[k], "plainLyrics"))) {
+        char *text = json_unescape_range(json + value->start,
+                                         (size_t)(value->end - value->start));
+        if (tok_is(json, &tokens[k], "syncedLyrics")) {
+          free(synced);
+          synced = text;
+        } else {
+          free(text);
+        }
+      }
+      k = tok_next(tokens, k + 1);
+    }
+    if (synced && diff < best_diff) {
+      free(best);
+      best = synced;
+      best_diff = diff;
+    } else {
+      free(synced);
+    }
+    i = tok_next(tokens, i);
+  }
+
+  free(tokens);
+  *out_text = best;
+  return best ? 0 : -1;
+}
+
+static int stream_parse(const char *json, size_t len, double target,
+                        char **out_text) {
+  json_stream js;
+  size_t off;
+  int timed = 0;
+  int result;
+
+  json_stream_init(&js, target, 0);
+  for (off = 0; off < len; off += CHUNK_SIZE) {
+    size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+    json_stream_feed(&js, json + off, n);
+  }
+  result = json_stream_finish(&js, out_text, &timed);
+  json_stream_free(&js);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  int results = 40;
+  int iterations = 200;
+  size_t len = 0;
+  char *payload;
+  char *legacy_text = NULL;
+  char *stream_text = NULL;
+  double target;
+  double start;
+  double legacy_ms;
+  double stream_ms;
+  int i;
+
+  if (argc > 1 && atoi(argv[1]) > 0) {
+    results = atoi(argv[1]);
+  }
+  if (argc > 2 && atoi(argv[2]) > 0) {
+    iterations = atoi(argv[2]);
+  }
+  payload = build_payload(results, &len);
+  target = 180.0 + results / 2;
+
+  if (legacy_parse(payload, target, &legacy_text) != 0 ||
+      stream_parse(payload, len, target, &stream_text) != 0 ||
+      strcmp(legacy_text, stream_text) != 0) {
+    fprintf(stderr, "parsers disagree\n");
+    return 1;
+  }
+  free(legacy_text);
+  free(stream_text);
+
+  start = now_ms();
+  for (i = 0; i < iterations; i++) {
+    legacy_parse(payload, target, &legacy_text);
+    free(legacy_text);
+  }
+  legacy_ms = (now_ms() - start) / iterations;
+
+  start = now_ms();
+  for (i = 0; i < iterations; i++) {
+    stream_parse(payload, len, target, &stream_text);
+    free(stream_text);
+  }
+  stream_ms = (now_ms() - start) / iterations;
+
+  printf("payload: %d results, %zu bytes\n", results, len);
+  printf("jsmn   %.3f ms/parse\n", legacy_ms);
+  printf("stream %.3f ms/parse\n", stream_ms);
+  free(payload);
+  return 0;
+}
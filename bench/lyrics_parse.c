@@ -0,0 +1,252 @@
+#include "app/lyrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Parses a synthetic LRC file with the previous strtok_r/sscanf parser
+ * (one realloc per line, one strdup per time tag, double seconds) and with
+ * lyrics_parse. Every fourth line is a chorus carrying several time tags.
+ *
+ * Usage: lyrics_parse [LINES] [ITERATIONS]
+ */
+
+typedef struct legacy_line {
+  double time;
+  char *text;
+  int has_time;
+} legacy_line;
+
+typedef struct legacy_doc {
+  legacy_line *lines;
+  size_t count;
+  int has_timestamps;
+} legacy_doc;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static int legacy_has_timestamp(const char *text) {
+  const char *p = text;
+  while (p && *p) {
+    if (*p == '[' && p[1] >= '0' && p[1] <= '9' && p[2] >= '0' &&
+        p[2] <= '9' && p[3] == ':') {
+      return 1;
+    }
+    p++;
+  }
+  return 0;
+}
+
+static int legacy_time_tag(const char *tag, double *out_time) {
+  int minutes = 0;
+  int seconds = 0;
+  int hundredths = 0;
+
+  if (sscanf(tag, "[%d:%d.%d]", &minutes, &seconds, &hundredths) < 2) {
+    if (sscanf(tag, "[%d:%d]", &minutes, &seconds) < 2) {
+      return 0;
+    }
+    hundredths = 0;
+  }
+  if (minutes < 0 || seconds < 0) {
+    return 0;
+  }
+  *out_time = (double)minutes * 60.0 + (double)seconds +
+              (double)hundredths / 100.0;
+  return 1;
+}
+
+static int legacy_compare(const void *a, const void *b) {
+  const legacy_line *la = (const legacy_line *)a;
+  const legacy_line *lb = (const legacy_line *)b;
+  return (la->time > lb->time) - (la->time < lb->time);
+}
+
+static legacy_doc *legacy_parse(const char *text) {
+  legacy_doc *doc = (legacy_doc *)calloc(1, sizeof(*doc));
+  char *copy = strdup(text);
+  char *saveptr;
+  char *line;
+  int timed = legacy_has_timestamp(text);
+  int offset_ms = 0;
+  size_t i;
+
+  if (!doc || !copy) {
+    exit(1);
+  }
+  doc->has_timestamps = timed;
+  for (line = strtok_r(copy, "\n", &saveptr); line;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    double times[8];
+    int count = 0;
+    size_t len = strlen(line);
+    char *p = line;
+    char *tag;
+    int n;
+
+    if (len > 0 && line[len - 1] == '\r') {
+      line[len - 1] = '\0';
+    }
+    tag = strstr(line, "[offset:");
+    if (tag) {
+      char *endptr;
+      long value = strtol(tag + 8, &endptr, 10);
+      if (*endptr == ']') {
+        offset_ms = (int)value;
+      }
+    }
+    while (*p == '[' && count < 8 && legacy_time_tag(p, &times[count])) {
+      count++;
+      p = strchr(p, ']');
+      if (!p) {
+        break;
+      }
+      p++;
+    }
+    if (!p) {
+      continue;
+    }
+    for (n = 0; n < (timed ? count : 1); n++) {
+      doc->lines = (legacy_line *)realloc(
+          doc->lines, sizeof(*doc->lines) * (doc->count + 1));
+      if (!doc->lines) {
+        exit(1);
+      }
+      doc->lines[doc->count].time = timed ? times[n] : 0.0;
+      doc->lines[doc->count].text = strdup(p);
+      doc->lines[doc->count].has_time = timed;
+      doc->count++;
+    }
+  }
+  free(copy);
+  for (i = 0; timed && offset_ms != 0 && i < doc->count; i++) {
+    doc->lines[i].time += (double)offset_ms / 1000.0;
+    if (doc->lines[i].time < 0.0) {
+      doc->lines[i].time = 0.0;
+    }
+  }
+  if (timed && doc->count > 1) {
+    qsort(doc->lines, doc->count, sizeof(*doc->lines), legacy_compare);
+  }
+  return doc;
+}
+
+static void legacy_free(legacy_doc *doc) {
+  size_t i;
+
+  for (i = 0; i < doc->count; i++) {
+    free(doc->lines[i].text);
+  }
+  free(doc->lines);
+  free(doc);
+}
+
+static char *build_lrc(int lines, size_t *out_len) {
+  size_t cap = (size_t)lines * 96 + 256;
+  char *buf = (char *)malloc(cap);
+  size_t len = 0;
+  int i;
+
+  if (!buf) {
+    exit(1);
+  }
+  len += (size_t)snprintf(buf + len, cap - len,
+                          "[ar:Bench Artist]\n[ti:Bench Title]\n"
+                          "[offset:+250]\n");
+  for (i = 0; i < lines; i++) {
+    int t = i * 3;
+    if (i % 4 == 3) {
+      len += (size_t)snprintf(
+          buf + len, cap - len,
+          "[%02d:%02d.%02d][%02d:%02d.%02d][%02d:%02d.%02d]Chorus line %d\r\n",
+          t / 60 % 100, t % 60, i % 100, (t + 1) / 60 % 100, (t + 1) % 60,
+          i % 100, (t + 2) / 60 % 100, (t + 2) % 60, i % 100, i);
+    } else {
+      len += (size_t)snprintf(buf + len, cap - len,
+                              "[%02d:%02d.%02d]Verse line number %d goes "
+                              "here\n",
+                              t / 60 % 100, t % 60, i % 100, i);
+    }
+  }
+  *out_len = len;
+  return buf;
+}
+
+/* Sorted times agree; equal times may come out in either order. */
+static int same_doc(const legacy_doc *a, const lyrics_doc *b) {
+  size_t i;
+
+  if (a->count != b->count || a->has_timestamps != b->has_timestamps) {
+    return 0;
+  }
+  for (i = 0; i < a->count; i++) {
+    if ((int32_t)(a->lines[i].time * 1000.0 + 0.5) != b->times[i] ||
+        a->lines[i].has_time != b->lines[i].has_time) {
+      return 0;
+    }
+    if (strcmp(a->lines[i].text, b->lines[i].text) != 0 &&
+        (i + 1 >= a->count || a->lines[i].time != a->lines[i + 1].time) &&
+        (i == 0 || a->lines[i].time != a->lines[i - 1].time)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  int lines = 5000;
+  int iterations = 200;
+  size_t len = 0;
+  char *text;
+  legacy_doc *legacy;
+  lyrics_doc *arena;
+  double start;
+  double legacy_ms;
+  double arena_ms;
+  size_t legacy_bytes;
+  int i;
+
+  if (argc > 1 && atoi(argv[1]) > 0) {
+    lines = atoi(argv[1]);
+  }
+  if (argc > 2 && atoi(argv[2]) > 0) {
+    iterations = atoi(argv[2]);
+  }
+  text = build_lrc(lines, &len);
+  legacy = legacy_parse(text);
+  arena = lyrics_parse(text);
+  if (!arena || !same_doc(legacy, arena)) {
+    fprintf(stderr, "parsers disagree\n");
+    return 1;
+  }
+  legacy_bytes = sizeof(*legacy) + legacy->count * sizeof(*legacy->lines);
+  for (i = 0; i < (int)legacy->count; i++) {
+    legacy_bytes += strlen(legacy->lines[i].text) + 1;
+  }
+  printf("input:  %d lines, %zu bytes, %zu timed entries\n", lines, len,
+         arena->count);
+  printf("memory: legacy %zu bytes in %zu blocks, arena %zu bytes in 1\n",
+         legacy_bytes, legacy->count + 2, lyrics_doc_size(arena));
+  legacy_free(legacy);
+  lyrics_free(arena);
+
+  start = now_ms();
+  for (i = 0; i < iterations; i++) {
+    legacy_free(legacy_parse(text));
+  }
+  legacy_ms = (now_ms() - start) / iterations;
+  start = now_ms();
+  for (i = 0; i < iterations; i++) {
+    lyrics_free(lyrics_parse(text));
+  }
+  arena_ms = (now_ms() - start) / iterations;
+  printf("legacy %.3f ms/parse\n", legacy_ms);
+  printf("arena  %.3f ms/parse\n", arena_ms);
+  free(text);
+  return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef CSONG_CACHE_INDEX_H
+#define CSONG_CACHE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  CACHE_INDEX_TIMED = 1 << 0,
+  CACHE_INDEX_PACKED = 1 << 1,
+  CACHE_INDEX_DELETED = 1 << 2
+};
+
+typedef struct cache_index_entry {
+  char name[256];
+  uint64_t offset;
+  uint32_t size;
+  uint32_t flags;
+  /* Last lookup, in seconds; 0 lets the index fill in the current time. */
+  uint32_t atime;
+  /* crc32 of a flat file's text, 0 while unknown; packs check their own. */
+  uint32_t crc;
+} cache_index_entry;
+
+/* Entries count distinct files and pack records, not keys. */
+typedef struct cache_index_usage {
+  size_t entries;
+  uint64_t bytes;
+  size_t timed;
+  size_t packed;
+  uint64_t hits;
+  uint64_t misses;
+} cache_index_usage;
+
+/* An entry under one of its keys. */
+typedef struct cache_index_item {
+  const char *key;
+  cache_index_entry entry;
+} cache_index_item;
+
+typedef int (*cache_index_key_fn)(void *ctx, const char *key);
+
+/* The canonical normalize_track_key form of a cache name's two halves. */
+int cache_index_key(const char *artist, const char *title, char *out,
+                    size_t out_size);
+int cache_index_stem_keys(const char *stem, cache_index_key_fn fn, void *ctx);
+/*
+ * Returns 0 and fills out when the key is indexed, 1 when the index is
+ * current and the key is definitely not cached, or -1 when the index is
+ * missing or the cache directory changed behind its back.
+ */
+int cache_index_lookup(const char *key, cache_index_entry *out);
+int cache_index_put(const char *key, const cache_index_entry *entry);
+/* Call after writing our own files into the cache directory. */
+void cache_index_touch(void);
+/*
+ * Brackets a batch of our own writes: lookups keep trusting the index
+ * meanwhile instead of rebuilding, and the release counts as a touch.
+ */
+void cache_index_hold(void);
+void cache_index_release(void);
+/* Counts a cache hit or miss; the totals persist in the index. */
+void cache_index_count(int hit);
+int cache_index_usage_get(cache_index_usage *out);
+/*
+ * One item per distinct file or pack record; the keys share the allocation,
+ * so a single free(*out) releases everything.
+ */
+int cache_index_entries(cache_index_item **out, size_t *out_count);
+/*
+ * Records the checksum of an entry whose crc was still unknown, under its
+ * key and every other key its file name splits into.
+ */
+int cache_index_seal(const char *key, const cache_index_entry *entry,
+                     uint32_t crc);
+/* Least recently used of a small random sample of entries, and its key. */
+int cache_index_oldest(char *key, size_t key_size, cache_index_entry *out);
+/*
+ * Drops the key and every other key of the entry's file or pack record
+ * (its name split as a rebuild does) that still points at it.
+ */
+int cache_index_forget(const char *key, const cache_index_entry *entry);
+int cache_index_rebuild(void);
+/* Format version of the index on disk, 0 when there is none. */
+unsigned int cache_index_version(void);
+/* Versions before this one keyed entries on the raw sanitized names. */
+#define CACHE_INDEX_CANONICAL_VERSION 3
+void cache_index_close(void);
+
+#endif
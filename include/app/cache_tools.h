@@ -0,0 +1,31 @@
+#ifndef CSONG_CACHE_TOOLS_H
+#define CSONG_CACHE_TOOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct cache_tool_report {
+  size_t files;
+  size_t written;
+  /* Import: already cached. Verify: checksums recorded for the first time. */
+  size_t skipped;
+  size_t corrupt;
+  uint64_t bytes;
+  long elapsed_ms;
+} cache_tool_report;
+
+/*
+ * Bulk cache maintenance for the command line. Files and entries are
+ * processed by a small thread pool; every text is parsed with lyrics_parse
+ * and anything unreadable is logged and counted as corrupt.
+ *
+ * import walks dir recursively for .lrc/.txt files, keys them by their
+ * [ar:]/[ti:] tags or "Artist - Title" file name and stores the ones not
+ * cached yet. verify reads every cached entry back and checks its size and
+ * checksum. export writes every entry to dir under its cache file name.
+ */
+int lyrics_cache_import(const char *dir, cache_tool_report *out);
+int lyrics_cache_verify(cache_tool_report *out);
+int lyrics_cache_export(const char *dir, cache_tool_report *out);
+
+#endif
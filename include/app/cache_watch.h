@@ -0,0 +1,16 @@
+#ifndef CSONG_CACHE_WATCH_H
+#define CSONG_CACHE_WATCH_H
+
+/*
+ * inotify watch on the lyrics cache directory. The descriptor goes into
+ * the main loop's poll set; cache_watch_poll reports the name of every
+ * file that was written, replaced or removed since the last call.
+ */
+typedef void (*cache_watch_fn)(void *ctx, const char *name);
+
+int cache_watch_open(void);
+void cache_watch_close(void);
+int cache_watch_fd(void);
+void cache_watch_poll(cache_watch_fn fn, void *ctx);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CSONG_CACHE_WRITER_H
+#define CSONG_CACHE_WRITER_H
+
+#include <stdint.h>
+
+/*
+ * Background writer for flat cache files. Each file is written to a temp
+ * name, synced and renamed into place, so a crash never leaves a partial
+ * file under the real name. Queued texts stay readable through
+ * cache_writer_pending until their rename is done.
+ */
+int cache_writer_put(const char *key, const char *path, const char *text,
+                     int timed);
+char *cache_writer_pending(const char *key);
+/* 1 when one of our recent renames put exactly this text under the name. */
+int cache_writer_committed(const char *name, uint32_t size, uint32_t crc);
+void cache_writer_flush(void);
+/* Runs lyrics_cache_trim on the writer thread until the cache fits. */
+void cache_writer_request_trim(void);
+void cache_writer_close(void);
+
+#endif
@@ -11,6 +11,23 @@ typedef struct app_config {
   int show_plain;
   char cache_dir[512];
   double lyrics_lead_seconds;
+  double lyrics_gap_seconds;
+  double lyrics_gap_lead_seconds;
+  double lyrics_gap_buffer_seconds;
+  double lyrics_outro_seconds;
+  int lyrics_prefetch;
+  char lyrics_provider[64];
+  long lyrics_budget_ms;
+  int lyrics_log_timings;
+  int library_parallel;
+  double library_rate_limit;
+  long cache_miss_ttl;
+  long cache_miss_max_ttl;
+  int cache_binary;
+  char cache_store[16];
+  long cache_memory_kb;
+  long cache_max_mb;
+  long cache_max_entries;
   char ui_backend[32];
   char ui_font[128];
   char ui_title_font[128];
@@ -0,0 +1,27 @@
+#ifndef CSONG_HTTP_H
+#define CSONG_HTTP_H
+
+#include <curl/curl.h>
+#include <stddef.h>
+
+typedef struct http_buffer {
+  char *data;
+  size_t size;
+} http_buffer;
+
+int http_init(void);
+void http_shutdown(void);
+
+CURLM *http_multi(void);
+CURL *http_acquire(void);
+void http_release(CURL *curl);
+void http_prepare(CURL *curl, const char *url, http_buffer *buf);
+int http_get(const char *url, http_buffer *out, long *out_code);
+void http_buffer_free(http_buffer *buf);
+
+void http_set_rate_limit(double per_second);
+void http_throttle(const char *url);
+
+char *http_escape(const char *text);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef CSONG_JSON_STREAM_H
+#define CSONG_JSON_STREAM_H
+
+#include <stddef.h>
+
+#define JSON_STREAM_MAX_DEPTH 32
+
+typedef struct json_raw {
+  char *data;
+  size_t len;
+  size_t cap;
+} json_raw;
+
+/*
+ * Incremental extractor for lrclib and lyrics.ovh responses. Records are the
+ * top-level object, or the objects of a top-level array. Only the lyrics
+ * fields and "duration" of each record are kept, still JSON-escaped; the
+ * winning candidate is unescaped once in json_stream_finish.
+ */
+typedef struct json_stream {
+  double target_duration;
+  int strict_duration;
+  int failed;
+
+  int state;
+  int depth;
+  int record_depth;
+  unsigned char in_object[JSON_STREAM_MAX_DEPTH];
+  int expect_key;
+  int escape;
+  int field;
+  char key[16];
+  size_t key_len;
+  char number[32];
+  size_t number_len;
+
+  double duration;
+  int has_duration;
+  json_raw cur_synced;
+  json_raw cur_plain;
+  json_raw best_synced;
+  json_raw best_plain;
+  double best_synced_diff;
+  double best_plain_diff;
+} json_stream;
+
+void json_stream_init(json_stream *js, double target_duration,
+                      int strict_duration);
+int json_stream_feed(json_stream *js, const char *data, size_t len);
+int json_stream_finish(json_stream *js, char **out_text, int *out_timed);
+void json_stream_free(json_stream *js);
+
+size_t json_stream_write_cb(char *ptr, size_t size, size_t nmemb,
+                            void *userdata);
+
+char *json_unescape_range(const char *input, size_t len);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef CSONG_LIBRARY_H
+#define CSONG_LIBRARY_H
+
+int library_prefetch(const char *host, int port, int parallel,
+                     double rate_limit);
+
+#endif
@@ -2,29 +2,133 @@
 #define CSONG_LYRICS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* Enhanced LRC <mm:ss.xx> word timings, relative to their line's time. */
+#define LYRICS_WORD_OPEN UINT32_MAX
+
+typedef struct lyrics_word {
+  uint32_t start_ms;
+  /* LYRICS_WORD_OPEN when the word lasts until the next line starts. */
+  uint32_t end_ms;
+  /* Byte range of the word in the line text, tags already stripped. */
+  uint32_t text_start;
+  uint32_t text_end;
+} lyrics_word;
 
 typedef struct lyrics_line {
-  double time;
   char *text;
   int has_time;
+  /* Slice of doc->words; lines repeated by several time tags share it. */
+  uint32_t word_first;
+  uint32_t word_count;
 } lyrics_line;
 
+typedef struct lyrics_query {
+  const char *artist;
+  const char *title;
+} lyrics_query;
+
+/* Polled while a fetch runs; returning non-zero aborts it. */
+typedef int (*lyrics_cancel_fn)(void *ctx);
+
 typedef struct lyrics_doc {
   lyrics_line *lines;
+  /* Line start times in milliseconds, parallel to lines and sorted. */
+  int32_t *times;
   size_t count;
+  lyrics_word *words;
+  size_t word_count;
   int has_timestamps;
+  /* Set when the line texts live in a mapped binary cache file. */
+  void *mapping;
+  size_t mapping_size;
+  /* Docs are shared with the in-memory LRU; lyrics_free drops one ref. */
+  int refs;
+  /*
+   * Bytes of the doc's single allocation: header, line, time and word
+   * arrays and, for parsed docs, the text blob the lines point into.
+   */
+  size_t size;
 } lyrics_doc;
 
 char *lyrics_cache_load(const char *artist, const char *title);
+lyrics_doc *lyrics_cache_load_doc(const char *artist, const char *title);
+/* 1 when this exact artist/title is cached, without the title-only fallback. */
+int lyrics_cache_contains(const char *artist, const char *title);
+/*
+ * A cache file changed outside csong: drops its stale sidecar, updates
+ * the index entry and evicts the parsed docs it backs, so the next load
+ * reparses just that file. 1 when the file still matches its index entry
+ * or was our own write, -1 when the name is not a lyrics file.
+ */
+int lyrics_cache_file_changed(const char *name);
+/* 1 when the cache file name holds the lyrics artist/title would load. */
+int lyrics_cache_file_matches(const char *name, const char *artist,
+                              const char *title);
+void lyrics_cache_set_binary(int enabled);
+void lyrics_cache_set_packed(int enabled);
+/* 0 leaves a limit off; eviction runs in the background writer thread. */
+void lyrics_cache_set_limits(unsigned long max_bytes,
+                             unsigned long max_entries);
+/* One bounded eviction step: 1 when still over budget, 0 when within it. */
+int lyrics_cache_trim(void);
+/*
+ * Moves a cache written with the old raw-name keys to canonical keys:
+ * re-keys the miss list and rebuilds the index, which picks one file per
+ * key and leaves every file on disk. Does nothing unless an older index
+ * exists or force is set.
+ */
+int lyrics_cache_migrate_keys(int force);
+/* Flushes batched writes and stops background cache work. */
+void lyrics_cache_close(void);
 int lyrics_cache_store(const char *artist, const char *title, const char *text,
                        int timed);
 void lyrics_cache_set_dir(const char *path);
+int lyrics_cache_path(const char *name, char *out, size_t out_size);
+int lyrics_cache_prepare(void);
+int lyrics_cache_is_miss(const char *artist, const char *title);
+int lyrics_cache_store_miss(const char *artist, const char *title);
+void lyrics_cache_set_miss_ttl(long ttl_seconds, long max_ttl_seconds);
 
+/* Returns 0 with lyrics, 1 when every provider answered without any, or -1. */
 int lyrics_fetch(const char *artist, const char *title, double duration,
                  char **out_text, int *out_timed);
+int lyrics_fetch_any(const lyrics_query *queries, size_t count,
+                     double duration, char **out_text, int *out_timed,
+                     lyrics_cancel_fn cancel, void *cancel_ctx);
+void lyrics_set_budget(long budget_ms);
+void lyrics_set_log_timings(int enabled);
 
 lyrics_doc *lyrics_parse(const char *text);
+lyrics_doc *lyrics_retain(lyrics_doc *doc);
 void lyrics_free(lyrics_doc *doc);
+size_t lyrics_doc_size(const lyrics_doc *doc);
+/*
+ * Remembers where the last lookup landed: while elapsed moves forward the
+ * next lookup steps on from there, and seeks fall back to binary search.
+ * Zero it, or call lyrics_cursor_reset, when starting on a new doc.
+ */
+typedef struct lyrics_cursor {
+  /* Lines whose time had been reached at the last lookup. */
+  size_t reached;
+} lyrics_cursor;
+
 int lyrics_find_current(const lyrics_doc *doc, double elapsed);
+void lyrics_cursor_reset(lyrics_cursor *cursor);
+/*
+ * lyrics_find_current through the cursor. out_until_next gets the seconds
+ * until the next line starts, or -1 when no later line follows.
+ */
+int lyrics_cursor_find(lyrics_cursor *cursor, const lyrics_doc *doc,
+                       double elapsed, double *out_until_next);
+/*
+ * Word of the line being sung at elapsed, as an index into the line's
+ * slice of doc->words, or -1 before its first word or when it has none.
+ * *hint keeps the previous answer between frames (start it at 0), so
+ * steady playback costs O(1); out_progress gets 0..1 through the word.
+ */
+int lyrics_active_word(const lyrics_doc *doc, int line, double elapsed,
+                       size_t *hint, double *out_progress);
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef CSONG_LYRICS_BINARY_H
+#define CSONG_LYRICS_BINARY_H
+
+#include "app/lyrics.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pre-parsed sidecar for a cached lyrics file: a version header, the sorted
+ * line times in milliseconds, one blob offset and word slice per line, the
+ * word timings and a single string blob. The doc returned by
+ * lyrics_binary_map points straight into the mapping.
+ * The size, mtime (nanoseconds) and crc32 of the text file it was built
+ * from tie the sidecar to that file: map rejects it when the size or mtime
+ * differ, or when source_crc is known (non-zero) and differs.
+ */
+lyrics_doc *lyrics_binary_map(const char *path, size_t source_size,
+                              int64_t source_mtime, uint32_t source_crc);
+int lyrics_binary_write(const char *path, const lyrics_doc *doc,
+                        size_t source_size, int64_t source_mtime,
+                        uint32_t source_crc);
+
+#endif
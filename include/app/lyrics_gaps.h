@@ -0,0 +1,43 @@
+#ifndef CSONG_LYRICS_GAPS_H
+#define CSONG_LYRICS_GAPS_H
+
+#include "app/lyrics.h"
+#include <stddef.h>
+
+/* Seconds; see lyrics_gaps_defaults for the stock values. */
+typedef struct lyrics_gap_options {
+  /* Silence between two lyric lines that counts as an instrumental gap. */
+  double min_gap;
+  /* Lyrics come back this long before the next line. */
+  double lead_in;
+  /* Trimmed off the start and the end of each gap. */
+  double buffer;
+  /* After the last line, the outro starts this much later. */
+  double outro;
+} lyrics_gap_options;
+
+typedef struct lyrics_span {
+  double start;
+  double end;
+} lyrics_span;
+
+/*
+ * The intro, instrumental gaps and outro of a synced doc as sorted,
+ * disjoint [start, end) spans. Built once per doc; lookups remember the
+ * last span so steady playback costs O(1).
+ */
+typedef struct lyrics_gaps {
+  lyrics_span *spans;
+  size_t count;
+  /* Spans that had ended at the last lookup. */
+  size_t passed;
+} lyrics_gaps;
+
+void lyrics_gaps_defaults(lyrics_gap_options *out);
+/* Replaces the spans in gaps; a missing or plain doc leaves none. */
+int lyrics_gaps_build(lyrics_gaps *gaps, const lyrics_doc *doc,
+                      const lyrics_gap_options *options);
+int lyrics_gaps_contains(lyrics_gaps *gaps, double elapsed);
+void lyrics_gaps_free(lyrics_gaps *gaps);
+
+#endif
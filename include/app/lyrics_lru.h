@@ -0,0 +1,30 @@
+#ifndef CSONG_LYRICS_LRU_H
+#define CSONG_LYRICS_LRU_H
+
+#include "app/lyrics.h"
+#include <stddef.h>
+
+typedef struct lyrics_lru_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+} lyrics_lru_stats;
+
+/*
+ * Parsed docs of recent tracks, keyed by the normalized artist/title so the
+ * same song from MPD and from an MPRIS player shares one entry. get returns
+ * a retained doc that the caller releases with lyrics_free.
+ */
+lyrics_doc *lyrics_lru_get(const char *artist, const char *title);
+void lyrics_lru_put(const char *artist, const char *title, lyrics_doc *doc);
+void lyrics_lru_forget(const char *artist, const char *title);
+/* Same, for a key already in normalize_track_key form. */
+void lyrics_lru_forget_key(const char *key);
+void lyrics_lru_set_budget(size_t bytes);
+void lyrics_lru_stats_get(lyrics_lru_stats *out);
+void lyrics_lru_clear(void);
+
+#endif
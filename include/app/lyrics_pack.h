@@ -0,0 +1,32 @@
+#ifndef CSONG_LYRICS_PACK_H
+#define CSONG_LYRICS_PACK_H
+
+#include "app/cache_index.h"
+#include <stddef.h>
+
+/*
+ * Append-only segments of zlib-compressed lyrics records under
+ * <cache>/pack/. Records are addressed through the cache index by segment
+ * name and offset. Stores are batched in memory and written together;
+ * segments that are mostly superseded are compacted by a background thread.
+ */
+typedef int (*lyrics_pack_scan_fn)(void *ctx, const char *stem,
+                                   const cache_index_entry *entry);
+
+int lyrics_pack_open(void);
+void lyrics_pack_close(void);
+/* key may be NULL when the caller rebuilds the index afterwards. */
+int lyrics_pack_put(const char *key, const char *stem, const char *text,
+                    int timed);
+int lyrics_pack_flush(void);
+char *lyrics_pack_pending(const char *key, int *out_timed);
+char *lyrics_pack_read(const cache_index_entry *entry);
+/* Also returns the flat-file stem the record was stored under. */
+char *lyrics_pack_read_stem(const cache_index_entry *entry, char *stem,
+                            size_t stem_size);
+/* Marks a record evicted from the index as dead for compaction. */
+void lyrics_pack_release(const cache_index_entry *entry);
+int lyrics_pack_scan(lyrics_pack_scan_fn fn, void *ctx);
+int lyrics_pack_migrate(void);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CSONG_LYRICS_PROVIDER_H
+#define CSONG_LYRICS_PROVIDER_H
+
+#include "app/json_stream.h"
+#include <stddef.h>
+
+/*
+ * Result tiers, best first. A response is scored as tier * variant_count +
+ * variant so that within a tier the earlier (less normalized) query wins.
+ */
+enum {
+  LYRICS_TIER_GET_SYNCED = 0,
+  LYRICS_TIER_SEARCH_SYNCED = 1,
+  LYRICS_TIER_PLAIN = 2,
+  LYRICS_TIER_OVH = 3
+};
+
+enum {
+  LYRICS_CAP_SYNCED = 1 << 0,
+  LYRICS_CAP_PLAIN = 1 << 1,
+  LYRICS_CAP_NEEDS_ARTIST = 1 << 2
+};
+
+typedef enum {
+  PROVIDER_HIT = 0,
+  PROVIDER_MISS,
+  PROVIDER_ERROR,
+  /* Still running at the deadline or past curl's timeout. */
+  PROVIDER_TIMEOUT
+} provider_outcome;
+
+typedef struct lyrics_provider {
+  const char *name;
+  unsigned int caps;
+  int best_tier;
+  int (*build_url)(const char *artist, const char *title, char *out,
+                   size_t out_size);
+  void (*begin)(json_stream *js, double duration);
+  int (*finish)(json_stream *js, char **out_text, int *out_timed,
+                int *out_tier);
+} lyrics_provider;
+
+extern const lyrics_provider lrclib_get_provider;
+extern const lyrics_provider lrclib_search_provider;
+extern const lyrics_provider ovh_provider;
+
+#define LYRICS_MAX_PROVIDERS 8
+
+int lyrics_registry_configure(const char *spec);
+size_t lyrics_registry_plan(const lyrics_provider **out, size_t max,
+                            int *out_skipped);
+int lyrics_registry_allows(const lyrics_provider *provider, size_t variant);
+void lyrics_registry_record(const lyrics_provider *provider, double latency_ms,
+                            provider_outcome outcome);
+double lyrics_registry_latency_p90(const lyrics_provider *provider);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CSONG_LYRICS_WORKER_H
+#define CSONG_LYRICS_WORKER_H
+
+#include "app/lyrics.h"
+#include "app/player.h"
+
+typedef struct lyrics_request {
+  unsigned long id;
+  char artist[256];
+  char title[256];
+  double duration;
+  player_source source;
+  int prefetch;
+} lyrics_request;
+
+typedef struct lyrics_result {
+  unsigned long id;
+  char *text;
+  lyrics_doc *doc;
+  int timed;
+  int found;
+} lyrics_result;
+
+int lyrics_lookup(const lyrics_request *req, lyrics_result *out);
+void lyrics_result_free(lyrics_result *res);
+
+int lyrics_worker_start(void);
+void lyrics_worker_stop(void);
+int lyrics_worker_submit(const lyrics_request *req);
+void lyrics_worker_clear_prefetch(void);
+void lyrics_worker_set_generation(unsigned long generation);
+int lyrics_worker_poll(lyrics_result *out);
+int lyrics_worker_get_fd(void);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef CSONG_MPD_CLIENT_H
 #define CSONG_MPD_CLIENT_H
 
+#include <stddef.h>
+
 typedef struct mpd_track {
   char artist[256];
   char title[256];
@@ -15,6 +17,9 @@ typedef struct mpd_track {
 int mpd_client_connect(const char *host, int port);
 void mpd_client_disconnect(void);
 int mpd_client_get_current(mpd_track *out);
+int mpd_client_read_upcoming(const char *host, int port, mpd_track *out,
+                             size_t max, size_t *out_count);
+int mpd_client_list_library(mpd_track **out, size_t *out_count);
 int mpd_client_get_fd(void);
 int mpd_client_idle_begin(unsigned int mask);
 int mpd_client_idle_end(unsigned int *events);
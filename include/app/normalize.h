@@ -1,7 +1,16 @@
 #ifndef CSONG_NORMALIZE_H
 #define CSONG_NORMALIZE_H
 
+#include <stddef.h>
+
 char *normalize_artist(const char *artist);
 char *normalize_title(const char *title);
+/*
+ * "artist<TAB>title" after descriptor stripping, case folding, canonical
+ * decomposition and punctuation folding; every cache of track data keys
+ * on it so spelling variants of one song share entries.
+ */
+int normalize_track_key(const char *artist, const char *title, char *out,
+                        size_t out_size);
 
 #endif
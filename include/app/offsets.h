@@ -0,0 +1,18 @@
+#ifndef CSONG_OFFSETS_H
+#define CSONG_OFFSETS_H
+
+/*
+ * Per-track lyric offsets from <cache>/.offsets, "Artist - Title = seconds"
+ * per line. The file is parsed once into a table keyed like the lyrics
+ * cache and parsed again only when the cache watch reports an edit.
+ * Adjustments are appended in batches by offsets_flush; later lines win.
+ */
+int offsets_open(void);
+void offsets_close(void);
+/* Call when .offsets changed on disk; returns 1 when the table was reloaded. */
+int offsets_reload(void);
+double offsets_lookup(const char *artist, const char *title);
+int offsets_set(const char *artist, const char *title, double seconds);
+int offsets_flush(void);
+
+#endif
@@ -12,5 +12,6 @@ typedef enum {
 } spotify_status;
 
 spotify_status spotify_get_current(player_track *out, char *err, size_t err_cap);
+spotify_status spotify_get_next(player_track *out, char *err, size_t err_cap);
 
 #endif
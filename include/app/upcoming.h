@@ -0,0 +1,10 @@
+#ifndef CSONG_UPCOMING_H
+#define CSONG_UPCOMING_H
+
+#include "app/player.h"
+
+int upcoming_start(const char *mpd_host, int mpd_port);
+void upcoming_stop(void);
+void upcoming_request(player_source source, int count);
+
+#endif
@@ -12,5 +12,6 @@ typedef enum {
 } ytmusic_status;
 
 ytmusic_status ytmusic_get_current(player_track *out, char *err, size_t err_cap);
+ytmusic_status ytmusic_get_next(player_track *out, char *err, size_t err_cap);
 
 #endif
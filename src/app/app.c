@@ -1,15 +1,25 @@
 #include "app/app.h"
+#include "app/cache_index.h"
+#include "app/cache_tools.h"
+#include "app/cache_watch.h"
 #include "app/config.h"
+#include "app/http.h"
+#include "app/library.h"
 #include "app/log.h"
 #include "app/lyrics.h"
+#include "app/lyrics_gaps.h"
+#include "app/lyrics_lru.h"
+#include "app/lyrics_pack.h"
+#include "app/lyrics_provider.h"
+#include "app/lyrics_worker.h"
 #include "app/mpd_client.h"
-#include "app/normalize.h"
+#include "app/offsets.h"
 #include "app/player.h"
 #include "app/spotify.h"
 #include "app/ytmusic.h"
 #include "app/ui.h"
+#include "app/upcoming.h"
 #include "app/time.h"
-#include <ctype.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,16 +33,73 @@ typedef struct app_args {
   int once;
   int interval;
   int show_plain;
+  int prefetch_library;
+  int rebuild_index;
+  int migrate_cache;
+  int cache_stats;
+  int cache_verify;
+  char cache_import[512];
+  char cache_export[512];
   int has_config;
   char config_path[512];
 } app_args;
 
 static void print_usage(const char *name) {
   printf("Usage: %s [--config PATH] [--mpd-host HOST] [--mpd-port PORT] "
-         "[--once] [--interval N] [--show-plain]\n",
+         "[--once] [--interval N] [--show-plain] [--prefetch-library] "
+         "[--rebuild-cache-index] [--migrate-cache] [--cache-stats] "
+         "[--cache-import DIR] [--cache-verify] [--cache-export DIR]\n",
          name);
 }
 
+static int print_cache_stats(const app_config *config) {
+  cache_index_usage usage;
+  uint64_t lookups;
+
+  if (lyrics_cache_prepare() != 0 || cache_index_usage_get(&usage) != 0) {
+    log_error("lyrics: cannot read cache index");
+    return 1;
+  }
+  lookups = usage.hits + usage.misses;
+  printf("entries:  %zu (%zu synced, %zu plain, %zu packed)\n", usage.entries,
+         usage.timed, usage.entries - usage.timed, usage.packed);
+  printf("bytes:    %llu\n", (unsigned long long)usage.bytes);
+  printf("lookups:  %llu (%llu hits, %llu misses)\n",
+         (unsigned long long)lookups, (unsigned long long)usage.hits,
+         (unsigned long long)usage.misses);
+  if (lookups > 0) {
+    printf("hit rate: %.1f%%\n", 100.0 * (double)usage.hits / (double)lookups);
+  }
+  if (config->cache_max_mb > 0) {
+    printf("budget:   %ld MB\n", config->cache_max_mb);
+  }
+  if (config->cache_max_entries > 0) {
+    printf("budget:   %ld entries\n", config->cache_max_entries);
+  }
+  return 0;
+}
+
+static int print_cache_report(const char *what, int result,
+                              const cache_tool_report *report) {
+  double seconds =
+      report->elapsed_ms > 0 ? (double)report->elapsed_ms / 1000.0 : 0.001;
+
+  if (result != 0) {
+    return 1;
+  }
+  printf("%s: %zu of %zu ok", what, report->written, report->files);
+  if (report->skipped > 0) {
+    printf(", %zu %s", report->skipped,
+           strcmp(what, "verified") == 0 ? "newly checksummed"
+                                         : "already cached");
+  }
+  printf(", %zu corrupt\n", report->corrupt);
+  printf("%.2f s, %.0f files/s, %.2f MB/s\n", seconds,
+         (double)report->files / seconds,
+         (double)report->bytes / (1024.0 * 1024.0) / seconds);
+  return report->corrupt > 0 ? 1 : 0;
+}
+
 static void args_default(app_args *out) {
   if (!out) {
     return;
@@ -42,6 +109,13 @@ static void args_default(app_args *out) {
   out->once = 0;
   out->interval = 1;
   out->show_plain = 0;
+  out->prefetch_library = 0;
+  out->rebuild_index = 0;
+  out->migrate_cache = 0;
+  out->cache_stats = 0;
+  out->cache_verify = 0;
+  out->cache_import[0] = '\0';
+  out->cache_export[0] = '\0';
   out->has_config = 0;
   out->config_path[0] = '\0';
 }
@@ -98,6 +172,29 @@ static int args_parse(app_args *out, int argc, char **argv) {
     } else if (strcmp(argv[i], "--show-plain") == 0) {
       out->show_plain = 1;
       i++;
+    } else if (strcmp(argv[i], "--prefetch-library") == 0) {
+      out->prefetch_library = 1;
+      i++;
+    } else if (strcmp(argv[i], "--rebuild-cache-index") == 0) {
+      out->rebuild_index = 1;
+      i++;
+    } else if (strcmp(argv[i], "--migrate-cache") == 0) {
+      out->migrate_cache = 1;
+      i++;
+    } else if (strcmp(argv[i], "--cache-stats") == 0) {
+      out->cache_stats = 1;
+      i++;
+    } else if (strcmp(argv[i], "--cache-import") == 0 && i + 1 < argc) {
+      snprintf(out->cache_import, sizeof(out->cache_import), "%s",
+               argv[i + 1]);
+      i += 2;
+    } else if (strcmp(argv[i], "--cache-verify") == 0) {
+      out->cache_verify = 1;
+      i++;
+    } else if (strcmp(argv[i], "--cache-export") == 0 && i + 1 < argc) {
+      snprintf(out->cache_export, sizeof(out->cache_export), "%s",
+               argv[i + 1]);
+      i += 2;
     } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
       print_usage(argv[0]);
       return 1;
@@ -109,42 +206,6 @@ static int args_parse(app_args *out, int argc, char **argv) {
   return 0;
 }
 
-static int line_has_text(const char *text) {
-  const unsigned char *p = (const unsigned char *)text;
-  if (!p) {
-    return 0;
-  }
-  while (*p) {
-    if (!isspace(*p)) {
-      return 1;
-    }
-    p++;
-  }
-  return 0;
-}
-
-static int is_unknown_artist_name(const char *artist) {
-  if (!artist || artist[0] == '\0') {
-    return 1;
-  }
-  return strcmp(artist, "Unknown Artist") == 0;
-}
-
-static void trim_whitespace(char *text) {
-  char *end;
-  if (!text || text[0] == '\0') {
-    return;
-  }
-  while (isspace((unsigned char)*text)) {
-    memmove(text, text + 1, strlen(text));
-  }
-  end = text + strlen(text);
-  while (end > text && isspace((unsigned char)end[-1])) {
-    end[-1] = '\0';
-    end--;
-  }
-}
-
 static void sleep_ms(int ms) {
   struct timespec ts;
 
@@ -156,25 +217,6 @@ static void sleep_ms(int ms) {
   nanosleep(&ts, NULL);
 }
 
-static void append_text(char *out, size_t out_size, const char *text) {
-  size_t len;
-  size_t avail;
-  size_t copy_len;
-
-  if (!out || out_size == 0 || !text) {
-    return;
-  }
-
-  len = strlen(out);
-  if (len >= out_size - 1) {
-    return;
-  }
-  avail = out_size - 1 - len;
-  copy_len = strnlen(text, avail);
-  memcpy(out + len, text, copy_len);
-  out[len + copy_len] = '\0';
-}
-
 static int player_is_playing(const player_track *track) {
   if (!track) {
     return 0;
@@ -288,143 +330,6 @@ static void player_track_from_mpd(player_track *out, const mpd_track *mpd) {
   out->source = PLAYER_SOURCE_MPD;
 }
 
-static double load_track_offset(const char *artist, const char *title) {
-  const char *home = getenv("HOME");
-  FILE *file;
-  char path[512];
-  char line[512];
-  char match[512];
-
-  if (!home || !title) {
-    return 0.0;
-  }
-
-  match[0] = '\0';
-  if (!is_unknown_artist_name(artist)) {
-    append_text(match, sizeof(match), artist ? artist : "");
-    append_text(match, sizeof(match), " - ");
-    append_text(match, sizeof(match), title);
-  } else {
-    append_text(match, sizeof(match), title);
-  }
-
-  snprintf(path, sizeof(path), "%s/lyrics/.offsets", home);
-  file = fopen(path, "r");
-  if (!file) {
-    return 0.0;
-  }
-
-  while (fgets(line, sizeof(line), file)) {
-    char *eq;
-    char *key;
-    char *val;
-    char *endptr;
-    double seconds;
-
-    if ((unsigned char)line[0] == 0xEF && (unsigned char)line[1] == 0xBB &&
-        (unsigned char)line[2] == 0xBF) {
-      memmove(line, line + 3, strlen(line + 3) + 1);
-    }
-
-    trim_whitespace(line);
-    if (line[0] == '\0' || line[0] == '#') {
-      continue;
-    }
-
-    eq = strchr(line, '=');
-    if (!eq) {
-      continue;
-    }
-    *eq = '\0';
-    key = line;
-    val = eq + 1;
-    trim_whitespace(key);
-    trim_whitespace(val);
-
-    if (strcmp(key, match) != 0) {
-      continue;
-    }
-
-    seconds = strtod(val, &endptr);
-    if (endptr == val) {
-      continue;
-    }
-    fclose(file);
-    return seconds;
-  }
-
-  fclose(file);
-  return 0.0;
-}
-
-static int is_music_only_section(const lyrics_doc *doc, double elapsed) {
-  const double lead_in = 2.0;
-  const double gap_threshold = 10.0;
-  const double gap_start_buffer = 1.0;
-  const double gap_end_buffer = 1.0;
-  const double outro_tail = 3.0;
-  double first_time = -1.0;
-  double prev_time = -1.0;
-  double last_time = -1.0;
-  size_t i;
-
-  if (!doc || !doc->has_timestamps || doc->count == 0) {
-    return 0;
-  }
-
-  for (i = 0; i < doc->count; i++) {
-    if (!doc->lines[i].has_time) {
-      continue;
-    }
-    if (!line_has_text(doc->lines[i].text)) {
-      continue;
-    }
-    first_time = doc->lines[i].time;
-    break;
-  }
-
-  if (first_time < 0.0) {
-    return 0;
-  }
-
-  if (elapsed < first_time - lead_in) {
-    return 1;
-  }
-
-  prev_time = -1.0;
-  for (i = 0; i < doc->count; i++) {
-    if (!doc->lines[i].has_time) {
-      continue;
-    }
-    if (!line_has_text(doc->lines[i].text)) {
-      continue;
-    }
-    if (prev_time < 0.0) {
-      prev_time = doc->lines[i].time;
-      last_time = prev_time;
-      continue;
-    }
-    last_time = doc->lines[i].time;
-    if (last_time - prev_time >= gap_threshold) {
-      double gap_start = prev_time + gap_start_buffer;
-      double gap_end = last_time - lead_in - gap_end_buffer;
-      if (gap_end < gap_start) {
-        gap_end = gap_start;
-      }
-      if (elapsed >= gap_start && elapsed < gap_end) {
-        return 1;
-      }
-    }
-    prev_time = last_time;
-  }
-
-  if (last_time >= 0.0 && elapsed > last_time + outro_tail) {
-    return 1;
-  }
-
-  return 0;
-}
-
 static void free_lyrics(char **text, lyrics_doc **doc) {
   if (doc && *doc) {
     lyrics_free(*doc);
@@ -436,6 +341,44 @@ static void free_lyrics(char **text, lyrics_doc **doc) {
   }
 }
 
+typedef struct cache_events {
+  const player_track *track;
+  int have_track;
+  int offsets;
+  int current;
+} cache_events;
+
+/* Edits to other cache files only evict them; the shown one is reparsed. */
+static void on_cache_change(void *ctx, const char *name) {
+  cache_events *events = (cache_events *)ctx;
+
+  if (strcmp(name, ".offsets") == 0) {
+    events->offsets = 1;
+  } else if (lyrics_cache_file_changed(name) == 0 && events->have_track &&
+             lyrics_cache_file_matches(name, events->track->artist,
+                                       events->track->title)) {
+    events->current = 1;
+  }
+}
+
+static void take_lyrics_result(lyrics_result *res, char **text,
+                               lyrics_doc **doc, char *status,
+                               size_t status_size) {
+  free_lyrics(text, doc);
+  *text = res->text;
+  *doc = res->doc;
+  res->text = NULL;
+  res->doc = NULL;
+  if (!res->found) {
+    return;
+  }
+  if (res->timed) {
+    snprintf(status, status_size, "%s", "Loaded synced lyrics");
+  } else {
+    snprintf(status, status_size, "%s", "Loaded lyrics");
+  }
+}
+
 int app_run(int argc, char **argv) {
   app_args args;
   app_config config;
@@ -466,11 +409,19 @@ int app_run(int argc, char **argv) {
   int last_paused = -1;
   char *lyrics_text = NULL;
   lyrics_doc *doc = NULL;
-  int fetched_timed = 0;
+  unsigned long lyrics_request_id = 0;
+  int lyrics_pending = 0;
+  int worker_ready = 0;
   char status[128] = {0};
   int has_lyrics = 0;
   int anim_frame = 0;
   int last_current_index = -1;
+  lyrics_cursor cursor = {0};
+  lyrics_gaps gaps = {0};
+  lyrics_gap_options gap_options;
+  int gaps_stale = 1;
+  /* Milliseconds until the next lyric line starts, -1 when none is due. */
+  long next_line_ms = -1;
   int pulse_frames = 0;
   const int transition_total = 7;
   const int transition_delay_us = 100000;
@@ -478,6 +429,7 @@ int app_run(int argc, char **argv) {
   double offset_seconds = 0.0;
   int showing_last_active = 0;
   int parse_result;
+  int result;
   int config_result = 1;
   char config_path[512] = {0};
   long last_tick_ms = 0;
@@ -526,14 +478,85 @@ int app_run(int argc, char **argv) {
   if (config.cache_dir[0] != '\0') {
     lyrics_cache_set_dir(config.cache_dir);
   }
+  lyrics_cache_set_miss_ttl(config.cache_miss_ttl, config.cache_miss_max_ttl);
+  lyrics_cache_set_binary(config.cache_binary);
+  lyrics_cache_set_packed(strcmp(config.cache_store, "pack") == 0);
+  lyrics_lru_set_budget((size_t)config.cache_memory_kb * 1024);
+  lyrics_registry_configure(config.lyrics_provider);
+  lyrics_set_budget(config.lyrics_budget_ms);
+  lyrics_set_log_timings(config.lyrics_log_timings);
 
   lyric_lead_seconds = config.lyrics_lead_seconds;
+  gap_options.min_gap = config.lyrics_gap_seconds;
+  gap_options.lead_in = config.lyrics_gap_lead_seconds;
+  gap_options.buffer = config.lyrics_gap_buffer_seconds;
+  gap_options.outro = config.lyrics_outro_seconds;
 
   parse_result = args_parse(&args, argc, argv);
   if (parse_result != 0) {
     return parse_result > 0 ? 0 : 1;
   }
 
+  if (args.rebuild_index) {
+    if (cache_index_rebuild() != 0) {
+      log_error("lyrics: cannot rebuild cache index");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (args.migrate_cache) {
+    result = lyrics_pack_migrate();
+    lyrics_cache_close();
+    if (result != 0) {
+      return 1;
+    }
+    if (strcmp(config.cache_store, "pack") != 0) {
+      printf("Set [cache] store = \"pack\" to keep new lyrics packed\n");
+    }
+    return 0;
+  }
+
+  if (args.cache_stats) {
+    result = print_cache_stats(&config);
+    lyrics_cache_close();
+    return result;
+  }
+
+  if (args.cache_import[0] != '\0' || args.cache_verify ||
+      args.cache_export[0] != '\0') {
+    cache_tool_report report;
+
+    /* The tools work on canonical keys, so an old cache is migrated first. */
+    lyrics_cache_migrate_keys(0);
+    if (args.cache_import[0] != '\0') {
+      result = print_cache_report(
+          "imported", lyrics_cache_import(args.cache_import, &report), &report);
+    } else if (args.cache_verify) {
+      result = print_cache_report("verified", lyrics_cache_verify(&report),
+                                  &report);
+    } else {
+      result = print_cache_report(
+          "exported", lyrics_cache_export(args.cache_export, &report), &report);
+    }
+    lyrics_cache_close();
+    return result;
+  }
+
+  if (lyrics_cache_migrate_keys(0) != 0) {
+    log_error("lyrics: cannot migrate cache keys");
+  }
+  /* Only now, so the one-shot commands above never evict anything. */
+  lyrics_cache_set_limits((unsigned long)config.cache_max_mb << 20,
+                          (unsigned long)config.cache_max_entries);
+
+  if (args.prefetch_library) {
+    result = library_prefetch(args.host, args.port, config.library_parallel,
+                              config.library_rate_limit);
+    lyrics_cache_close();
+    return result;
+  }
+
   memset(&mpd_state, 0, sizeof(mpd_state));
   mpd_state.is_stopped = 1;
   player_track_reset(&track);
@@ -577,6 +600,13 @@ int app_run(int argc, char **argv) {
   ui_init(&ui);
   ui_set_rtl(config.rtl_mode, config.rtl_align, config.rtl_shape,
              config.bidi_mode);
+  if (!args.once) {
+    worker_ready = lyrics_worker_start() == 0;
+    if (worker_ready) {
+      upcoming_start(args.host, args.port);
+    }
+    cache_watch_open();
+  }
   if (args.host[0] != '\0') {
     if (mpd_client_connect(args.host, args.port) != 0) {
       log_error("mpd: connection failed");
@@ -606,6 +636,7 @@ int app_run(int argc, char **argv) {
     }
     last_tick_ms = now;
     showing_last_active = 0;
+    next_line_ms = -1;
 
     if (!mpd_ready && args.host[0] != '\0' && now >= mpd_retry_at) {
       if (mpd_client_connect(args.host, args.port) == 0) {
@@ -834,100 +865,75 @@ int app_run(int argc, char **argv) {
         strcmp(track.artist, last_artist) != 0 ||
         strcmp(track.title, last_title) != 0) {
       free_lyrics(&lyrics_text, &doc);
+      lyrics_pending = 0;
+      lyrics_request_id++;
+      if (worker_ready) {
+        lyrics_worker_set_generation(lyrics_request_id);
+      }
       rendered_for_track = 0;
       last_current_index = -1;
+      lyrics_cursor_reset(&cursor);
+      gaps_stale = 1;
       pulse_frames = 0;
       anim_frame = 0;
-      offset_seconds = load_track_offset(track.artist, track.title);
+      offset_seconds = offsets_lookup(track.artist, track.title);
       snprintf(status, sizeof(status), "%s", "Loading lyrics...");
       ui_draw(track.artist, track.title, NULL, -1, track.elapsed, status,
               track.is_paused ? "⏸" : "♪", 0, -1, 0, 0);
       status[0] = '\0';
-      lyrics_text = lyrics_cache_load(track.artist, track.title);
-      if (!lyrics_text) {
-        char *norm_artist = NULL;
-        char *norm_title = NULL;
-        int fetched = 0;
-
-        if (track.source != PLAYER_SOURCE_MPD) {
-          norm_artist = normalize_artist(track.artist);
-          norm_title = normalize_title(track.title);
-        }
-
-        if (lyrics_fetch(track.artist, track.title, track.duration, &lyrics_text,
-                         &fetched_timed) == 0) {
-          fetched = 1;
-        } else {
-          if (!fetched && norm_title && norm_title[0] != '\0') {
-            const char *use_artist = norm_artist && norm_artist[0] != '\0'
-                                         ? norm_artist
-                                         : track.artist;
-            if ((norm_artist && strcmp(use_artist, track.artist) != 0) ||
-                (norm_title && strcmp(norm_title, track.title) != 0)) {
-              if (lyrics_fetch(use_artist, norm_title, track.duration,
-                               &lyrics_text, &fetched_timed) == 0) {
-                fetched = 1;
-              }
-            }
-          }
-          if (!fetched && norm_artist && norm_artist[0] != '\0' &&
-              strcmp(norm_artist, track.artist) != 0) {
-            if (lyrics_fetch(norm_artist, track.title, track.duration,
-                             &lyrics_text, &fetched_timed) == 0) {
-              fetched = 1;
-            }
-          }
-          if (!fetched && norm_title && norm_title[0] != '\0' &&
-              strcmp(norm_title, track.title) != 0) {
-            if (lyrics_fetch(track.artist, norm_title, track.duration,
-                             &lyrics_text, &fetched_timed) == 0) {
-              fetched = 1;
-            }
-          }
-        }
-
-        if (!fetched &&
-            (track.source == PLAYER_SOURCE_YOUTUBE || track.artist[0] == '\0')) {
-          const char *title_only = norm_title && norm_title[0] != '\0'
-                                       ? norm_title
-                                       : track.title;
-          if (title_only && title_only[0] != '\0') {
-            if (lyrics_fetch("", title_only, track.duration, &lyrics_text,
-                             &fetched_timed) == 0) {
-              fetched = 1;
-            }
-          }
-        }
-
-        free(norm_artist);
-        free(norm_title);
-
-        if (fetched) {
-          doc = lyrics_parse(lyrics_text);
-          if (doc) {
-            fetched_timed = doc->has_timestamps;
-          }
-          lyrics_cache_store(track.artist, track.title, lyrics_text,
-                             fetched_timed);
-          if (fetched_timed) {
-            snprintf(status, sizeof(status), "%s", "Loaded synced lyrics");
-          } else {
-            snprintf(status, sizeof(status), "%s", "Loaded lyrics");
+      doc = lyrics_cache_load_doc(track.artist, track.title);
+      if (!doc && lyrics_cache_is_miss(track.artist, track.title)) {
+        snprintf(status, sizeof(status), "%s", "No lyrics found");
+      } else if (!doc) {
+        lyrics_request req;
+
+        memset(&req, 0, sizeof(req));
+        req.id = lyrics_request_id;
+        snprintf(req.artist, sizeof(req.artist), "%s", track.artist);
+        snprintf(req.title, sizeof(req.title), "%s", track.title);
+        req.duration = track.duration;
+        req.source = track.source;
+        if (args.once || !worker_ready) {
+          lyrics_result res;
+          if (lyrics_lookup(&req, &res) == 0) {
+            take_lyrics_result(&res, &lyrics_text, &doc, status,
+                               sizeof(status));
           }
+        } else if (lyrics_worker_submit(&req) == 0) {
+          lyrics_pending = 1;
         }
       } else {
-        doc = lyrics_parse(lyrics_text);
         snprintf(status, sizeof(status), "%s", "Loaded from cache");
       }
+      if (worker_ready && !args.once &&
+          (track.source != PLAYER_SOURCE_MPD || mpd_ready)) {
+        upcoming_request(track.source, config.lyrics_prefetch);
+      }
       snprintf(last_artist, sizeof(last_artist), "%s", track.artist);
       snprintf(last_title, sizeof(last_title), "%s", track.title);
       have_track = 1;
       last_source = track.source;
     }
 
+    if (worker_ready) {
+      lyrics_result res;
+      while (lyrics_worker_poll(&res)) {
+        if (lyrics_pending && res.id == lyrics_request_id) {
+          take_lyrics_result(&res, &lyrics_text, &doc, status,
+                             sizeof(status));
+          lyrics_pending = 0;
+          rendered_for_track = 0;
+          lyrics_cursor_reset(&cursor);
+          gaps_stale = 1;
+        }
+        lyrics_result_free(&res);
+      }
+    }
+
     has_lyrics = (doc && doc->count > 0);
     if (!has_lyrics) {
-      snprintf(status, sizeof(status), "%s", "No lyrics found");
+      snprintf(status, sizeof(status), "%s",
+               lyrics_pending ? "Loading lyrics..." : "No lyrics found");
     } else if (!doc->has_timestamps && !args.show_plain) {
       snprintf(status, sizeof(status), "%s", "No synced lyrics");
     }
@@ -958,15 +964,21 @@ int app_run(int argc, char **argv) {
     if (lyric_position < 0.0) {
       lyric_position = 0.0;
     }
+    if (gaps_stale) {
+      if (lyrics_gaps_build(&gaps, doc, &gap_options) != 0) {
+        log_error("lyrics: gap table allocation failed");
+      }
+      gaps_stale = 0;
+    }
 
     if (args.once) {
       int current_index = -1;
       int pulse = 0;
       const char *icon = track.is_paused ? "⏸" : "♪";
        int music_only = track.is_playing && !track.is_paused &&
-                        is_music_only_section(doc, lyric_position);
+                        lyrics_gaps_contains(&gaps, lyric_position);
        if (doc && doc->has_timestamps) {
-        current_index = lyrics_find_current(doc, lyric_position);
+        current_index = lyrics_cursor_find(&cursor, doc, lyric_position, NULL);
         if (current_index >= 0 && current_index != last_current_index) {
           pulse_frames = 2;
           last_current_index = current_index;
@@ -993,16 +1005,22 @@ int app_run(int argc, char **argv) {
     }
 
     if (track.is_playing && !track.is_paused &&
-        is_music_only_section(doc, lyric_position)) {
+        lyrics_gaps_contains(&gaps, lyric_position)) {
       static const char *frames[] = {"♪    ", " ♪   ", "  ♪  ", "   ♪ ", "    ♪"};
       snprintf(status, sizeof(status), "%s", frames[anim_frame % 5]);
       ui_draw(track.artist, track.title, NULL, -1, track.elapsed, status,
               "♪", 0, -1, 0, 0);
     } else if (doc && doc->has_timestamps) {
-      int current_index = lyrics_find_current(doc, lyric_position);
+      double until_next = -1.0;
+      int current_index =
+          lyrics_cursor_find(&cursor, doc, lyric_position, &until_next);
       int pulse = 0;
       int prev_index = last_current_index;
       int do_transition = 0;
+
+      if (until_next >= 0.0 && track.is_playing && !track.is_paused) {
+        next_line_ms = (long)(until_next * 1000.0) + 1;
+      }
       if (current_index >= 0 && current_index != last_current_index) {
         pulse_frames = 2;
         if (!track.is_paused && prev_index >= 0) {
@@ -1051,42 +1069,110 @@ wait_loop:
     if (args.once) {
       break;
     }
-    if (mpd_fd >= 0) {
-      if (!idle_active) {
-        if (mpd_client_idle_begin(0) == 0) {
-          idle_active = 1;
-        }
+    if (mpd_fd >= 0 && !idle_active) {
+      if (mpd_client_idle_begin(0) == 0) {
+        idle_active = 1;
       }
-      if (idle_active) {
-        struct pollfd pfd;
-        int poll_result;
-        pfd.fd = mpd_fd;
-        pfd.events = POLLIN;
-        pfd.revents = 0;
-        poll_result = poll(&pfd, 1, tick_ms);
-        if (poll_result > 0 && (pfd.revents & POLLIN)) {
-          if (mpd_client_idle_end(NULL) != 0) {
-            idle_active = 0;
-          } else {
-            idle_active = 0;
-          }
+    }
+    {
+      struct pollfd pfds[3];
+      nfds_t nfds = 0;
+      int mpd_slot = -1;
+      int watch_slot = -1;
+      int wait_ms = mpd_fd >= 0 ? tick_ms : args.interval * 1000;
+      int poll_result;
+
+      /* Wake for the next line instead of up to a tick after it. */
+      if (next_line_ms >= 0 && next_line_ms < wait_ms) {
+        wait_ms = next_line_ms < 10 ? 10 : (int)next_line_ms;
+      }
+
+      if (mpd_fd >= 0 && idle_active) {
+        pfds[nfds].fd = mpd_fd;
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        mpd_slot = (int)nfds++;
+      }
+      if (worker_ready) {
+        pfds[nfds].fd = lyrics_worker_get_fd();
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        nfds++;
+      }
+      if (cache_watch_fd() >= 0) {
+        pfds[nfds].fd = cache_watch_fd();
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        watch_slot = (int)nfds++;
+      }
+
+      if (nfds == 0) {
+        sleep_ms(wait_ms);
+      } else {
+        poll_result = poll(pfds, nfds, wait_ms);
+        if (poll_result > 0 && mpd_slot >= 0 &&
+            (pfds[mpd_slot].revents & POLLIN)) {
+          mpd_client_idle_end(NULL);
+          idle_active = 0;
           refresh_mpd = 1;
         } else if (poll_result < 0) {
           idle_active = 0;
-          sleep_ms(tick_ms);
+          sleep_ms(wait_ms);
+        }
+        if (poll_result > 0 && watch_slot >= 0 &&
+            (pfds[watch_slot].revents & POLLIN)) {
+          cache_events events;
+
+          memset(&events, 0, sizeof(events));
+          events.track = &track;
+          events.have_track = have_track && !lyrics_pending;
+          cache_watch_poll(on_cache_change, &events);
+          if (events.offsets && offsets_reload() && have_track) {
+            offset_seconds = offsets_lookup(track.artist, track.title);
+          }
+          if (events.current) {
+            lyrics_doc *edited;
+
+            lyrics_lru_forget(track.artist, track.title);
+            edited = lyrics_cache_load_doc(track.artist, track.title);
+            /* Swapped between frames; the next pass redraws from it. */
+            if (edited) {
+              free_lyrics(&lyrics_text, &doc);
+              doc = edited;
+              rendered_for_track = 0;
+              last_current_index = -1;
+              lyrics_cursor_reset(&cursor);
+              gaps_stale = 1;
+            }
+          }
         }
-      } else {
-        sleep_ms(tick_ms);
       }
-    } else {
-      sleep((unsigned int)args.interval);
     }
   }
 
   if (idle_active) {
     mpd_client_noidle(NULL);
   }
+  upcoming_stop();
+  lyrics_worker_stop();
+  http_shutdown();
+  cache_watch_close();
+  offsets_close();
   free_lyrics(&lyrics_text, &doc);
+  lyrics_gaps_free(&gaps);
+  if (config.lyrics_log_timings) {
+    lyrics_lru_stats stats;
+    char line[160];
+
+    lyrics_lru_stats_get(&stats);
+    snprintf(line, sizeof(line),
+             "memory cache: %lu hits, %lu misses, %lu evictions, %zu entries, "
+             "%zu bytes",
+             stats.hits, stats.misses, stats.evictions, stats.entries,
+             stats.bytes);
+    log_info(line);
+  }
+  lyrics_cache_close();
   ui_shutdown();
   mpd_client_disconnect();
   return 0;
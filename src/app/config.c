@@ -79,6 +79,23 @@ void config_default(app_config *out) {
   out->show_plain = 0;
   out->cache_dir[0] = '\0';
   out->lyrics_lead_seconds = 1.0;
+  out->lyrics_gap_seconds = 10.0;
+  out->lyrics_gap_lead_seconds = 2.0;
+  out->lyrics_gap_buffer_seconds = 1.0;
+  out->lyrics_outro_seconds = 3.0;
+  out->lyrics_prefetch = 3;
+  snprintf(out->lyrics_provider, sizeof(out->lyrics_provider), "%s", "auto");
+  out->lyrics_budget_ms = 8000;
+  out->lyrics_log_timings = 0;
+  out->library_parallel = 4;
+  out->library_rate_limit = 2.0;
+  out->cache_miss_ttl = 6 * 60 * 60;
+  out->cache_miss_max_ttl = 30 * 24 * 60 * 60;
+  out->cache_binary = 1;
+  snprintf(out->cache_store, sizeof(out->cache_store), "%s", "files");
+  out->cache_memory_kb = 8192;
+  out->cache_max_mb = 0;
+  out->cache_max_entries = 0;
   snprintf(out->ui_backend, sizeof(out->ui_backend), "%s", "terminal");
   snprintf(out->ui_font, sizeof(out->ui_font), "%s", "Sans 12");
   out->ui_title_font[0] = '\0';
@@ -309,6 +326,98 @@ int config_load(const char *path, app_config *out) {
     if (value.ok && value.u.d >= 0.0) {
       out->lyrics_lead_seconds = value.u.d;
     }
+
+    value = toml_double_in(table, "gap_seconds");
+    if (value.ok && value.u.d > 0.0) {
+      out->lyrics_gap_seconds = value.u.d;
+    }
+
+    value = toml_double_in(table, "gap_lead_seconds");
+    if (value.ok && value.u.d >= 0.0) {
+      out->lyrics_gap_lead_seconds = value.u.d;
+    }
+
+    value = toml_double_in(table, "gap_buffer_seconds");
+    if (value.ok && value.u.d >= 0.0) {
+      out->lyrics_gap_buffer_seconds = value.u.d;
+    }
+
+    value = toml_double_in(table, "outro_seconds");
+    if (value.ok && value.u.d >= 0.0) {
+      out->lyrics_outro_seconds = value.u.d;
+    }
+
+    value = toml_string_in(table, "provider");
+    if (value.ok && value.u.s) {
+      snprintf(out->lyrics_provider, sizeof(out->lyrics_provider), "%s",
+               value.u.s);
+      trim_spaces(out->lyrics_provider);
+      free(value.u.s);
+    }
+
+    value = toml_int_in(table, "prefetch");
+    if (value.ok && value.u.i >= 0) {
+      out->lyrics_prefetch = value.u.i > 16 ? 16 : (int)value.u.i;
+    }
+
+    value = toml_int_in(table, "budget_ms");
+    if (value.ok && value.u.i > 0) {
+      out->lyrics_budget_ms = (long)value.u.i;
+    }
+
+    value = toml_bool_in(table, "log_timings");
+    if (value.ok) {
+      out->lyrics_log_timings = value.u.b ? 1 : 0;
+    }
+  }
+
+  table = toml_table_in(root, "library");
+  if (table) {
+    value = toml_int_in(table, "parallel");
+    if (value.ok && value.u.i > 0) {
+      out->library_parallel = value.u.i > 16 ? 16 : (int)value.u.i;
+    }
+
+    value = toml_double_in(table, "rate_limit");
+    if (value.ok && value.u.d >= 0.0) {
+      out->library_rate_limit = value.u.d;
+    }
+  }
+
+  table = toml_table_in(root, "cache");
+  if (table) {
+    value = toml_int_in(table, "miss_ttl");
+    if (value.ok && value.u.i >= 0) {
+      out->cache_miss_ttl = (long)value.u.i;
+    }
+
+    value = toml_int_in(table, "miss_max_ttl");
+    if (value.ok && value.u.i >= 0) {
+      out->cache_miss_max_ttl = (long)value.u.i;
+    }
+
+    value = toml_bool_in(table, "binary");
+    if (value.ok) {
+      out->cache_binary = value.u.b ? 1 : 0;
+    }
+
+    value = toml_string_in(table, "store");
+    apply_toml_string(out->cache_store, sizeof(out->cache_store), value);
+
+    value = toml_int_in(table, "memory_kb");
+    if (value.ok && value.u.i >= 0) {
+      out->cache_memory_kb = (long)value.u.i;
+    }
+
+    value = toml_int_in(table, "max_mb");
+    if (value.ok && value.u.i >= 0) {
+      out->cache_max_mb = (long)value.u.i;
+    }
+
+    value = toml_int_in(table, "max_entries");
+    if (value.ok && value.u.i >= 0) {
+      out->cache_max_entries = (long)value.u.i;
+    }
   }
 
   table = toml_table_in(root, "render");
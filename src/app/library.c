@@ -0,0 +1,293 @@
+#include "app/library.h"
+#include "app/cache_index.h"
+#include "app/http.h"
+#include "app/log.h"
+#include "app/lyrics.h"
+#include "app/lyrics_worker.h"
+#include "app/mpd_client.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LIBRARY_MAX_PARALLEL 16
+#define LIBRARY_SAVE_EVERY 50
+#define LIBRARY_MAX_FAILURES 20
+/* Each lookup asks every provider once, so spacing lookups spaces hosts. */
+#define LIBRARY_THROTTLE_SLOT "library-lookups"
+
+/*
+ * Walks the whole MPD database and fills the lyrics cache with a bounded
+ * number of worker threads. Progress is saved as "<total> <done>" in
+ * <cache>/.library-progress, where <done> is the length of the finished
+ * prefix; an interrupted run resumes there as long as the database size is
+ * unchanged. Tracks that failed are not finished, so the prefix ends before
+ * the first of them. A run stops early after a streak of network failures.
+ */
+typedef struct library_state {
+  pthread_mutex_t lock;
+  mpd_track *tracks;
+  size_t count;
+  size_t next;
+  size_t watermark;
+  unsigned char *done;
+  size_t completed;
+  size_t cached;
+  size_t known_missing;
+  size_t fetched;
+  size_t not_found;
+  size_t failed;
+  int failure_streak;
+  int stop;
+} library_state;
+
+static library_state g_library = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static volatile sig_atomic_t g_library_interrupted = 0;
+
+static void on_interrupt(int sig) {
+  (void)sig;
+  g_library_interrupted = 1;
+}
+
+static size_t load_progress(size_t total) {
+  char path[512];
+  FILE *file;
+  unsigned long saved_total = 0;
+  unsigned long saved_done = 0;
+
+  if (lyrics_cache_path(".library-progress", path, sizeof(path)) != 0) {
+    return 0;
+  }
+  file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  if (fscanf(file, "%lu %lu", &saved_total, &saved_done) != 2) {
+    saved_total = 0;
+  }
+  fclose(file);
+  if (saved_total != total || saved_done > total) {
+    return 0;
+  }
+  return (size_t)saved_done;
+}
+
+static void save_progress_locked(void) {
+  char path[512];
+  FILE *file;
+
+  if (lyrics_cache_path(".library-progress", path, sizeof(path)) != 0) {
+    return;
+  }
+  if (g_library.watermark >= g_library.count) {
+    remove(path);
+    cache_index_touch();
+    return;
+  }
+  file = fopen(path, "w");
+  if (!file) {
+    return;
+  }
+  fprintf(file, "%lu %lu\n", (unsigned long)g_library.count,
+          (unsigned long)g_library.watermark);
+  fclose(file);
+  cache_index_touch();
+}
+
+static void print_progress_locked(void) {
+  printf("prefetch: %lu/%lu cached=%lu missing=%lu fetched=%lu "
+         "not_found=%lu failed=%lu\n",
+         (unsigned long)g_library.watermark, (unsigned long)g_library.count,
+         (unsigned long)g_library.cached,
+         (unsigned long)g_library.known_missing,
+         (unsigned long)g_library.fetched, (unsigned long)g_library.not_found,
+         (unsigned long)g_library.failed);
+  fflush(stdout);
+}
+
+typedef enum {
+  ITEM_SKIPPED = 0,
+  ITEM_CACHED,
+  ITEM_KNOWN_MISSING,
+  ITEM_FETCHED,
+  ITEM_NOT_FOUND,
+  ITEM_FAILED
+} item_result;
+
+static item_result prefetch_one(const mpd_track *track) {
+  lyrics_request req;
+  lyrics_result res;
+  char *cached;
+
+  if (track->title[0] == '\0') {
+    return ITEM_SKIPPED;
+  }
+  cached = lyrics_cache_load(track->artist, track->title);
+  if (cached) {
+    free(cached);
+    return ITEM_CACHED;
+  }
+  if (lyrics_cache_is_miss(track->artist, track->title)) {
+    return ITEM_KNOWN_MISSING;
+  }
+
+  memset(&req, 0, sizeof(req));
+  snprintf(req.artist, sizeof(req.artist), "%s", track->artist);
+  snprintf(req.title, sizeof(req.title), "%s", track->title);
+  req.duration = track->duration;
+  req.source = PLAYER_SOURCE_MPD;
+  req.prefetch = 1;
+  /* Wait here, before the lookup starts its deadline, not between hedges. */
+  http_throttle(LIBRARY_THROTTLE_SLOT);
+  if (lyrics_lookup(&req, &res) == 0) {
+    lyrics_result_free(&res);
+    return ITEM_FETCHED;
+  }
+  if (lyrics_cache_is_miss(track->artist, track->title)) {
+    return ITEM_NOT_FOUND;
+  }
+  return ITEM_FAILED;
+}
+
+static void finish_item(size_t index, item_result result) {
+  pthread_mutex_lock(&g_library.lock);
+  /* A failed track holds the watermark back so a resumed run retries it. */
+  g_library.done[index] = result != ITEM_FAILED;
+  while (g_library.watermark < g_library.count &&
+         g_library.done[g_library.watermark]) {
+    g_library.watermark++;
+  }
+  switch (result) {
+    case ITEM_CACHED:
+      g_library.cached++;
+      break;
+    case ITEM_KNOWN_MISSING:
+      g_library.known_missing++;
+      break;
+    case ITEM_FETCHED:
+      g_library.fetched++;
+      break;
+    case ITEM_NOT_FOUND:
+      g_library.not_found++;
+      break;
+    case ITEM_FAILED:
+      g_library.failed++;
+      break;
+    default:
+      break;
+  }
+  if (result == ITEM_FAILED) {
+    if (++g_library.failure_streak >= LIBRARY_MAX_FAILURES &&
+        !g_library.stop) {
+      log_error("prefetch: too many failures, network unavailable?");
+      g_library.stop = 1;
+    }
+  } else if (result == ITEM_FETCHED || result == ITEM_NOT_FOUND) {
+    g_library.failure_streak = 0;
+  }
+  if (++g_library.completed % LIBRARY_SAVE_EVERY == 0) {
+    save_progress_locked();
+    print_progress_locked();
+  }
+  pthread_mutex_unlock(&g_library.lock);
+}
+
+static void *library_worker(void *arg) {
+  (void)arg;
+
+  for (;;) {
+    size_t index;
+
+    pthread_mutex_lock(&g_library.lock);
+    if (g_library_interrupted) {
+      g_library.stop = 1;
+    }
+    if (g_library.stop || g_library.next >= g_library.count) {
+      pthread_mutex_unlock(&g_library.lock);
+      break;
+    }
+    index = g_library.next++;
+    pthread_mutex_unlock(&g_library.lock);
+
+    finish_item(index, prefetch_one(&g_library.tracks[index]));
+  }
+  return NULL;
+}
+
+int library_prefetch(const char *host, int port, int parallel,
+                     double rate_limit) {
+  pthread_t threads[LIBRARY_MAX_PARALLEL];
+  struct sigaction sa;
+  int started = 0;
+  int i;
+  int result;
+
+  if (mpd_client_connect(host, port) != 0) {
+    log_error("prefetch: cannot connect to MPD");
+    return 1;
+  }
+  if (mpd_client_list_library(&g_library.tracks, &g_library.count) != 0) {
+    log_error("prefetch: cannot list MPD database");
+    mpd_client_disconnect();
+    return 1;
+  }
+  mpd_client_disconnect();
+
+  if (lyrics_cache_prepare() != 0 || http_init() != 0) {
+    free(g_library.tracks);
+    return 1;
+  }
+  g_library.done = (unsigned char *)calloc(g_library.count + 1, 1);
+  if (!g_library.done) {
+    free(g_library.tracks);
+    return 1;
+  }
+  g_library.watermark = load_progress(g_library.count);
+  g_library.next = g_library.watermark;
+  memset(g_library.done, 1, g_library.watermark);
+  if (g_library.watermark > 0) {
+    printf("prefetch: resuming at %lu/%lu\n",
+           (unsigned long)g_library.watermark, (unsigned long)g_library.count);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_interrupt;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  http_set_rate_limit(rate_limit);
+  if (parallel < 1) {
+    parallel = 1;
+  }
+  if (parallel > LIBRARY_MAX_PARALLEL) {
+    parallel = LIBRARY_MAX_PARALLEL;
+  }
+  for (i = 0; i < parallel; i++) {
+    if (pthread_create(&threads[started], NULL, library_worker, NULL) == 0) {
+      started++;
+    }
+  }
+  if (started == 0) {
+    library_worker(NULL);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_lock(&g_library.lock);
+  save_progress_locked();
+  print_progress_locked();
+  result = g_library.watermark >= g_library.count ? 0 : 1;
+  pthread_mutex_unlock(&g_library.lock);
+
+  free(g_library.done);
+  free(g_library.tracks);
+  g_library.done = NULL;
+  g_library.tracks = NULL;
+  http_shutdown();
+  return result;
+}
@@ -0,0 +1,474 @@
+#include "app/offsets.h"
+#include "app/cache_index.h"
+#include "app/log.h"
+#include "app/lyrics.h"
+#include "app/normalize.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OFFSETS_KEY_SIZE 512
+#define OFFSETS_LINE_SIZE 1024
+#define OFFSETS_PENDING_MAX 64
+
+typedef struct offset_entry {
+  uint64_t hash;
+  char *key;
+  double seconds;
+  /* Line of the file that set the value, -1 while only in memory. */
+  long line;
+} offset_entry;
+
+typedef struct offset_pending {
+  char label[OFFSETS_KEY_SIZE];
+  double seconds;
+} offset_pending;
+
+typedef struct offsets_state {
+  int opened;
+  offset_entry *slots;
+  size_t capacity;
+  size_t count;
+  long lines;
+  long data_lines;
+  offset_pending pending[OFFSETS_PENDING_MAX];
+  size_t pending_count;
+  /* Size and mtime after our own last write, so its event is ignored. */
+  off_t own_size;
+  struct timespec own_mtime;
+} offsets_state;
+
+static offsets_state g_offsets;
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 1469598103934665603ULL;
+
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+static int offsets_path(char *out, size_t out_size) {
+  return lyrics_cache_path(".offsets", out, out_size);
+}
+
+static void trim(char *text) {
+  size_t start = 0;
+  size_t len = strlen(text);
+
+  while (start < len && isspace((unsigned char)text[start])) {
+    start++;
+  }
+  while (len > start && isspace((unsigned char)text[len - 1])) {
+    len--;
+  }
+  memmove(text, text + start, len - start);
+  text[len - start] = '\0';
+}
+
+static offset_entry *table_find(const char *key, uint64_t hash) {
+  size_t i;
+
+  if (g_offsets.capacity == 0) {
+    return NULL;
+  }
+  i = (size_t)hash & (g_offsets.capacity - 1);
+  while (g_offsets.slots[i].hash != 0) {
+    if (g_offsets.slots[i].hash == hash &&
+        strcmp(g_offsets.slots[i].key, key) == 0) {
+      return &g_offsets.slots[i];
+    }
+    i = (i + 1) & (g_offsets.capacity - 1);
+  }
+  return NULL;
+}
+
+static int table_grow(void) {
+  size_t capacity = g_offsets.capacity ? g_offsets.capacity * 2 : 64;
+  offset_entry *slots = (offset_entry *)calloc(capacity, sizeof(*slots));
+  size_t i;
+
+  if (!slots) {
+    return -1;
+  }
+  for (i = 0; i < g_offsets.capacity; i++) {
+    size_t j;
+    if (g_offsets.slots[i].hash == 0) {
+      continue;
+    }
+    j = (size_t)g_offsets.slots[i].hash & (capacity - 1);
+    while (slots[j].hash != 0) {
+      j = (j + 1) & (capacity - 1);
+    }
+    slots[j] = g_offsets.slots[i];
+  }
+  free(g_offsets.slots);
+  g_offsets.slots = slots;
+  g_offsets.capacity = capacity;
+  return 0;
+}
+
+static int table_put(const char *key, double seconds, long line) {
+  uint64_t hash = hash_key(key);
+  offset_entry *entry = table_find(key, hash);
+  size_t i;
+
+  if (entry) {
+    entry->seconds = seconds;
+    entry->line = line;
+    return 0;
+  }
+  if ((g_offsets.count + 1) * 4 > g_offsets.capacity * 3 &&
+      table_grow() != 0) {
+    return -1;
+  }
+  i = (size_t)hash & (g_offsets.capacity - 1);
+  while (g_offsets.slots[i].hash != 0) {
+    i = (i + 1) & (g_offsets.capacity - 1);
+  }
+  g_offsets.slots[i].key = strdup(key);
+  if (!g_offsets.slots[i].key) {
+    return -1;
+  }
+  g_offsets.slots[i].hash = hash;
+  g_offsets.slots[i].seconds = seconds;
+  g_offsets.slots[i].line = line;
+  g_offsets.count++;
+  return 0;
+}
+
+static void table_clear(void) {
+  size_t i;
+
+  for (i = 0; i < g_offsets.capacity; i++) {
+    free(g_offsets.slots[i].key);
+  }
+  free(g_offsets.slots);
+  g_offsets.slots = NULL;
+  g_offsets.capacity = 0;
+  g_offsets.count = 0;
+}
+
+typedef struct label_put {
+  double seconds;
+  long line;
+  int result;
+} label_put;
+
+static int put_label_key(void *ctx, const char *key) {
+  label_put *put = (label_put *)ctx;
+
+  if (table_put(key, put->seconds, put->line) != 0) {
+    put->result = -1;
+  }
+  return 0;
+}
+
+/*
+ * "A - B - C" may be artist "A - B" or artist "A", and a track without an
+ * artist may carry the whole label as its title, so every reading is
+ * indexed, exactly like cache file names.
+ */
+static int put_label(const char *label, double seconds, long line) {
+  label_put put;
+
+  put.seconds = seconds;
+  put.line = line;
+  put.result = 0;
+  if (cache_index_stem_keys(label, put_label_key, &put) != 0) {
+    return -1;
+  }
+  return put.result;
+}
+
+typedef struct label_check {
+  long line;
+  int live;
+} label_check;
+
+static int check_label_key(void *ctx, const char *key) {
+  label_check *check = (label_check *)ctx;
+  const offset_entry *entry = table_find(key, hash_key(key));
+
+  if (entry && entry->line == check->line) {
+    check->live = 1;
+  }
+  return 0;
+}
+
+/* Splits "label = seconds"; returns 0 for a data line. */
+static int parse_line(char *line, char **out_label, double *out_seconds) {
+  char *eq;
+  char *end;
+  char *value;
+
+  if ((unsigned char)line[0] == 0xEF && (unsigned char)line[1] == 0xBB &&
+      (unsigned char)line[2] == 0xBF) {
+    memmove(line, line + 3, strlen(line + 3) + 1);
+  }
+  trim(line);
+  if (line[0] == '\0' || line[0] == '#') {
+    return -1;
+  }
+  eq = strrchr(line, '=');
+  if (!eq) {
+    return -1;
+  }
+  *eq = '\0';
+  value = eq + 1;
+  trim(line);
+  trim(value);
+  *out_seconds = strtod(value, &end);
+  if (end == value || line[0] == '\0') {
+    return -1;
+  }
+  *out_label = line;
+  return 0;
+}
+
+static void remember_own_write(void) {
+  char path[512];
+  struct stat st;
+
+  if (offsets_path(path, sizeof(path)) == 0 && stat(path, &st) == 0) {
+    g_offsets.own_size = st.st_size;
+    g_offsets.own_mtime = st.st_mtim;
+  }
+}
+
+static int load_file(void) {
+  char path[512];
+  char line[OFFSETS_LINE_SIZE];
+  FILE *file;
+
+  table_clear();
+  g_offsets.lines = 0;
+  g_offsets.data_lines = 0;
+  if (offsets_path(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  file = fopen(path, "r");
+  if (!file) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    char *label;
+    double seconds;
+    long index = g_offsets.lines++;
+
+    if (parse_line(line, &label, &seconds) == 0) {
+      put_label(label, seconds, index);
+      g_offsets.data_lines++;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+int offsets_open(void) {
+  if (g_offsets.opened) {
+    return 0;
+  }
+  g_offsets.opened = 1;
+  if (lyrics_cache_prepare() != 0) {
+    return -1;
+  }
+  return load_file();
+}
+
+static int changed_by_others(void) {
+  char path[512];
+  struct stat st;
+
+  if (offsets_path(path, sizeof(path)) != 0 || stat(path, &st) != 0) {
+    return g_offsets.count > 0;
+  }
+  return st.st_size != g_offsets.own_size ||
+         st.st_mtim.tv_sec != g_offsets.own_mtime.tv_sec ||
+         st.st_mtim.tv_nsec != g_offsets.own_mtime.tv_nsec;
+}
+
+int offsets_reload(void) {
+  if (!g_offsets.opened || !changed_by_others()) {
+    return 0;
+  }
+  load_file();
+  remember_own_write();
+  return 1;
+}
+
+double offsets_lookup(const char *artist, const char *title) {
+  char key[OFFSETS_KEY_SIZE];
+  const offset_entry *entry;
+
+  if (!title) {
+    return 0.0;
+  }
+  if (!g_offsets.opened) {
+    offsets_open();
+  }
+  if (artist && strcmp(artist, "Unknown Artist") == 0) {
+    artist = NULL;
+  }
+  if (normalize_track_key(artist ? artist : "", title, key, sizeof(key)) != 0) {
+    return 0.0;
+  }
+  entry = table_find(key, hash_key(key));
+  return entry ? entry->seconds : 0.0;
+}
+
+int offsets_set(const char *artist, const char *title, double seconds) {
+  offset_pending *pending;
+
+  if (!title) {
+    return -1;
+  }
+  if (!g_offsets.opened) {
+    offsets_open();
+  }
+  if (g_offsets.pending_count == OFFSETS_PENDING_MAX && offsets_flush() != 0) {
+    return -1;
+  }
+  pending = &g_offsets.pending[g_offsets.pending_count++];
+  if (artist && artist[0] != '\0' && strcmp(artist, "Unknown Artist") != 0) {
+    snprintf(pending->label, sizeof(pending->label), "%s - %s", artist, title);
+  } else {
+    snprintf(pending->label, sizeof(pending->label), "%s", title);
+  }
+  pending->seconds = seconds;
+  return put_label(pending->label, seconds, -1);
+}
+
+/*
+ * Rewrites the file without the lines later ones overrode, keeping
+ * comments, then appends the pending adjustments.
+ */
+static int compact_file(const char *path) {
+  char temp[520];
+  char line[OFFSETS_LINE_SIZE];
+  char copy[OFFSETS_LINE_SIZE];
+  FILE *in;
+  FILE *out;
+  long index = 0;
+  int ok = 1;
+
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  in = fopen(path, "r");
+  out = fopen(temp, "w");
+  if (!in || !out) {
+    if (in) {
+      fclose(in);
+    }
+    if (out) {
+      fclose(out);
+    }
+    return -1;
+  }
+  while (ok && fgets(line, sizeof(line), in)) {
+    label_check check;
+    char *label;
+    double seconds;
+
+    snprintf(copy, sizeof(copy), "%s", line);
+    check.line = index++;
+    check.live = 1;
+    if (parse_line(copy, &label, &seconds) == 0) {
+      check.live = 0;
+      cache_index_stem_keys(label, check_label_key, &check);
+    }
+    if (check.live) {
+      ok = fputs(line, out) != EOF;
+    }
+  }
+  fclose(in);
+  if (fclose(out) != 0 || !ok || rename(temp, path) != 0) {
+    remove(temp);
+    return -1;
+  }
+  cache_index_touch();
+  return load_file();
+}
+
+/*
+ * Data lines some key still points at. The table holds one key per
+ * reading of each label, so its size says nothing about the file.
+ */
+static long live_lines(void) {
+  unsigned char *seen;
+  long live = 0;
+  size_t i;
+
+  if (g_offsets.lines <= 0) {
+    return 0;
+  }
+  seen = (unsigned char *)calloc((size_t)g_offsets.lines / 8 + 1, 1);
+  if (!seen) {
+    return g_offsets.data_lines;
+  }
+  for (i = 0; i < g_offsets.capacity; i++) {
+    long line = g_offsets.slots[i].line;
+
+    if (g_offsets.slots[i].hash == 0 || line < 0 ||
+        line >= g_offsets.lines) {
+      continue;
+    }
+    if (!(seen[line / 8] & (1u << (line % 8)))) {
+      seen[line / 8] |= (unsigned char)(1u << (line % 8));
+      live++;
+    }
+  }
+  free(seen);
+  return live;
+}
+
+int offsets_flush(void) {
+  char path[512];
+  FILE *file;
+  size_t i;
+  int ok = 1;
+
+  if (g_offsets.pending_count == 0) {
+    return 0;
+  }
+  if (offsets_path(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  /* Superseded lines pile up with every append; drop them now and then. */
+  if (g_offsets.data_lines > OFFSETS_PENDING_MAX &&
+      g_offsets.data_lines > live_lines() + OFFSETS_PENDING_MAX) {
+    compact_file(path);
+  }
+  file = fopen(path, "a");
+  if (!file) {
+    log_error("offsets: cannot write offsets file");
+    return -1;
+  }
+  for (i = 0; i < g_offsets.pending_count && ok; i++) {
+    ok = fprintf(file, "%s = %.3f\n", g_offsets.pending[i].label,
+                 g_offsets.pending[i].seconds) > 0;
+    put_label(g_offsets.pending[i].label, g_offsets.pending[i].seconds,
+              g_offsets.lines++);
+    g_offsets.data_lines++;
+  }
+  if (fclose(file) != 0 || !ok) {
+    log_error("offsets: cannot write offsets file");
+    return -1;
+  }
+  g_offsets.pending_count = 0;
+  remember_own_write();
+  cache_index_touch();
+  return 0;
+}
+
+void offsets_close(void) {
+  offsets_flush();
+  table_clear();
+  g_offsets.opened = 0;
+}
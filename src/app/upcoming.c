@@ -0,0 +1,191 @@
+#include "app/upcoming.h"
+#include "app/log.h"
+#include "app/lyrics_worker.h"
+#include "app/mpd_client.h"
+#include "app/spotify.h"
+#include "app/ytmusic.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define UPCOMING_MAX 16
+
+/*
+ * Reads the tracks after the current one on a thread of its own and queues
+ * low-priority lookups for them, so the next transition is a cache hit. The
+ * MPD queue read and the MPRIS TrackList calls block for up to a second and
+ * must stay off the render thread. Only the newest request counts: one that
+ * is replaced while its read is running is dropped instead of submitted.
+ */
+typedef struct upcoming_state {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  int started;
+  int stopping;
+  int pending;
+  unsigned long generation;
+  player_source source;
+  int count;
+  char host[128];
+  int port;
+} upcoming_state;
+
+static upcoming_state g_upcoming = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+typedef struct upcoming_list {
+  mpd_track tracks[UPCOMING_MAX];
+  size_t count;
+  player_source source;
+} upcoming_list;
+
+static void list_add(upcoming_list *list, const player_track *track) {
+  mpd_track *out = &list->tracks[list->count++];
+
+  memset(out, 0, sizeof(*out));
+  snprintf(out->artist, sizeof(out->artist), "%s", track->artist);
+  snprintf(out->title, sizeof(out->title), "%s", track->title);
+  out->duration = track->duration;
+}
+
+/* MPD exposes the queue directly; MPRIS players only report the next track
+ * when they implement TrackList. */
+static void read_upcoming(player_source source, int count,
+                          upcoming_list *list) {
+  list->count = 0;
+  list->source = source;
+  if (count > UPCOMING_MAX) {
+    count = UPCOMING_MAX;
+  }
+
+  if (source == PLAYER_SOURCE_MPD) {
+    if (mpd_client_read_upcoming(g_upcoming.host, g_upcoming.port,
+                                 list->tracks, (size_t)count,
+                                 &list->count) != 0) {
+      list->count = 0;
+    }
+  } else if (source == PLAYER_SOURCE_SPOTIFY) {
+    player_track next;
+    char err[128];
+
+    player_track_reset(&next);
+    if (spotify_get_next(&next, err, sizeof(err)) == SPOTIFY_OK) {
+      list_add(list, &next);
+    }
+  } else if (source == PLAYER_SOURCE_YOUTUBE) {
+    player_track next;
+    char err[128];
+
+    player_track_reset(&next);
+    if (ytmusic_get_next(&next, err, sizeof(err)) == YTMUSIC_OK) {
+      list_add(list, &next);
+    }
+  }
+}
+
+static void submit_list(const upcoming_list *list) {
+  size_t i;
+
+  for (i = 0; i < list->count; i++) {
+    const mpd_track *track = &list->tracks[i];
+    lyrics_request req;
+
+    if (track->title[0] == '\0') {
+      continue;
+    }
+    memset(&req, 0, sizeof(req));
+    snprintf(req.artist, sizeof(req.artist), "%s", track->artist);
+    snprintf(req.title, sizeof(req.title), "%s", track->title);
+    req.duration = track->duration;
+    req.source = list->source;
+    req.prefetch = 1;
+    lyrics_worker_submit(&req);
+  }
+}
+
+static void *upcoming_main(void *arg) {
+  upcoming_list list;
+
+  (void)arg;
+  pthread_mutex_lock(&g_upcoming.lock);
+  while (!g_upcoming.stopping) {
+    unsigned long generation;
+    player_source source;
+    int count;
+
+    if (!g_upcoming.pending) {
+      pthread_cond_wait(&g_upcoming.wake, &g_upcoming.lock);
+      continue;
+    }
+    g_upcoming.pending = 0;
+    generation = g_upcoming.generation;
+    source = g_upcoming.source;
+    count = g_upcoming.count;
+    pthread_mutex_unlock(&g_upcoming.lock);
+
+    read_upcoming(source, count, &list);
+
+    pthread_mutex_lock(&g_upcoming.lock);
+    if (generation == g_upcoming.generation && !g_upcoming.stopping) {
+      submit_list(&list);
+    }
+  }
+  pthread_mutex_unlock(&g_upcoming.lock);
+  return NULL;
+}
+
+int upcoming_start(const char *mpd_host, int mpd_port) {
+  pthread_mutex_lock(&g_upcoming.lock);
+  if (g_upcoming.started) {
+    pthread_mutex_unlock(&g_upcoming.lock);
+    return 0;
+  }
+  snprintf(g_upcoming.host, sizeof(g_upcoming.host), "%s",
+           mpd_host ? mpd_host : "");
+  g_upcoming.port = mpd_port;
+  g_upcoming.stopping = 0;
+  g_upcoming.pending = 0;
+  if (pthread_create(&g_upcoming.thread, NULL, upcoming_main, NULL) != 0) {
+    pthread_mutex_unlock(&g_upcoming.lock);
+    log_error("prefetch: cannot start the queue reader");
+    return -1;
+  }
+  g_upcoming.started = 1;
+  pthread_mutex_unlock(&g_upcoming.lock);
+  return 0;
+}
+
+void upcoming_stop(void) {
+  pthread_mutex_lock(&g_upcoming.lock);
+  if (!g_upcoming.started) {
+    pthread_mutex_unlock(&g_upcoming.lock);
+    return;
+  }
+  g_upcoming.stopping = 1;
+  pthread_cond_broadcast(&g_upcoming.wake);
+  pthread_mutex_unlock(&g_upcoming.lock);
+  pthread_join(g_upcoming.thread, NULL);
+
+  pthread_mutex_lock(&g_upcoming.lock);
+  g_upcoming.started = 0;
+  g_upcoming.stopping = 0;
+  pthread_mutex_unlock(&g_upcoming.lock);
+}
+
+/* Replaces whatever prefetch was queued for the previous track. */
+void upcoming_request(player_source source, int count) {
+  pthread_mutex_lock(&g_upcoming.lock);
+  lyrics_worker_clear_prefetch();
+  g_upcoming.generation++;
+  g_upcoming.pending = 0;
+  if (g_upcoming.started && count > 0) {
+    g_upcoming.source = source;
+    g_upcoming.count = count;
+    g_upcoming.pending = 1;
+    pthread_cond_signal(&g_upcoming.wake);
+  }
+  pthread_mutex_unlock(&g_upcoming.lock);
+}
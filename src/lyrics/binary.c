@@ -0,0 +1,208 @@
+#include "app/lyrics_binary.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BINARY_VERSION 4
+
+enum { BINARY_TIMED = 1 << 0 };
+
+typedef struct binary_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t flags;
+  uint32_t source_size;
+  uint32_t blob_size;
+  uint32_t word_count;
+  uint32_t source_crc;
+  int64_t source_mtime;
+} binary_header;
+
+lyrics_doc *lyrics_binary_map(const char *path, size_t source_size,
+                              int64_t source_mtime, uint32_t source_crc) {
+  const binary_header *header;
+  const int32_t *times;
+  const uint32_t *offsets;
+  const uint32_t *word_firsts;
+  const uint32_t *word_counts;
+  const lyrics_word *words;
+  const char *blob;
+  lyrics_doc *doc;
+  struct stat st;
+  size_t expect;
+  size_t i;
+  void *map;
+  int fd;
+
+  if (!path) {
+    return NULL;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(binary_header)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  header = (const binary_header *)map;
+  expect = sizeof(*header) +
+           (size_t)header->count * (sizeof(int32_t) + 3 * sizeof(uint32_t)) +
+           (size_t)header->word_count * sizeof(lyrics_word) +
+           header->blob_size;
+  if (memcmp(header->magic, "CSLB", 4) != 0 ||
+      header->version != BINARY_VERSION ||
+      header->source_size != source_size ||
+      header->source_mtime != source_mtime ||
+      (source_crc != 0 && header->source_crc != source_crc) ||
+      header->blob_size == 0 ||
+      expect != (size_t)st.st_size) {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  times = (const int32_t *)(header + 1);
+  offsets = (const uint32_t *)(times + header->count);
+  word_firsts = offsets + header->count;
+  word_counts = word_firsts + header->count;
+  words = (const lyrics_word *)(word_counts + header->count);
+  blob = (const char *)(words + header->word_count);
+  if (blob[header->blob_size - 1] != '\0') {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+
+  /* The line array shares the doc's allocation; texts, times and words
+   * stay in the map. */
+  doc = (lyrics_doc *)calloc(1, sizeof(*doc) +
+                                    header->count * sizeof(*doc->lines));
+  if (!doc) {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  doc->lines = header->count > 0 ? (lyrics_line *)(doc + 1) : NULL;
+  doc->size = sizeof(*doc) + header->count * sizeof(*doc->lines);
+  doc->has_timestamps = (header->flags & BINARY_TIMED) != 0;
+  doc->refs = 1;
+  for (i = 0; i < header->count; i++) {
+    uint32_t w;
+
+    if (offsets[i] >= header->blob_size ||
+        word_counts[i] > header->word_count ||
+        word_firsts[i] > header->word_count - word_counts[i]) {
+      free(doc);
+      munmap(map, (size_t)st.st_size);
+      return NULL;
+    }
+    for (w = word_firsts[i]; w < word_firsts[i] + word_counts[i]; w++) {
+      if (words[w].text_start > words[w].text_end ||
+          words[w].text_end >= header->blob_size - offsets[i]) {
+        free(doc);
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+      }
+    }
+    doc->lines[i].text = (char *)(blob + offsets[i]);
+    doc->lines[i].has_time = doc->has_timestamps;
+    doc->lines[i].word_first = word_firsts[i];
+    doc->lines[i].word_count = word_counts[i];
+  }
+  if (header->word_count > 0) {
+    doc->words = (lyrics_word *)words;
+    doc->word_count = header->word_count;
+  }
+  doc->times = header->count > 0 ? (int32_t *)times : NULL;
+  doc->count = header->count;
+  doc->mapping = map;
+  doc->mapping_size = (size_t)st.st_size;
+  return doc;
+}
+
+int lyrics_binary_write(const char *path, const lyrics_doc *doc,
+                        size_t source_size, int64_t source_mtime,
+                        uint32_t source_crc) {
+  binary_header header;
+  char temp[520];
+  uint32_t *offsets;
+  size_t lines = doc ? doc->count : 0;
+  size_t blob_size = 0;
+  size_t i;
+  FILE *file;
+  int ok;
+
+  if (!path || !doc || source_size > UINT32_MAX ||
+      doc->word_count > UINT32_MAX) {
+    return -1;
+  }
+  for (i = 0; i < doc->count; i++) {
+    blob_size += strlen(doc->lines[i].text ? doc->lines[i].text : "") + 1;
+  }
+  if (blob_size == 0) {
+    blob_size = 1;
+  }
+  if (blob_size > UINT32_MAX) {
+    return -1;
+  }
+  /* Blob offsets, then each line's first word, then its word count. */
+  offsets = (uint32_t *)malloc((lines ? lines : 1) * 3 * sizeof(*offsets));
+  if (!offsets) {
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "CSLB", 4);
+  header.version = BINARY_VERSION;
+  header.count = (uint32_t)doc->count;
+  header.flags = doc->has_timestamps ? BINARY_TIMED : 0;
+  header.source_size = (uint32_t)source_size;
+  header.blob_size = (uint32_t)blob_size;
+  header.word_count = (uint32_t)doc->word_count;
+  header.source_crc = source_crc;
+  header.source_mtime = source_mtime;
+
+  blob_size = 0;
+  for (i = 0; i < doc->count; i++) {
+    offsets[i] = (uint32_t)blob_size;
+    offsets[lines + i] = doc->lines[i].word_first;
+    offsets[2 * lines + i] = doc->lines[i].word_count;
+    blob_size += strlen(doc->lines[i].text ? doc->lines[i].text : "") + 1;
+  }
+
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  file = fopen(temp, "wb");
+  if (!file) {
+    free(offsets);
+    return -1;
+  }
+  ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+       (lines == 0 ||
+        fwrite(doc->times, sizeof(*doc->times), lines, file) == lines) &&
+       fwrite(offsets, sizeof(*offsets), 3 * lines, file) == 3 * lines &&
+       (doc->word_count == 0 ||
+        fwrite(doc->words, sizeof(*doc->words), doc->word_count, file) ==
+            doc->word_count);
+  for (i = 0; ok && i < doc->count; i++) {
+    const char *text = doc->lines[i].text ? doc->lines[i].text : "";
+    ok = fwrite(text, 1, strlen(text) + 1, file) == strlen(text) + 1;
+  }
+  if (ok && doc->count == 0) {
+    ok = fputc('\0', file) != EOF;
+  }
+  free(offsets);
+  if (fclose(file) != 0 || !ok || rename(temp, path) != 0) {
+    remove(temp);
+    return -1;
+  }
+  return 0;
+}
@@ -1,13 +1,76 @@
 #include "app/lyrics.h"
+#include "app/cache_index.h"
+#include "app/cache_writer.h"
+#include "app/log.h"
+#include "app/lyrics_binary.h"
+#include "app/lyrics_lru.h"
+#include "app/lyrics_pack.h"
+#include "app/normalize.h"
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MISS_KEY_SIZE 512
+#define MISS_MAX_ATTEMPTS 16
 
 static char g_cache_dir[512];
+static int g_cache_binary = 1;
+static int g_cache_packed = 0;
+
+#define TRIM_STEP 16
+
+typedef struct cache_limits {
+  pthread_mutex_t trim_lock;
+  unsigned long max_bytes;
+  unsigned long max_entries;
+} cache_limits;
+
+static cache_limits g_limits = {
+    .trim_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Tracks the providers answered for without lyrics, keyed by the normalized
+ * artist/title. Each further miss doubles the re-check delay up to max_ttl.
+ * Persisted as "<next_check>\t<attempts>\t<key>" lines in <cache>/.misses;
+ * each change is appended, the last line for a key wins, attempts 0 drops
+ * the key, and the file is rewritten once stale lines outnumber live ones.
+ */
+typedef struct miss_entry {
+  uint64_t hash;
+  time_t next_check;
+  int attempts;
+  char *key;
+} miss_entry;
+
+typedef struct miss_table {
+  pthread_mutex_t lock;
+  miss_entry *slots;
+  size_t capacity;
+  size_t count;
+  long ttl;
+  long max_ttl;
+  int loaded;
+  /* Lines in the file, live or superseded. */
+  size_t lines;
+} miss_table;
+
+static miss_table g_misses = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ttl = 6 * 60 * 60,
+    .max_ttl = 30 * 24 * 60 * 60,
+};
 
 static int ensure_dir(const char *path) {
   if (mkdir(path, 0700) == 0) {
@@ -237,6 +300,28 @@ static int ensure_cache_dirs(void) {
   return ensure_dir_recursive(path);
 }
 
+int lyrics_cache_prepare(void) {
+  return ensure_cache_dirs();
+}
+
+int lyrics_cache_path(const char *name, char *out, size_t out_size) {
+  const char *home;
+
+  if (!name || !out || out_size == 0) {
+    return -1;
+  }
+  if (g_cache_dir[0] != '\0') {
+    snprintf(out, out_size, "%s/%s", g_cache_dir, name);
+    return 0;
+  }
+  home = getenv("HOME");
+  if (!home || home[0] == '\0') {
+    return -1;
+  }
+  snprintf(out, out_size, "%s/lyrics/%s", home, name);
+  return 0;
+}
+
 static int is_unknown_artist(const char *artist) {
   if (!artist || artist[0] == '\0') {
     return 1;
@@ -291,9 +376,473 @@ static char *read_file(const char *path) {
   return buffer;
 }
 
-char *lyrics_cache_load(const char *artist, const char *title) {
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 1469598103934665603ULL;
+
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+static miss_entry *miss_find(const char *key, uint64_t hash) {
+  size_t i;
+
+  if (g_misses.capacity == 0) {
+    return NULL;
+  }
+  i = (size_t)hash & (g_misses.capacity - 1);
+  while (g_misses.slots[i].hash != 0) {
+    if (g_misses.slots[i].hash == hash &&
+        strcmp(g_misses.slots[i].key, key) == 0) {
+      return &g_misses.slots[i];
+    }
+    i = (i + 1) & (g_misses.capacity - 1);
+  }
+  return NULL;
+}
+
+static void miss_place(miss_entry *slots, size_t capacity,
+                       const miss_entry *entry) {
+  size_t i = (size_t)entry->hash & (capacity - 1);
+
+  while (slots[i].hash != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+  slots[i] = *entry;
+}
+
+static int miss_grow(void) {
+  size_t capacity = g_misses.capacity ? g_misses.capacity * 2 : 64;
+  miss_entry *slots = (miss_entry *)calloc(capacity, sizeof(*slots));
+  size_t i;
+
+  if (!slots) {
+    return -1;
+  }
+  for (i = 0; i < g_misses.capacity; i++) {
+    if (g_misses.slots[i].hash != 0) {
+      miss_place(slots, capacity, &g_misses.slots[i]);
+    }
+  }
+  free(g_misses.slots);
+  g_misses.slots = slots;
+  g_misses.capacity = capacity;
+  return 0;
+}
+
+static miss_entry *miss_insert(const char *key, uint64_t hash) {
+  miss_entry entry;
+  miss_entry *found;
+
+  if ((g_misses.count + 1) * 4 > g_misses.capacity * 3 && miss_grow() != 0) {
+    return NULL;
+  }
+  memset(&entry, 0, sizeof(entry));
+  entry.hash = hash;
+  entry.key = (char *)malloc(strlen(key) + 1);
+  if (!entry.key) {
+    return NULL;
+  }
+  strcpy(entry.key, key);
+  miss_place(g_misses.slots, g_misses.capacity, &entry);
+  g_misses.count++;
+  found = miss_find(key, hash);
+  return found;
+}
+
+/* Backward-shift deletion keeps probe chains intact without tombstones. */
+static void miss_remove(miss_entry *entry) {
+  size_t mask = g_misses.capacity - 1;
+  size_t hole = (size_t)(entry - g_misses.slots);
+  size_t i = (hole + 1) & mask;
+
+  free(entry->key);
+  memset(entry, 0, sizeof(*entry));
+  g_misses.count--;
+
+  while (g_misses.slots[i].hash != 0) {
+    size_t home = (size_t)g_misses.slots[i].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      g_misses.slots[hole] = g_misses.slots[i];
+      memset(&g_misses.slots[i], 0, sizeof(g_misses.slots[i]));
+      hole = i;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+static int build_miss_path(char *out, size_t out_size) {
+  return lyrics_cache_path(".misses", out, out_size);
+}
+
+static void miss_load_locked(void) {
+  char path[512];
+  char line[MISS_KEY_SIZE + 64];
+  FILE *file;
+
+  g_misses.loaded = 1;
+  if (build_miss_path(path, sizeof(path)) != 0) {
+    return;
+  }
+  file = fopen(path, "r");
+  if (!file) {
+    return;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    char *end;
+    char *key;
+    long long next_check = strtoll(line, &end, 10);
+    long attempts;
+    miss_entry *entry;
+    uint64_t hash;
+
+    if (*end != '\t') {
+      continue;
+    }
+    attempts = strtol(end + 1, &key, 10);
+    if (*key != '\t' || attempts < 0) {
+      continue;
+    }
+    key++;
+    key[strcspn(key, "\n")] = '\0';
+    if (key[0] == '\0') {
+      continue;
+    }
+    g_misses.lines++;
+    hash = hash_key(key);
+    entry = miss_find(key, hash);
+    if (attempts == 0) {
+      if (entry) {
+        miss_remove(entry);
+      }
+      continue;
+    }
+    if (!entry) {
+      entry = miss_insert(key, hash);
+    }
+    if (entry) {
+      entry->next_check = (time_t)next_check;
+      entry->attempts = (int)attempts;
+    }
+  }
+  fclose(file);
+}
+
+/*
+ * Rewrites the whole file through a temp file. Entries that expired more
+ * than max_ttl ago are dropped so the backoff eventually resets.
+ */
+static void miss_save_locked(void) {
   char path[512];
+  char temp[520];
+  FILE *file;
+  time_t now = time(NULL);
+  size_t i;
+
+  if (build_miss_path(path, sizeof(path)) != 0 || ensure_cache_dirs() != 0) {
+    return;
+  }
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  file = fopen(temp, "w");
+  if (!file) {
+    log_error("lyrics: cannot write miss cache");
+    return;
+  }
+  g_misses.lines = 0;
+  for (i = 0; i < g_misses.capacity; i++) {
+    const miss_entry *entry = &g_misses.slots[i];
+    if (entry->hash == 0 || entry->next_check + g_misses.max_ttl < now) {
+      continue;
+    }
+    fprintf(file, "%lld\t%d\t%s\n", (long long)entry->next_check,
+            entry->attempts, entry->key);
+    g_misses.lines++;
+  }
+  if (fclose(file) != 0 || rename(temp, path) != 0) {
+    remove(temp);
+  }
+  cache_index_touch();
+}
+
+/*
+ * Appends one change, so a library prefetch full of misses costs a line
+ * each instead of a rewrite each; compacts once the file is mostly stale.
+ */
+static void miss_append_locked(const char *key, const miss_entry *entry) {
+  char path[512];
+  FILE *file;
+  int created;
+
+  if (g_misses.lines > 2 * g_misses.count + 256) {
+    miss_save_locked();
+    return;
+  }
+  if (build_miss_path(path, sizeof(path)) != 0 || ensure_cache_dirs() != 0) {
+    return;
+  }
+  created = access(path, F_OK) != 0;
+  file = fopen(path, "a");
+  if (!file) {
+    log_error("lyrics: cannot write miss cache");
+    return;
+  }
+  fprintf(file, "%lld\t%d\t%s\n",
+          (long long)(entry ? entry->next_check : 0),
+          entry ? entry->attempts : 0, key);
+  fclose(file);
+  g_misses.lines++;
+  /* Appending leaves the directory alone; only creating the file does not. */
+  if (created) {
+    cache_index_touch();
+  }
+}
+
+static long miss_delay(int attempts) {
+  long delay = g_misses.ttl;
+  int i;
+
+  for (i = 1; i < attempts && delay < g_misses.max_ttl; i++) {
+    delay *= 2;
+  }
+  return delay < g_misses.max_ttl ? delay : g_misses.max_ttl;
+}
+
+int lyrics_cache_is_miss(const char *artist, const char *title) {
+  char key[MISS_KEY_SIZE];
+  miss_entry *entry;
+  int result = 0;
+
+  if (g_misses.ttl <= 0 ||
+      normalize_track_key(artist, title, key, sizeof(key)) != 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_misses.lock);
+  if (!g_misses.loaded) {
+    miss_load_locked();
+  }
+  entry = miss_find(key, hash_key(key));
+  if (entry && entry->next_check > time(NULL)) {
+    result = 1;
+  }
+  pthread_mutex_unlock(&g_misses.lock);
+  return result;
+}
+
+int lyrics_cache_store_miss(const char *artist, const char *title) {
+  char key[MISS_KEY_SIZE];
+  uint64_t hash;
+  miss_entry *entry;
+
+  if (g_misses.ttl <= 0 ||
+      normalize_track_key(artist, title, key, sizeof(key)) != 0) {
+    return -1;
+  }
+  hash = hash_key(key);
+
+  pthread_mutex_lock(&g_misses.lock);
+  if (!g_misses.loaded) {
+    miss_load_locked();
+  }
+  entry = miss_find(key, hash);
+  if (!entry) {
+    entry = miss_insert(key, hash);
+  }
+  if (!entry) {
+    pthread_mutex_unlock(&g_misses.lock);
+    return -1;
+  }
+  if (entry->attempts < MISS_MAX_ATTEMPTS) {
+    entry->attempts++;
+  }
+  entry->next_check = time(NULL) + miss_delay(entry->attempts);
+  miss_append_locked(key, entry);
+  pthread_mutex_unlock(&g_misses.lock);
+  return 0;
+}
+
+static void miss_forget(const char *artist, const char *title) {
+  char key[MISS_KEY_SIZE];
+  miss_entry *entry;
+
+  if (normalize_track_key(artist, title, key, sizeof(key)) != 0) {
+    return;
+  }
+  pthread_mutex_lock(&g_misses.lock);
+  if (!g_misses.loaded) {
+    miss_load_locked();
+  }
+  entry = miss_find(key, hash_key(key));
+  if (entry) {
+    miss_remove(entry);
+    miss_append_locked(key, NULL);
+  }
+  pthread_mutex_unlock(&g_misses.lock);
+}
+
+void lyrics_cache_set_miss_ttl(long ttl_seconds, long max_ttl_seconds) {
+  pthread_mutex_lock(&g_misses.lock);
+  g_misses.ttl = ttl_seconds > 0 ? ttl_seconds : 0;
+  g_misses.max_ttl =
+      max_ttl_seconds > g_misses.ttl ? max_ttl_seconds : g_misses.ttl;
+  pthread_mutex_unlock(&g_misses.lock);
+}
+
+/* The index is keyed by the same sanitized names the file paths use. */
+static int index_key(const char *artist, const char *title, char *out,
+                     size_t out_size) {
+  char safe_artist[256];
+  char safe_title[256];
+
+  safe_artist[0] = '\0';
+  if (artist) {
+    sanitize_component(artist, safe_artist, sizeof(safe_artist));
+    if (safe_artist[0] == '\0') {
+      snprintf(safe_artist, sizeof(safe_artist), "%s", "Unknown Artist");
+    }
+  }
+  sanitize_component(title ? title : "Unknown Title", safe_title,
+                     sizeof(safe_title));
+  if (safe_title[0] == '\0') {
+    snprintf(safe_title, sizeof(safe_title), "%s", "Unknown Title");
+  }
+  return cache_index_key(safe_artist, safe_title, out, out_size);
+}
+
+/* The index already knows the size, so a hit is one open and one read. */
+static char *read_sized(const char *path, size_t size) {
   char *buffer;
+  size_t total = 0;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    return NULL;
+  }
+  buffer = (char *)malloc(size + 2);
+  if (!buffer) {
+    close(fd);
+    return NULL;
+  }
+  while (total < size + 1) {
+    ssize_t n = read(fd, buffer + total, size + 1 - total);
+    if (n <= 0) {
+      break;
+    }
+    total += (size_t)n;
+  }
+  close(fd);
+  if (total != size) {
+    free(buffer);
+    return read_file(path);
+  }
+  buffer[size] = '\0';
+  return buffer;
+}
+
+static int find_indexed(const char *artist, const char *title,
+                        cache_index_entry *out) {
+  char key[512];
+
+  if (index_key(artist, title, key, sizeof(key)) != 0) {
+    return -1;
+  }
+  return cache_index_lookup(key, out);
+}
+
+/* Same precedence as probing: artist/title first, then the bare title. */
+static int find_entry(const char *artist, const char *title,
+                      cache_index_entry *out) {
+  int result = 1;
+
+  if (!is_unknown_artist(artist)) {
+    result = find_indexed(artist, title, out);
+    if (result != 1) {
+      return result;
+    }
+  }
+  return find_indexed(NULL, title, out);
+}
+
+/* 0 with *out set, 1 when the index says there is no file, -1 to probe. */
+static int load_indexed(const char *artist, const char *title, char **out) {
+  char key[512];
+  char path[512];
+  cache_index_entry entry;
+  int result;
+
+  if (index_key(artist, title, key, sizeof(key)) != 0) {
+    return -1;
+  }
+  *out = g_cache_packed ? lyrics_pack_pending(key, NULL)
+                        : cache_writer_pending(key);
+  if (*out) {
+    return 0;
+  }
+  result = cache_index_lookup(key, &entry);
+  if (result != 0) {
+    return result;
+  }
+  if (entry.flags & CACHE_INDEX_PACKED) {
+    *out = lyrics_pack_read(&entry);
+    return *out ? 0 : -1;
+  }
+  if (lyrics_cache_path(entry.name, path, sizeof(path)) != 0) {
+    return -1;
+  }
+  *out = read_sized(path, entry.size);
+  return *out ? 0 : -1;
+}
+
+int lyrics_cache_contains(const char *artist, const char *title) {
+  cache_index_entry entry;
+  char key[512];
+  char *text;
+  int result;
+
+  if (index_key(is_unknown_artist(artist) ? NULL : artist, title, key,
+                sizeof(key)) != 0) {
+    return 0;
+  }
+  text = g_cache_packed ? lyrics_pack_pending(key, NULL)
+                        : cache_writer_pending(key);
+  if (text) {
+    free(text);
+    return 1;
+  }
+  result = cache_index_lookup(key, &entry);
+  if (result >= 0) {
+    return result == 0;
+  }
+  text = lyrics_cache_load(artist, title);
+  result = text != NULL;
+  free(text);
+  return result;
+}
+
+char *lyrics_cache_load(const char *artist, const char *title) {
+  char path[512];
+  char *buffer = NULL;
+  int indexed = 1;
+
+  if (!is_unknown_artist(artist)) {
+    int result = load_indexed(artist, title, &buffer);
+    if (result == 0) {
+      return buffer;
+    }
+    indexed = result == 1;
+  }
+  if (indexed) {
+    int result = load_indexed(NULL, title, &buffer);
+    if (result == 0) {
+      return buffer;
+    }
+    if (result == 1) {
+      return NULL;
+    }
+  }
 
   if (!is_unknown_artist(artist)) {
     if (build_path_artist_title(artist, title, ".lrc", path, sizeof(path)) ==
@@ -326,15 +875,370 @@ char *lyrics_cache_load(const char *artist, const char *title) {
   return NULL;
 }
 
+/* "Artist - Title.lrc" gets "Artist - Title.lrcb". */
+static int sidecar_path(const char *name, char *out, size_t out_size) {
+  char sidecar[272];
+
+  snprintf(sidecar, sizeof(sidecar), "%sb", name);
+  return lyrics_cache_path(sidecar, out, out_size);
+}
+
+/*
+ * Cached lyrics are parsed once; later hits map the pre-parsed sidecar
+ * instead. A sidecar built from a file of another size, mtime or crc, or
+ * by another format version, is ignored and rewritten, so even a same-size
+ * edit made while we were not watching is picked up. Recent docs are served from
+ * the in-memory LRU without touching the cache directory at all.
+ */
+lyrics_doc *lyrics_cache_load_doc(const char *artist, const char *title) {
+  cache_index_entry entry;
+  char path[512];
+  char source[512];
+  lyrics_doc *doc;
+  struct stat st;
+  int64_t mtime = 0;
+  char *text;
+  int indexed;
+
+  doc = lyrics_lru_get(artist, title);
+  if (doc) {
+    return doc;
+  }
+  indexed = g_cache_binary && find_entry(artist, title, &entry) == 0 &&
+            !(entry.flags & CACHE_INDEX_PACKED) &&
+            sidecar_path(entry.name, path, sizeof(path)) == 0 &&
+            lyrics_cache_path(entry.name, source, sizeof(source)) == 0 &&
+            stat(source, &st) == 0;
+  if (indexed) {
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    doc = lyrics_binary_map(path, entry.size, mtime, entry.crc);
+    if (doc) {
+      cache_index_count(1);
+      lyrics_lru_put(artist, title, doc);
+      return doc;
+    }
+  }
+  text = lyrics_cache_load(artist, title);
+  cache_index_count(text != NULL);
+  if (!text) {
+    return NULL;
+  }
+  doc = lyrics_parse(text);
+  if (doc && indexed && strlen(text) == entry.size &&
+      (uint64_t)st.st_size == entry.size) {
+    uint32_t crc = (uint32_t)crc32(0L, (const Bytef *)text, (uInt)entry.size);
+
+    /* A crc the index disagrees with is left for --cache-verify to flag. */
+    if ((entry.crc == 0 || entry.crc == crc) &&
+        lyrics_binary_write(path, doc, entry.size, mtime, crc) == 0) {
+      cache_index_touch();
+    }
+  }
+  free(text);
+  lyrics_lru_put(artist, title, doc);
+  return doc;
+}
+
+/* Flat cache names the store path writes: "<stem>.lrc" or "<stem>.txt". */
+static int lyrics_file_stem(const char *name, char *stem, size_t stem_size) {
+  size_t len = name ? strlen(name) : 0;
+
+  if (len <= 4 || len - 4 >= stem_size || name[0] == '.' ||
+      (strcmp(name + len - 4, ".lrc") != 0 &&
+       strcmp(name + len - 4, ".txt") != 0)) {
+    return -1;
+  }
+  memcpy(stem, name, len - 4);
+  stem[len - 4] = '\0';
+  return 0;
+}
+
+typedef struct changed_ctx {
+  const char *name;
+  int exists;
+  uint32_t size;
+  uint32_t crc;
+  int changed;
+} changed_ctx;
+
+static int refresh_key(void *ctx, const char *key) {
+  changed_ctx *changed = (changed_ctx *)ctx;
+  cache_index_entry entry;
+
+  if (cache_index_lookup(key, &entry) != 0) {
+    /* Index is being rebuilt; it picks the file up, the doc may be stale. */
+    changed->changed = 1;
+    lyrics_lru_forget_key(key);
+    return 0;
+  }
+  if ((entry.flags & CACHE_INDEX_PACKED) ||
+      strcmp(entry.name, changed->name) != 0) {
+    return 0;
+  }
+  if (changed->exists && entry.size == changed->size &&
+      entry.crc == changed->crc) {
+    return 0;
+  }
+  changed->changed = 1;
+  lyrics_lru_forget_key(key);
+  if (!changed->exists) {
+    cache_index_forget(key, &entry);
+  } else {
+    entry.size = changed->size;
+    entry.crc = changed->crc;
+    cache_index_put(key, &entry);
+  }
+  return 0;
+}
+
+int lyrics_cache_file_changed(const char *name) {
+  char stem[256];
+  char path[512];
+  changed_ctx changed;
+  struct stat st;
+
+  if (lyrics_file_stem(name, stem, sizeof(stem)) != 0 ||
+      lyrics_cache_path(name, path, sizeof(path)) != 0) {
+    return -1;
+  }
+  memset(&changed, 0, sizeof(changed));
+  changed.name = name;
+  if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size <= UINT32_MAX) {
+    char *text = read_sized(path, (size_t)st.st_size);
+
+    if (!text) {
+      return 1;
+    }
+    changed.exists = 1;
+    changed.size = (uint32_t)strlen(text);
+    changed.crc = (uint32_t)crc32(0L, (const Bytef *)text, changed.size);
+    free(text);
+    /* Our own writer's rename raises the same event as an outside edit. */
+    if (cache_writer_committed(name, changed.size, changed.crc)) {
+      return 1;
+    }
+  }
+  cache_index_stem_keys(stem, refresh_key, &changed);
+  if (!changed.changed) {
+    return 1;
+  }
+  /* A same-size edit would otherwise keep serving the old sidecar. */
+  if (sidecar_path(name, path, sizeof(path)) == 0 && unlink(path) == 0) {
+    cache_index_touch();
+  }
+  return 0;
+}
+
+typedef struct match_ctx {
+  char keys[2][512];
+  size_t count;
+  int found;
+} match_ctx;
+
+static int match_key(void *ctx, const char *key) {
+  match_ctx *match = (match_ctx *)ctx;
+  size_t i;
+
+  for (i = 0; i < match->count; i++) {
+    if (strcmp(match->keys[i], key) == 0) {
+      match->found = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int lyrics_cache_file_matches(const char *name, const char *artist,
+                              const char *title) {
+  match_ctx match;
+  char stem[256];
+
+  if (lyrics_file_stem(name, stem, sizeof(stem)) != 0) {
+    return 0;
+  }
+  match.count = 0;
+  match.found = 0;
+  if (!is_unknown_artist(artist) &&
+      index_key(artist, title, match.keys[match.count],
+                sizeof(match.keys[0])) == 0) {
+    match.count++;
+  }
+  if (index_key(NULL, title, match.keys[match.count],
+                sizeof(match.keys[0])) == 0) {
+    match.count++;
+  }
+  cache_index_stem_keys(stem, match_key, &match);
+  return match.found;
+}
+
+void lyrics_cache_set_binary(int enabled) {
+  g_cache_binary = enabled;
+}
+
+void lyrics_cache_set_packed(int enabled) {
+  g_cache_packed = enabled;
+}
+
+void lyrics_cache_set_limits(unsigned long max_bytes,
+                             unsigned long max_entries) {
+  g_limits.max_bytes = max_bytes;
+  g_limits.max_entries = max_entries;
+  if (max_bytes > 0 || max_entries > 0) {
+    cache_writer_request_trim();
+  }
+}
+
+static int over_limits(const cache_index_usage *usage) {
+  return (g_limits.max_bytes > 0 && usage->bytes > g_limits.max_bytes) ||
+         (g_limits.max_entries > 0 && usage->entries > g_limits.max_entries);
+}
+
+/*
+ * Evicts the least recently looked-up of a random sample, a few entries
+ * per call, so the index lock is never held for a whole sweep.
+ */
+int lyrics_cache_trim(void) {
+  cache_index_usage usage;
+  cache_index_entry victim;
+  char key[512];
+  char path[512];
+  int step;
+  int more;
+
+  if (g_limits.max_bytes == 0 && g_limits.max_entries == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&g_limits.trim_lock);
+  if (cache_index_usage_get(&usage) != 0) {
+    pthread_mutex_unlock(&g_limits.trim_lock);
+    return 0;
+  }
+  for (step = 0; step < TRIM_STEP && over_limits(&usage); step++) {
+    if (cache_index_oldest(key, sizeof(key), &victim) != 0 ||
+        cache_index_forget(key, &victim) != 0) {
+      break;
+    }
+    if (victim.flags & CACHE_INDEX_PACKED) {
+      lyrics_pack_release(&victim);
+    } else {
+      if (lyrics_cache_path(victim.name, path, sizeof(path)) == 0) {
+        remove(path);
+      }
+      if (sidecar_path(victim.name, path, sizeof(path)) == 0) {
+        remove(path);
+      }
+      cache_index_touch();
+    }
+    usage.entries--;
+    usage.bytes -= usage.bytes < victim.size ? usage.bytes : victim.size;
+  }
+  more = step == TRIM_STEP && over_limits(&usage);
+  pthread_mutex_unlock(&g_limits.trim_lock);
+  return more;
+}
+
+/* Folds the stored miss keys into the current key form, merging clashes. */
+static void miss_rekey(void) {
+  miss_entry *slots;
+  size_t capacity;
+  size_t i;
+
+  pthread_mutex_lock(&g_misses.lock);
+  if (!g_misses.loaded) {
+    miss_load_locked();
+  }
+  slots = g_misses.slots;
+  capacity = g_misses.capacity;
+  g_misses.slots = NULL;
+  g_misses.capacity = 0;
+  g_misses.count = 0;
+  for (i = 0; i < capacity; i++) {
+    char key[MISS_KEY_SIZE];
+    char *tab;
+    miss_entry *entry;
+    uint64_t hash;
+
+    if (slots[i].hash == 0) {
+      continue;
+    }
+    tab = strchr(slots[i].key, '\t');
+    if (tab) {
+      *tab = '\0';
+    }
+    if (normalize_track_key(tab ? slots[i].key : "", tab ? tab + 1 : slots[i].key,
+                            key, sizeof(key)) == 0) {
+      hash = hash_key(key);
+      entry = miss_find(key, hash);
+      if (!entry) {
+        entry = miss_insert(key, hash);
+      }
+      if (entry) {
+        if (slots[i].next_check > entry->next_check) {
+          entry->next_check = slots[i].next_check;
+        }
+        if (slots[i].attempts > entry->attempts) {
+          entry->attempts = slots[i].attempts;
+        }
+      }
+    }
+    free(slots[i].key);
+  }
+  free(slots);
+  miss_save_locked();
+  pthread_mutex_unlock(&g_misses.lock);
+}
+
+int lyrics_cache_migrate_keys(int force) {
+  unsigned int version = cache_index_version();
+
+  /* Without an index there is nothing old to migrate; lookups build it. */
+  if (!force && (version == 0 || version >= CACHE_INDEX_CANONICAL_VERSION)) {
+    return 0;
+  }
+  if (ensure_cache_dirs() != 0) {
+    return -1;
+  }
+  miss_rekey();
+  return cache_index_rebuild();
+}
+
+void lyrics_cache_close(void) {
+  cache_writer_close();
+  lyrics_lru_clear();
+  lyrics_pack_close();
+  cache_index_close();
+}
+
+/* The pack record keeps the flat-file stem so the index can be rebuilt. */
+static int store_packed(const char *artist, const char *title, const char *path,
+                        const char *text, int timed) {
+  char stem[256];
+  char key[512];
+  const char *name = strrchr(path, '/');
+  size_t len;
+
+  name = name ? name + 1 : path;
+  len = strlen(name);
+  if (len <= 4 || len - 4 >= sizeof(stem) ||
+      index_key(artist, title, key, sizeof(key)) != 0) {
+    return -1;
+  }
+  memcpy(stem, name, len - 4);
+  stem[len - 4] = '\0';
+  return lyrics_pack_put(key, stem, text, timed);
+}
+
 int lyrics_cache_store(const char *artist, const char *title, const char *text,
                        int timed) {
-  FILE *file;
   char path[512];
+  char key[512];
   const char *ext = timed ? ".lrc" : ".txt";
 
   if (!text || ensure_cache_dirs() != 0) {
     return -1;
   }
+  lyrics_lru_forget(artist, title);
 
   if (is_unknown_artist(artist)) {
     if (build_path_title_only(title, ext, path, sizeof(path)) != 0) {
@@ -346,17 +1250,21 @@ int lyrics_cache_store(const char *artist, const char *title, const char *text,
     }
   }
 
-  file = fopen(path, "wb");
-  if (!file) {
+  if (g_cache_packed) {
+    if (store_packed(is_unknown_artist(artist) ? NULL : artist, title, path,
+                     text, timed) != 0) {
+      return -1;
+    }
+  } else if (index_key(is_unknown_artist(artist) ? NULL : artist, title, key,
+                       sizeof(key)) != 0 ||
+             cache_writer_put(key, path, text, timed) != 0) {
+    /* The writer thread renames the file into place and updates the index. */
     return -1;
   }
-
-  if (fwrite(text, 1, strlen(text), file) != strlen(text)) {
-    fclose(file);
-    return -1;
+  miss_forget(artist, title);
+  if (g_limits.max_bytes > 0 || g_limits.max_entries > 0) {
+    cache_writer_request_trim();
   }
-
-  fclose(file);
   return 0;
 }
 
@@ -0,0 +1,1379 @@
+#include "app/cache_index.h"
+#include "app/log.h"
+#include "app/lyrics.h"
+#include "app/lyrics_pack.h"
+#include "app/normalize.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_VERSION 3
+#define INDEX_MIN_CAPACITY 64
+#define INDEX_KEY_SIZE 512
+#define JOURNAL_MAX 64
+#define FORGET_MAX_KEYS 16
+#define FIELD_SEP '\x1f'
+
+/*
+ * <cache>/.index is an open-addressing table of fixed 40-byte slots followed
+ * by a blob of NUL-terminated keys and file names; it is mmap'ed shared.
+ * Stores append to <cache>/.index.log and are folded into a new .index (temp
+ * + rename) every JOURNAL_MAX entries. Access times, checksums and the hit
+ * counters are written in place through the mapping. The index is trusted
+ * only while the cache directory has not been modified by anything but us;
+ * otherwise it is rebuilt from the flat files and pack segments. The rescan
+ * runs with the lock dropped, on a background thread when a lookup noticed,
+ * and lookups report "not current" meanwhile so callers probe directly.
+ */
+typedef struct index_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t count;
+  uint64_t strings_size;
+  uint64_t hits;
+  uint64_t misses;
+} index_header;
+
+typedef struct index_slot {
+  uint64_t hash;
+  uint64_t offset;
+  uint32_t size;
+  uint32_t flags;
+  uint32_t key_off;
+  uint32_t name_off;
+  uint32_t atime;
+  uint32_t crc;
+} index_slot;
+
+typedef struct journal_entry {
+  char key[INDEX_KEY_SIZE];
+  cache_index_entry entry;
+  /* Stores made while a rescan runs are folded into its result. */
+  unsigned long serial;
+} journal_entry;
+
+typedef struct index_state {
+  pthread_mutex_t lock;
+  int opened;
+  int writable;
+  unsigned char *map;
+  size_t map_size;
+  index_header *header;
+  index_slot *slots;
+  const char *strings;
+  journal_entry journal[JOURNAL_MAX];
+  size_t journal_count;
+  int holds;
+  int rebuilding;
+  pthread_cond_t rebuilt;
+  unsigned long serial;
+  struct timespec dir_mtime;
+  struct timespec failed_mtime;
+} index_state;
+
+typedef struct build_item {
+  uint64_t hash;
+  char *key;
+  cache_index_entry entry;
+} build_item;
+
+typedef struct index_builder {
+  build_item *items;
+  size_t capacity;
+  size_t count;
+  size_t strings_size;
+  /* Set while scanning the directory, where clashing files are ranked. */
+  int scanning;
+} index_builder;
+
+static index_state g_index = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .rebuilt = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 1469598103934665603ULL;
+
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+static int timespec_after(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec > b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+static int dir_mtime(struct timespec *out) {
+  char path[512];
+  struct stat st;
+
+  if (lyrics_cache_path("", path, sizeof(path)) != 0 || stat(path, &st) != 0) {
+    return -1;
+  }
+  *out = st.st_mtim;
+  return 0;
+}
+
+/* Newest mtime among the files we write into the cache directory. */
+static void own_mtime(struct timespec *out) {
+  static const char *names[] = {".index", ".index.log", ".misses",
+                                ".library-progress"};
+  char path[512];
+  struct stat st;
+  size_t i;
+
+  out->tv_sec = 0;
+  out->tv_nsec = 0;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (lyrics_cache_path(names[i], path, sizeof(path)) == 0 &&
+        stat(path, &st) == 0 && timespec_after(&st.st_mtim, out)) {
+      *out = st.st_mtim;
+    }
+  }
+}
+
+static void unmap_locked(void) {
+  if (g_index.map) {
+    munmap(g_index.map, g_index.map_size);
+  }
+  g_index.map = NULL;
+  g_index.map_size = 0;
+  g_index.header = NULL;
+  g_index.slots = NULL;
+  g_index.strings = NULL;
+}
+
+static int map_locked(void) {
+  char path[512];
+  struct stat st;
+  index_header *header;
+  size_t table_size;
+  void *map;
+  int fd;
+
+  unmap_locked();
+  if (lyrics_cache_path(".index", path, sizeof(path)) != 0) {
+    return -1;
+  }
+  /* A read-only cache still works; it just does not track accesses. */
+  g_index.writable = 1;
+  fd = open(path, O_RDWR);
+  if (fd < 0) {
+    g_index.writable = 0;
+    fd = open(path, O_RDONLY);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(index_header)) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, (size_t)st.st_size,
+             g_index.writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+             fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  header = (index_header *)map;
+  table_size = (size_t)header->capacity * sizeof(index_slot);
+  if (memcmp(header->magic, "CSIX", 4) != 0 ||
+      header->version != INDEX_VERSION || header->capacity == 0 ||
+      (header->capacity & (header->capacity - 1)) != 0 ||
+      sizeof(index_header) + table_size + header->strings_size !=
+          (size_t)st.st_size) {
+    munmap(map, (size_t)st.st_size);
+    log_error("lyrics: cache index outdated, rebuilding");
+    return -1;
+  }
+  g_index.map = (unsigned char *)map;
+  g_index.map_size = (size_t)st.st_size;
+  g_index.header = header;
+  g_index.slots = (index_slot *)(g_index.map + sizeof(index_header));
+  g_index.strings = (const char *)(g_index.map + sizeof(index_header) +
+                                   table_size);
+  return 0;
+}
+
+static index_slot *map_find(const char *key, uint64_t hash) {
+  uint32_t mask;
+  uint32_t i;
+
+  if (!g_index.header) {
+    return NULL;
+  }
+  mask = g_index.header->capacity - 1;
+  i = (uint32_t)hash & mask;
+  while (g_index.slots[i].hash != 0) {
+    index_slot *slot = &g_index.slots[i];
+    if (slot->hash == hash && slot->key_off < g_index.header->strings_size &&
+        strcmp(g_index.strings + slot->key_off, key) == 0) {
+      return slot;
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+static journal_entry *journal_find(const char *key) {
+  size_t i;
+
+  for (i = g_index.journal_count; i > 0; i--) {
+    if (strcmp(g_index.journal[i - 1].key, key) == 0) {
+      return &g_index.journal[i - 1];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Synced lyrics win over plain ones for the same key, as probing did.
+ * Deletions always apply, and anything stored later revives the key.
+ */
+static int entry_replaces(const cache_index_entry *old,
+                          const cache_index_entry *next) {
+  if ((old->flags | next->flags) & CACHE_INDEX_DELETED) {
+    return 1;
+  }
+  return !(old->flags & CACHE_INDEX_TIMED) || (next->flags & CACHE_INDEX_TIMED);
+}
+
+/*
+ * Files whose names fold to the same key during a scan: synced wins, then
+ * the most recently used or written, then the shortest (fewest
+ * descriptors) and first name, so the choice does not depend on directory
+ * order. The losers stay on disk. Equal names are the same pack stem
+ * appended again, and pack scans run oldest first, so the later one wins.
+ */
+static int scan_prefers(const cache_index_entry *old,
+                        const cache_index_entry *next) {
+  int old_timed = (old->flags & CACHE_INDEX_TIMED) != 0;
+  int next_timed = (next->flags & CACHE_INDEX_TIMED) != 0;
+
+  if (old_timed != next_timed) {
+    return next_timed;
+  }
+  if (old->atime != next->atime) {
+    return next->atime > old->atime;
+  }
+  if (strlen(next->name) != strlen(old->name)) {
+    return strlen(next->name) < strlen(old->name);
+  }
+  return strcmp(next->name, old->name) <= 0;
+}
+
+static int builder_grow(index_builder *b) {
+  size_t capacity = b->capacity ? b->capacity * 2 : INDEX_MIN_CAPACITY;
+  build_item *items = (build_item *)calloc(capacity, sizeof(*items));
+  size_t i;
+
+  if (!items) {
+    return -1;
+  }
+  for (i = 0; i < b->capacity; i++) {
+    size_t j;
+    if (b->items[i].hash == 0) {
+      continue;
+    }
+    j = (size_t)b->items[i].hash & (capacity - 1);
+    while (items[j].hash != 0) {
+      j = (j + 1) & (capacity - 1);
+    }
+    items[j] = b->items[i];
+  }
+  free(b->items);
+  b->items = items;
+  b->capacity = capacity;
+  return 0;
+}
+
+static int builder_put(index_builder *b, const char *key,
+                       const cache_index_entry *entry) {
+  uint64_t hash = hash_key(key);
+  size_t i;
+
+  if ((b->count + 1) * 4 > b->capacity * 3 && builder_grow(b) != 0) {
+    return -1;
+  }
+  i = (size_t)hash & (b->capacity - 1);
+  while (b->items[i].hash != 0) {
+    if (b->items[i].hash == hash && strcmp(b->items[i].key, key) == 0) {
+      if (b->scanning ? scan_prefers(&b->items[i].entry, entry)
+                      : entry_replaces(&b->items[i].entry, entry)) {
+        b->strings_size -= strlen(b->items[i].entry.name) + 1;
+        b->items[i].entry = *entry;
+        b->strings_size += strlen(entry->name) + 1;
+      }
+      return 0;
+    }
+    i = (i + 1) & (b->capacity - 1);
+  }
+  b->items[i].key = strdup(key);
+  if (!b->items[i].key) {
+    return -1;
+  }
+  b->items[i].hash = hash;
+  b->items[i].entry = *entry;
+  b->strings_size += strlen(key) + 1 + strlen(entry->name) + 1;
+  b->count++;
+  return 0;
+}
+
+static void builder_free(index_builder *b) {
+  size_t i;
+
+  for (i = 0; i < b->capacity; i++) {
+    free(b->items[i].key);
+  }
+  free(b->items);
+  memset(b, 0, sizeof(*b));
+}
+
+static int builder_write(const index_builder *b) {
+  char path[512];
+  char temp[520];
+  index_header header;
+  index_slot *slots;
+  char *strings;
+  size_t capacity = INDEX_MIN_CAPACITY;
+  size_t count = 0;
+  size_t used = 0;
+  uint32_t now = (uint32_t)time(NULL);
+  size_t i;
+  FILE *file;
+  int ok;
+
+  while (capacity * 3 < (b->count + 1) * 4) {
+    capacity *= 2;
+  }
+  if (lyrics_cache_path(".index", path, sizeof(path)) != 0 ||
+      b->strings_size > UINT32_MAX) {
+    return -1;
+  }
+  slots = (index_slot *)calloc(capacity, sizeof(*slots));
+  strings = (char *)malloc(b->strings_size ? b->strings_size : 1);
+  if (!slots || !strings) {
+    free(slots);
+    free(strings);
+    return -1;
+  }
+
+  for (i = 0; i < b->capacity; i++) {
+    const build_item *item = &b->items[i];
+    const index_slot *old;
+    size_t key_len;
+    size_t name_len;
+    size_t j;
+
+    if (item->hash == 0 || (item->entry.flags & CACHE_INDEX_DELETED)) {
+      continue;
+    }
+    j = (size_t)item->hash & (capacity - 1);
+    while (slots[j].hash != 0) {
+      j = (j + 1) & (capacity - 1);
+    }
+    key_len = strlen(item->key) + 1;
+    name_len = strlen(item->entry.name) + 1;
+    slots[j].hash = item->hash;
+    slots[j].offset = item->entry.offset;
+    slots[j].size = item->entry.size;
+    slots[j].flags = item->entry.flags;
+    slots[j].key_off = (uint32_t)used;
+    memcpy(strings + used, item->key, key_len);
+    used += key_len;
+    slots[j].name_off = (uint32_t)used;
+    memcpy(strings + used, item->entry.name, name_len);
+    used += name_len;
+    /* A rebuild keeps the access times the old index knew about. */
+    slots[j].atime = item->entry.atime;
+    slots[j].crc = item->entry.crc;
+    old = map_find(item->key, item->hash);
+    if (old && old->atime > slots[j].atime) {
+      slots[j].atime = old->atime;
+    }
+    if (slots[j].atime == 0) {
+      slots[j].atime = now;
+    }
+    count++;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "CSIX", 4);
+  header.version = INDEX_VERSION;
+  header.capacity = (uint32_t)capacity;
+  header.count = (uint32_t)count;
+  header.strings_size = used;
+  if (g_index.header) {
+    header.hits = g_index.header->hits;
+    header.misses = g_index.header->misses;
+  }
+
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  file = fopen(temp, "wb");
+  if (!file) {
+    free(slots);
+    free(strings);
+    return -1;
+  }
+  ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(slots, sizeof(*slots), capacity, file) == capacity &&
+       (used == 0 || fwrite(strings, 1, used, file) == used);
+  free(slots);
+  free(strings);
+  if (fclose(file) != 0 || !ok || rename(temp, path) != 0) {
+    remove(temp);
+    log_error("lyrics: cannot write cache index");
+    return -1;
+  }
+  /* The rename bumped the directory mtime; make the index newer again. */
+  utimensat(AT_FDCWD, path, NULL, 0);
+  return 0;
+}
+
+static void remember_dir_locked(void) {
+  if (dir_mtime(&g_index.dir_mtime) != 0) {
+    g_index.dir_mtime.tv_sec = 0;
+    g_index.dir_mtime.tv_nsec = 0;
+  }
+}
+
+static void journal_reset_locked(void) {
+  char path[512];
+
+  g_index.journal_count = 0;
+  if (lyrics_cache_path(".index.log", path, sizeof(path)) == 0) {
+    remove(path);
+  }
+}
+
+/* Folds the journal into a fresh .index. */
+static int merge_locked(void) {
+  index_builder b;
+  size_t i;
+  int result = 0;
+
+  memset(&b, 0, sizeof(b));
+  if (g_index.header) {
+    for (i = 0; i < g_index.header->capacity && result == 0; i++) {
+      const index_slot *slot = &g_index.slots[i];
+      cache_index_entry entry;
+
+      if (slot->hash == 0 || slot->name_off >= g_index.header->strings_size) {
+        continue;
+      }
+      memset(&entry, 0, sizeof(entry));
+      snprintf(entry.name, sizeof(entry.name), "%s",
+               g_index.strings + slot->name_off);
+      entry.offset = slot->offset;
+      entry.size = slot->size;
+      entry.flags = slot->flags;
+      entry.atime = slot->atime;
+      entry.crc = slot->crc;
+      result = builder_put(&b, g_index.strings + slot->key_off, &entry);
+    }
+  }
+  for (i = 0; i < g_index.journal_count && result == 0; i++) {
+    result = builder_put(&b, g_index.journal[i].key, &g_index.journal[i].entry);
+  }
+  if (result == 0) {
+    result = builder_write(&b);
+  }
+  builder_free(&b);
+  if (result == 0) {
+    journal_reset_locked();
+    map_locked();
+    remember_dir_locked();
+  }
+  return result;
+}
+
+static void journal_add_locked(const char *key, const cache_index_entry *entry) {
+  journal_entry *slot = journal_find(key);
+
+  if (slot) {
+    if (entry_replaces(&slot->entry, entry)) {
+      slot->entry = *entry;
+      slot->serial = ++g_index.serial;
+    }
+    return;
+  }
+  if (g_index.journal_count == JOURNAL_MAX) {
+    return;
+  }
+  slot = &g_index.journal[g_index.journal_count++];
+  snprintf(slot->key, sizeof(slot->key), "%s", key);
+  slot->entry = *entry;
+  slot->serial = ++g_index.serial;
+}
+
+static void journal_load_locked(void) {
+  char path[512];
+  char line[INDEX_KEY_SIZE + 320];
+  FILE *file;
+
+  if (lyrics_cache_path(".index.log", path, sizeof(path)) != 0) {
+    return;
+  }
+  file = fopen(path, "r");
+  if (!file) {
+    return;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    cache_index_entry entry;
+    char *fields[6];
+    char *p = line;
+    int n = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    while (n < 6) {
+      fields[n++] = p;
+      p = strchr(p, FIELD_SEP);
+      if (!p) {
+        break;
+      }
+      *p++ = '\0';
+    }
+    /* Logs written before checksums were tracked have five fields. */
+    if (n < 5 || fields[3][0] == '\0' || fields[4][0] == '\0') {
+      continue;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.flags = (uint32_t)strtoul(fields[0], NULL, 10);
+    entry.size = (uint32_t)strtoul(fields[1], NULL, 10);
+    entry.offset = (uint64_t)strtoull(fields[2], NULL, 10);
+    entry.crc = n == 6 ? (uint32_t)strtoul(fields[5], NULL, 10) : 0;
+    snprintf(entry.name, sizeof(entry.name), "%s", fields[4]);
+    if (g_index.journal_count == JOURNAL_MAX && !journal_find(fields[3])) {
+      merge_locked();
+    }
+    journal_add_locked(fields[3], &entry);
+  }
+  fclose(file);
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name);
+  size_t suffix_len = strlen(suffix);
+  return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+/* Flat files are "<stem>.lrc" or "<stem>.txt". */
+static int name_stem(const char *name, char *stem, size_t stem_size) {
+  size_t len = strlen(name);
+
+  if ((!has_suffix(name, ".lrc") && !has_suffix(name, ".txt")) ||
+      len - 4 >= stem_size) {
+    return -1;
+  }
+  memcpy(stem, name, len - 4);
+  stem[len - 4] = '\0';
+  return 0;
+}
+
+/*
+ * "Artist - Title" is ambiguous when either side contains " - ", so a stem
+ * is indexed under every split; the store path always knows the exact one.
+ */
+int cache_index_stem_keys(const char *stem, cache_index_key_fn fn, void *ctx) {
+  char key[INDEX_KEY_SIZE];
+  const char *sep;
+
+  if (cache_index_key("", stem, key, sizeof(key)) != 0 || fn(ctx, key) != 0) {
+    return -1;
+  }
+  for (sep = strstr(stem, " - "); sep; sep = strstr(sep + 1, " - ")) {
+    char artist[256];
+    size_t artist_len = (size_t)(sep - stem);
+
+    if (artist_len >= sizeof(artist)) {
+      break;
+    }
+    memcpy(artist, stem, artist_len);
+    artist[artist_len] = '\0';
+    if (cache_index_key(artist, sep + 3, key, sizeof(key)) != 0 ||
+        fn(ctx, key) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+typedef struct stem_ctx {
+  index_builder *b;
+  const cache_index_entry *entry;
+} stem_ctx;
+
+typedef struct crc_ctx {
+  const cache_index_entry *entry;
+  uint32_t crc;
+} crc_ctx;
+
+/* Stops at the first key the old index or journal has a checksum under. */
+static int find_stem_crc(void *ctx, const char *key) {
+  crc_ctx *find = (crc_ctx *)ctx;
+  const journal_entry *pending = journal_find(key);
+  const index_slot *old = map_find(key, hash_key(key));
+
+  if (pending && pending->entry.crc != 0 &&
+      pending->entry.offset == find->entry->offset &&
+      strcmp(pending->entry.name, find->entry->name) == 0) {
+    find->crc = pending->entry.crc;
+  } else if (old && old->crc != 0 && old->offset == find->entry->offset &&
+             old->name_off < g_index.header->strings_size &&
+             strcmp(g_index.strings + old->name_off, find->entry->name) == 0) {
+    find->crc = old->crc;
+  }
+  return find->crc != 0;
+}
+
+static int put_stem_key(void *ctx, const char *key) {
+  stem_ctx *stem = (stem_ctx *)ctx;
+  return builder_put(stem->b, key, stem->entry);
+}
+
+/*
+ * A checksum stays with its file even when the size changed, so verify
+ * still flags a file truncated or edited while nothing was watching.
+ */
+static int put_stem(void *ctx, const char *stem,
+                    const cache_index_entry *entry) {
+  cache_index_entry kept = *entry;
+  crc_ctx find;
+  stem_ctx put;
+
+  find.entry = entry;
+  find.crc = 0;
+  if (kept.crc == 0 && !(kept.flags & CACHE_INDEX_PACKED)) {
+    pthread_mutex_lock(&g_index.lock);
+    cache_index_stem_keys(stem, find_stem_crc, &find);
+    pthread_mutex_unlock(&g_index.lock);
+    kept.crc = find.crc;
+  }
+  put.b = (index_builder *)ctx;
+  put.entry = &kept;
+  return cache_index_stem_keys(stem, put_stem_key, &put);
+}
+
+static int index_file(index_builder *b, const char *dir, const char *name) {
+  char path[768];
+  char base[256];
+  cache_index_entry entry;
+  struct stat st;
+  size_t len;
+  int timed = has_suffix(name, ".lrc");
+
+  if (name[0] == '.' || (!timed && !has_suffix(name, ".txt"))) {
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  len = strlen(name) - 4;
+  if (len >= sizeof(base) || strlen(name) >= sizeof(entry.name) ||
+      stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+    return 0;
+  }
+  memcpy(base, name, len);
+  base[len] = '\0';
+
+  memset(&entry, 0, sizeof(entry));
+  snprintf(entry.name, sizeof(entry.name), "%s", name);
+  entry.size = (uint32_t)st.st_size;
+  entry.flags = timed ? CACHE_INDEX_TIMED : 0;
+  entry.atime = (uint32_t)(st.st_atime > st.st_mtime ? st.st_atime
+                                                      : st.st_mtime);
+  return put_stem(b, base, &entry);
+}
+
+/* Runs without the lock; only the checksum lookups in put_stem take it. */
+static int scan_cache(index_builder *b) {
+  char dir[512];
+  struct dirent *ent;
+  DIR *handle;
+  size_t len;
+  int result = 0;
+
+  if (lyrics_cache_path("", dir, sizeof(dir)) != 0) {
+    return -1;
+  }
+  len = strlen(dir);
+  if (len > 1 && dir[len - 1] == '/') {
+    dir[len - 1] = '\0';
+  }
+  handle = opendir(dir);
+  if (!handle) {
+    return -1;
+  }
+  b->scanning = 1;
+  while (result == 0 && (ent = readdir(handle)) != NULL) {
+    result = index_file(b, dir, ent->d_name);
+  }
+  closedir(handle);
+  if (result == 0) {
+    result = lyrics_pack_scan(put_stem, b);
+  }
+  b->scanning = 0;
+  return result;
+}
+
+/*
+ * Called with rebuilding set and the lock held; drops the lock for the
+ * scan. Stores that landed meanwhile are folded in, and if anything else
+ * changed the directory during the scan the result stays stale, so the
+ * next check rescans.
+ */
+static int rebuild_locked(void) {
+  struct timespec started;
+  struct timespec before;
+  unsigned long since = g_index.serial;
+  index_builder b;
+  size_t i;
+  int changed;
+  int result;
+
+  memset(&b, 0, sizeof(b));
+  result = dir_mtime(&started);
+  if (result == 0) {
+    pthread_mutex_unlock(&g_index.lock);
+    result = scan_cache(&b);
+    pthread_mutex_lock(&g_index.lock);
+  }
+  for (i = 0; i < g_index.journal_count && result == 0; i++) {
+    if (g_index.journal[i].serial > since) {
+      result = builder_put(&b, g_index.journal[i].key,
+                           &g_index.journal[i].entry);
+    }
+  }
+  changed = dir_mtime(&before) != 0 || timespec_after(&before, &started);
+  if (result == 0) {
+    result = builder_write(&b);
+  }
+  builder_free(&b);
+  if (result == 0) {
+    journal_reset_locked();
+    map_locked();
+    remember_dir_locked();
+    if (changed) {
+      g_index.dir_mtime = started;
+    }
+  } else {
+    g_index.failed_mtime = started;
+  }
+  g_index.rebuilding = 0;
+  pthread_cond_broadcast(&g_index.rebuilt);
+  return result;
+}
+
+static void *rebuild_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&g_index.lock);
+  rebuild_locked();
+  pthread_mutex_unlock(&g_index.lock);
+  return NULL;
+}
+
+static void start_rebuild_locked(void) {
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  if (g_index.rebuilding || pthread_attr_init(&attr) != 0) {
+    return;
+  }
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  g_index.rebuilding = 1;
+  if (pthread_create(&thread, &attr, rebuild_main, NULL) != 0) {
+    g_index.rebuilding = 0;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+static void open_locked(void) {
+  struct timespec current;
+  struct timespec ours;
+
+  g_index.opened = 1;
+  if (dir_mtime(&current) != 0 || map_locked() != 0) {
+    return;
+  }
+  own_mtime(&ours);
+  if (timespec_after(&current, &ours)) {
+    return;
+  }
+  journal_load_locked();
+  remember_dir_locked();
+}
+
+/*
+ * Anything else touching the directory since our last write forces a
+ * rebuild; a failed rebuild is not retried until the directory changes.
+ * Lookups never wait for it: they start it in the background and get "not
+ * current". Everything else waits, or rebuilds on the calling thread.
+ */
+static int current_locked(int wait) {
+  struct timespec now;
+
+  if (!g_index.opened) {
+    open_locked();
+  }
+  for (;;) {
+    if (dir_mtime(&now) != 0) {
+      return 0;
+    }
+    if (g_index.header &&
+        (g_index.holds > 0 || !timespec_after(&now, &g_index.dir_mtime))) {
+      return 1;
+    }
+    if (now.tv_sec == g_index.failed_mtime.tv_sec &&
+        now.tv_nsec == g_index.failed_mtime.tv_nsec) {
+      return 0;
+    }
+    if (!wait) {
+      start_rebuild_locked();
+      return 0;
+    }
+    if (!g_index.rebuilding) {
+      g_index.rebuilding = 1;
+      return rebuild_locked() == 0 && g_index.header;
+    }
+    pthread_cond_wait(&g_index.rebuilt, &g_index.lock);
+  }
+}
+
+int cache_index_key(const char *artist, const char *title, char *out,
+                    size_t out_size) {
+  return normalize_track_key(artist ? artist : "", title, out, out_size);
+}
+
+static void slot_entry(const index_slot *slot, cache_index_entry *out) {
+  memset(out, 0, sizeof(*out));
+  snprintf(out->name, sizeof(out->name), "%s",
+           g_index.strings + slot->name_off);
+  out->offset = slot->offset;
+  out->size = slot->size;
+  out->flags = slot->flags;
+  out->atime = slot->atime;
+  out->crc = slot->crc;
+}
+
+/* Skips the store when the recorded time is recent enough. */
+static void slot_touch(index_slot *slot, uint32_t now) {
+  if (g_index.writable && slot->atime + 60 < now) {
+    slot->atime = now;
+  }
+}
+
+int cache_index_lookup(const char *key, cache_index_entry *out) {
+  journal_entry *pending;
+  index_slot *slot;
+  uint32_t now = (uint32_t)time(NULL);
+  int result = 1;
+
+  if (!key || !out) {
+    return -1;
+  }
+  pthread_mutex_lock(&g_index.lock);
+  if (!current_locked(0)) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  pending = journal_find(key);
+  slot = map_find(key, hash_key(key));
+  if (pending) {
+    if (!(pending->entry.flags & CACHE_INDEX_DELETED)) {
+      pending->entry.atime = now;
+      *out = pending->entry;
+      result = 0;
+    }
+  } else if (slot && slot->name_off < g_index.header->strings_size) {
+    slot_touch(slot, now);
+    slot_entry(slot, out);
+    result = 0;
+  }
+  pthread_mutex_unlock(&g_index.lock);
+  return result;
+}
+
+static int put_locked(const char *key, const cache_index_entry *entry) {
+  char path[512];
+  FILE *file;
+  int clean = !strchr(key, FIELD_SEP) && !strchr(key, '\n') &&
+              !strchr(entry->name, FIELD_SEP) && !strchr(entry->name, '\n');
+  int result = 0;
+
+  /* Mid-rescan the journal stays in memory until the rescan folds it in. */
+  if (g_index.rebuilding) {
+    if (g_index.journal_count == JOURNAL_MAX && !journal_find(key)) {
+      return -1;
+    }
+    journal_add_locked(key, entry);
+    return 0;
+  }
+  if (g_index.journal_count == JOURNAL_MAX && !journal_find(key)) {
+    merge_locked();
+  }
+  journal_add_locked(key, entry);
+  if (!clean || g_index.journal_count == JOURNAL_MAX) {
+    result = merge_locked();
+  } else if (lyrics_cache_path(".index.log", path, sizeof(path)) == 0 &&
+             (file = fopen(path, "a")) != NULL) {
+    fprintf(file, "%u%c%u%c%llu%c%s%c%s%c%u\n", entry->flags, FIELD_SEP,
+            entry->size, FIELD_SEP, (unsigned long long)entry->offset,
+            FIELD_SEP, key, FIELD_SEP, entry->name, FIELD_SEP, entry->crc);
+    fclose(file);
+  } else {
+    result = merge_locked();
+  }
+  remember_dir_locked();
+  return result;
+}
+
+int cache_index_put(const char *key, const cache_index_entry *entry) {
+  int result;
+
+  if (!key || !entry || strlen(key) >= INDEX_KEY_SIZE) {
+    return -1;
+  }
+  pthread_mutex_lock(&g_index.lock);
+  result = current_locked(1) ? put_locked(key, entry) : -1;
+  pthread_mutex_unlock(&g_index.lock);
+  return result;
+}
+
+void cache_index_touch(void) {
+  pthread_mutex_lock(&g_index.lock);
+  if (g_index.opened && g_index.header) {
+    remember_dir_locked();
+  }
+  pthread_mutex_unlock(&g_index.lock);
+}
+
+void cache_index_hold(void) {
+  pthread_mutex_lock(&g_index.lock);
+  g_index.holds++;
+  pthread_mutex_unlock(&g_index.lock);
+}
+
+void cache_index_release(void) {
+  pthread_mutex_lock(&g_index.lock);
+  if (g_index.holds > 0 && --g_index.holds == 0 && g_index.opened &&
+      g_index.header) {
+    remember_dir_locked();
+  }
+  pthread_mutex_unlock(&g_index.lock);
+}
+
+void cache_index_count(int hit) {
+  pthread_mutex_lock(&g_index.lock);
+  if (current_locked(0) && g_index.writable) {
+    if (hit) {
+      g_index.header->hits++;
+    } else {
+      g_index.header->misses++;
+    }
+  }
+  pthread_mutex_unlock(&g_index.lock);
+}
+
+static int same_place(const cache_index_entry *a, const cache_index_entry *b) {
+  return a->offset == b->offset && strcmp(a->name, b->name) == 0;
+}
+
+/* 1 the first time a file or pack record is seen, however many keys it has. */
+static int seen_add(uint64_t *seen, size_t capacity,
+                    const cache_index_entry *entry) {
+  uint64_t hash = hash_key(entry->name) ^ (entry->offset * 0x9e3779b97f4a7c15ULL);
+  size_t i;
+
+  hash = hash ? hash : 1;
+  i = (size_t)hash & (capacity - 1);
+  while (seen[i] != 0) {
+    if (seen[i] == hash) {
+      return 0;
+    }
+    i = (i + 1) & (capacity - 1);
+  }
+  seen[i] = hash;
+  return 1;
+}
+
+static int usage_add(uint64_t *seen, size_t capacity,
+                     const cache_index_entry *entry, cache_index_usage *out) {
+  if (!seen_add(seen, capacity, entry)) {
+    return 0;
+  }
+  out->entries++;
+  out->bytes += entry->size;
+  out->timed += (entry->flags & CACHE_INDEX_TIMED) != 0;
+  out->packed += (entry->flags & CACHE_INDEX_PACKED) != 0;
+  return 1;
+}
+
+int cache_index_usage_get(cache_index_usage *out) {
+  cache_index_entry entry;
+  uint64_t *seen;
+  size_t capacity = INDEX_MIN_CAPACITY;
+  size_t i;
+
+  if (!out) {
+    return -1;
+  }
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&g_index.lock);
+  if (!current_locked(1)) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  while (capacity < (g_index.header->capacity + JOURNAL_MAX) * 2) {
+    capacity *= 2;
+  }
+  seen = (uint64_t *)calloc(capacity, sizeof(*seen));
+  if (!seen) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  /* The journal shadows the table, so its entries go first. */
+  for (i = 0; i < g_index.journal_count; i++) {
+    if (!(g_index.journal[i].entry.flags & CACHE_INDEX_DELETED)) {
+      usage_add(seen, capacity, &g_index.journal[i].entry, out);
+    }
+  }
+  for (i = 0; i < g_index.header->capacity; i++) {
+    const index_slot *slot = &g_index.slots[i];
+
+    if (slot->hash == 0 || slot->name_off >= g_index.header->strings_size ||
+        journal_find(g_index.strings + slot->key_off)) {
+      continue;
+    }
+    slot_entry(slot, &entry);
+    usage_add(seen, capacity, &entry, out);
+  }
+  out->hits = g_index.header->hits;
+  out->misses = g_index.header->misses;
+  pthread_mutex_unlock(&g_index.lock);
+  free(seen);
+  return 0;
+}
+
+int cache_index_entries(cache_index_item **out, size_t *out_count) {
+  cache_index_item *items;
+  cache_index_entry entry;
+  uint64_t *seen;
+  char *keys;
+  size_t capacity = INDEX_MIN_CAPACITY;
+  size_t max;
+  size_t count = 0;
+  size_t i;
+
+  if (!out || !out_count) {
+    return -1;
+  }
+  *out = NULL;
+  *out_count = 0;
+  pthread_mutex_lock(&g_index.lock);
+  if (!current_locked(1)) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  while (capacity < (g_index.header->capacity + JOURNAL_MAX) * 2) {
+    capacity *= 2;
+  }
+  max = g_index.header->count + g_index.journal_count + 1;
+  seen = (uint64_t *)calloc(capacity, sizeof(*seen));
+  /* The table's string blob bounds its keys; journal keys come on top. */
+  items = (cache_index_item *)malloc(max * sizeof(*items) +
+                                     g_index.header->strings_size +
+                                     g_index.journal_count * INDEX_KEY_SIZE);
+  if (!seen || !items) {
+    pthread_mutex_unlock(&g_index.lock);
+    free(seen);
+    free(items);
+    return -1;
+  }
+  keys = (char *)(items + max);
+  for (i = 0; i < g_index.journal_count; i++) {
+    const journal_entry *pending = &g_index.journal[i];
+    size_t len = strlen(pending->key) + 1;
+
+    if (!(pending->entry.flags & CACHE_INDEX_DELETED) &&
+        seen_add(seen, capacity, &pending->entry)) {
+      memcpy(keys, pending->key, len);
+      items[count].key = keys;
+      items[count++].entry = pending->entry;
+      keys += len;
+    }
+  }
+  for (i = 0; i < g_index.header->capacity; i++) {
+    const index_slot *slot = &g_index.slots[i];
+    const char *key = g_index.strings + slot->key_off;
+    size_t len;
+
+    if (slot->hash == 0 || slot->name_off >= g_index.header->strings_size ||
+        journal_find(key)) {
+      continue;
+    }
+    slot_entry(slot, &entry);
+    if (seen_add(seen, capacity, &entry)) {
+      len = strlen(key) + 1;
+      memcpy(keys, key, len);
+      items[count].key = keys;
+      items[count++].entry = entry;
+      keys += len;
+    }
+  }
+  pthread_mutex_unlock(&g_index.lock);
+  free(seen);
+  *out = items;
+  *out_count = count;
+  return 0;
+}
+
+typedef struct seal_ctx {
+  const cache_index_entry *entry;
+  uint32_t crc;
+  int sealed;
+} seal_ctx;
+
+static int seal_key(void *ctx, const char *key) {
+  seal_ctx *seal = (seal_ctx *)ctx;
+  journal_entry *pending = journal_find(key);
+  index_slot *slot = map_find(key, hash_key(key));
+  cache_index_entry found;
+
+  if (pending && pending->entry.crc == 0 &&
+      same_place(&pending->entry, seal->entry) &&
+      pending->entry.size == seal->entry->size) {
+    pending->entry.crc = seal->crc;
+    seal->sealed = 1;
+  }
+  if (slot && g_index.writable && slot->crc == 0 &&
+      slot->name_off < g_index.header->strings_size) {
+    slot_entry(slot, &found);
+    if (same_place(&found, seal->entry) && found.size == seal->entry->size) {
+      slot->crc = seal->crc;
+      seal->sealed = 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Updated in place like access times: the mapped slots directly and the
+ * journal in memory, which reaches disk with the next merge. A flat file's
+ * other keys are found again by splitting its name, as a rebuild does.
+ */
+int cache_index_seal(const char *key, const cache_index_entry *entry,
+                     uint32_t crc) {
+  char stem[256];
+  seal_ctx seal;
+
+  if (!key || !entry) {
+    return -1;
+  }
+  seal.entry = entry;
+  seal.crc = crc;
+  seal.sealed = 0;
+  pthread_mutex_lock(&g_index.lock);
+  if (!current_locked(1)) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  seal_key(&seal, key);
+  if (!(entry->flags & CACHE_INDEX_PACKED) &&
+      name_stem(entry->name, stem, sizeof(stem)) == 0) {
+    cache_index_stem_keys(stem, seal_key, &seal);
+  }
+  pthread_mutex_unlock(&g_index.lock);
+  return seal.sealed ? 0 : -1;
+}
+
+int cache_index_oldest(char *key, size_t key_size, cache_index_entry *out) {
+  uint32_t mask;
+  uint32_t start;
+  uint32_t i;
+  int sampled = 0;
+
+  if (!key || key_size == 0 || !out) {
+    return -1;
+  }
+  pthread_mutex_lock(&g_index.lock);
+  if (!current_locked(1) || g_index.header->count == 0) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  mask = g_index.header->capacity - 1;
+  start = (uint32_t)rand() & mask;
+  for (i = 0; i <= mask && sampled < 32; i++) {
+    const index_slot *slot = &g_index.slots[(start + i) & mask];
+
+    if (slot->hash == 0 || slot->name_off >= g_index.header->strings_size ||
+        journal_find(g_index.strings + slot->key_off)) {
+      continue;
+    }
+    if (sampled == 0 || slot->atime < out->atime) {
+      slot_entry(slot, out);
+      snprintf(key, key_size, "%s", g_index.strings + slot->key_off);
+    }
+    sampled++;
+  }
+  pthread_mutex_unlock(&g_index.lock);
+  return sampled > 0 ? 0 : -1;
+}
+
+typedef struct forget_ctx {
+  const cache_index_entry *entry;
+  char keys[FORGET_MAX_KEYS][INDEX_KEY_SIZE];
+  size_t count;
+  int overflow;
+} forget_ctx;
+
+/* The live entry under a key, journal first. */
+static int entry_for_key(const char *key, cache_index_entry *out) {
+  const journal_entry *pending = journal_find(key);
+  const index_slot *slot;
+
+  if (pending) {
+    *out = pending->entry;
+    return !(pending->entry.flags & CACHE_INDEX_DELETED);
+  }
+  slot = map_find(key, hash_key(key));
+  if (!slot || slot->name_off >= g_index.header->strings_size) {
+    return 0;
+  }
+  slot_entry(slot, out);
+  return 1;
+}
+
+static int collect_forget_key(void *ctx, const char *key) {
+  forget_ctx *forget = (forget_ctx *)ctx;
+  cache_index_entry found;
+  size_t i;
+
+  for (i = 0; i < forget->count; i++) {
+    if (strcmp(forget->keys[i], key) == 0) {
+      return 0;
+    }
+  }
+  if (!entry_for_key(key, &found) || !same_place(&found, forget->entry)) {
+    return 0;
+  }
+  if (forget->count == FORGET_MAX_KEYS) {
+    forget->overflow = 1;
+    return 0;
+  }
+  snprintf(forget->keys[forget->count++], INDEX_KEY_SIZE, "%s", key);
+  return 0;
+}
+
+int cache_index_forget(const char *key, const cache_index_entry *entry) {
+  cache_index_entry tomb;
+  forget_ctx forget;
+  char stem[256];
+  int have_stem;
+  size_t i;
+  int result = 0;
+
+  if (!key || !entry) {
+    return -1;
+  }
+  /* A pack record carries its stem; reading it takes the pack lock. */
+  if (entry->flags & CACHE_INDEX_PACKED) {
+    char *text;
+
+    stem[0] = '\0';
+    text = lyrics_pack_read_stem(entry, stem, sizeof(stem));
+    have_stem = text && stem[0] != '\0';
+    free(text);
+  } else {
+    have_stem = name_stem(entry->name, stem, sizeof(stem)) == 0;
+  }
+  tomb = *entry;
+  tomb.flags |= CACHE_INDEX_DELETED;
+  forget.entry = entry;
+  forget.count = 0;
+  forget.overflow = 0;
+
+  pthread_mutex_lock(&g_index.lock);
+  if (!current_locked(1)) {
+    pthread_mutex_unlock(&g_index.lock);
+    return -1;
+  }
+  collect_forget_key(&forget, key);
+  if (have_stem) {
+    cache_index_stem_keys(stem, collect_forget_key, &forget);
+  }
+  if (forget.overflow) {
+    log_error("lyrics: cache entry has too many keys, some stay indexed");
+  }
+  /* put_locked may merge and remap, so the keys were copied out first. */
+  for (i = 0; i < forget.count && result == 0; i++) {
+    result = put_locked(forget.keys[i], &tomb);
+  }
+  pthread_mutex_unlock(&g_index.lock);
+  return result;
+}
+
+int cache_index_rebuild(void) {
+  int result;
+
+  if (lyrics_cache_prepare() != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&g_index.lock);
+  while (g_index.rebuilding) {
+    pthread_cond_wait(&g_index.rebuilt, &g_index.lock);
+  }
+  g_index.opened = 1;
+  /* The old table supplies access times and hit counters, if readable. */
+  if (!g_index.header) {
+    map_locked();
+  }
+  g_index.rebuilding = 1;
+  result = rebuild_locked();
+  pthread_mutex_unlock(&g_index.lock);
+  return result;
+}
+
+unsigned int cache_index_version(void) {
+  index_header header;
+  char path[512];
+  FILE *file;
+  unsigned int version = 0;
+
+  if (lyrics_cache_path(".index", path, sizeof(path)) != 0) {
+    return 0;
+  }
+  file = fopen(path, "rb");
+  if (!file) {
+    return 0;
+  }
+  if (fread(&header, sizeof(header), 1, file) == 1 &&
+      memcmp(header.magic, "CSIX", 4) == 0) {
+    version = header.version;
+  }
+  fclose(file);
+  return version;
+}
+
+void cache_index_close(void) {
+  pthread_mutex_lock(&g_index.lock);
+  while (g_index.rebuilding) {
+    pthread_cond_wait(&g_index.rebuilt, &g_index.lock);
+  }
+  if (g_index.journal_count > 0) {
+    merge_locked();
+  }
+  unmap_locked();
+  g_index.opened = 0;
+  pthread_mutex_unlock(&g_index.lock);
+}
@@ -0,0 +1,541 @@
+#include "app/cache_tools.h"
+#include "app/cache_index.h"
+#include "app/cache_writer.h"
+#include "app/log.h"
+#include "app/lyrics.h"
+#include "app/lyrics_pack.h"
+#include "app/time.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define TOOL_THREADS_MAX 8
+#define TOOL_FILE_MAX (1u << 20)
+#define TOOL_DEPTH_MAX 16
+
+typedef void (*tool_job_fn)(void *ctx, size_t index);
+
+typedef struct tool_pool {
+  pthread_mutex_t lock;
+  size_t next;
+  size_t count;
+  tool_job_fn fn;
+  void *ctx;
+  cache_tool_report *report;
+} tool_pool;
+
+typedef struct path_list {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} path_list;
+
+typedef struct import_ctx {
+  tool_pool *pool;
+  const path_list *files;
+} import_ctx;
+
+typedef struct entry_ctx {
+  tool_pool *pool;
+  const cache_index_item *items;
+  const char *dir;
+} entry_ctx;
+
+static size_t tool_threads(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (online < 1) {
+    return 1;
+  }
+  return online > TOOL_THREADS_MAX ? TOOL_THREADS_MAX : (size_t)online;
+}
+
+static void *pool_main(void *arg) {
+  tool_pool *pool = (tool_pool *)arg;
+
+  for (;;) {
+    size_t index;
+
+    pthread_mutex_lock(&pool->lock);
+    index = pool->next < pool->count ? pool->next++ : pool->count;
+    pthread_mutex_unlock(&pool->lock);
+    if (index == pool->count) {
+      break;
+    }
+    pool->fn(pool->ctx, index);
+  }
+  return NULL;
+}
+
+/* The calling thread works too, so a failed pthread_create only slows it. */
+static void pool_run(tool_pool *pool) {
+  pthread_t threads[TOOL_THREADS_MAX];
+  size_t started = 0;
+  size_t want = tool_threads();
+  size_t i;
+
+  while (started + 1 < want && started + 1 < pool->count &&
+         pthread_create(&threads[started], NULL, pool_main, pool) == 0) {
+    started++;
+  }
+  pool_main(pool);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static void report_add(tool_pool *pool, size_t written, size_t skipped,
+                       size_t corrupt, uint64_t bytes) {
+  pthread_mutex_lock(&pool->lock);
+  pool->report->written += written;
+  pool->report->skipped += skipped;
+  pool->report->corrupt += corrupt;
+  pool->report->bytes += bytes;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void report_corrupt(tool_pool *pool, const char *name,
+                           const char *reason) {
+  char message[640];
+
+  snprintf(message, sizeof(message), "cache: %s: %s", name, reason);
+  log_error(message);
+  report_add(pool, 0, 0, 1, 0);
+}
+
+/* Returns NULL with *reason set; the text is NUL-terminated. */
+static char *read_text(const char *path, size_t *out_size,
+                       const char **reason) {
+  struct stat st;
+  size_t total = 0;
+  char *text;
+  FILE *file;
+
+  *reason = "cannot read";
+  file = fopen(path, "rb");
+  if (!file) {
+    *reason = errno == ENOENT ? "missing" : "cannot read";
+    return NULL;
+  }
+  if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+    fclose(file);
+    return NULL;
+  }
+  if ((uint64_t)st.st_size > TOOL_FILE_MAX) {
+    fclose(file);
+    *reason = "too large for lyrics";
+    return NULL;
+  }
+  text = (char *)malloc((size_t)st.st_size + 1);
+  if (!text) {
+    fclose(file);
+    return NULL;
+  }
+  total = fread(text, 1, (size_t)st.st_size, file);
+  fclose(file);
+  if (total != (size_t)st.st_size) {
+    free(text);
+    *reason = "short read";
+    return NULL;
+  }
+  text[total] = '\0';
+  if (strlen(text) != total) {
+    free(text);
+    *reason = "binary data";
+    return NULL;
+  }
+  *out_size = total;
+  return text;
+}
+
+/* 1 for synced lyrics, 0 for plain ones, -1 when nothing parses. */
+static int check_text(const char *text) {
+  lyrics_doc *doc = lyrics_parse(text);
+  int timed;
+
+  if (!doc || doc->count == 0) {
+    lyrics_free(doc);
+    return -1;
+  }
+  timed = doc->has_timestamps;
+  lyrics_free(doc);
+  return timed;
+}
+
+static int has_lyrics_ext(const char *name) {
+  size_t len = strlen(name);
+
+  return len > 4 && (strcasecmp(name + len - 4, ".lrc") == 0 ||
+                     strcasecmp(name + len - 4, ".txt") == 0);
+}
+
+static int path_list_add(path_list *list, const char *path) {
+  if (list->count == list->capacity) {
+    size_t next = list->capacity ? list->capacity * 2 : 256;
+    char **grown = (char **)realloc(list->paths, next * sizeof(*grown));
+    if (!grown) {
+      return -1;
+    }
+    list->paths = grown;
+    list->capacity = next;
+  }
+  list->paths[list->count] = strdup(path);
+  if (!list->paths[list->count]) {
+    return -1;
+  }
+  list->count++;
+  return 0;
+}
+
+static void path_list_free(path_list *list) {
+  size_t i;
+
+  for (i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+  memset(list, 0, sizeof(*list));
+}
+
+static int collect_files(const char *dir, int depth, path_list *out) {
+  struct dirent *ent;
+  DIR *handle;
+  int result = 0;
+
+  if (depth > TOOL_DEPTH_MAX || (handle = opendir(dir)) == NULL) {
+    return depth == 0 ? -1 : 0;
+  }
+  while (result == 0 && (ent = readdir(handle)) != NULL) {
+    char path[1024];
+    struct stat st;
+
+    if (ent->d_name[0] == '.' ||
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >=
+            (int)sizeof(path) ||
+        stat(path, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      result = collect_files(path, depth + 1, out);
+    } else if (S_ISREG(st.st_mode) && has_lyrics_ext(ent->d_name)) {
+      result = path_list_add(out, path);
+    }
+  }
+  closedir(handle);
+  return result;
+}
+
+/* Value of an LRC header tag such as [ar:Artist], searched near the top. */
+static void find_tag(const char *text, const char *tag, char *out,
+                     size_t out_size) {
+  size_t tag_len = strlen(tag);
+  const char *line = text;
+  int lines;
+
+  out[0] = '\0';
+  for (lines = 0; line && *line && lines < 32; lines++) {
+    const char *end = strchr(line, '\n');
+    const char *close;
+    size_t len;
+
+    while (*line == ' ' || *line == '\t' || *line == '\r') {
+      line++;
+    }
+    if (line[0] == '[' && strncasecmp(line + 1, tag, tag_len) == 0 &&
+        line[1 + tag_len] == ':' && (close = strchr(line, ']')) != NULL &&
+        (!end || close < end)) {
+      line += 2 + tag_len;
+      while (line < close && isspace((unsigned char)*line)) {
+        line++;
+      }
+      len = (size_t)(close - line);
+      while (len > 0 && isspace((unsigned char)line[len - 1])) {
+        len--;
+      }
+      if (len >= out_size) {
+        len = out_size - 1;
+      }
+      memcpy(out, line, len);
+      out[len] = '\0';
+      return;
+    }
+    line = end ? end + 1 : NULL;
+  }
+}
+
+/* Tags win; otherwise the file name splits like the cache's own names. */
+static int import_names(const char *path, const char *text, char *artist,
+                        size_t artist_size, char *title, size_t title_size) {
+  const char *base = strrchr(path, '/');
+  char stem[256];
+  char tag[256];
+  const char *sep;
+  size_t len;
+
+  base = base ? base + 1 : path;
+  len = strlen(base) - 4;
+  if (len == 0 || len >= sizeof(stem)) {
+    return -1;
+  }
+  memcpy(stem, base, len);
+  stem[len] = '\0';
+  sep = strstr(stem, " - ");
+  if (sep) {
+    snprintf(artist, artist_size, "%.*s", (int)(sep - stem), stem);
+    snprintf(title, title_size, "%s", sep + 3);
+  } else {
+    artist[0] = '\0';
+    snprintf(title, title_size, "%s", stem);
+  }
+  find_tag(text, "ti", tag, sizeof(tag));
+  if (tag[0] != '\0') {
+    snprintf(title, title_size, "%s", tag);
+    find_tag(text, "ar", tag, sizeof(tag));
+    if (tag[0] != '\0') {
+      snprintf(artist, artist_size, "%s", tag);
+    }
+  }
+  return title[0] != '\0' ? 0 : -1;
+}
+
+static void import_one(void *ctx, size_t index) {
+  import_ctx *import = (import_ctx *)ctx;
+  const char *path = import->files->paths[index];
+  const char *reason;
+  char artist[256];
+  char title[256];
+  size_t size = 0;
+  char *text = read_text(path, &size, &reason);
+  int timed;
+
+  if (!text) {
+    report_corrupt(import->pool, path, reason);
+    return;
+  }
+  timed = check_text(text);
+  if (timed < 0) {
+    report_corrupt(import->pool, path, "no lyrics lines");
+  } else if (import_names(path, text, artist, sizeof(artist), title,
+                          sizeof(title)) != 0) {
+    report_corrupt(import->pool, path, "cannot tell the track from its name");
+  } else if (lyrics_cache_contains(artist[0] ? artist : NULL, title)) {
+    report_add(import->pool, 0, 1, 0, 0);
+  } else if (lyrics_cache_store(artist[0] ? artist : NULL, title, text,
+                                timed) != 0) {
+    report_corrupt(import->pool, path, "cannot store");
+  } else {
+    report_add(import->pool, 1, 0, 0, size);
+  }
+  free(text);
+}
+
+static void pool_init(tool_pool *pool, size_t count, tool_job_fn fn, void *ctx,
+                      cache_tool_report *report) {
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->next = 0;
+  pool->count = count;
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->report = report;
+}
+
+int lyrics_cache_import(const char *dir, cache_tool_report *out) {
+  path_list files;
+  tool_pool pool;
+  import_ctx ctx;
+  long start = time_now_ms();
+  char message[640];
+
+  if (!dir || !out) {
+    return -1;
+  }
+  memset(out, 0, sizeof(*out));
+  memset(&files, 0, sizeof(files));
+  if (lyrics_cache_prepare() != 0) {
+    return -1;
+  }
+  if (collect_files(dir, 0, &files) != 0) {
+    snprintf(message, sizeof(message), "cache: cannot scan %s", dir);
+    log_error(message);
+    path_list_free(&files);
+    return -1;
+  }
+  out->files = files.count;
+  ctx.pool = &pool;
+  ctx.files = &files;
+  pool_init(&pool, files.count, import_one, &ctx, out);
+  pool_run(&pool);
+  pthread_mutex_destroy(&pool.lock);
+  path_list_free(&files);
+  /* Batched writes land before the clock stops. */
+  cache_writer_flush();
+  lyrics_pack_flush();
+  out->elapsed_ms = time_now_ms() - start;
+  return 0;
+}
+
+static int entry_text(const cache_index_entry *entry, char **out_text,
+                      size_t *out_size, char *stem, size_t stem_size,
+                      const char **reason) {
+  char path[512];
+  uint32_t crc;
+
+  if (entry->flags & CACHE_INDEX_PACKED) {
+    *out_text = lyrics_pack_read_stem(entry, stem, stem_size);
+    *reason = "corrupt pack record";
+    *out_size = *out_text ? strlen(*out_text) : 0;
+    return *out_text ? 0 : -1;
+  }
+  if (lyrics_cache_path(entry->name, path, sizeof(path)) != 0) {
+    *reason = "bad name";
+    return -1;
+  }
+  *out_text = read_text(path, out_size, reason);
+  if (!*out_text) {
+    return -1;
+  }
+  if (*out_size != entry->size) {
+    *reason = *out_size < entry->size ? "truncated" : "size changed";
+    free(*out_text);
+    *out_text = NULL;
+    return -1;
+  }
+  crc = (uint32_t)crc32(0L, (const Bytef *)*out_text, (uInt)*out_size);
+  if (entry->crc != 0 && crc != entry->crc) {
+    *reason = "checksum mismatch";
+    free(*out_text);
+    *out_text = NULL;
+    return -1;
+  }
+  /* 1 tells the caller the checksum was not known yet. */
+  return entry->crc == 0 ? 1 : 0;
+}
+
+static void verify_one(void *ctx, size_t index) {
+  entry_ctx *verify = (entry_ctx *)ctx;
+  const cache_index_item *item = &verify->items[index];
+  const cache_index_entry *entry = &item->entry;
+  const char *reason;
+  char *text = NULL;
+  size_t size = 0;
+  int result = entry_text(entry, &text, &size, NULL, 0, &reason);
+
+  if (result < 0) {
+    report_corrupt(verify->pool, entry->name, reason);
+    return;
+  }
+  if (check_text(text) < 0) {
+    report_corrupt(verify->pool, entry->name, "no lyrics lines");
+  } else if (result == 1 &&
+             cache_index_seal(item->key, entry,
+                              (uint32_t)crc32(0L, (const Bytef *)text,
+                                              (uInt)size)) == 0) {
+    report_add(verify->pool, 1, 1, 0, size);
+  } else {
+    report_add(verify->pool, 1, 0, 0, size);
+  }
+  free(text);
+}
+
+static int run_entries(tool_job_fn fn, const char *dir,
+                       cache_tool_report *out) {
+  cache_index_item *items = NULL;
+  size_t count = 0;
+  tool_pool pool;
+  entry_ctx ctx;
+  long start = time_now_ms();
+
+  if (!out) {
+    return -1;
+  }
+  memset(out, 0, sizeof(*out));
+  if (lyrics_cache_prepare() != 0 ||
+      cache_index_entries(&items, &count) != 0) {
+    log_error("lyrics: cannot read cache index");
+    return -1;
+  }
+  out->files = count;
+  ctx.pool = &pool;
+  ctx.items = items;
+  ctx.dir = dir;
+  pool_init(&pool, count, fn, &ctx, out);
+  pool_run(&pool);
+  pthread_mutex_destroy(&pool.lock);
+  free(items);
+  out->elapsed_ms = time_now_ms() - start;
+  return 0;
+}
+
+int lyrics_cache_verify(cache_tool_report *out) {
+  return run_entries(verify_one, NULL, out);
+}
+
+static int write_export(const char *path, const char *text, size_t size) {
+  char temp[1040];
+  FILE *file;
+  int ok;
+
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  file = fopen(temp, "wb");
+  if (!file) {
+    return -1;
+  }
+  ok = fwrite(text, 1, size, file) == size;
+  if (fclose(file) != 0 || !ok || rename(temp, path) != 0) {
+    remove(temp);
+    return -1;
+  }
+  return 0;
+}
+
+static void export_one(void *ctx, size_t index) {
+  entry_ctx *export = (entry_ctx *)ctx;
+  const cache_index_entry *entry = &export->items[index].entry;
+  const char *reason;
+  char stem[256];
+  char path[1024];
+  char *text = NULL;
+  size_t size = 0;
+
+  stem[0] = '\0';
+  if (entry_text(entry, &text, &size, stem, sizeof(stem), &reason) < 0) {
+    report_corrupt(export->pool, entry->name, reason);
+    return;
+  }
+  if (entry->flags & CACHE_INDEX_PACKED) {
+    snprintf(path, sizeof(path), "%s/%s%s", export->dir, stem,
+             (entry->flags & CACHE_INDEX_TIMED) ? ".lrc" : ".txt");
+  } else {
+    snprintf(path, sizeof(path), "%s/%s", export->dir, entry->name);
+  }
+  if (check_text(text) < 0) {
+    report_corrupt(export->pool, entry->name, "no lyrics lines");
+  } else if (write_export(path, text, size) != 0) {
+    report_corrupt(export->pool, path, "cannot write");
+  } else {
+    report_add(export->pool, 1, 0, 0, size);
+  }
+  free(text);
+}
+
+int lyrics_cache_export(const char *dir, cache_tool_report *out) {
+  char message[640];
+
+  if (!dir) {
+    return -1;
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    snprintf(message, sizeof(message), "cache: cannot create %s", dir);
+    log_error(message);
+    return -1;
+  }
+  return run_entries(export_one, dir, out);
+}
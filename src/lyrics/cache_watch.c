@@ -0,0 +1,84 @@
+#include "app/cache_watch.h"
+#include "app/lyrics.h"
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define WATCH_NAMES 32
+
+static int g_watch_fd = -1;
+
+int cache_watch_open(void) {
+  char dir[512];
+
+  if (g_watch_fd >= 0) {
+    return 0;
+  }
+  if (lyrics_cache_prepare() != 0 ||
+      lyrics_cache_path("", dir, sizeof(dir)) != 0) {
+    return -1;
+  }
+  g_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (g_watch_fd < 0) {
+    return -1;
+  }
+  /* Editors often save through a rename, so watch the directory. */
+  if (inotify_add_watch(g_watch_fd, dir,
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+    close(g_watch_fd);
+    g_watch_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+void cache_watch_close(void) {
+  if (g_watch_fd >= 0) {
+    close(g_watch_fd);
+  }
+  g_watch_fd = -1;
+}
+
+int cache_watch_fd(void) {
+  return g_watch_fd;
+}
+
+/* A save usually raises several events; each name is reported once. */
+void cache_watch_poll(cache_watch_fn fn, void *ctx) {
+  _Alignas(struct inotify_event) char buffer[4096];
+  char names[WATCH_NAMES][256];
+  size_t count = 0;
+  size_t i;
+  ssize_t n;
+
+  if (g_watch_fd < 0 || !fn) {
+    return;
+  }
+  while ((n = read(g_watch_fd, buffer, sizeof(buffer))) > 0) {
+    ssize_t off = 0;
+
+    while (off < n) {
+      const struct inotify_event *event =
+          (const struct inotify_event *)(buffer + off);
+      off += (ssize_t)sizeof(*event) + event->len;
+      if (event->len == 0 || strlen(event->name) >= sizeof(names[0])) {
+        continue;
+      }
+      for (i = 0; i < count && strcmp(names[i], event->name) != 0; i++) {
+      }
+      if (i < count) {
+        continue;
+      }
+      if (count == WATCH_NAMES) {
+        for (i = 0; i < count; i++) {
+          fn(ctx, names[i]);
+        }
+        count = 0;
+      }
+      strcpy(names[count++], event->name);
+    }
+  }
+  for (i = 0; i < count; i++) {
+    fn(ctx, names[i]);
+  }
+}
@@ -0,0 +1,418 @@
+#include "app/cache_writer.h"
+#include "app/cache_index.h"
+#include "app/log.h"
+#include "app/lyrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define WRITER_BATCH 32
+#define WRITER_QUEUE_MAX 256
+#define WRITER_LINGER_MS 50
+#define WRITER_RECENT 64
+
+typedef struct write_job {
+  struct write_job *next;
+  char *key;
+  char *path;
+  char *text;
+  size_t size;
+  uint32_t crc;
+  int timed;
+  int skip;
+  int committed;
+  int fd;
+} write_job;
+
+/* A file we renamed into place, so its inotify event can be told apart. */
+typedef struct recent_commit {
+  char name[256];
+  uint32_t size;
+  uint32_t crc;
+} recent_commit;
+
+/*
+ * Jobs stay on the list while they are written so lookups keep finding
+ * them; a newer job for the same key is appended behind an older one.
+ */
+typedef struct writer_state {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  write_job *head;
+  write_job *tail;
+  size_t count;
+  int started;
+  int stopping;
+  int trim;
+  pthread_t thread;
+  recent_commit recent[WRITER_RECENT];
+  size_t recent_next;
+} writer_state;
+
+static writer_state g_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void job_free(write_job *job) {
+  if (!job) {
+    return;
+  }
+  free(job->key);
+  free(job->path);
+  free(job->text);
+  free(job);
+}
+
+static void temp_path(const write_job *job, char *out, size_t out_size) {
+  snprintf(out, out_size, "%s.tmp", job->path);
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Leaves the temp file open in job->fd so the batch can be synced. */
+static int job_write(write_job *job) {
+  char temp[600];
+
+  temp_path(job, temp, sizeof(temp));
+  job->fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (job->fd < 0) {
+    return -1;
+  }
+  if (write_all(job->fd, job->text, job->size) != 0) {
+    close(job->fd);
+    job->fd = -1;
+    remove(temp);
+    return -1;
+  }
+  return 0;
+}
+
+static const char *job_name(const write_job *job) {
+  const char *name = strrchr(job->path, '/');
+  return name ? name + 1 : job->path;
+}
+
+/* Recorded before the rename, which is what raises the event. */
+static void remember_commit(const write_job *job) {
+  recent_commit *recent;
+
+  pthread_mutex_lock(&g_writer.lock);
+  recent = &g_writer.recent[g_writer.recent_next];
+  g_writer.recent_next = (g_writer.recent_next + 1) % WRITER_RECENT;
+  snprintf(recent->name, sizeof(recent->name), "%s", job_name(job));
+  recent->size = (uint32_t)job->size;
+  recent->crc = job->crc;
+  pthread_mutex_unlock(&g_writer.lock);
+}
+
+static int job_commit(write_job *job) {
+  char temp[600];
+  int ok;
+
+  remember_commit(job);
+  temp_path(job, temp, sizeof(temp));
+  ok = fdatasync(job->fd) == 0;
+  ok = close(job->fd) == 0 && ok;
+  job->fd = -1;
+  if (!ok || rename(temp, job->path) != 0) {
+    remove(temp);
+    return -1;
+  }
+  /* The old sidecar was built from the replaced text. */
+  snprintf(temp, sizeof(temp), "%sb", job->path);
+  remove(temp);
+  return 0;
+}
+
+/* One directory sync makes every rename of the batch durable. */
+static void sync_parent(const char *path) {
+  char dir[512];
+  char *slash;
+  int fd;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  slash = strrchr(dir, '/');
+  if (!slash) {
+    return;
+  }
+  *slash = '\0';
+  fd = open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+static void job_publish(const write_job *job) {
+  cache_index_entry entry;
+
+  memset(&entry, 0, sizeof(entry));
+  snprintf(entry.name, sizeof(entry.name), "%s", job_name(job));
+  entry.size = (uint32_t)job->size;
+  entry.flags = job->timed ? CACHE_INDEX_TIMED : 0;
+  entry.crc = job->crc;
+  cache_index_put(job->key, &entry);
+}
+
+static void linger_locked(void) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += WRITER_LINGER_MS * 1000000L;
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  while (!g_writer.stopping && g_writer.count < WRITER_BATCH &&
+         pthread_cond_timedwait(&g_writer.wake, &g_writer.lock, &until) == 0) {
+  }
+}
+
+/* Skips jobs whose key has a newer job queued; only the last one lands. */
+static int superseded_locked(const write_job *job) {
+  const write_job *other;
+
+  for (other = job->next; other; other = other->next) {
+    if (strcmp(other->key, job->key) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *writer_main(void *arg) {
+  write_job *batch[WRITER_BATCH];
+  write_job *job;
+  char message[640];
+  size_t count;
+  size_t i;
+  int more;
+
+  (void)arg;
+  pthread_mutex_lock(&g_writer.lock);
+  for (;;) {
+    while (!g_writer.head && !g_writer.trim && !g_writer.stopping) {
+      pthread_cond_wait(&g_writer.wake, &g_writer.lock);
+    }
+    if (!g_writer.head && g_writer.trim && !g_writer.stopping) {
+      /* Evictions go one bounded step at a time between write batches. */
+      g_writer.trim = 0;
+      pthread_mutex_unlock(&g_writer.lock);
+      more = lyrics_cache_trim() > 0;
+      pthread_mutex_lock(&g_writer.lock);
+      g_writer.trim = g_writer.trim || more;
+      continue;
+    }
+    if (!g_writer.head) {
+      break;
+    }
+    linger_locked();
+    count = 0;
+    for (job = g_writer.head; job && count < WRITER_BATCH; job = job->next) {
+      job->skip = superseded_locked(job);
+      batch[count++] = job;
+    }
+    pthread_mutex_unlock(&g_writer.lock);
+
+    /* Our temp files and renames must not make the index look stale. */
+    cache_index_hold();
+    for (i = 0; i < count; i++) {
+      job = batch[i];
+      if (job->skip) {
+        continue;
+      }
+      if (job_write(job) != 0) {
+        snprintf(message, sizeof(message), "cache: cannot write %s", job->path);
+        log_error(message);
+      }
+    }
+    for (i = 0; i < count; i++) {
+      job = batch[i];
+      if (job->fd < 0) {
+        continue;
+      }
+      if (job_commit(job) == 0) {
+        job->committed = 1;
+      } else {
+        snprintf(message, sizeof(message), "cache: cannot commit %s",
+                 job->path);
+        log_error(message);
+      }
+    }
+    if (count > 0) {
+      sync_parent(batch[0]->path);
+    }
+    for (i = 0; i < count; i++) {
+      if (batch[i]->committed) {
+        job_publish(batch[i]);
+      }
+    }
+    cache_index_release();
+
+    pthread_mutex_lock(&g_writer.lock);
+    for (i = 0; i < count; i++) {
+      g_writer.head = batch[i]->next;
+      job_free(batch[i]);
+      g_writer.count--;
+    }
+    if (!g_writer.head) {
+      g_writer.tail = NULL;
+    }
+    pthread_cond_broadcast(&g_writer.done);
+  }
+  pthread_mutex_unlock(&g_writer.lock);
+  return NULL;
+}
+
+static int ensure_started_locked(void) {
+  if (g_writer.started) {
+    return 0;
+  }
+  if (pthread_create(&g_writer.thread, NULL, writer_main, NULL) != 0) {
+    log_error("cache: cannot start writer thread");
+    return -1;
+  }
+  g_writer.started = 1;
+  return 0;
+}
+
+int cache_writer_put(const char *key, const char *path, const char *text,
+                     int timed) {
+  write_job *job;
+
+  if (!key || !path || !text) {
+    return -1;
+  }
+  job = (write_job *)calloc(1, sizeof(*job));
+  if (!job) {
+    return -1;
+  }
+  job->key = strdup(key);
+  job->path = strdup(path);
+  job->text = strdup(text);
+  job->size = strlen(text);
+  job->timed = timed;
+  job->fd = -1;
+  if (!job->key || !job->path || !job->text || job->size > UINT32_MAX) {
+    job_free(job);
+    return -1;
+  }
+  job->crc = (uint32_t)crc32(0L, (const Bytef *)job->text, (uInt)job->size);
+
+  pthread_mutex_lock(&g_writer.lock);
+  if (g_writer.stopping || ensure_started_locked() != 0) {
+    pthread_mutex_unlock(&g_writer.lock);
+    job_free(job);
+    return -1;
+  }
+  while (g_writer.count >= WRITER_QUEUE_MAX) {
+    pthread_cond_wait(&g_writer.done, &g_writer.lock);
+  }
+  if (g_writer.tail) {
+    g_writer.tail->next = job;
+  } else {
+    g_writer.head = job;
+  }
+  g_writer.tail = job;
+  g_writer.count++;
+  pthread_cond_signal(&g_writer.wake);
+  pthread_mutex_unlock(&g_writer.lock);
+  return 0;
+}
+
+int cache_writer_committed(const char *name, uint32_t size, uint32_t crc) {
+  size_t i;
+  int found = 0;
+
+  if (!name) {
+    return 0;
+  }
+  pthread_mutex_lock(&g_writer.lock);
+  for (i = 0; i < WRITER_RECENT && !found; i++) {
+    const recent_commit *recent = &g_writer.recent[i];
+    found = recent->size == size && recent->crc == crc &&
+            strcmp(recent->name, name) == 0;
+  }
+  pthread_mutex_unlock(&g_writer.lock);
+  return found;
+}
+
+char *cache_writer_pending(const char *key) {
+  const write_job *job;
+  const write_job *found = NULL;
+  char *text = NULL;
+
+  if (!key) {
+    return NULL;
+  }
+  pthread_mutex_lock(&g_writer.lock);
+  for (job = g_writer.head; job; job = job->next) {
+    if (strcmp(job->key, key) == 0) {
+      found = job;
+    }
+  }
+  if (found) {
+    text = strdup(found->text);
+  }
+  pthread_mutex_unlock(&g_writer.lock);
+  return text;
+}
+
+void cache_writer_flush(void) {
+  pthread_mutex_lock(&g_writer.lock);
+  while (g_writer.head) {
+    pthread_cond_signal(&g_writer.wake);
+    pthread_cond_wait(&g_writer.done, &g_writer.lock);
+  }
+  pthread_mutex_unlock(&g_writer.lock);
+}
+
+void cache_writer_request_trim(void) {
+  pthread_mutex_lock(&g_writer.lock);
+  if (!g_writer.stopping && ensure_started_locked() == 0) {
+    g_writer.trim = 1;
+    pthread_cond_signal(&g_writer.wake);
+  }
+  pthread_mutex_unlock(&g_writer.lock);
+}
+
+void cache_writer_close(void) {
+  int started;
+
+  pthread_mutex_lock(&g_writer.lock);
+  started = g_writer.started;
+  g_writer.stopping = 1;
+  pthread_cond_signal(&g_writer.wake);
+  pthread_mutex_unlock(&g_writer.lock);
+  if (started) {
+    pthread_join(g_writer.thread, NULL);
+  }
+  pthread_mutex_lock(&g_writer.lock);
+  g_writer.started = 0;
+  g_writer.stopping = 0;
+  g_writer.trim = 0;
+  pthread_mutex_unlock(&g_writer.lock);
+}
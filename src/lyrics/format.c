@@ -1,226 +1,580 @@
 #include "app/lyrics.h"
 #include <ctype.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-static int has_timestamp(const char *text) {
-  const char *p = text;
-  while (p && *p) {
-    if (*p == '[' && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2]) &&
-        p[3] == ':') {
-      return 1;
-    }
-    p++;
-  }
-  return 0;
+static pthread_mutex_t g_refs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define PARSE_MAX_TAGS 8
+
+/* Where a line will land in the doc, recorded while the text streams by. */
+typedef struct parse_entry {
+  int32_t time;
+  size_t text_off;
+  size_t order;
+  int has_time;
+  /* First entry of its source line; plain docs keep only these. */
+  int first;
+  uint32_t word_first;
+  uint32_t word_count;
+} parse_entry;
+
+typedef struct parse_list {
+  parse_entry *items;
+  size_t count;
+  size_t capacity;
+} parse_list;
+
+typedef struct word_list {
+  lyrics_word *items;
+  size_t count;
+  size_t capacity;
+} word_list;
+
+/* The doc header is followed by the text blob, the lines, then the words. */
+static size_t doc_header_size(void) {
+  size_t align = _Alignof(max_align_t);
+  return (sizeof(lyrics_doc) + align - 1) & ~(align - 1);
 }
 
-static int parse_time_tag(const char *tag, double *out_time) {
-  int minutes = 0;
-  int seconds = 0;
-  int hundredths = 0;
-  int read;
+static size_t scan_digits(const char *p, const char *end, int *out) {
+  size_t n = 0;
+  int value = 0;
 
-  if (!tag || tag[0] != '[') {
-    return 0;
+  while (p + n < end && p[n] >= '0' && p[n] <= '9' && n < 9) {
+    value = value * 10 + (p[n] - '0');
+    n++;
   }
+  *out = value;
+  return n;
+}
+
+/*
+ * "[mm:ss]", "[mm:ss.f]" up to "[mm:ss.fff]", or "[hh:mm:ss.fff]" at p,
+ * or the same between '<' and '>' when close is '>'. The fraction is
+ * scaled by its digit count and anything past milliseconds is dropped.
+ * Returns the length of the tag including the brackets, or 0.
+ */
+static size_t scan_time_tag(const char *p, const char *end, char close,
+                            int32_t *out_ms) {
+  /* ms = fraction * frac_mul[digits] / frac_div[digits] */
+  static const int frac_mul[10] = {0, 100, 10, 1, 1, 1, 1, 1, 1, 1};
+  static const int frac_div[10] = {1,     1,     1,      1,       10,
+                                   100,   1000,  10000,  100000,  1000000};
+  const char *q = p + 1;
+  int fields[3];
+  int count = 0;
+  int fraction = 0;
+  size_t n;
+  long long ms;
 
-  read = sscanf(tag, "[%d:%d.%d]", &minutes, &seconds, &hundredths);
-  if (read < 2) {
-    read = sscanf(tag, "[%d:%d]", &minutes, &seconds);
-    if (read < 2) {
+  for (;;) {
+    if (q >= end || (n = scan_digits(q, end, &fields[count])) == 0) {
       return 0;
     }
-    hundredths = 0;
+    q += n;
+    count++;
+    if (count == 3 || q >= end || *q != ':') {
+      break;
+    }
+    q++;
   }
-
-  if (minutes < 0 || seconds < 0) {
+  if (count < 2) {
     return 0;
   }
-
-  if (out_time) {
-    *out_time = (double)minutes * 60.0 + (double)seconds +
-                (double)hundredths / 100.0;
+  if (q < end && *q == '.') {
+    q++;
+    n = scan_digits(q, end, &fraction);
+    q += n;
+    fraction = fraction * frac_mul[n] / frac_div[n];
+  }
+  if (q >= end || *q != close) {
+    return 0;
   }
-  return 1;
+  /* Two fields are minutes and seconds; three add hours in front. */
+  ms = (long long)fields[count - 2] * 60000 +
+       (long long)fields[count - 1] * 1000 + fraction;
+  if (count == 3) {
+    ms += (long long)fields[0] * 3600000;
+  }
+  if (ms > INT32_MAX) {
+    return 0;
+  }
+  *out_ms = (int32_t)ms;
+  return (size_t)(q + 1 - p);
 }
 
-static char *strip_cr(char *line) {
-  size_t len = strlen(line);
-  if (len > 0 && line[len - 1] == '\r') {
-    line[len - 1] = '\0';
+/* "[offset:+/-ms]" anywhere in the line; only the first one counts. */
+static void scan_offset_tag(const char *line, const char *end,
+                            int *offset_ms) {
+  const char *p = line;
+  int offset_seen = 0;
+
+  while ((p = memchr(p, '[', (size_t)(end - p))) != NULL) {
+    if (!offset_seen && end - p >= 8 && memcmp(p + 1, "offset:", 7) == 0) {
+      const char *q = p + 8;
+      int negative = 0;
+      long value = 0;
+
+      offset_seen = 1;
+      if (q < end && (*q == '+' || *q == '-')) {
+        negative = *q++ == '-';
+      }
+      if (q < end && isdigit((unsigned char)*q)) {
+        while (q < end && isdigit((unsigned char)*q) && value < 100000000L) {
+          value = value * 10 + (*q++ - '0');
+        }
+        if (q < end && *q == ']') {
+          *offset_ms = (int)(negative ? -value : value);
+        }
+      }
+    }
+    p++;
   }
-  return line;
 }
 
-static int compare_lines(const void *a, const void *b) {
-  const lyrics_line *la = (const lyrics_line *)a;
-  const lyrics_line *lb = (const lyrics_line *)b;
-  if (la->time < lb->time) {
-    return -1;
-  }
-  if (la->time > lb->time) {
-    return 1;
+static int list_add(parse_list *list, int32_t time, size_t text_off,
+                    int has_time, int first) {
+  parse_entry *entry;
+
+  if (list->count == list->capacity) {
+    size_t next = list->capacity ? list->capacity * 2 : 64;
+    parse_entry *grown =
+        (parse_entry *)realloc(list->items, next * sizeof(*grown));
+    if (!grown) {
+      return -1;
+    }
+    list->items = grown;
+    list->capacity = next;
   }
+  entry = &list->items[list->count];
+  entry->time = time;
+  entry->text_off = text_off;
+  entry->order = list->count;
+  entry->has_time = has_time;
+  entry->first = first;
+  entry->word_first = 0;
+  entry->word_count = 0;
+  list->count++;
   return 0;
 }
 
-static int parse_offset_tag(const char *line, int *out_ms) {
-  const char *p;
-  char *endptr;
-  long value;
-
-  if (!line || !out_ms) {
-    return 0;
+static lyrics_word *word_add(word_list *list) {
+  if (list->count == list->capacity) {
+    size_t next = list->capacity ? list->capacity * 2 : 64;
+    lyrics_word *grown =
+        (lyrics_word *)realloc(list->items, next * sizeof(*grown));
+    if (!grown) {
+      return NULL;
+    }
+    list->items = grown;
+    list->capacity = next;
   }
+  return &list->items[list->count++];
+}
 
-  p = strstr(line, "[offset:");
-  if (!p) {
-    return 0;
-  }
+/*
+ * Copies a timed line's text to out with its "<mm:ss.ff>" word tags
+ * removed, recording one word per tag. Word starts are milliseconds after
+ * line_ms and never run backwards; each tag ends the word before it, so
+ * a trailing tag only closes the last word. Returns the copied length, or
+ * (size_t)-1 when the word table cannot grow.
+ */
+static size_t copy_words(const char *q, const char *end, int32_t line_ms,
+                         char *out, word_list *words, uint32_t *out_first,
+                         uint32_t *out_count) {
+  size_t first = words->count;
+  size_t len = 0;
+  uint32_t floor_ms = 0;
+  lyrics_word *word = NULL;
 
-  p += 8;
-  value = strtol(p, &endptr, 10);
-  if (!endptr || *endptr != ']') {
-    return 0;
+  while (q < end) {
+    const char *tag = memchr(q, '<', (size_t)(end - q));
+    int32_t at = 0;
+    size_t tag_len = 0;
+    size_t run;
+    uint32_t ms;
+
+    if (tag) {
+      tag_len = scan_time_tag(tag, end, '>', &at);
+    }
+    run = (size_t)((tag ? tag + (tag_len ? 0 : 1) : end) - q);
+    memcpy(out + len, q, run);
+    len += run;
+    q += run;
+    if (tag_len == 0) {
+      continue;
+    }
+    q += tag_len;
+    ms = at > line_ms ? (uint32_t)(at - line_ms) : 0;
+    if (ms < floor_ms) {
+      ms = floor_ms;
+    }
+    floor_ms = ms;
+    if (word) {
+      word->end_ms = ms;
+      word->text_end = (uint32_t)len;
+    }
+    /* A tag with no text since the last one just moves the start. */
+    if (!word || word->text_start < word->text_end) {
+      if (!(word = word_add(words))) {
+        return (size_t)-1;
+      }
+    }
+    word->start_ms = ms;
+    word->end_ms = LYRICS_WORD_OPEN;
+    word->text_start = (uint32_t)len;
+    word->text_end = (uint32_t)len;
+  }
+  if (word) {
+    word->text_end = (uint32_t)len;
+    if (word->text_start == word->text_end) {
+      words->count--;
+    }
   }
+  *out_first = (uint32_t)first;
+  *out_count = (uint32_t)(words->count - first);
+  return len;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const parse_entry *ea = (const parse_entry *)a;
+  const parse_entry *eb = (const parse_entry *)b;
 
-  *out_ms = (int)value;
-  return 1;
+  if (ea->time != eb->time) {
+    return ea->time < eb->time ? -1 : 1;
+  }
+  return (ea->order > eb->order) - (ea->order < eb->order);
 }
 
+/*
+ * Single pass over the text: each line's tags are scanned in place and its
+ * lyric text is copied once into the blob behind the doc header, however
+ * many time tags share it. The line and word arrays are appended to the
+ * same block at the end, so the whole doc is one allocation.
+ */
 lyrics_doc *lyrics_parse(const char *text) {
+  size_t header = doc_header_size();
+  size_t len;
+  size_t blob_used = 0;
+  size_t lines_off;
+  size_t times_off;
+  size_t words_off;
+  size_t kept = 0;
+  size_t i;
+  parse_list list;
+  word_list words;
   lyrics_doc *doc;
-  char *copy;
-  char *line;
-  char *saveptr;
-  int timed;
+  char *arena;
+  char *grown;
+  const char *p;
+  const char *end;
+  int timed = 0;
   int offset_ms = 0;
 
   if (!text) {
     return NULL;
   }
-
-  doc = (lyrics_doc *)calloc(1, sizeof(*doc));
-  if (!doc) {
+  len = strlen(text);
+  arena = (char *)malloc(header + len + 1);
+  if (!arena) {
     return NULL;
   }
+  memset(&list, 0, sizeof(list));
+  memset(&words, 0, sizeof(words));
 
-  timed = has_timestamp(text);
-  doc->has_timestamps = timed;
-
-  copy = strdup(text);
-  if (!copy) {
-    free(doc);
-    return NULL;
-  }
-
-  line = strtok_r(copy, "\n", &saveptr);
-  while (line) {
-    double times[8];
+  for (p = text, end = text + len; p < end;) {
+    const char *line_end = memchr(p, '\n', (size_t)(end - p));
+    const char *next = line_end ? line_end + 1 : end;
+    const char *q = p;
+    int32_t times[PARSE_MAX_TAGS];
     int time_count = 0;
-    char *p = line;
-    char *text_start;
-    strip_cr(p);
-    parse_offset_tag(p, &offset_ms);
-
-    while (*p == '[' && time_count < 8) {
-      double t;
-      if (parse_time_tag(p, &t)) {
-        times[time_count++] = t;
-        p = strchr(p, ']');
-        if (!p) {
-          break;
-        }
-        p++;
-      } else {
-        break;
-      }
+    size_t tag_len;
+    size_t text_len;
+    uint32_t word_first = 0;
+    uint32_t word_count = 0;
+    int ok = 0;
+
+    if (!line_end) {
+      line_end = end;
+    }
+    if (line_end == p) {
+      p = next;
+      continue;
     }
+    if (line_end[-1] == '\r') {
+      line_end--;
+    }
+    scan_offset_tag(p, line_end, &offset_ms);
+    while (q < line_end && *q == '[' && time_count < PARSE_MAX_TAGS &&
+           (tag_len = scan_time_tag(q, line_end, ']', &times[time_count])) > 0) {
+      time_count++;
+      q += tag_len;
+    }
+    /* One line opening with a valid time tag makes the doc synced. */
+    timed = timed || time_count > 0;
 
-    text_start = p;
-    if (timed) {
-      int i;
-      if (time_count > 0) {
-        for (i = 0; i < time_count; i++) {
-          lyrics_line *next = (lyrics_line *)realloc(
-              doc->lines, sizeof(*doc->lines) * (doc->count + 1));
-          if (!next) {
-            break;
-          }
-          doc->lines = next;
-          doc->lines[doc->count].time = times[i];
-          doc->lines[doc->count].text = strdup(text_start);
-          doc->lines[doc->count].has_time = 1;
-          doc->count++;
-        }
+    if (time_count > 0) {
+      text_len = copy_words(q, line_end, times[0], arena + header + blob_used,
+                            &words, &word_first, &word_count);
+      if (text_len == (size_t)-1) {
+        break;
       }
     } else {
-      lyrics_line *next = (lyrics_line *)realloc(
-          doc->lines, sizeof(*doc->lines) * (doc->count + 1));
-      if (!next) {
-        break;
+      text_len = (size_t)(line_end - q);
+      memcpy(arena + header + blob_used, q, text_len);
+    }
+    arena[header + blob_used + text_len] = '\0';
+    if (time_count == 0) {
+      ok = list_add(&list, 0, blob_used, 0, 1);
+    }
+    for (i = 0; i < (size_t)time_count && ok == 0; i++) {
+      ok = list_add(&list, times[i], blob_used, 1, i == 0);
+      if (ok == 0) {
+        list.items[list.count - 1].word_first = word_first;
+        list.items[list.count - 1].word_count = word_count;
       }
-      doc->lines = next;
-      doc->lines[doc->count].time = 0.0;
-      doc->lines[doc->count].text = strdup(text_start);
-      doc->lines[doc->count].has_time = 0;
-      doc->count++;
     }
-
-    line = strtok_r(NULL, "\n", &saveptr);
+    if (ok != 0) {
+      break;
+    }
+    blob_used += text_len + 1;
+    p = next;
   }
 
-  free(copy);
+  /* Synced docs keep tagged lines only; plain ones keep one per line. */
+  for (i = 0; i < list.count; i++) {
+    parse_entry entry = list.items[i];
 
-  if (offset_ms != 0 && doc->count > 0) {
-    size_t i;
-    double shift = (double)offset_ms / 1000.0;
-    for (i = 0; i < doc->count; i++) {
-      if (doc->lines[i].has_time) {
-        doc->lines[i].time += shift;
-        if (doc->lines[i].time < 0.0) {
-          doc->lines[i].time = 0.0;
-        }
-      }
+    if (timed ? !entry.has_time : !entry.first) {
+      continue;
+    }
+    if (!timed) {
+      entry.time = 0;
+      entry.has_time = 0;
+    } else if (offset_ms != 0) {
+      long long shifted = (long long)entry.time + offset_ms;
+      entry.time = shifted < 0           ? 0
+                   : shifted > INT32_MAX ? INT32_MAX
+                                         : (int32_t)shifted;
     }
+    list.items[kept++] = entry;
+  }
+  if (timed && kept > 1) {
+    qsort(list.items, kept, sizeof(*list.items), compare_entries);
   }
 
-  if (doc->has_timestamps && doc->count > 1) {
-    qsort(doc->lines, doc->count, sizeof(*doc->lines), compare_lines);
+  lines_off = (header + blob_used + _Alignof(lyrics_line) - 1) &
+              ~(_Alignof(lyrics_line) - 1);
+  times_off = lines_off + kept * sizeof(lyrics_line);
+  words_off = (times_off + kept * sizeof(int32_t) + _Alignof(lyrics_word) - 1) &
+              ~(_Alignof(lyrics_word) - 1);
+  grown = (char *)realloc(arena, words_off + words.count * sizeof(lyrics_word));
+  if (!grown) {
+    free(arena);
+    free(list.items);
+    free(words.items);
+    return NULL;
+  }
+  arena = grown;
+  doc = (lyrics_doc *)arena;
+  memset(doc, 0, sizeof(*doc));
+  doc->lines = kept > 0 ? (lyrics_line *)(arena + lines_off) : NULL;
+  doc->times = kept > 0 ? (int32_t *)(arena + times_off) : NULL;
+  doc->count = kept;
+  doc->has_timestamps = timed;
+  doc->refs = 1;
+  doc->size = words_off + words.count * sizeof(lyrics_word);
+  for (i = 0; i < kept; i++) {
+    doc->times[i] = list.items[i].time;
+    doc->lines[i].text = arena + header + list.items[i].text_off;
+    doc->lines[i].has_time = list.items[i].has_time;
+    doc->lines[i].word_first = list.items[i].word_first;
+    doc->lines[i].word_count = list.items[i].word_count;
+  }
+  if (words.count > 0) {
+    doc->words = (lyrics_word *)(arena + words_off);
+    doc->word_count = words.count;
+    memcpy(doc->words, words.items, words.count * sizeof(lyrics_word));
   }
+  free(list.items);
+  free(words.items);
+  return doc;
+}
 
+lyrics_doc *lyrics_retain(lyrics_doc *doc) {
+  if (doc) {
+    pthread_mutex_lock(&g_refs_lock);
+    doc->refs++;
+    pthread_mutex_unlock(&g_refs_lock);
+  }
   return doc;
 }
 
 void lyrics_free(lyrics_doc *doc) {
-  size_t i;
+  int refs;
+
   if (!doc) {
     return;
   }
-  for (i = 0; i < doc->count; i++) {
-    free(doc->lines[i].text);
+  pthread_mutex_lock(&g_refs_lock);
+  refs = --doc->refs;
+  pthread_mutex_unlock(&g_refs_lock);
+  if (refs > 0) {
+    return;
+  }
+  if (doc->mapping) {
+    munmap(doc->mapping, doc->mapping_size);
   }
-  free(doc->lines);
   free(doc);
 }
 
-int lyrics_find_current(const lyrics_doc *doc, double elapsed) {
-  size_t i;
-  int current = -1;
+size_t lyrics_doc_size(const lyrics_doc *doc) {
+  if (!doc) {
+    return 0;
+  }
+  return doc->size + (doc->mapping ? doc->mapping_size : 0);
+}
 
+/* Forward steps the cursor takes before treating the jump as a seek. */
+#define CURSOR_MAX_STEPS 4
+
+/* Whole milliseconds reached at elapsed seconds, rounded down. */
+static int32_t elapsed_ms(double elapsed) {
+  double ms = elapsed * 1000.0;
+  long long whole;
+
+  if (ms >= (double)INT32_MAX) {
+    return INT32_MAX;
+  }
+  if (ms <= (double)INT32_MIN) {
+    return INT32_MIN;
+  }
+  whole = (long long)ms;
+  return (int32_t)(whole - (whole > ms));
+}
+
+/*
+ * Timed docs hold only timed lines, sorted; counts those reached. The
+ * halving step compiles to a conditional move, so the search does not
+ * branch on the data.
+ */
+static size_t lines_reached(const lyrics_doc *doc, int32_t ms) {
+  const int32_t *base = doc->times;
+  size_t n = doc->count;
+
+  while (n > 1) {
+    size_t half = n / 2;
+    base = base[half] <= ms ? base + half : base;
+    n -= half;
+  }
+  return (size_t)(base - doc->times) + (*base <= ms);
+}
+
+int lyrics_find_current(const lyrics_doc *doc, double elapsed) {
   if (!doc || !doc->has_timestamps || doc->count == 0) {
     return -1;
   }
+  return (int)lines_reached(doc, elapsed_ms(elapsed)) - 1;
+}
 
-  for (i = 0; i < doc->count; i++) {
-    if (doc->lines[i].has_time && doc->lines[i].time <= elapsed) {
-      current = (int)i;
-    } else if (doc->lines[i].has_time && doc->lines[i].time > elapsed) {
-      break;
+void lyrics_cursor_reset(lyrics_cursor *cursor) {
+  if (cursor) {
+    cursor->reached = 0;
+  }
+}
+
+int lyrics_cursor_find(lyrics_cursor *cursor, const lyrics_doc *doc,
+                       double elapsed, double *out_until_next) {
+  size_t reached;
+  int32_t ms;
+  int steps = 0;
+
+  if (out_until_next) {
+    *out_until_next = -1.0;
+  }
+  if (!cursor || !doc || !doc->has_timestamps || doc->count == 0) {
+    return -1;
+  }
+  ms = elapsed_ms(elapsed);
+  reached = cursor->reached;
+  if (reached > doc->count || (reached > 0 && doc->times[reached - 1] > ms)) {
+    reached = lines_reached(doc, ms);
+  } else {
+    while (reached < doc->count && doc->times[reached] <= ms) {
+      if (++steps > CURSOR_MAX_STEPS) {
+        reached = lines_reached(doc, ms);
+        break;
+      }
+      reached++;
     }
   }
+  cursor->reached = reached;
+  if (out_until_next && reached < doc->count) {
+    *out_until_next = (double)doc->times[reached] / 1000.0 - elapsed;
+  }
+  return (int)reached - 1;
+}
+
+/* Milliseconds into the line at which an open-ended last word stops. */
+static double open_word_end(const lyrics_doc *doc, size_t line) {
+  size_t i;
 
-  return current;
+  for (i = line + 1; i < doc->count; i++) {
+    if (doc->lines[i].has_time && doc->times[i] > doc->times[line]) {
+      return (double)doc->times[i] - (double)doc->times[line];
+    }
+  }
+  return -1.0;
+}
+
+int lyrics_active_word(const lyrics_doc *doc, int line, double elapsed,
+                       size_t *hint, double *out_progress) {
+  const lyrics_line *l;
+  const lyrics_word *words;
+  size_t i = hint ? *hint : 0;
+  double at;
+  double end;
+
+  if (out_progress) {
+    *out_progress = 0.0;
+  }
+  if (!doc || line < 0 || (size_t)line >= doc->count || !doc->words) {
+    return -1;
+  }
+  l = &doc->lines[line];
+  if (!l->has_time || l->word_count == 0) {
+    return -1;
+  }
+  words = doc->words + l->word_first;
+  at = elapsed * 1000.0 - (double)doc->times[line];
+  /* Starts never decrease, so only a seek back needs a rescan. */
+  if (i >= l->word_count || at < (double)words[i].start_ms) {
+    i = 0;
+  }
+  while (i + 1 < l->word_count && (double)words[i + 1].start_ms <= at) {
+    i++;
+  }
+  if (hint) {
+    *hint = i;
+  }
+  if (at < (double)words[i].start_ms) {
+    return -1;
+  }
+  end = words[i].end_ms == LYRICS_WORD_OPEN ? open_word_end(doc, (size_t)line)
+                                            : (double)words[i].end_ms;
+  if (out_progress) {
+    if (end <= (double)words[i].start_ms || at >= end) {
+      *out_progress = 1.0;
+    } else {
+      *out_progress = (at - (double)words[i].start_ms) /
+                      (end - (double)words[i].start_ms);
+    }
+  }
+  return (int)i;
 }
@@ -0,0 +1,139 @@
+#include "app/lyrics_gaps.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Forward steps a lookup takes before treating the jump as a seek. */
+#define GAPS_MAX_STEPS 4
+
+static int line_has_text(const char *text) {
+  const unsigned char *p = (const unsigned char *)text;
+  if (!p) {
+    return 0;
+  }
+  while (*p) {
+    if (!isspace(*p)) {
+      return 1;
+    }
+    p++;
+  }
+  return 0;
+}
+
+void lyrics_gaps_defaults(lyrics_gap_options *out) {
+  if (!out) {
+    return;
+  }
+  out->min_gap = 10.0;
+  out->lead_in = 2.0;
+  out->buffer = 1.0;
+  out->outro = 3.0;
+}
+
+static void span_add(lyrics_gaps *gaps, double start, double end) {
+  if (end > start) {
+    gaps->spans[gaps->count].start = start;
+    gaps->spans[gaps->count].end = end;
+    gaps->count++;
+  }
+}
+
+int lyrics_gaps_build(lyrics_gaps *gaps, const lyrics_doc *doc,
+                      const lyrics_gap_options *options) {
+  lyrics_gap_options defaults;
+  double prev_time = -1.0;
+  size_t texts = 0;
+  size_t i;
+
+  if (!gaps) {
+    return -1;
+  }
+  lyrics_gaps_free(gaps);
+  if (!doc || !doc->has_timestamps || doc->count == 0) {
+    return 0;
+  }
+  if (!options) {
+    lyrics_gaps_defaults(&defaults);
+    options = &defaults;
+  }
+  for (i = 0; i < doc->count; i++) {
+    if (doc->lines[i].has_time && line_has_text(doc->lines[i].text)) {
+      texts++;
+    }
+  }
+  if (texts == 0) {
+    return 0;
+  }
+  /* At most an intro, one gap between each pair of lines and an outro. */
+  gaps->spans = (lyrics_span *)malloc((texts + 1) * sizeof(*gaps->spans));
+  if (!gaps->spans) {
+    return -1;
+  }
+
+  for (i = 0; i < doc->count; i++) {
+    double time = (double)doc->times[i] / 1000.0;
+
+    if (!doc->lines[i].has_time || !line_has_text(doc->lines[i].text)) {
+      continue;
+    }
+    if (prev_time < 0.0) {
+      span_add(gaps, -HUGE_VAL, time - options->lead_in);
+    } else if (time - prev_time >= options->min_gap) {
+      double start = prev_time + options->buffer;
+      span_add(gaps, start,
+               fmax(start, time - options->lead_in - options->buffer));
+    }
+    prev_time = time;
+  }
+  span_add(gaps, prev_time + options->outro, HUGE_VAL);
+  return 0;
+}
+
+/* Spans ending at or before elapsed; they are sorted and disjoint. */
+static size_t spans_passed(const lyrics_gaps *gaps, double elapsed) {
+  size_t lo = 0;
+  size_t hi = gaps->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (gaps->spans[mid].end <= elapsed) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+int lyrics_gaps_contains(lyrics_gaps *gaps, double elapsed) {
+  size_t passed;
+  int steps = 0;
+
+  if (!gaps || gaps->count == 0) {
+    return 0;
+  }
+  passed = gaps->passed;
+  if (passed > gaps->count ||
+      (passed > 0 && gaps->spans[passed - 1].end > elapsed)) {
+    passed = spans_passed(gaps, elapsed);
+  } else {
+    while (passed < gaps->count && gaps->spans[passed].end <= elapsed) {
+      if (++steps > GAPS_MAX_STEPS) {
+        passed = spans_passed(gaps, elapsed);
+        break;
+      }
+      passed++;
+    }
+  }
+  gaps->passed = passed;
+  return passed < gaps->count && gaps->spans[passed].start <= elapsed;
+}
+
+void lyrics_gaps_free(lyrics_gaps *gaps) {
+  if (!gaps) {
+    return;
+  }
+  free(gaps->spans);
+  memset(gaps, 0, sizeof(*gaps));
+}
@@ -0,0 +1,383 @@
+#include "app/http.h"
+#include "app/log.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HTTP_POOL_SIZE 16
+#define HTTP_MAX_HOSTS 16
+
+/* Next free request slot per host when a rate limit is set. */
+typedef struct http_host_slot {
+  char host[128];
+  double next_ms;
+} http_host_slot;
+
+/*
+ * DNS and TLS sessions live in a process-wide share. libcurl does not
+ * support sharing one connection cache between concurrent threads, so live
+ * connections (and HTTP/2 multiplexing) are kept by a long-lived multi handle
+ * owned by each calling thread instead.
+ */
+typedef struct http_state {
+  pthread_mutex_t pool_lock;
+  pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+  pthread_key_t multi_key;
+  CURLSH *share;
+  CURL *pool[HTTP_POOL_SIZE];
+  size_t pool_count;
+  pthread_mutex_t rate_lock;
+  http_host_slot hosts[HTTP_MAX_HOSTS];
+  size_t host_count;
+  double rate_interval_ms;
+  int ready;
+} http_state;
+
+static http_state g_http = {
+    .pool_lock = PTHREAD_MUTEX_INITIALIZER,
+    .rate_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t g_http_once = PTHREAD_ONCE_INIT;
+
+static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  size_t total = size * nmemb;
+  http_buffer *buf = (http_buffer *)userdata;
+  char *next = (char *)realloc(buf->data, buf->size + total + 1);
+
+  if (!next) {
+    return 0;
+  }
+
+  buf->data = next;
+  memcpy(buf->data + buf->size, ptr, total);
+  buf->size += total;
+  buf->data[buf->size] = '\0';
+  return total;
+}
+
+static void share_lock(CURL *curl, curl_lock_data data,
+                       curl_lock_access access, void *userptr) {
+  (void)curl;
+  (void)access;
+  (void)userptr;
+  if (data >= 0 && data < CURL_LOCK_DATA_LAST) {
+    pthread_mutex_lock(&g_http.share_locks[data]);
+  }
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr) {
+  (void)curl;
+  (void)userptr;
+  if (data >= 0 && data < CURL_LOCK_DATA_LAST) {
+    pthread_mutex_unlock(&g_http.share_locks[data]);
+  }
+}
+
+static void multi_destroy(void *value) {
+  if (value) {
+    curl_multi_cleanup((CURLM *)value);
+  }
+}
+
+static void http_init_once(void) {
+  int i;
+
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
+    log_error("http: curl init failed");
+    return;
+  }
+  if (pthread_key_create(&g_http.multi_key, multi_destroy) != 0) {
+    log_error("http: thread key failed");
+    return;
+  }
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&g_http.share_locks[i], NULL);
+  }
+
+  g_http.share = curl_share_init();
+  if (g_http.share) {
+    curl_share_setopt(g_http.share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(g_http.share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(g_http.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_http.share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  g_http.ready = 1;
+}
+
+int http_init(void) {
+  pthread_once(&g_http_once, http_init_once);
+  return g_http.ready ? 0 : -1;
+}
+
+void http_shutdown(void) {
+  size_t i;
+
+  if (!g_http.ready) {
+    return;
+  }
+
+  multi_destroy(pthread_getspecific(g_http.multi_key));
+  pthread_setspecific(g_http.multi_key, NULL);
+
+  pthread_mutex_lock(&g_http.pool_lock);
+  for (i = 0; i < g_http.pool_count; i++) {
+    curl_easy_cleanup(g_http.pool[i]);
+  }
+  g_http.pool_count = 0;
+  pthread_mutex_unlock(&g_http.pool_lock);
+
+  if (g_http.share) {
+    curl_share_cleanup(g_http.share);
+    g_http.share = NULL;
+  }
+  g_http.ready = 0;
+  curl_global_cleanup();
+}
+
+CURLM *http_multi(void) {
+  CURLM *multi;
+
+  if (http_init() != 0) {
+    return NULL;
+  }
+
+  multi = (CURLM *)pthread_getspecific(g_http.multi_key);
+  if (multi) {
+    return multi;
+  }
+
+  multi = curl_multi_init();
+  if (!multi) {
+    return NULL;
+  }
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, 8L);
+  pthread_setspecific(g_http.multi_key, multi);
+  return multi;
+}
+
+CURL *http_acquire(void) {
+  CURL *curl = NULL;
+
+  if (http_init() != 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&g_http.pool_lock);
+  if (g_http.pool_count > 0) {
+    curl = g_http.pool[--g_http.pool_count];
+  }
+  pthread_mutex_unlock(&g_http.pool_lock);
+
+  if (!curl) {
+    curl = curl_easy_init();
+  }
+  return curl;
+}
+
+void http_release(CURL *curl) {
+  if (!curl) {
+    return;
+  }
+
+  curl_easy_reset(curl);
+  pthread_mutex_lock(&g_http.pool_lock);
+  if (g_http.pool_count < HTTP_POOL_SIZE) {
+    g_http.pool[g_http.pool_count++] = curl;
+    curl = NULL;
+  }
+  pthread_mutex_unlock(&g_http.pool_lock);
+
+  if (curl) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+void http_prepare(CURL *curl, const char *url, http_buffer *buf) {
+  if (!curl) {
+    return;
+  }
+  if (g_http.share) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, g_http.share);
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, buf);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "csong/0.1.0");
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+int http_get(const char *url, http_buffer *out, long *out_code) {
+  CURLM *multi = http_multi();
+  CURL *curl;
+  CURLMsg *msg;
+  CURLcode result = CURLE_FAILED_INIT;
+  int running = 1;
+  int left = 0;
+
+  if (!url || !out || !multi) {
+    return -1;
+  }
+  memset(out, 0, sizeof(*out));
+
+  http_throttle(url);
+  curl = http_acquire();
+  if (!curl) {
+    return -1;
+  }
+  http_prepare(curl, url, out);
+  if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+    http_release(curl);
+    return -1;
+  }
+
+  while (running) {
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      break;
+    }
+    if (running) {
+      curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+  }
+  while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+    if (msg->msg == CURLMSG_DONE && msg->easy_handle == curl) {
+      result = msg->data.result;
+    }
+  }
+
+  if (out_code) {
+    *out_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, out_code);
+  }
+  curl_multi_remove_handle(multi, curl);
+  http_release(curl);
+
+  if (result != CURLE_OK) {
+    log_error(curl_easy_strerror(result));
+    http_buffer_free(out);
+    return -1;
+  }
+  return 0;
+}
+
+void http_set_rate_limit(double per_second) {
+  pthread_mutex_lock(&g_http.rate_lock);
+  g_http.rate_interval_ms = per_second > 0.0 ? 1000.0 / per_second : 0.0;
+  pthread_mutex_unlock(&g_http.rate_lock);
+}
+
+static double monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static void url_host(const char *url, char *out, size_t out_size) {
+  const char *start = strstr(url, "://");
+  size_t len;
+
+  start = start ? start + 3 : url;
+  len = strcspn(start, "/?#");
+  snprintf(out, out_size, "%.*s", (int)len, start);
+}
+
+/*
+ * Reserves the next slot for the URL's host and sleeps until it is due, so
+ * concurrent callers are spaced rate_interval_ms apart per host. A bare
+ * name without a scheme is its own slot.
+ */
+void http_throttle(const char *url) {
+  char host[128];
+  http_host_slot *slot = NULL;
+  double now;
+  double wait = 0.0;
+  size_t i;
+
+  if (!url || g_http.rate_interval_ms <= 0.0) {
+    return;
+  }
+  url_host(url, host, sizeof(host));
+
+  pthread_mutex_lock(&g_http.rate_lock);
+  for (i = 0; i < g_http.host_count; i++) {
+    if (strcmp(g_http.hosts[i].host, host) == 0) {
+      slot = &g_http.hosts[i];
+      break;
+    }
+  }
+  if (!slot) {
+    slot = &g_http.hosts[g_http.host_count < HTTP_MAX_HOSTS
+                             ? g_http.host_count++
+                             : HTTP_MAX_HOSTS - 1];
+    snprintf(slot->host, sizeof(slot->host), "%s", host);
+    slot->next_ms = 0.0;
+  }
+  now = monotonic_ms();
+  if (slot->next_ms > now) {
+    wait = slot->next_ms - now;
+    slot->next_ms += g_http.rate_interval_ms;
+  } else {
+    slot->next_ms = now + g_http.rate_interval_ms;
+  }
+  pthread_mutex_unlock(&g_http.rate_lock);
+
+  if (wait > 0.0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(wait / 1000.0);
+    ts.tv_nsec = (long)((wait - (double)ts.tv_sec * 1000.0) * 1000000.0);
+    nanosleep(&ts, NULL);
+  }
+}
+
+void http_buffer_free(http_buffer *buf) {
+  if (!buf) {
+    return;
+  }
+  free(buf->data);
+  buf->data = NULL;
+  buf->size = 0;
+}
+
+char *http_escape(const char *text) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t len;
+  size_t i;
+  size_t o = 0;
+  char *out;
+
+  if (!text) {
+    return NULL;
+  }
+
+  len = strlen(text);
+  out = (char *)malloc(len * 3 + 1);
+  if (!out) {
+    return NULL;
+  }
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)text[i];
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+        c == '~') {
+      out[o++] = (char)c;
+    } else {
+      out[o++] = '%';
+      out[o++] = hex[c >> 4];
+      out[o++] = hex[c & 0x0F];
+    }
+  }
+  out[o] = '\0';
+  return out;
+}
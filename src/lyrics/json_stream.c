@@ -0,0 +1,437 @@
+#include "app/json_stream.h"
+#include "app/unicode.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { ST_VALUE = 0, ST_STRING, ST_PRIMITIVE };
+
+enum {
+  FIELD_NONE = 0,
+  FIELD_KEY,
+  FIELD_SYNCED,
+  FIELD_PLAIN,
+  FIELD_DURATION
+};
+
+#define NO_MATCH_DIFF 1e9
+#define UNKNOWN_DIFF 1e6
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return 10 + (c - 'a');
+  }
+  if (c >= 'A' && c <= 'F') {
+    return 10 + (c - 'A');
+  }
+  return -1;
+}
+
+char *json_unescape_range(const char *input, size_t len) {
+  size_t i;
+  size_t out_len = 0;
+  char *out;
+
+  if (!input) {
+    return NULL;
+  }
+
+  out = (char *)malloc(len + 1);
+  if (!out) {
+    return NULL;
+  }
+
+  for (i = 0; i < len; i++) {
+    char c = input[i];
+    if (c == '\\' && i + 1 < len) {
+      char n = input[++i];
+      switch (n) {
+        case 'n':
+          out[out_len++] = '\n';
+          break;
+        case 'r':
+          out[out_len++] = '\r';
+          break;
+        case 't':
+          out[out_len++] = '\t';
+          break;
+        case '\\':
+          out[out_len++] = '\\';
+          break;
+        case '"':
+          out[out_len++] = '"';
+          break;
+        case '/':
+          out[out_len++] = '/';
+          break;
+        case 'u':
+          if (i + 4 < len) {
+            int h1 = hex_value(input[i + 1]);
+            int h2 = hex_value(input[i + 2]);
+            int h3 = hex_value(input[i + 3]);
+            int h4 = hex_value(input[i + 4]);
+            uint32_t codepoint;
+            size_t wrote = 0;
+            char buffer[4];
+            if (h1 >= 0 && h2 >= 0 && h3 >= 0 && h4 >= 0) {
+              codepoint = (uint32_t)((h1 << 12) | (h2 << 8) | (h3 << 4) | h4);
+              i += 4;
+              if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                if (i + 6 < len && input[i + 1] == '\\' && input[i + 2] == 'u') {
+                  int l1 = hex_value(input[i + 3]);
+                  int l2 = hex_value(input[i + 4]);
+                  int l3 = hex_value(input[i + 5]);
+                  int l4 = hex_value(input[i + 6]);
+                  if (l1 >= 0 && l2 >= 0 && l3 >= 0 && l4 >= 0) {
+                    uint32_t low = (uint32_t)((l1 << 12) | (l2 << 8) | (l3 << 4) | l4);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                      codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                      i += 6;
+                    }
+                  }
+                }
+              }
+              if (unicode_encode_utf8(codepoint, buffer, &wrote) == 0) {
+                size_t j;
+                for (j = 0; j < wrote; j++) {
+                  out[out_len++] = buffer[j];
+                }
+                break;
+              }
+            }
+          }
+          out[out_len++] = '?';
+          break;
+        default:
+          out[out_len++] = n;
+          break;
+      }
+    } else {
+      out[out_len++] = c;
+    }
+  }
+
+  out[out_len] = '\0';
+  return out;
+}
+
+static int raw_append(json_raw *raw, const char *data, size_t len) {
+  if (raw->len + len > raw->cap) {
+    size_t cap = raw->cap ? raw->cap : 4096;
+    char *next;
+    while (cap < raw->len + len) {
+      cap *= 2;
+    }
+    next = (char *)realloc(raw->data, cap);
+    if (!next) {
+      return -1;
+    }
+    raw->data = next;
+    raw->cap = cap;
+  }
+  memcpy(raw->data + raw->len, data, len);
+  raw->len += len;
+  return 0;
+}
+
+static void raw_swap(json_raw *a, json_raw *b) {
+  json_raw tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static int key_is(const json_stream *js, const char *name) {
+  size_t len = strlen(name);
+  return js->key_len == len && memcmp(js->key, name, len) == 0;
+}
+
+static int at_record(const json_stream *js) {
+  return js->depth > 0 && js->depth == js->record_depth &&
+         js->in_object[js->depth - 1];
+}
+
+static void begin_record(json_stream *js) {
+  js->cur_synced.len = 0;
+  js->cur_plain.len = 0;
+  js->duration = 0.0;
+  js->has_duration = 0;
+}
+
+/*
+ * Candidates are ranked by distance to the target duration; the first one
+ * wins ties. Strict mode (lrclib /get) rejects a record whose duration is
+ * more than 3 seconds off.
+ */
+static void end_record(json_stream *js) {
+  double diff = UNKNOWN_DIFF;
+
+  if (js->has_duration && js->target_duration > 0.0 && js->duration > 0.0) {
+    diff = fabs(js->target_duration - js->duration);
+    if (js->strict_duration && diff > 3.0) {
+      return;
+    }
+  }
+  if (js->cur_synced.len > 0 && diff < js->best_synced_diff) {
+    raw_swap(&js->cur_synced, &js->best_synced);
+    js->best_synced_diff = diff;
+  }
+  if (js->cur_plain.len > 0 && diff < js->best_plain_diff) {
+    raw_swap(&js->cur_plain, &js->best_plain);
+    js->best_plain_diff = diff;
+  }
+}
+
+static void finish_primitive(json_stream *js) {
+  if (js->field == FIELD_DURATION && js->number_len > 0 &&
+      js->number_len < sizeof(js->number)) {
+    char *end;
+    double value;
+    js->number[js->number_len] = '\0';
+    value = strtod(js->number, &end);
+    if (end != js->number) {
+      js->duration = value;
+      js->has_duration = 1;
+    }
+  }
+  js->field = FIELD_NONE;
+  js->state = ST_VALUE;
+}
+
+static void string_bytes(json_stream *js, const char *data, size_t len) {
+  json_raw *target = NULL;
+
+  switch (js->field) {
+    case FIELD_KEY:
+      if (js->key_len + len <= sizeof(js->key)) {
+        memcpy(js->key + js->key_len, data, len);
+        js->key_len += len;
+      } else {
+        js->key_len = sizeof(js->key) + 1;
+      }
+      return;
+    case FIELD_SYNCED:
+      target = &js->cur_synced;
+      break;
+    case FIELD_PLAIN:
+      target = &js->cur_plain;
+      break;
+    default:
+      return;
+  }
+  if (raw_append(target, data, len) != 0) {
+    js->failed = 1;
+  }
+}
+
+static void begin_string(json_stream *js) {
+  js->state = ST_STRING;
+  js->escape = 0;
+  if (js->depth > 0 && js->in_object[js->depth - 1] && js->expect_key) {
+    js->field = FIELD_KEY;
+    js->key_len = 0;
+    return;
+  }
+  js->field = FIELD_NONE;
+  if (!at_record(js)) {
+    return;
+  }
+  if (key_is(js, "syncedLyrics")) {
+    js->field = FIELD_SYNCED;
+    js->cur_synced.len = 0;
+  } else if (key_is(js, "plainLyrics") || key_is(js, "lyrics")) {
+    js->field = FIELD_PLAIN;
+    js->cur_plain.len = 0;
+  }
+}
+
+static void open_container(json_stream *js, int is_object) {
+  if (js->depth >= JSON_STREAM_MAX_DEPTH) {
+    js->failed = 1;
+    return;
+  }
+  js->in_object[js->depth++] = (unsigned char)is_object;
+  js->expect_key = is_object;
+  if (js->record_depth == 0) {
+    js->record_depth = is_object ? 1 : 2;
+  }
+  if (is_object && js->depth == js->record_depth) {
+    begin_record(js);
+  }
+}
+
+static void close_container(json_stream *js) {
+  if (js->depth == 0) {
+    js->failed = 1;
+    return;
+  }
+  if (at_record(js)) {
+    end_record(js);
+  }
+  js->depth--;
+  js->expect_key = 0;
+}
+
+void json_stream_init(json_stream *js, double target_duration,
+                      int strict_duration) {
+  memset(js, 0, sizeof(*js));
+  js->target_duration = target_duration;
+  js->strict_duration = strict_duration;
+  js->best_synced_diff = NO_MATCH_DIFF;
+  js->best_plain_diff = NO_MATCH_DIFF;
+}
+
+int json_stream_feed(json_stream *js, const char *data, size_t len) {
+  size_t i = 0;
+
+  while (i < len && !js->failed) {
+    char c = data[i];
+
+    if (js->state == ST_STRING) {
+      size_t start = i;
+      if (js->escape) {
+        js->escape = 0;
+        string_bytes(js, data + i, 1);
+        i++;
+        continue;
+      }
+      while (i < len && data[i] != '"' && data[i] != '\\') {
+        i++;
+      }
+      if (i > start) {
+        string_bytes(js, data + start, i - start);
+      }
+      if (i == len) {
+        break;
+      }
+      if (data[i] == '\\') {
+        js->escape = 1;
+        string_bytes(js, data + i, 1);
+      } else {
+        js->state = ST_VALUE;
+        if (js->field != FIELD_KEY) {
+          js->field = FIELD_NONE;
+        }
+      }
+      i++;
+      continue;
+    }
+
+    if (js->state == ST_PRIMITIVE) {
+      if (c == ',' || c == '}' || c == ']' || c == ' ' || c == '\t' ||
+          c == '\n' || c == '\r') {
+        finish_primitive(js);
+        continue;
+      }
+      if (js->number_len < sizeof(js->number)) {
+        js->number[js->number_len++] = c;
+      }
+      i++;
+      continue;
+    }
+
+    switch (c) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        break;
+      case '{':
+        open_container(js, 1);
+        break;
+      case '[':
+        open_container(js, 0);
+        break;
+      case '}':
+      case ']':
+        close_container(js);
+        break;
+      case ':':
+        js->expect_key = 0;
+        break;
+      case ',':
+        js->expect_key = js->depth > 0 && js->in_object[js->depth - 1];
+        break;
+      case '"':
+        begin_string(js);
+        break;
+      default:
+        js->state = ST_PRIMITIVE;
+        js->number_len = 0;
+        js->field =
+            at_record(js) && key_is(js, "duration") ? FIELD_DURATION : FIELD_NONE;
+        continue;
+    }
+    i++;
+  }
+
+  return js->failed ? -1 : 0;
+}
+
+size_t json_stream_write_cb(char *ptr, size_t size, size_t nmemb,
+                            void *userdata) {
+  size_t total = size * nmemb;
+
+  if (json_stream_feed((json_stream *)userdata, ptr, total) != 0) {
+    return 0;
+  }
+  return total;
+}
+
+static char *unescape_raw(const json_raw *raw) {
+  char *text = json_unescape_range(raw->data, raw->len);
+
+  if (text && text[0] == '\0') {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+int json_stream_finish(json_stream *js, char **out_text, int *out_timed) {
+  char *text;
+
+  if (!js || !out_text || !out_timed) {
+    return -1;
+  }
+  *out_text = NULL;
+  *out_timed = 0;
+  if (js->state == ST_PRIMITIVE && js->depth == 0) {
+    finish_primitive(js);
+  }
+  if (js->failed || js->state != ST_VALUE || js->depth != 0 ||
+      js->record_depth == 0) {
+    return -1;
+  }
+
+  if (js->best_synced.len > 0) {
+    text = unescape_raw(&js->best_synced);
+    if (text) {
+      *out_text = text;
+      *out_timed = 1;
+      return 0;
+    }
+  }
+  if (js->best_plain.len > 0) {
+    text = unescape_raw(&js->best_plain);
+    if (text) {
+      *out_text = text;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void json_stream_free(json_stream *js) {
+  if (!js) {
+    return;
+  }
+  free(js->cur_synced.data);
+  free(js->cur_plain.data);
+  free(js->best_synced.data);
+  free(js->best_plain.data);
+  memset(js, 0, sizeof(*js));
+}
@@ -0,0 +1,109 @@
+#include "app/http.h"
+#include "app/lyrics_provider.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int build_get_url(const char *artist, const char *title, char *out,
+                         size_t out_size) {
+  char *artist_enc;
+  char *title_enc;
+
+  if (!artist || !title || !out || out_size == 0) {
+    return -1;
+  }
+
+  title_enc = http_escape(title);
+  artist_enc = http_escape(artist);
+  if (!title_enc || !artist_enc) {
+    free(title_enc);
+    free(artist_enc);
+    return -1;
+  }
+
+  snprintf(out, out_size,
+           "https://lrclib.net/api/get?track_name=%s&artist_name=%s",
+           title_enc, artist_enc);
+  free(artist_enc);
+  free(title_enc);
+  return 0;
+}
+
+static int build_search_url(const char *artist, const char *title, char *out,
+                            size_t out_size) {
+  char *artist_enc = NULL;
+  char *title_enc;
+
+  if (!title || !out || out_size == 0) {
+    return -1;
+  }
+
+  title_enc = http_escape(title);
+  if (!title_enc) {
+    return -1;
+  }
+
+  if (artist && artist[0] != '\0' && strcasecmp(artist, "Unknown Artist") != 0) {
+    artist_enc = http_escape(artist);
+  }
+
+  if (artist_enc) {
+    snprintf(out, out_size,
+             "https://lrclib.net/api/search?track_name=%s&artist_name=%s",
+             title_enc, artist_enc);
+    free(artist_enc);
+  } else {
+    snprintf(out, out_size, "https://lrclib.net/api/search?track_name=%s",
+             title_enc);
+  }
+
+  free(title_enc);
+  return 0;
+}
+
+/* /api/get returns a single record that must match the track duration. */
+static void begin_get(json_stream *js, double duration) {
+  json_stream_init(js, duration, 1);
+}
+
+/* /api/search returns an array; the record closest in duration wins. */
+static void begin_search(json_stream *js, double duration) {
+  json_stream_init(js, duration, 0);
+}
+
+static int finish_get(json_stream *js, char **out_text, int *out_timed,
+                      int *out_tier) {
+  if (json_stream_finish(js, out_text, out_timed) != 0) {
+    return -1;
+  }
+  *out_tier = *out_timed ? LYRICS_TIER_GET_SYNCED : LYRICS_TIER_PLAIN;
+  return 0;
+}
+
+static int finish_search(json_stream *js, char **out_text, int *out_timed,
+                         int *out_tier) {
+  if (json_stream_finish(js, out_text, out_timed) != 0) {
+    return -1;
+  }
+  *out_tier = *out_timed ? LYRICS_TIER_SEARCH_SYNCED : LYRICS_TIER_PLAIN;
+  return 0;
+}
+
+const lyrics_provider lrclib_get_provider = {
+    .name = "lrclib-get",
+    .caps = LYRICS_CAP_SYNCED | LYRICS_CAP_PLAIN | LYRICS_CAP_NEEDS_ARTIST,
+    .best_tier = LYRICS_TIER_GET_SYNCED,
+    .build_url = build_get_url,
+    .begin = begin_get,
+    .finish = finish_get,
+};
+
+const lyrics_provider lrclib_search_provider = {
+    .name = "lrclib-search",
+    .caps = LYRICS_CAP_SYNCED | LYRICS_CAP_PLAIN,
+    .best_tier = LYRICS_TIER_SEARCH_SYNCED,
+    .build_url = build_search_url,
+    .begin = begin_search,
+    .finish = finish_search,
+};
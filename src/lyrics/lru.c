@@ -0,0 +1,264 @@
+#include "app/lyrics_lru.h"
+#include "app/normalize.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LRU_BUCKETS 256
+#define LRU_KEY_SIZE 512
+#define LRU_DEFAULT_BUDGET (8u << 20)
+
+typedef struct lru_entry {
+  struct lru_entry *chain;
+  struct lru_entry *prev;
+  struct lru_entry *next;
+  uint64_t hash;
+  char *key;
+  lyrics_doc *doc;
+  size_t bytes;
+} lru_entry;
+
+/* Chained hash for lookup plus a recency list; head is most recent. */
+typedef struct lru_state {
+  pthread_mutex_t lock;
+  lru_entry *buckets[LRU_BUCKETS];
+  lru_entry *head;
+  lru_entry *tail;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} lru_state;
+
+static lru_state g_lru = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .budget = LRU_DEFAULT_BUDGET,
+};
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 1469598103934665603ULL;
+
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static lru_entry **find_slot(const char *key, uint64_t hash) {
+  lru_entry **slot = &g_lru.buckets[hash % LRU_BUCKETS];
+
+  while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) {
+    slot = &(*slot)->chain;
+  }
+  return slot;
+}
+
+static void unlink_entry(lru_entry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    g_lru.head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    g_lru.tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void push_front(lru_entry *entry) {
+  entry->next = g_lru.head;
+  entry->prev = NULL;
+  if (g_lru.head) {
+    g_lru.head->prev = entry;
+  }
+  g_lru.head = entry;
+  if (!g_lru.tail) {
+    g_lru.tail = entry;
+  }
+}
+
+/* Unlinks the entry; the doc is released by the caller outside the lock. */
+static lyrics_doc *remove_entry(lru_entry *entry) {
+  lru_entry **slot = find_slot(entry->key, entry->hash);
+  lyrics_doc *doc = entry->doc;
+
+  *slot = entry->chain;
+  unlink_entry(entry);
+  g_lru.entries--;
+  g_lru.bytes -= entry->bytes;
+  free(entry->key);
+  free(entry);
+  return doc;
+}
+
+/* Collects evicted docs into out so they are released after unlocking. */
+static size_t evict_locked(lyrics_doc **out, size_t max) {
+  size_t count = 0;
+
+  while (g_lru.tail && g_lru.bytes > g_lru.budget && count < max) {
+    out[count++] = remove_entry(g_lru.tail);
+    g_lru.evictions++;
+  }
+  return count;
+}
+
+static void release_all(lyrics_doc **docs, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    lyrics_free(docs[i]);
+  }
+}
+
+lyrics_doc *lyrics_lru_get(const char *artist, const char *title) {
+  char key[LRU_KEY_SIZE];
+  lru_entry *entry;
+  lyrics_doc *doc = NULL;
+
+  if (normalize_track_key(artist, title, key, sizeof(key)) != 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&g_lru.lock);
+  entry = *find_slot(key, hash_key(key));
+  if (entry) {
+    unlink_entry(entry);
+    push_front(entry);
+    doc = lyrics_retain(entry->doc);
+    g_lru.hits++;
+  } else {
+    g_lru.misses++;
+  }
+  pthread_mutex_unlock(&g_lru.lock);
+  return doc;
+}
+
+void lyrics_lru_put(const char *artist, const char *title, lyrics_doc *doc) {
+  char key[LRU_KEY_SIZE];
+  lyrics_doc *evicted[16];
+  lyrics_doc *replaced = NULL;
+  lru_entry **slot;
+  lru_entry *entry;
+  uint64_t hash;
+  size_t bytes;
+  size_t count;
+
+  if (!doc || g_lru.budget == 0 ||
+      normalize_track_key(artist, title, key, sizeof(key)) != 0) {
+    return;
+  }
+  bytes = lyrics_doc_size(doc) + strlen(key) + 1 + sizeof(*entry);
+  hash = hash_key(key);
+
+  pthread_mutex_lock(&g_lru.lock);
+  if (bytes > g_lru.budget) {
+    pthread_mutex_unlock(&g_lru.lock);
+    return;
+  }
+  slot = find_slot(key, hash);
+  entry = *slot;
+  if (entry) {
+    if (entry->doc != doc) {
+      replaced = entry->doc;
+      entry->doc = lyrics_retain(doc);
+      g_lru.bytes = g_lru.bytes - entry->bytes + bytes;
+      entry->bytes = bytes;
+    }
+    unlink_entry(entry);
+    push_front(entry);
+  } else {
+    entry = (lru_entry *)calloc(1, sizeof(*entry));
+    if (entry) {
+      entry->key = strdup(key);
+    }
+    if (!entry || !entry->key) {
+      free(entry);
+      pthread_mutex_unlock(&g_lru.lock);
+      return;
+    }
+    entry->hash = hash;
+    entry->doc = lyrics_retain(doc);
+    entry->bytes = bytes;
+    entry->chain = g_lru.buckets[hash % LRU_BUCKETS];
+    g_lru.buckets[hash % LRU_BUCKETS] = entry;
+    push_front(entry);
+    g_lru.entries++;
+    g_lru.bytes += bytes;
+  }
+  count = evict_locked(evicted, sizeof(evicted) / sizeof(evicted[0]));
+  pthread_mutex_unlock(&g_lru.lock);
+
+  lyrics_free(replaced);
+  release_all(evicted, count);
+}
+
+void lyrics_lru_forget(const char *artist, const char *title) {
+  char key[LRU_KEY_SIZE];
+
+  if (normalize_track_key(artist, title, key, sizeof(key)) == 0) {
+    lyrics_lru_forget_key(key);
+  }
+}
+
+void lyrics_lru_forget_key(const char *key) {
+  lru_entry *entry;
+  lyrics_doc *doc = NULL;
+
+  if (!key) {
+    return;
+  }
+  pthread_mutex_lock(&g_lru.lock);
+  entry = *find_slot(key, hash_key(key));
+  if (entry) {
+    doc = remove_entry(entry);
+  }
+  pthread_mutex_unlock(&g_lru.lock);
+  lyrics_free(doc);
+}
+
+void lyrics_lru_set_budget(size_t bytes) {
+  lyrics_doc *evicted[16];
+  size_t count;
+
+  do {
+    pthread_mutex_lock(&g_lru.lock);
+    g_lru.budget = bytes;
+    count = evict_locked(evicted, sizeof(evicted) / sizeof(evicted[0]));
+    pthread_mutex_unlock(&g_lru.lock);
+    release_all(evicted, count);
+  } while (count > 0);
+}
+
+void lyrics_lru_stats_get(lyrics_lru_stats *out) {
+  if (!out) {
+    return;
+  }
+  pthread_mutex_lock(&g_lru.lock);
+  out->hits = g_lru.hits;
+  out->misses = g_lru.misses;
+  out->evictions = g_lru.evictions;
+  out->entries = g_lru.entries;
+  out->bytes = g_lru.bytes;
+  out->budget = g_lru.budget;
+  pthread_mutex_unlock(&g_lru.lock);
+}
+
+void lyrics_lru_clear(void) {
+  lyrics_doc *doc;
+
+  for (;;) {
+    pthread_mutex_lock(&g_lru.lock);
+    doc = g_lru.tail ? remove_entry(g_lru.tail) : NULL;
+    pthread_mutex_unlock(&g_lru.lock);
+    if (!doc) {
+      break;
+    }
+    lyrics_free(doc);
+  }
+}
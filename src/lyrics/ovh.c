@@ -0,0 +1,52 @@
+#include "app/http.h"
+#include "app/lyrics_provider.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int build_url(const char *artist, const char *title, char *out,
+                     size_t out_size) {
+  char *artist_enc;
+  char *title_enc;
+
+  if (!artist || !title || !out || out_size == 0) {
+    return -1;
+  }
+
+  artist_enc = http_escape(artist);
+  title_enc = http_escape(title);
+  if (!artist_enc || !title_enc) {
+    free(artist_enc);
+    free(title_enc);
+    return -1;
+  }
+
+  snprintf(out, out_size, "https://api.lyrics.ovh/v1/%s/%s", artist_enc,
+           title_enc);
+  free(artist_enc);
+  free(title_enc);
+  return 0;
+}
+
+static void begin(json_stream *js, double duration) {
+  json_stream_init(js, duration, 0);
+}
+
+/* lyrics.ovh only has plain text under "lyrics". */
+static int finish(json_stream *js, char **out_text, int *out_timed,
+                  int *out_tier) {
+  if (json_stream_finish(js, out_text, out_timed) != 0) {
+    return -1;
+  }
+  *out_timed = 0;
+  *out_tier = LYRICS_TIER_OVH;
+  return 0;
+}
+
+const lyrics_provider ovh_provider = {
+    .name = "ovh",
+    .caps = LYRICS_CAP_PLAIN | LYRICS_CAP_NEEDS_ARTIST,
+    .best_tier = LYRICS_TIER_OVH,
+    .build_url = build_url,
+    .begin = begin,
+    .finish = finish,
+};
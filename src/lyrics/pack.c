@@ -0,0 +1,1109 @@
+#include "app/lyrics_pack.h"
+#include "app/log.h"
+#include "app/lyrics.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 8
+#define PACK_RECORD_MAGIC 0x52505343u
+#define PACK_SEGMENT_MAX (8u << 20)
+#define PACK_BATCH_RECORDS 32
+#define PACK_BATCH_BYTES (256u << 10)
+#define PACK_LINGER_MS 500
+#define PACK_MAX_SEGMENTS 256
+#define PACK_KEY_SIZE 512
+#define PACK_STEM_SIZE 256
+
+/*
+ * Segment layout: "CSPK" + u32 version, then records of
+ * { magic, flags, stem_len, raw_size, comp_size, crc32 } + stem + zlib data.
+ * The stem is the flat-file name without extension, so the index can be
+ * rebuilt from segments exactly as from files.
+ */
+typedef struct pack_record {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t stem_len;
+  uint32_t raw_size;
+  uint32_t comp_size;
+  uint32_t crc;
+} pack_record;
+
+typedef struct pack_pending {
+  char key[PACK_KEY_SIZE];
+  char stem[PACK_STEM_SIZE];
+  pack_record record;
+  char *text;
+  unsigned char *data;
+} pack_pending;
+
+typedef struct pack_segment {
+  unsigned int id;
+  unsigned char *map;
+  size_t map_size;
+  unsigned long records;
+  unsigned long dead;
+} pack_segment;
+
+typedef struct pack_state {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int opened;
+  int stopping;
+  int compact_requested;
+  int thread_started;
+  pthread_t thread;
+  pack_segment segments[PACK_MAX_SEGMENTS];
+  size_t segment_count;
+  unsigned int active_id;
+  int active_fd;
+  uint64_t active_size;
+  pack_pending pending[PACK_BATCH_RECORDS];
+  size_t pending_count;
+  size_t pending_bytes;
+  struct timespec pending_until;
+} pack_state;
+
+static pack_state g_pack = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .active_fd = -1,
+};
+
+static void segment_name(unsigned int id, char *out, size_t out_size) {
+  snprintf(out, out_size, "pack/%06u.seg", id);
+}
+
+static int segment_path(unsigned int id, char *out, size_t out_size) {
+  char name[32];
+
+  segment_name(id, name, sizeof(name));
+  return lyrics_cache_path(name, out, out_size);
+}
+
+static int parse_segment_id(const char *name, unsigned int *out) {
+  unsigned int id;
+  char tail;
+
+  if (strncmp(name, "pack/", 5) == 0) {
+    name += 5;
+  }
+  if (sscanf(name, "%u.se%c", &id, &tail) != 2 || tail != 'g' ||
+      strlen(name) != 10) {
+    return -1;
+  }
+  *out = id;
+  return 0;
+}
+
+static pack_segment *find_segment(unsigned int id) {
+  size_t i;
+
+  for (i = 0; i < g_pack.segment_count; i++) {
+    if (g_pack.segments[i].id == id) {
+      return &g_pack.segments[i];
+    }
+  }
+  return NULL;
+}
+
+static pack_segment *add_segment(unsigned int id) {
+  pack_segment *seg = find_segment(id);
+  size_t i;
+
+  if (seg) {
+    return seg;
+  }
+  if (g_pack.segment_count == PACK_MAX_SEGMENTS) {
+    return NULL;
+  }
+  i = g_pack.segment_count++;
+  while (i > 0 && g_pack.segments[i - 1].id > id) {
+    g_pack.segments[i] = g_pack.segments[i - 1];
+    i--;
+  }
+  memset(&g_pack.segments[i], 0, sizeof(g_pack.segments[i]));
+  g_pack.segments[i].id = id;
+  return &g_pack.segments[i];
+}
+
+static void drop_segment_locked(unsigned int id) {
+  pack_segment *seg = find_segment(id);
+  size_t i;
+
+  if (!seg) {
+    return;
+  }
+  if (seg->map) {
+    munmap(seg->map, seg->map_size);
+  }
+  for (i = (size_t)(seg - g_pack.segments); i + 1 < g_pack.segment_count; i++) {
+    g_pack.segments[i] = g_pack.segments[i + 1];
+  }
+  g_pack.segment_count--;
+}
+
+/* Segments only grow, so a mapping is replaced once a record lies past it. */
+static int map_segment_locked(pack_segment *seg, size_t need) {
+  char path[512];
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (seg->map && seg->map_size >= need) {
+    return 0;
+  }
+  if (seg->map) {
+    munmap(seg->map, seg->map_size);
+    seg->map = NULL;
+    seg->map_size = 0;
+  }
+  if (segment_path(seg->id, path, sizeof(path)) != 0) {
+    return -1;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < need ||
+      (size_t)st.st_size < PACK_HEADER_SIZE) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  seg->map = (unsigned char *)map;
+  seg->map_size = (size_t)st.st_size;
+  return 0;
+}
+
+static int header_valid(const unsigned char *data) {
+  uint32_t version;
+
+  memcpy(&version, data + 4, sizeof(version));
+  return memcmp(data, "CSPK", 4) == 0 && version == PACK_VERSION;
+}
+
+/* Returns the record length at off, or 0 when the bytes there are not one. */
+static size_t record_at(const unsigned char *data, size_t size, size_t off,
+                        pack_record *out) {
+  size_t len;
+
+  if (off + sizeof(*out) > size) {
+    return 0;
+  }
+  memcpy(out, data + off, sizeof(*out));
+  len = sizeof(*out) + (size_t)out->stem_len + (size_t)out->comp_size;
+  if (out->magic != PACK_RECORD_MAGIC || out->stem_len == 0 ||
+      out->stem_len >= PACK_STEM_SIZE || off + len > size) {
+    return 0;
+  }
+  return len;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int create_segment_locked(unsigned int id) {
+  char path[512];
+  unsigned char header[PACK_HEADER_SIZE];
+  uint32_t version = PACK_VERSION;
+  int fd;
+
+  if (!add_segment(id) || segment_path(id, path, sizeof(path)) != 0) {
+    return -1;
+  }
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd < 0) {
+    drop_segment_locked(id);
+    return -1;
+  }
+  memcpy(header, "CSPK", 4);
+  memcpy(header + 4, &version, sizeof(version));
+  if (write_all(fd, header, sizeof(header)) != 0) {
+    close(fd);
+    drop_segment_locked(id);
+    return -1;
+  }
+  if (g_pack.active_fd >= 0) {
+    close(g_pack.active_fd);
+  }
+  g_pack.active_fd = fd;
+  g_pack.active_id = id;
+  g_pack.active_size = PACK_HEADER_SIZE;
+  return 0;
+}
+
+/*
+ * Reopens the newest segment for appending. A torn record left by a crash
+ * is cut off so new records land on a clean boundary.
+ */
+static int resume_segment_locked(unsigned int id) {
+  pack_segment *seg = find_segment(id);
+  char path[512];
+  pack_record record;
+  size_t off = PACK_HEADER_SIZE;
+  size_t len;
+  int fd;
+
+  if (!seg || segment_path(id, path, sizeof(path)) != 0 ||
+      map_segment_locked(seg, PACK_HEADER_SIZE) != 0 ||
+      !header_valid(seg->map) || seg->map_size >= PACK_SEGMENT_MAX) {
+    return -1;
+  }
+  while ((len = record_at(seg->map, seg->map_size, off, &record)) > 0) {
+    off += len;
+  }
+  fd = open(path, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    return -1;
+  }
+  if (off < seg->map_size) {
+    log_error("lyrics: dropping torn record at the end of a pack segment");
+    munmap(seg->map, seg->map_size);
+    seg->map = NULL;
+    seg->map_size = 0;
+    if (ftruncate(fd, (off_t)off) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  g_pack.active_fd = fd;
+  g_pack.active_id = id;
+  g_pack.active_size = off;
+  return 0;
+}
+
+static void *compact_main(void *arg);
+
+static int open_locked(void) {
+  char dir[512];
+  struct dirent *ent;
+  DIR *handle;
+
+  if (g_pack.opened) {
+    return g_pack.active_fd >= 0 ? 0 : -1;
+  }
+  g_pack.opened = 1;
+  if (lyrics_cache_prepare() != 0 ||
+      lyrics_cache_path("pack", dir, sizeof(dir)) != 0 ||
+      (mkdir(dir, 0700) != 0 && errno != EEXIST)) {
+    return -1;
+  }
+  handle = opendir(dir);
+  if (!handle) {
+    return -1;
+  }
+  while ((ent = readdir(handle)) != NULL) {
+    unsigned int id;
+    if (parse_segment_id(ent->d_name, &id) == 0) {
+      add_segment(id);
+    }
+  }
+  closedir(handle);
+
+  if (g_pack.segment_count == 0 ||
+      resume_segment_locked(g_pack.segments[g_pack.segment_count - 1].id) !=
+          0) {
+    unsigned int next = g_pack.segment_count
+                            ? g_pack.segments[g_pack.segment_count - 1].id + 1
+                            : 1;
+    if (create_segment_locked(next) != 0) {
+      log_error("lyrics: cannot create pack segment");
+      return -1;
+    }
+  }
+  if (pthread_create(&g_pack.thread, NULL, compact_main, NULL) == 0) {
+    g_pack.thread_started = 1;
+  }
+  return 0;
+}
+
+int lyrics_pack_open(void) {
+  int result;
+
+  pthread_mutex_lock(&g_pack.lock);
+  result = open_locked();
+  pthread_mutex_unlock(&g_pack.lock);
+  return result;
+}
+
+static void pending_free(pack_pending *p) {
+  free(p->text);
+  free(p->data);
+  p->text = NULL;
+  p->data = NULL;
+}
+
+static size_t record_size(const pack_record *record) {
+  return sizeof(*record) + record->stem_len + record->comp_size;
+}
+
+/* Counts a record that the index no longer points at. */
+static void mark_dead_locked(unsigned int id) {
+  pack_segment *seg = find_segment(id);
+
+  if (!seg) {
+    return;
+  }
+  seg->dead++;
+  if (id != g_pack.active_id && seg->dead * 2 > seg->records) {
+    g_pack.compact_requested = 1;
+    pthread_cond_signal(&g_pack.wake);
+  }
+}
+
+static void index_record_locked(const char *key, unsigned int id,
+                                 uint64_t offset, const pack_record *record) {
+  cache_index_entry entry;
+  cache_index_entry old;
+  unsigned int old_id;
+
+  memset(&entry, 0, sizeof(entry));
+  segment_name(id, entry.name, sizeof(entry.name));
+  entry.offset = offset;
+  entry.size = record->raw_size;
+  entry.flags = record->flags | CACHE_INDEX_PACKED;
+
+  /* A rebuild during the lookup may already have indexed this very record. */
+  if (cache_index_lookup(key, &old) == 0 && (old.flags & CACHE_INDEX_PACKED) &&
+      parse_segment_id(old.name, &old_id) == 0 &&
+      (old_id != id || old.offset != offset)) {
+    if ((old.flags & CACHE_INDEX_TIMED) && !(entry.flags & CACHE_INDEX_TIMED)) {
+      mark_dead_locked(id);
+      return;
+    }
+    mark_dead_locked(old_id);
+  }
+  cache_index_put(key, &entry);
+}
+
+/*
+ * Writes the whole batch with one write per segment and a single fdatasync,
+ * then publishes the records in the index.
+ */
+static void linger_deadline(struct timespec *until) {
+  clock_gettime(CLOCK_REALTIME, until);
+  until->tv_nsec += PACK_LINGER_MS * 1000000L;
+  if (until->tv_nsec >= 1000000000L) {
+    until->tv_sec++;
+    until->tv_nsec -= 1000000000L;
+  }
+}
+
+static int flush_locked(void) {
+  unsigned char *buffer;
+  uint64_t offsets[PACK_BATCH_RECORDS];
+  unsigned int ids[PACK_BATCH_RECORDS];
+  size_t used = 0;
+  size_t i;
+  int result = 0;
+
+  if (g_pack.pending_count == 0) {
+    return 0;
+  }
+  if (g_pack.active_fd < 0) {
+    return -1;
+  }
+  buffer = (unsigned char *)malloc(g_pack.pending_bytes);
+  if (!buffer) {
+    return -1;
+  }
+  for (i = 0; i < g_pack.pending_count && result == 0; i++) {
+    const pack_pending *p = &g_pack.pending[i];
+    size_t len = record_size(&p->record);
+
+    if (g_pack.active_size + used + len > PACK_SEGMENT_MAX &&
+        g_pack.active_size + used > PACK_HEADER_SIZE) {
+      if (write_all(g_pack.active_fd, buffer, used) != 0) {
+        result = -1;
+        break;
+      }
+      fdatasync(g_pack.active_fd);
+      g_pack.active_size += used;
+      used = 0;
+      if (create_segment_locked(g_pack.active_id + 1) != 0) {
+        result = -1;
+        break;
+      }
+    }
+    ids[i] = g_pack.active_id;
+    offsets[i] = g_pack.active_size + used;
+    memcpy(buffer + used, &p->record, sizeof(p->record));
+    memcpy(buffer + used + sizeof(p->record), p->stem, p->record.stem_len);
+    memcpy(buffer + used + sizeof(p->record) + p->record.stem_len, p->data,
+           p->record.comp_size);
+    used += len;
+  }
+  if (result == 0 && used > 0) {
+    if (write_all(g_pack.active_fd, buffer, used) != 0) {
+      result = -1;
+    } else {
+      fdatasync(g_pack.active_fd);
+      g_pack.active_size += used;
+    }
+  }
+  free(buffer);
+  if (result != 0) {
+    log_error("lyrics: cannot write pack segment");
+    return -1;
+  }
+
+  for (i = 0; i < g_pack.pending_count; i++) {
+    pack_pending *p = &g_pack.pending[i];
+    pack_segment *seg = find_segment(ids[i]);
+
+    if (seg) {
+      seg->records++;
+    }
+    if (p->key[0] != '\0') {
+      index_record_locked(p->key, ids[i], offsets[i], &p->record);
+    }
+    pending_free(p);
+  }
+  g_pack.pending_count = 0;
+  g_pack.pending_bytes = 0;
+  return 0;
+}
+
+int lyrics_pack_flush(void) {
+  int result;
+
+  pthread_mutex_lock(&g_pack.lock);
+  result = flush_locked();
+  pthread_mutex_unlock(&g_pack.lock);
+  return result;
+}
+
+int lyrics_pack_put(const char *key, const char *stem, const char *text,
+                    int timed) {
+  pack_pending next;
+  uLongf comp_size;
+  size_t raw_size;
+  size_t i;
+  int result = 0;
+
+  if (!stem || stem[0] == '\0' || !text ||
+      strlen(stem) >= PACK_STEM_SIZE ||
+      (key && strlen(key) >= PACK_KEY_SIZE)) {
+    return -1;
+  }
+  raw_size = strlen(text);
+  if (raw_size > UINT32_MAX / 2) {
+    return -1;
+  }
+
+  memset(&next, 0, sizeof(next));
+  snprintf(next.key, sizeof(next.key), "%s", key ? key : "");
+  snprintf(next.stem, sizeof(next.stem), "%s", stem);
+  comp_size = compressBound((uLong)raw_size);
+  next.data = (unsigned char *)malloc(comp_size);
+  next.text = strdup(text);
+  if (!next.data || !next.text ||
+      compress2(next.data, &comp_size, (const Bytef *)text, (uLong)raw_size,
+                Z_DEFAULT_COMPRESSION) != Z_OK) {
+    pending_free(&next);
+    return -1;
+  }
+  next.record.magic = PACK_RECORD_MAGIC;
+  next.record.flags = timed ? CACHE_INDEX_TIMED : 0;
+  next.record.stem_len = (uint32_t)strlen(stem);
+  next.record.raw_size = (uint32_t)raw_size;
+  next.record.comp_size = (uint32_t)comp_size;
+  next.record.crc = (uint32_t)crc32(0L, (const Bytef *)text, (uInt)raw_size);
+
+  pthread_mutex_lock(&g_pack.lock);
+  if (open_locked() != 0) {
+    pthread_mutex_unlock(&g_pack.lock);
+    pending_free(&next);
+    return -1;
+  }
+  for (i = 0; i < g_pack.pending_count; i++) {
+    pack_pending *p = &g_pack.pending[i];
+    if (next.key[0] != '\0' && strcmp(p->key, next.key) == 0 &&
+        (!(p->record.flags & CACHE_INDEX_TIMED) || timed)) {
+      g_pack.pending_bytes -= record_size(&p->record);
+      pending_free(p);
+      *p = next;
+      g_pack.pending_bytes += record_size(&next.record);
+      pthread_mutex_unlock(&g_pack.lock);
+      return 0;
+    }
+  }
+  if (g_pack.pending_count == PACK_BATCH_RECORDS) {
+    result = flush_locked();
+  }
+  if (g_pack.pending_count < PACK_BATCH_RECORDS) {
+    if (g_pack.pending_count == 0) {
+      linger_deadline(&g_pack.pending_until);
+      pthread_cond_signal(&g_pack.wake);
+    }
+    g_pack.pending[g_pack.pending_count++] = next;
+    g_pack.pending_bytes += record_size(&next.record);
+  } else {
+    pending_free(&next);
+    result = -1;
+  }
+  /* Without the compaction thread nothing would flush a partial batch. */
+  if (g_pack.pending_count == PACK_BATCH_RECORDS ||
+      g_pack.pending_bytes >= PACK_BATCH_BYTES || !g_pack.thread_started) {
+    result = flush_locked();
+  }
+  pthread_mutex_unlock(&g_pack.lock);
+  return result;
+}
+
+char *lyrics_pack_pending(const char *key, int *out_timed) {
+  char *text = NULL;
+  size_t i;
+
+  if (!key) {
+    return NULL;
+  }
+  pthread_mutex_lock(&g_pack.lock);
+  for (i = 0; i < g_pack.pending_count; i++) {
+    if (strcmp(g_pack.pending[i].key, key) == 0) {
+      text = strdup(g_pack.pending[i].text);
+      if (out_timed) {
+        *out_timed = (g_pack.pending[i].record.flags & CACHE_INDEX_TIMED) != 0;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_pack.lock);
+  return text;
+}
+
+static char *inflate_record(const unsigned char *data, const pack_record *record) {
+  uLongf raw_size = record->raw_size;
+  char *text = (char *)malloc((size_t)record->raw_size + 1);
+
+  if (!text) {
+    return NULL;
+  }
+  if (uncompress((Bytef *)text, &raw_size, data, record->comp_size) != Z_OK ||
+      raw_size != record->raw_size ||
+      (uint32_t)crc32(0L, (const Bytef *)text, (uInt)raw_size) != record->crc) {
+    free(text);
+    log_error("lyrics: corrupt record in pack segment");
+    return NULL;
+  }
+  text[raw_size] = '\0';
+  return text;
+}
+
+char *lyrics_pack_read(const cache_index_entry *entry) {
+  return lyrics_pack_read_stem(entry, NULL, 0);
+}
+
+char *lyrics_pack_read_stem(const cache_index_entry *entry, char *stem,
+                            size_t stem_size) {
+  pack_segment *seg;
+  pack_record record;
+  unsigned int id;
+  char *text = NULL;
+  size_t off;
+
+  if (!entry || parse_segment_id(entry->name, &id) != 0) {
+    return NULL;
+  }
+  off = (size_t)entry->offset;
+  pthread_mutex_lock(&g_pack.lock);
+  seg = find_segment(id);
+  if (!seg && !g_pack.opened) {
+    open_locked();
+    seg = find_segment(id);
+  }
+  if (seg && map_segment_locked(seg, off + sizeof(record)) == 0) {
+    /* The record may extend past a mapping made before it was appended. */
+    memcpy(&record, seg->map + off, sizeof(record));
+    if (record.magic == PACK_RECORD_MAGIC &&
+        map_segment_locked(seg, off + record_size(&record)) == 0 &&
+        record_at(seg->map, seg->map_size, off, &record) > 0 &&
+        record.raw_size == entry->size) {
+      text = inflate_record(seg->map + off + sizeof(record) + record.stem_len,
+                            &record);
+      if (text && stem && stem_size > 0) {
+        size_t len = record.stem_len < stem_size ? record.stem_len
+                                                 : stem_size - 1;
+        memcpy(stem, seg->map + off + sizeof(record), len);
+        stem[len] = '\0';
+      }
+    }
+  }
+  pthread_mutex_unlock(&g_pack.lock);
+  return text;
+}
+
+void lyrics_pack_release(const cache_index_entry *entry) {
+  unsigned int id;
+
+  if (!entry || parse_segment_id(entry->name, &id) != 0) {
+    return;
+  }
+  pthread_mutex_lock(&g_pack.lock);
+  if (!g_pack.opened) {
+    open_locked();
+  }
+  mark_dead_locked(id);
+  pthread_mutex_unlock(&g_pack.lock);
+}
+
+static int list_segments(unsigned int *ids, size_t max, size_t *out_count) {
+  char dir[512];
+  struct dirent *ent;
+  DIR *handle;
+  size_t count = 0;
+
+  *out_count = 0;
+  if (lyrics_cache_path("pack", dir, sizeof(dir)) != 0) {
+    return -1;
+  }
+  handle = opendir(dir);
+  if (!handle) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  while ((ent = readdir(handle)) != NULL && count < max) {
+    unsigned int id;
+    size_t j;
+
+    if (parse_segment_id(ent->d_name, &id) != 0) {
+      continue;
+    }
+    j = count++;
+    while (j > 0 && ids[j - 1] > id) {
+      ids[j] = ids[j - 1];
+      j--;
+    }
+    ids[j] = id;
+  }
+  closedir(handle);
+  *out_count = count;
+  return 0;
+}
+
+/*
+ * Walks every record of every segment in write order without taking the
+ * pack lock, so the index can call it while rebuilding.
+ */
+int lyrics_pack_scan(lyrics_pack_scan_fn fn, void *ctx) {
+  unsigned int ids[PACK_MAX_SEGMENTS];
+  size_t count;
+  size_t i;
+  int result = 0;
+
+  if (!fn || list_segments(ids, PACK_MAX_SEGMENTS, &count) != 0) {
+    return -1;
+  }
+  for (i = 0; i < count && result == 0; i++) {
+    char path[512];
+    struct stat st;
+    unsigned char *map;
+    pack_record record;
+    size_t off = PACK_HEADER_SIZE;
+    size_t len;
+    int fd;
+
+    if (segment_path(ids[i], path, sizeof(path)) != 0 ||
+        (fd = open(path, O_RDONLY)) < 0) {
+      continue;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < PACK_HEADER_SIZE) {
+      close(fd);
+      continue;
+    }
+    map = (unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ,
+                                MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      continue;
+    }
+    if (!header_valid(map)) {
+      log_error("lyrics: skipping pack segment with unknown version");
+      munmap(map, (size_t)st.st_size);
+      continue;
+    }
+    while (result == 0 &&
+           (len = record_at(map, (size_t)st.st_size, off, &record)) > 0) {
+      cache_index_entry entry;
+      char stem[PACK_STEM_SIZE];
+
+      memcpy(stem, map + off + sizeof(record), record.stem_len);
+      stem[record.stem_len] = '\0';
+      memset(&entry, 0, sizeof(entry));
+      segment_name(ids[i], entry.name, sizeof(entry.name));
+      entry.offset = off;
+      entry.size = record.raw_size;
+      entry.flags = (record.flags & CACHE_INDEX_TIMED) | CACHE_INDEX_PACKED;
+      result = fn(ctx, stem, &entry);
+      off += len;
+    }
+    munmap(map, (size_t)st.st_size);
+  }
+  return result;
+}
+
+typedef struct live_check {
+  const char *name;
+  uint64_t offset;
+  char keys[4][PACK_KEY_SIZE];
+  size_t count;
+} live_check;
+
+static int collect_live_key(void *ctx, const char *key) {
+  live_check *check = (live_check *)ctx;
+  cache_index_entry entry;
+
+  if (check->count < 4 && cache_index_lookup(key, &entry) == 0 &&
+      entry.offset == check->offset && strcmp(entry.name, check->name) == 0) {
+    snprintf(check->keys[check->count++], PACK_KEY_SIZE, "%s", key);
+  }
+  return 0;
+}
+
+/*
+ * Copies the records of one segment that the index still points at to the
+ * active segment, repoints the index and deletes the segment. With copy
+ * unset it only counts live and dead records.
+ */
+static int walk_segment(unsigned int id, int copy) {
+  unsigned char *buffer = NULL;
+  size_t buffer_size = 0;
+  size_t off = PACK_HEADER_SIZE;
+  unsigned long records = 0;
+  unsigned long dead = 0;
+  int result = 0;
+
+  for (;;) {
+    pack_segment *seg;
+    pack_record record;
+    live_check check;
+    char stem[PACK_STEM_SIZE];
+    char name[32];
+    size_t len;
+    size_t i;
+
+    pthread_mutex_lock(&g_pack.lock);
+    seg = find_segment(id);
+    len = 0;
+    if (seg && !g_pack.stopping &&
+        map_segment_locked(seg, off + sizeof(record)) == 0) {
+      len = record_at(seg->map, seg->map_size, off, &record);
+    }
+    if (len > buffer_size) {
+      unsigned char *next = (unsigned char *)realloc(buffer, len);
+      if (next) {
+        buffer = next;
+        buffer_size = len;
+      } else {
+        len = 0;
+        result = -1;
+      }
+    }
+    if (len > 0) {
+      memcpy(buffer, seg->map + off, len);
+    }
+    pthread_mutex_unlock(&g_pack.lock);
+    if (len == 0) {
+      break;
+    }
+
+    memcpy(stem, buffer + sizeof(record), record.stem_len);
+    stem[record.stem_len] = '\0';
+    segment_name(id, name, sizeof(name));
+    memset(&check, 0, sizeof(check));
+    check.name = name;
+    check.offset = off;
+    cache_index_stem_keys(stem, collect_live_key, &check);
+    records++;
+    if (check.count == 0) {
+      dead++;
+    } else if (copy) {
+      pthread_mutex_lock(&g_pack.lock);
+      if (g_pack.active_size + len > PACK_SEGMENT_MAX) {
+        create_segment_locked(g_pack.active_id + 1);
+      }
+      if (write_all(g_pack.active_fd, buffer, len) == 0) {
+        uint64_t new_off = g_pack.active_size;
+        pack_segment *active = find_segment(g_pack.active_id);
+
+        g_pack.active_size += len;
+        if (active) {
+          active->records++;
+        }
+        for (i = 0; i < check.count; i++) {
+          cache_index_entry entry;
+          /* A store may have repointed the key since the check above. */
+          if (cache_index_lookup(check.keys[i], &entry) != 0 ||
+              entry.offset != off || strcmp(entry.name, name) != 0) {
+            continue;
+          }
+          segment_name(g_pack.active_id, entry.name, sizeof(entry.name));
+          entry.offset = new_off;
+          cache_index_put(check.keys[i], &entry);
+        }
+      } else {
+        result = -1;
+      }
+      pthread_mutex_unlock(&g_pack.lock);
+    }
+    off += len;
+    if (result != 0) {
+      break;
+    }
+  }
+  free(buffer);
+
+  pthread_mutex_lock(&g_pack.lock);
+  if (!copy) {
+    pack_segment *seg = find_segment(id);
+    if (seg) {
+      seg->records = records;
+      seg->dead = dead;
+    }
+  } else if (result == 0 && !g_pack.stopping) {
+    char path[512];
+    fdatasync(g_pack.active_fd);
+    drop_segment_locked(id);
+    if (segment_path(id, path, sizeof(path)) == 0) {
+      remove(path);
+    }
+  }
+  pthread_mutex_unlock(&g_pack.lock);
+  return result;
+}
+
+static int next_compaction(unsigned int *out) {
+  size_t i;
+
+  for (i = 0; i < g_pack.segment_count; i++) {
+    const pack_segment *seg = &g_pack.segments[i];
+    if (seg->id != g_pack.active_id && seg->dead * 2 > seg->records) {
+      *out = seg->id;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *compact_main(void *arg) {
+  unsigned int ids[PACK_MAX_SEGMENTS];
+  size_t count = 0;
+  int compacting = 1;
+  size_t i;
+
+  (void)arg;
+  /* Dead counts are not persisted; recount them once per run. */
+  pthread_mutex_lock(&g_pack.lock);
+  for (i = 0; i < g_pack.segment_count; i++) {
+    if (g_pack.segments[i].id != g_pack.active_id) {
+      ids[count++] = g_pack.segments[i].id;
+    }
+  }
+  pthread_mutex_unlock(&g_pack.lock);
+  for (i = 0; i < count; i++) {
+    walk_segment(ids[i], 0);
+  }
+
+  pthread_mutex_lock(&g_pack.lock);
+  while (!g_pack.stopping) {
+    unsigned int id;
+
+    /* A partial batch lingers briefly so a crash loses at most that much. */
+    if (g_pack.pending_count > 0) {
+      if (pthread_cond_timedwait(&g_pack.wake, &g_pack.lock,
+                                 &g_pack.pending_until) == ETIMEDOUT &&
+          g_pack.pending_count > 0 && flush_locked() != 0) {
+        linger_deadline(&g_pack.pending_until);
+      }
+      continue;
+    }
+    if (!compacting || !next_compaction(&id)) {
+      g_pack.compact_requested = 0;
+      pthread_cond_wait(&g_pack.wake, &g_pack.lock);
+      continue;
+    }
+    pthread_mutex_unlock(&g_pack.lock);
+    if (walk_segment(id, 1) != 0) {
+      log_error("lyrics: pack compaction failed");
+      compacting = 0;
+    }
+    pthread_mutex_lock(&g_pack.lock);
+  }
+  pthread_mutex_unlock(&g_pack.lock);
+  return NULL;
+}
+
+void lyrics_pack_close(void) {
+  size_t i;
+
+  pthread_mutex_lock(&g_pack.lock);
+  if (!g_pack.opened) {
+    pthread_mutex_unlock(&g_pack.lock);
+    return;
+  }
+  flush_locked();
+  g_pack.stopping = 1;
+  pthread_cond_broadcast(&g_pack.wake);
+  pthread_mutex_unlock(&g_pack.lock);
+  if (g_pack.thread_started) {
+    pthread_join(g_pack.thread, NULL);
+    g_pack.thread_started = 0;
+  }
+
+  pthread_mutex_lock(&g_pack.lock);
+  for (i = 0; i < g_pack.segment_count; i++) {
+    if (g_pack.segments[i].map) {
+      munmap(g_pack.segments[i].map, g_pack.segments[i].map_size);
+    }
+  }
+  g_pack.segment_count = 0;
+  if (g_pack.active_fd >= 0) {
+    close(g_pack.active_fd);
+  }
+  g_pack.active_fd = -1;
+  g_pack.opened = 0;
+  g_pack.stopping = 0;
+  pthread_mutex_unlock(&g_pack.lock);
+}
+
+typedef struct migrate_list {
+  char (*names)[256];
+  size_t count;
+  size_t cap;
+} migrate_list;
+
+static int has_ext(const char *name, const char *ext) {
+  size_t len = strlen(name);
+  return len > 4 && strcmp(name + len - 4, ext) == 0;
+}
+
+static int migrate_one(const char *dir, const char *name, migrate_list *list) {
+  char path[768];
+  char stem[PACK_STEM_SIZE];
+  struct stat st;
+  FILE *file;
+  char *text;
+  size_t len = strlen(name) - 4;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if (len >= sizeof(stem) || strlen(name) >= sizeof(list->names[0]) ||
+      stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  text = (char *)malloc((size_t)st.st_size + 1);
+  file = fopen(path, "rb");
+  if (!text || !file ||
+      fread(text, 1, (size_t)st.st_size, file) != (size_t)st.st_size) {
+    free(text);
+    if (file) {
+      fclose(file);
+    }
+    return 0;
+  }
+  fclose(file);
+  text[st.st_size] = '\0';
+  memcpy(stem, name, len);
+  stem[len] = '\0';
+  if (lyrics_pack_put(NULL, stem, text, has_ext(name, ".lrc")) != 0) {
+    free(text);
+    return -1;
+  }
+  free(text);
+
+  if (list->count == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 256;
+    char(*names)[256] = realloc(list->names, cap * sizeof(*names));
+    if (!names) {
+      return -1;
+    }
+    list->names = names;
+    list->cap = cap;
+  }
+  snprintf(list->names[list->count++], sizeof(list->names[0]), "%s", name);
+  return 0;
+}
+
+/*
+ * Imports the flat "Artist - Title.lrc/.txt" files into pack segments,
+ * removes them (and their binary sidecars) once the segments are synced and
+ * rebuilds the index.
+ */
+int lyrics_pack_migrate(void) {
+  char dir[512];
+  struct dirent *ent;
+  migrate_list list;
+  DIR *handle;
+  size_t len;
+  size_t i;
+  int result = 0;
+
+  if (lyrics_pack_open() != 0 || lyrics_cache_path("", dir, sizeof(dir)) != 0) {
+    return -1;
+  }
+  len = strlen(dir);
+  if (len > 1 && dir[len - 1] == '/') {
+    dir[len - 1] = '\0';
+  }
+  handle = opendir(dir);
+  if (!handle) {
+    return -1;
+  }
+  memset(&list, 0, sizeof(list));
+  while (result == 0 && (ent = readdir(handle)) != NULL) {
+    if (ent->d_name[0] == '.' ||
+        (!has_ext(ent->d_name, ".lrc") && !has_ext(ent->d_name, ".txt"))) {
+      continue;
+    }
+    result = migrate_one(dir, ent->d_name, &list);
+  }
+  closedir(handle);
+  if (result == 0) {
+    result = lyrics_pack_flush();
+  }
+
+  if (result == 0) {
+    for (i = 0; i < list.count; i++) {
+      char path[768];
+      snprintf(path, sizeof(path), "%s/%s", dir, list.names[i]);
+      remove(path);
+      snprintf(path, sizeof(path), "%s/%sb", dir, list.names[i]);
+      remove(path);
+    }
+    printf("migrate: packed %lu files\n", (unsigned long)list.count);
+    result = cache_index_rebuild();
+  } else {
+    log_error("lyrics: cache migration failed, flat files kept");
+  }
+  free(list.names);
+  return result;
+}
@@ -1,711 +1,448 @@
 #include "app/lyrics.h"
+#include "app/http.h"
 #include "app/log.h"
-#include "app/unicode.h"
-#include <curl/curl.h>
-#include <math.h>
+#include "app/lyrics_provider.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+
+#define DEFAULT_BUDGET_MS 8000L
+#define MIN_HEDGE_MS 200.0
+
+/*
+ * Every lookup gets one deadline. All allowed variants of every provider are
+ * issued immediately. When a provider's first variant is still running past
+ * that provider's own p90 latency, one duplicate of it goes out as a hedge
+ * and whichever copy answers first wins. Whatever is still running at the
+ * deadline is dropped.
+ */
+typedef struct fetch_settings {
+  long budget_ms;
+  int log_timings;
+} fetch_settings;
+
+static fetch_settings g_fetch = {
+    .budget_ms = DEFAULT_BUDGET_MS,
+};
+
+/* Response bodies are never buffered; the JSON is parsed as it arrives. */
+typedef struct fetch_attempt {
+  CURL *curl;
+  json_stream json;
+  const lyrics_provider *provider;
+  const lyrics_query *query;
+  size_t variant;
+  int best_score;
+  int primary;
+  int hedge;
+  int launched;
+  int active;
+  double started_at;
+  double hedge_at;
+  struct fetch_attempt *twin;
+} fetch_attempt;
+
+void lyrics_set_budget(long budget_ms) {
+  g_fetch.budget_ms = budget_ms > 0 ? budget_ms : DEFAULT_BUDGET_MS;
+}
 
-#define JSMN_STATIC
-#include "jsmn.h"
-
-typedef struct http_buffer {
-  char *data;
-  size_t size;
-} http_buffer;
-
-static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
-  size_t total = size * nmemb;
-  http_buffer *buf = (http_buffer *)userdata;
-  char *next = (char *)realloc(buf->data, buf->size + total + 1);
-
-  if (!next) {
-    return 0;
-  }
+void lyrics_set_log_timings(int enabled) {
+  g_fetch.log_timings = enabled;
+}
 
-  buf->data = next;
-  memcpy(buf->data + buf->size, ptr, total);
-  buf->size += total;
-  buf->data[buf->size] = '\0';
-  return total;
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
 }
 
-static int hex_value(char c) {
-  if (c >= '0' && c <= '9') {
-    return c - '0';
-  }
-  if (c >= 'a' && c <= 'f') {
-    return 10 + (c - 'a');
-  }
-  if (c >= 'A' && c <= 'F') {
-    return 10 + (c - 'A');
-  }
-  return -1;
+static int has_known_artist(const char *artist) {
+  return artist && artist[0] != '\0' && strcasecmp(artist, "Unknown Artist") != 0;
 }
 
-static char *json_unescape_range(const char *input, size_t len) {
-  size_t i;
-  size_t out_len = 0;
-  char *out;
+static int attempt_launch(CURLM *multi, fetch_attempt *attempt,
+                          double duration, long timeout_ms) {
+  const char *artist = attempt->query->artist ? attempt->query->artist : "";
+  char url[1024];
 
-  if (!input) {
-    return NULL;
+  attempt->launched = 1;
+  attempt->started_at = now_ms();
+  if (attempt->provider->build_url(artist, attempt->query->title, url,
+                                   sizeof(url)) != 0) {
+    return -1;
   }
-
-  out = (char *)malloc(len + 1);
-  if (!out) {
-    return NULL;
+  attempt->curl = http_acquire();
+  if (!attempt->curl) {
+    return -1;
   }
-
-  for (i = 0; i < len; i++) {
-    char c = input[i];
-    if (c == '\\' && i + 1 < len) {
-      char n = input[++i];
-      switch (n) {
-        case 'n':
-          out[out_len++] = '\n';
-          break;
-        case 'r':
-          out[out_len++] = '\r';
-          break;
-        case 't':
-          out[out_len++] = '\t';
-          break;
-        case '\\':
-          out[out_len++] = '\\';
-          break;
-        case '"':
-          out[out_len++] = '"';
-          break;
-        case '/':
-          out[out_len++] = '/';
-          break;
-        case 'u':
-          if (i + 4 < len) {
-            int h1 = hex_value(input[i + 1]);
-            int h2 = hex_value(input[i + 2]);
-            int h3 = hex_value(input[i + 3]);
-            int h4 = hex_value(input[i + 4]);
-            uint32_t codepoint;
-            size_t wrote = 0;
-            char buffer[4];
-            if (h1 >= 0 && h2 >= 0 && h3 >= 0 && h4 >= 0) {
-              codepoint = (uint32_t)((h1 << 12) | (h2 << 8) | (h3 << 4) | h4);
-              i += 4;
-              if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
-                if (i + 6 < len && input[i + 1] == '\\' && input[i + 2] == 'u') {
-                  int l1 = hex_value(input[i + 3]);
-                  int l2 = hex_value(input[i + 4]);
-                  int l3 = hex_value(input[i + 5]);
-                  int l4 = hex_value(input[i + 6]);
-                  if (l1 >= 0 && l2 >= 0 && l3 >= 0 && l4 >= 0) {
-                    uint32_t low = (uint32_t)((l1 << 12) | (l2 << 8) | (l3 << 4) | l4);
-                    if (low >= 0xDC00 && low <= 0xDFFF) {
-                      codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
-                      i += 6;
-                    }
-                  }
-                }
-              }
-              if (unicode_encode_utf8(codepoint, buffer, &wrote) == 0) {
-                size_t j;
-                for (j = 0; j < wrote; j++) {
-                  out[out_len++] = buffer[j];
-                }
-                break;
-              }
-            }
-          }
-          out[out_len++] = '?';
-          break;
-        default:
-          out[out_len++] = n;
-          break;
-      }
-    } else {
-      out[out_len++] = c;
-    }
+  attempt->provider->begin(&attempt->json, duration);
+  http_prepare(attempt->curl, url, NULL);
+  curl_easy_setopt(attempt->curl, CURLOPT_WRITEFUNCTION, json_stream_write_cb);
+  curl_easy_setopt(attempt->curl, CURLOPT_WRITEDATA, &attempt->json);
+  curl_easy_setopt(attempt->curl, CURLOPT_PRIVATE, attempt);
+  curl_easy_setopt(attempt->curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  if (curl_multi_add_handle(multi, attempt->curl) != CURLM_OK) {
+    http_release(attempt->curl);
+    attempt->curl = NULL;
+    json_stream_free(&attempt->json);
+    return -1;
   }
-
-  out[out_len] = '\0';
-  return out;
+  attempt->active = 1;
+  return 0;
 }
 
-static int json_token_equal(const char *json, const jsmntok_t *tok,
-                            const char *text) {
-  size_t len;
-
-  if (!json || !tok || !text || tok->type != JSMN_STRING) {
-    return 0;
+static provider_outcome attempt_outcome(CURLcode result, long http_code,
+                                        int found) {
+  if (result == CURLE_OPERATION_TIMEDOUT) {
+    return PROVIDER_TIMEOUT;
   }
-
-  len = strlen(text);
-  if ((size_t)(tok->end - tok->start) != len) {
-    return 0;
+  if (result != CURLE_OK || http_code >= 500 || http_code == 429) {
+    return PROVIDER_ERROR;
   }
-
-  return strncmp(json + tok->start, text, len) == 0;
+  return found ? PROVIDER_HIT : PROVIDER_MISS;
 }
 
-static int json_token_is_null(const char *json, const jsmntok_t *tok) {
-  size_t len;
-
-  if (!json || !tok || tok->type != JSMN_PRIMITIVE) {
-    return 0;
+static void attempt_finish(CURLM *multi, fetch_attempt *attempt) {
+  if (!attempt->curl) {
+    return;
   }
-
-  len = (size_t)(tok->end - tok->start);
-  if (len != 4) {
-    return 0;
-  }
-
-  return strncmp(json + tok->start, "null", 4) == 0;
+  curl_multi_remove_handle(multi, attempt->curl);
+  http_release(attempt->curl);
+  attempt->curl = NULL;
+  attempt->active = 0;
+  json_stream_free(&attempt->json);
 }
 
-static int json_token_next(const jsmntok_t *tokens, int index) {
-  int i;
-  int count;
-
-  if (!tokens || index < 0) {
-    return index + 1;
-  }
-
-  switch (tokens[index].type) {
-    case JSMN_OBJECT:
-      count = tokens[index].size;
-      i = index + 1;
-      for (; count > 0; count--) {
-        i = json_token_next(tokens, i);
-        i = json_token_next(tokens, i);
-      }
-      return i;
-    case JSMN_ARRAY:
-      count = tokens[index].size;
-      i = index + 1;
-      for (; count > 0; count--) {
-        i = json_token_next(tokens, i);
-      }
-      return i;
-    default:
-      return index + 1;
-  }
+static double stage_ms(CURL *curl, CURLINFO info) {
+  curl_off_t us = 0;
+  curl_easy_getinfo(curl, info, &us);
+  return (double)us / 1000.0;
 }
 
-static int json_obj_get(const char *json, const jsmntok_t *tokens, int obj_index,
-                        const char *key, int *out_index) {
-  int i;
-  int count;
+static void log_attempt_timings(const fetch_attempt *attempt, long http_code,
+                                provider_outcome outcome) {
+  static const char *outcomes[] = {"hit", "miss", "error", "timeout"};
+  char msg[256];
+
+  snprintf(msg, sizeof(msg),
+           "lyrics: %s v%lu%s dns=%.0fms connect=%.0fms tls=%.0fms "
+           "ttfb=%.0fms total=%.0fms http=%ld %s",
+           attempt->provider->name, (unsigned long)attempt->variant,
+           attempt->hedge ? " (hedge)" : "",
+           stage_ms(attempt->curl, CURLINFO_NAMELOOKUP_TIME_T),
+           stage_ms(attempt->curl, CURLINFO_CONNECT_TIME_T),
+           stage_ms(attempt->curl, CURLINFO_APPCONNECT_TIME_T),
+           stage_ms(attempt->curl, CURLINFO_STARTTRANSFER_TIME_T),
+           stage_ms(attempt->curl, CURLINFO_TOTAL_TIME_T), http_code,
+           outcomes[outcome]);
+  log_info(msg);
+}
 
-  if (!json || !tokens || !key) {
-    return 0;
-  }
-  if (tokens[obj_index].type != JSMN_OBJECT) {
-    return 0;
-  }
+/* Launched attempts still running, plus hedges not sent yet, count. */
+static int pending_can_beat(const fetch_attempt *attempts, size_t count,
+                            int best_score) {
+  size_t i;
 
-  i = obj_index + 1;
-  count = tokens[obj_index].size;
-  for (; count > 0; count--) {
-    if (json_token_equal(json, &tokens[i], key)) {
-      if (out_index) {
-        *out_index = i + 1;
-      }
+  for (i = 0; i < count; i++) {
+    int pending = attempts[i].active || !attempts[i].launched;
+    if (pending && attempts[i].best_score < best_score) {
       return 1;
     }
-    i = json_token_next(tokens, i + 1);
   }
   return 0;
 }
 
-static int json_parse(const char *json, jsmntok_t **out_tokens,
-                      int *out_count) {
-  jsmn_parser parser;
-  jsmntok_t *tokens;
-  int count;
-
-  if (!json || !out_tokens || !out_count) {
-    return -1;
-  }
-
-  jsmn_init(&parser);
-  count = jsmn_parse(&parser, json, strlen(json), NULL, 0);
-  if (count <= 0) {
-    return -1;
-  }
+static double hedge_delay(const lyrics_provider *provider) {
+  double delay = lyrics_registry_latency_p90(provider);
 
-  tokens = (jsmntok_t *)calloc((size_t)count, sizeof(*tokens));
-  if (!tokens) {
-    return -1;
+  if (delay < MIN_HEDGE_MS) {
+    delay = MIN_HEDGE_MS;
   }
-
-  jsmn_init(&parser);
-  count = jsmn_parse(&parser, json, strlen(json), tokens, (unsigned int)count);
-  if (count < 0) {
-    free(tokens);
-    return -1;
+  if (delay > (double)g_fetch.budget_ms / 2.0) {
+    delay = (double)g_fetch.budget_ms / 2.0;
   }
-
-  *out_tokens = tokens;
-  *out_count = count;
-  return 0;
+  return delay;
 }
 
-static int json_number_from_token(const char *json, const jsmntok_t *tok,
-                                  double *out_value) {
-  char buf[64];
-  int len;
-  char *endptr;
-
-  if (!json || !tok || !out_value || tok->type != JSMN_PRIMITIVE) {
-    return 0;
-  }
-
-  len = tok->end - tok->start;
-  if (len <= 0 || len >= (int)sizeof(buf)) {
-    return 0;
-  }
+/* A primary that is still running with no hedge yet is due one. */
+static int needs_hedge(const fetch_attempt *attempt) {
+  return attempt->primary && attempt->active && !attempt->twin;
+}
 
-  memcpy(buf, json + tok->start, (size_t)len);
-  buf[len] = '\0';
+static double next_hedge_at(const fetch_attempt *attempts, size_t count,
+                            double deadline) {
+  double next = deadline;
+  size_t i;
 
-  *out_value = strtod(buf, &endptr);
-  if (endptr == buf) {
-    return 0;
+  for (i = 0; i < count; i++) {
+    if (needs_hedge(&attempts[i]) && attempts[i].hedge_at < next) {
+      next = attempts[i].hedge_at;
+    }
   }
-  return 1;
+  return next;
 }
 
-static char *json_string_from_token(const char *json, const jsmntok_t *tok) {
-  if (!json || !tok || tok->type != JSMN_STRING) {
-    return NULL;
-  }
-  return json_unescape_range(json + tok->start,
-                             (size_t)(tok->end - tok->start));
-}
+/*
+ * Requests dropped at the deadline count against their provider, so one
+ * that hangs reaches its cooldown and its p90 sees the wait. A hedge pair
+ * counts once.
+ */
+static void record_timeouts(const fetch_attempt *attempts, size_t count,
+                            double now) {
+  size_t i;
 
-static int http_get(const char *url, char **out_body) {
-  CURL *curl;
-  CURLcode res;
-  long http_code = 0;
-  http_buffer buf = {0};
-  static int curl_ready;
+  for (i = 0; i < count; i++) {
+    const fetch_attempt *attempt = &attempts[i];
 
-  if (!url || !out_body) {
-    return -1;
-  }
-  *out_body = NULL;
-
-  if (!curl_ready) {
-    if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
-      return -1;
+    if (!attempt->active || (attempt->hedge && attempt->twin->active)) {
+      continue;
+    }
+    lyrics_registry_record(attempt->provider, now - attempt->started_at,
+                           PROVIDER_TIMEOUT);
+    if (g_fetch.log_timings) {
+      log_attempt_timings(attempt, 0, PROVIDER_TIMEOUT);
     }
-    curl_ready = 1;
-  }
-
-  curl = curl_easy_init();
-  if (!curl) {
-    return -1;
-  }
-
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-  curl_easy_setopt(curl, CURLOPT_USERAGENT, "csong/0.1.0");
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-
-  res = curl_easy_perform(curl);
-  if (res != CURLE_OK) {
-    log_error(curl_easy_strerror(res));
-    curl_easy_cleanup(curl);
-    free(buf.data);
-    return -1;
   }
+}
 
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-  curl_easy_cleanup(curl);
+static int anything_pending(const fetch_attempt *attempts, size_t count) {
+  size_t i;
 
-  if (http_code != 200) {
-    free(buf.data);
-    return -1;
+  for (i = 0; i < count; i++) {
+    if (attempts[i].active || !attempts[i].launched) {
+      return 1;
+    }
   }
-
-  *out_body = buf.data;
   return 0;
 }
 
-static int duration_close(double target, double actual) {
-  if (target <= 0.0 || actual <= 0.0) {
-    return 1;
-  }
-  return fabs(target - actual) <= 3.0;
-}
-
-static int parse_lrclib_search_best(const char *json, double target_duration,
-                                    char **out_text, int *out_timed) {
-  jsmntok_t *tokens = NULL;
-  int count = 0;
-  char *best_synced = NULL;
-  char *best_plain = NULL;
-  double best_synced_diff = 1e9;
-  double best_plain_diff = 1e9;
-  int i;
-
-  if (!json || !out_text || !out_timed) {
+int lyrics_fetch_any(const lyrics_query *queries, size_t count,
+                     double duration, char **out_text, int *out_timed,
+                     lyrics_cancel_fn cancel, void *cancel_ctx) {
+  const lyrics_provider *providers[LYRICS_MAX_PROVIDERS];
+  size_t provider_count;
+  fetch_attempt *attempts;
+  size_t attempt_count = 0;
+  size_t planned;
+  size_t i;
+  size_t p;
+  CURLM *multi;
+  char *best_text = NULL;
+  const lyrics_provider *best_provider = NULL;
+  int best_timed = 0;
+  int best_score = -1;
+  int running = 0;
+  size_t answered = 0;
+  size_t hedged = 0;
+  int skipped = 0;
+  int cancelled = 0;
+  double start;
+  double deadline;
+
+  if (!queries || count == 0 || !out_text || !out_timed) {
     return -1;
   }
+  *out_text = NULL;
+  *out_timed = 0;
 
-  if (json_parse(json, &tokens, &count) != 0) {
+  multi = http_multi();
+  if (!multi) {
     return -1;
   }
-  if (count < 1 || tokens[0].type != JSMN_ARRAY) {
-    free(tokens);
+
+  provider_count = lyrics_registry_plan(providers, LYRICS_MAX_PROVIDERS,
+                                        &skipped);
+  /* One slot per variant, plus one hedge per provider. */
+  attempts = (fetch_attempt *)calloc((count + 1) * LYRICS_MAX_PROVIDERS,
+                                     sizeof(*attempts));
+  if (!attempts) {
     return -1;
   }
 
-  i = 1;
-  for (int item = 0; item < tokens[0].size; item++) {
-    int obj_index = i;
-    int value_index = -1;
-    double diff = 1e6;
-    double duration = 0.0;
-
-    if (tokens[obj_index].type == JSMN_OBJECT) {
-      if (json_obj_get(json, tokens, obj_index, "duration", &value_index)) {
-        if (json_number_from_token(json, &tokens[value_index], &duration)) {
-          if (target_duration > 0.0 && duration > 0.0) {
-            diff = fabs(target_duration - duration);
-          }
-        }
-      }
+  for (p = 0; p < provider_count; p++) {
+    const lyrics_provider *provider = providers[p];
+    int have_primary = 0;
 
-      if (json_obj_get(json, tokens, obj_index, "syncedLyrics", &value_index) &&
-          !json_token_is_null(json, &tokens[value_index])) {
-        char *synced = json_string_from_token(json, &tokens[value_index]);
-        if (synced && synced[0] != '\0') {
-          if (diff < best_synced_diff) {
-            free(best_synced);
-            best_synced = synced;
-            best_synced_diff = diff;
-          } else {
-            free(synced);
-          }
-        } else {
-          free(synced);
-        }
-      }
+    for (i = 0; i < count; i++) {
+      const char *artist = queries[i].artist ? queries[i].artist : "";
+      const char *title = queries[i].title;
+      fetch_attempt *attempt;
 
-      if (json_obj_get(json, tokens, obj_index, "plainLyrics", &value_index) &&
-          !json_token_is_null(json, &tokens[value_index])) {
-        char *plain = json_string_from_token(json, &tokens[value_index]);
-        if (plain && plain[0] != '\0') {
-          if (diff < best_plain_diff) {
-            free(best_plain);
-            best_plain = plain;
-            best_plain_diff = diff;
-          } else {
-            free(plain);
-          }
-        } else {
-          free(plain);
-        }
+      if (!title || title[0] == '\0' ||
+          !lyrics_registry_allows(provider, i)) {
+        continue;
+      }
+      if ((provider->caps & LYRICS_CAP_NEEDS_ARTIST) &&
+          !has_known_artist(artist)) {
+        continue;
       }
+      attempt = &attempts[attempt_count++];
+      attempt->provider = provider;
+      attempt->query = &queries[i];
+      attempt->variant = i;
+      attempt->best_score = provider->best_tier * (int)count + (int)i;
+      attempt->primary = !have_primary;
+      have_primary = 1;
     }
-
-    i = json_token_next(tokens, i);
   }
+  planned = attempt_count;
 
-  if (best_synced) {
-    *out_text = best_synced;
-    *out_timed = 1;
-    free(best_plain);
-    free(tokens);
-    return 0;
-  }
-  if (best_plain) {
-    *out_text = best_plain;
-    *out_timed = 0;
-    free(tokens);
-    return 0;
+  start = now_ms();
+  deadline = start + (double)g_fetch.budget_ms;
+  for (i = 0; i < planned; i++) {
+    if (attempts[i].primary) {
+      attempts[i].hedge_at = start + hedge_delay(attempts[i].provider);
+    }
+    attempt_launch(multi, &attempts[i], duration, g_fetch.budget_ms);
   }
 
-  free(tokens);
-  return -1;
-}
-
-static int parse_lrclib_get_best(const char *json, double target_duration,
-                                 char **out_text, int *out_timed) {
-  jsmntok_t *tokens = NULL;
-  int count = 0;
-  int value_index = -1;
-  double duration = 0.0;
+  while (anything_pending(attempts, attempt_count)) {
+    CURLMsg *msg;
+    int left = 0;
+    double now = now_ms();
 
-  if (!json || !out_text || !out_timed) {
-    return -1;
-  }
-
-  if (json_parse(json, &tokens, &count) != 0) {
-    return -1;
-  }
-  if (count < 1 || tokens[0].type != JSMN_OBJECT) {
-    free(tokens);
-    return -1;
-  }
+    if (now >= deadline) {
+      record_timeouts(attempts, attempt_count, now);
+      break;
+    }
+    for (i = 0; i < planned; i++) {
+      fetch_attempt *stalled = &attempts[i];
+      fetch_attempt *hedge;
 
-  if (json_obj_get(json, tokens, 0, "duration", &value_index)) {
-    if (json_number_from_token(json, &tokens[value_index], &duration)) {
-      if (!duration_close(target_duration, duration)) {
-        free(tokens);
-        return -1;
+      if (!needs_hedge(stalled) || now < stalled->hedge_at ||
+          (best_score >= 0 && stalled->best_score >= best_score)) {
+        continue;
       }
+      hedge = &attempts[attempt_count++];
+      hedge->provider = stalled->provider;
+      hedge->query = stalled->query;
+      hedge->variant = stalled->variant;
+      hedge->best_score = stalled->best_score;
+      hedge->hedge = 1;
+      hedge->twin = stalled;
+      stalled->twin = hedge;
+      attempt_launch(multi, hedge, duration, (long)(deadline - now) + 1);
+      hedged++;
     }
-  }
 
-  if (json_obj_get(json, tokens, 0, "syncedLyrics", &value_index) &&
-      !json_token_is_null(json, &tokens[value_index])) {
-    char *synced = json_string_from_token(json, &tokens[value_index]);
-    if (synced && synced[0] != '\0') {
-      *out_text = synced;
-      *out_timed = 1;
-      free(tokens);
-      return 0;
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      break;
     }
-    free(synced);
-  }
 
-  if (json_obj_get(json, tokens, 0, "plainLyrics", &value_index) &&
-      !json_token_is_null(json, &tokens[value_index])) {
-    char *plain = json_string_from_token(json, &tokens[value_index]);
-    if (plain && plain[0] != '\0') {
-      *out_text = plain;
-      *out_timed = 0;
-      free(tokens);
-      return 0;
+    while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+      fetch_attempt *attempt = NULL;
+      long http_code = 0;
+      double total_time = 0.0;
+      char *text = NULL;
+      int timed = 0;
+      int tier = 0;
+      int found = 0;
+      provider_outcome outcome;
+
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&attempt);
+      if (!attempt) {
+        continue;
+      }
+      if (msg->data.result != CURLE_OK) {
+        log_error(curl_easy_strerror(msg->data.result));
+      } else {
+        curl_easy_getinfo(attempt->curl, CURLINFO_RESPONSE_CODE, &http_code);
+      }
+      if (http_code == 200 &&
+          attempt->provider->finish(&attempt->json, &text, &timed, &tier) ==
+              0) {
+        int score = tier * (int)count + (int)attempt->variant;
+        if (best_score < 0 || score < best_score) {
+          free(best_text);
+          best_text = text;
+          best_timed = timed;
+          best_score = score;
+          best_provider = attempt->provider;
+        } else {
+          free(text);
+        }
+        found = 1;
+      }
+      outcome = attempt_outcome(msg->data.result, http_code, found);
+      curl_easy_getinfo(attempt->curl, CURLINFO_TOTAL_TIME, &total_time);
+      lyrics_registry_record(attempt->provider, total_time * 1000.0, outcome);
+      if (g_fetch.log_timings) {
+        log_attempt_timings(attempt, http_code, outcome);
+      }
+      attempt_finish(multi, attempt);
+      /* The first copy to answer settles the request; an error leaves the
+       * other copy running. */
+      if (outcome == PROVIDER_HIT || outcome == PROVIDER_MISS) {
+        answered++;
+        if (attempt->twin) {
+          attempt_finish(multi, attempt->twin);
+        }
+      }
     }
-    free(plain);
-  }
-
-  free(tokens);
-  return -1;
-}
-
-static int build_lrclib_get_url(const char *artist, const char *title, char *out,
-                                size_t out_size) {
-  CURL *curl;
-  char *artist_enc = NULL;
-  char *title_enc = NULL;
-  int result = -1;
-
-  if (!artist || !title || !out || out_size == 0) {
-    return -1;
-  }
-
-  curl = curl_easy_init();
-  if (!curl) {
-    return -1;
-  }
-
-  title_enc = curl_easy_escape(curl, title, 0);
-  if (!title_enc) {
-    curl_easy_cleanup(curl);
-    return -1;
-  }
-
-  artist_enc = curl_easy_escape(curl, artist, 0);
-  if (!artist_enc) {
-    curl_free(title_enc);
-    curl_easy_cleanup(curl);
-    return -1;
-  }
-
-  snprintf(out, out_size,
-           "https://lrclib.net/api/get?track_name=%s&artist_name=%s",
-           title_enc, artist_enc);
-  curl_free(artist_enc);
-
-  curl_free(title_enc);
-  curl_easy_cleanup(curl);
-  result = 0;
-  return result;
-}
-
-static int build_lrclib_search_url(const char *artist, const char *title,
-                                   char *out, size_t out_size) {
-  CURL *curl;
-  char *artist_enc = NULL;
-  char *title_enc = NULL;
-  int result = -1;
-
-  if (!title || !out || out_size == 0) {
-    return -1;
-  }
-
-  curl = curl_easy_init();
-  if (!curl) {
-    return -1;
-  }
-
-  title_enc = curl_easy_escape(curl, title, 0);
-  if (!title_enc) {
-    curl_easy_cleanup(curl);
-    return -1;
-  }
-
-  if (artist && artist[0] != '\0' && strcasecmp(artist, "Unknown Artist") != 0) {
-    artist_enc = curl_easy_escape(curl, artist, 0);
-  }
-
-  if (artist_enc) {
-    snprintf(out, out_size,
-             "https://lrclib.net/api/search?track_name=%s&artist_name=%s",
-             title_enc, artist_enc);
-    curl_free(artist_enc);
-  } else {
-    snprintf(out, out_size, "https://lrclib.net/api/search?track_name=%s",
-             title_enc);
-  }
-
-  curl_free(title_enc);
-  curl_easy_cleanup(curl);
-  result = 0;
-  return result;
-}
-
-static int build_ovh_url(const char *artist, const char *title, char *out,
-                         size_t out_size) {
-  CURL *curl;
-  char *artist_enc;
-  char *title_enc;
-  int result = -1;
-
-  if (!artist || !title || !out || out_size == 0) {
-    return -1;
-  }
-
-  curl = curl_easy_init();
-  if (!curl) {
-    return -1;
-  }
 
-  artist_enc = curl_easy_escape(curl, artist, 0);
-  title_enc = curl_easy_escape(curl, title, 0);
-  if (!artist_enc || !title_enc) {
-    if (artist_enc) {
-      curl_free(artist_enc);
+    if (best_score >= 0 &&
+        !pending_can_beat(attempts, attempt_count, best_score)) {
+      break;
     }
-    if (title_enc) {
-      curl_free(title_enc);
+    if (cancel && cancel(cancel_ctx)) {
+      cancelled = 1;
+      break;
     }
-    curl_easy_cleanup(curl);
-    return -1;
-  }
-
-  snprintf(out, out_size, "https://api.lyrics.ovh/v1/%s/%s", artist_enc,
-           title_enc);
-  curl_free(artist_enc);
-  curl_free(title_enc);
-  curl_easy_cleanup(curl);
-  result = 0;
-  return result;
-}
-
-static int lyrics_fetch_lrclib(const char *artist, const char *title,
-                               double duration, char **out_text,
-                               int *out_timed) {
-  char url[1024];
-  char *json;
-
-  if (!out_text || !out_timed) {
-    return -1;
-  }
-  *out_text = NULL;
-  *out_timed = 0;
-
-  if (artist && artist[0] != '\0' && strcasecmp(artist, "Unknown Artist") != 0) {
-    if (build_lrclib_get_url(artist, title, url, sizeof(url)) == 0 &&
-        http_get(url, &json) == 0) {
-      if (parse_lrclib_get_best(json, duration, out_text, out_timed) == 0) {
-        free(json);
-        return 0;
+    if (running) {
+      double wait = next_hedge_at(attempts, planned, deadline) - now_ms();
+      if (wait > 100.0) {
+        wait = 100.0;
       }
-      free(json);
+      curl_multi_poll(multi, NULL, 0, wait > 0.0 ? (int)wait : 0, NULL);
     }
   }
 
-  if (build_lrclib_search_url(artist, title, url, sizeof(url)) != 0) {
-    return -1;
-  }
-
-  if (http_get(url, &json) != 0) {
-    return -1;
-  }
-
-  if (parse_lrclib_search_best(json, duration, out_text, out_timed) == 0) {
-    free(json);
-    return 0;
-  }
-
-  free(json);
-  return -1;
-}
-
-static int lyrics_fetch_ovh(const char *artist, const char *title,
-                            char **out_text) {
-  char url[1024];
-  char *json;
-  char *lyrics;
-  jsmntok_t *tokens = NULL;
-  int count = 0;
-  int value_index = -1;
-
-  if (!out_text) {
-    return -1;
+  if (g_fetch.log_timings) {
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "lyrics: lookup %.0fms/%ldms, %lu requests (%lu hedged), %s%s",
+             now_ms() - start, g_fetch.budget_ms, (unsigned long)attempt_count,
+             (unsigned long)hedged,
+             best_provider ? best_provider->name : "no result",
+             cancelled ? ", cancelled" : "");
+    log_info(msg);
   }
-  *out_text = NULL;
 
-  if (build_ovh_url(artist, title, url, sizeof(url)) != 0) {
-    return -1;
+  for (i = 0; i < attempt_count; i++) {
+    attempt_finish(multi, &attempts[i]);
   }
 
-  if (http_get(url, &json) != 0) {
+  if (cancelled) {
+    free(attempts);
+    free(best_text);
     return -1;
   }
-
-  lyrics = NULL;
-  if (json_parse(json, &tokens, &count) == 0 && count > 0 &&
-      tokens[0].type == JSMN_OBJECT &&
-      json_obj_get(json, tokens, 0, "lyrics", &value_index) &&
-      !json_token_is_null(json, &tokens[value_index])) {
-    lyrics = json_string_from_token(json, &tokens[value_index]);
-  }
-  free(tokens);
-  free(json);
-  if (!lyrics || lyrics[0] == '\0') {
-    free(lyrics);
-    return -1;
+  if (!best_text) {
+    /* Only a definitive miss when every planned request actually answered. */
+    int definitive = !skipped && planned > 0 && answered == planned;
+    free(attempts);
+    return definitive ? 1 : -1;
   }
-
-  *out_text = lyrics;
+  free(attempts);
+  *out_text = best_text;
+  *out_timed = best_timed;
   return 0;
 }
 
 int lyrics_fetch(const char *artist, const char *title, double duration,
                  char **out_text, int *out_timed) {
+  lyrics_query query;
+
   if (!artist || !title || !out_text || !out_timed) {
     return -1;
   }
 
-  if (lyrics_fetch_lrclib(artist, title, duration, out_text, out_timed) == 0) {
-    return 0;
-  }
-
-  if (lyrics_fetch_ovh(artist, title, out_text) == 0) {
-    *out_timed = 0;
-    return 0;
-  }
-
-  return -1;
+  query.artist = artist;
+  query.title = title;
+  return lyrics_fetch_any(&query, 1, duration, out_text, out_timed, NULL, NULL);
 }
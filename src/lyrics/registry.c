@@ -0,0 +1,264 @@
+#include "app/log.h"
+#include "app/lyrics_provider.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define EWMA_ALPHA 0.2
+#define PRIOR_LATENCY_MS 500.0
+#define PRIOR_SUCCESS 0.5
+#define DEMOTE_SAMPLES 20
+#define DEMOTE_SUCCESS 0.1
+#define DEMOTE_LATENCY_MS 5000.0
+#define COOLDOWN_FAILURES 3
+#define COOLDOWN_BASE_MS 30000L
+#define COOLDOWN_MAX_SHIFT 5
+#define LATENCY_WINDOW 32
+#define LATENCY_MIN_SAMPLES 5
+#define PRIOR_P90_MS 1500.0
+
+/*
+ * Per-provider EWMA latency and hit rate. Every provider is queried at once,
+ * so there is no issue order to tune; providers that rarely hit or are very
+ * slow are only asked for the primary query variant, and ones that keep
+ * failing at the transport level are skipped for an exponentially growing
+ * cooldown. A short window of raw latencies backs the p90 used to time
+ * hedged requests.
+ */
+typedef struct provider_stats {
+  const lyrics_provider *provider;
+  int enabled;
+  double latency_ms;
+  double success;
+  unsigned long samples;
+  int failures;
+  long cooldown_until_ms;
+  double window[LATENCY_WINDOW];
+  size_t window_len;
+  size_t window_next;
+} provider_stats;
+
+typedef struct registry_state {
+  pthread_mutex_t lock;
+  provider_stats entries[LYRICS_MAX_PROVIDERS];
+  size_t count;
+} registry_state;
+
+#define PROVIDER_ENTRY(p) \
+  { &(p), 1, PRIOR_LATENCY_MS, PRIOR_SUCCESS, 0, 0, 0, {0}, 0, 0 }
+
+static registry_state g_registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .entries =
+        {
+            PROVIDER_ENTRY(lrclib_get_provider),
+            PROVIDER_ENTRY(lrclib_search_provider),
+            PROVIDER_ENTRY(ovh_provider),
+        },
+    .count = 3,
+};
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static provider_stats *find_stats(const lyrics_provider *provider) {
+  size_t i;
+
+  for (i = 0; i < g_registry.count; i++) {
+    if (g_registry.entries[i].provider == provider) {
+      return &g_registry.entries[i];
+    }
+  }
+  return NULL;
+}
+
+/* "lrclib" selects every "lrclib-*" provider. */
+static int name_matches(const char *name, const char *token, size_t len) {
+  if (strncasecmp(name, token, len) != 0) {
+    return 0;
+  }
+  return name[len] == '\0' || name[len] == '-';
+}
+
+int lyrics_registry_configure(const char *spec) {
+  const char *p = spec;
+  size_t enabled = 0;
+  size_t i;
+  int result = 0;
+
+  if (!spec || spec[0] == '\0' || strcasecmp(spec, "auto") == 0) {
+    pthread_mutex_lock(&g_registry.lock);
+    for (i = 0; i < g_registry.count; i++) {
+      g_registry.entries[i].enabled = 1;
+    }
+    pthread_mutex_unlock(&g_registry.lock);
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_registry.lock);
+  for (i = 0; i < g_registry.count; i++) {
+    g_registry.entries[i].enabled = 0;
+  }
+  while (*p) {
+    size_t len;
+    int matched = 0;
+
+    while (*p == ',' || *p == ' ') {
+      p++;
+    }
+    len = strcspn(p, ", ");
+    if (len == 0) {
+      break;
+    }
+    for (i = 0; i < g_registry.count; i++) {
+      if (name_matches(g_registry.entries[i].provider->name, p, len)) {
+        if (!g_registry.entries[i].enabled) {
+          enabled++;
+        }
+        g_registry.entries[i].enabled = 1;
+        matched = 1;
+      }
+    }
+    if (!matched) {
+      char msg[128];
+      snprintf(msg, sizeof(msg), "lyrics: unknown provider '%.*s'", (int)len,
+               p);
+      log_error(msg);
+      result = -1;
+    }
+    p += len;
+  }
+  if (enabled == 0) {
+    for (i = 0; i < g_registry.count; i++) {
+      g_registry.entries[i].enabled = 1;
+    }
+  }
+  pthread_mutex_unlock(&g_registry.lock);
+  return result;
+}
+
+size_t lyrics_registry_plan(const lyrics_provider **out, size_t max,
+                            int *out_skipped) {
+  long now = now_ms();
+  size_t count = 0;
+  size_t i;
+  int skipped = 0;
+
+  if (!out) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_registry.lock);
+  for (i = 0; i < g_registry.count && count < max; i++) {
+    const provider_stats *stats = &g_registry.entries[i];
+
+    if (!stats->enabled) {
+      continue;
+    }
+    if (stats->cooldown_until_ms > now) {
+      skipped = 1;
+      continue;
+    }
+    out[count++] = stats->provider;
+  }
+  pthread_mutex_unlock(&g_registry.lock);
+
+  if (out_skipped) {
+    *out_skipped = skipped;
+  }
+  return count;
+}
+
+int lyrics_registry_allows(const lyrics_provider *provider, size_t variant) {
+  const provider_stats *stats;
+  int demoted = 0;
+
+  if (variant == 0) {
+    return 1;
+  }
+  pthread_mutex_lock(&g_registry.lock);
+  stats = find_stats(provider);
+  if (stats && stats->samples >= DEMOTE_SAMPLES &&
+      (stats->success < DEMOTE_SUCCESS ||
+       stats->latency_ms > DEMOTE_LATENCY_MS)) {
+    demoted = 1;
+  }
+  pthread_mutex_unlock(&g_registry.lock);
+  return !demoted;
+}
+
+void lyrics_registry_record(const lyrics_provider *provider, double latency_ms,
+                            provider_outcome outcome) {
+  provider_stats *stats;
+
+  pthread_mutex_lock(&g_registry.lock);
+  stats = find_stats(provider);
+  if (!stats) {
+    pthread_mutex_unlock(&g_registry.lock);
+    return;
+  }
+
+  stats->latency_ms += EWMA_ALPHA * (latency_ms - stats->latency_ms);
+  stats->success +=
+      EWMA_ALPHA * ((outcome == PROVIDER_HIT ? 1.0 : 0.0) - stats->success);
+  stats->samples++;
+  /* Fast transport errors would drag the p90 down; timeouts belong in it. */
+  if (outcome != PROVIDER_ERROR) {
+    stats->window[stats->window_next] = latency_ms;
+    stats->window_next = (stats->window_next + 1) % LATENCY_WINDOW;
+    if (stats->window_len < LATENCY_WINDOW) {
+      stats->window_len++;
+    }
+  }
+
+  if (outcome == PROVIDER_HIT || outcome == PROVIDER_MISS) {
+    stats->failures = 0;
+    stats->cooldown_until_ms = 0;
+  } else if (++stats->failures >= COOLDOWN_FAILURES) {
+    int shift = stats->failures - COOLDOWN_FAILURES;
+    char msg[128];
+
+    if (shift > COOLDOWN_MAX_SHIFT) {
+      shift = COOLDOWN_MAX_SHIFT;
+    }
+    stats->cooldown_until_ms = now_ms() + (COOLDOWN_BASE_MS << shift);
+    snprintf(msg, sizeof(msg), "lyrics: %s failing, paused for %lds",
+             provider->name, (COOLDOWN_BASE_MS << shift) / 1000L);
+    log_error(msg);
+  }
+  pthread_mutex_unlock(&g_registry.lock);
+}
+
+double lyrics_registry_latency_p90(const lyrics_provider *provider) {
+  double sorted[LATENCY_WINDOW];
+  const provider_stats *stats;
+  size_t count = 0;
+  size_t i;
+
+  pthread_mutex_lock(&g_registry.lock);
+  stats = find_stats(provider);
+  if (stats && stats->window_len >= LATENCY_MIN_SAMPLES) {
+    count = stats->window_len;
+    memcpy(sorted, stats->window, count * sizeof(sorted[0]));
+  }
+  pthread_mutex_unlock(&g_registry.lock);
+
+  if (count == 0) {
+    return PRIOR_P90_MS;
+  }
+  for (i = 1; i < count; i++) {
+    double value = sorted[i];
+    size_t j = i;
+    while (j > 0 && sorted[j - 1] > value) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = value;
+  }
+  return sorted[(count * 9 - 1) / 10];
+}
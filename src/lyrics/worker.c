@@ -0,0 +1,583 @@
+#include "app/lyrics_worker.h"
+#include "app/http.h"
+#include "app/log.h"
+#include "app/lyrics_lru.h"
+#include "app/normalize.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WORKER_QUEUE_SIZE 16
+#define WORKER_KEY_SIZE 512
+#define FLIGHT_SLOTS 32
+
+/* The lookup the worker thread is running right now. */
+typedef struct worker_current {
+  int active;
+  unsigned long id;
+  int prefetch;
+  /* Set once the lookup has seen a cancel; it may already be unwinding. */
+  int cancelled;
+  char key[WORKER_KEY_SIZE];
+} worker_current;
+
+/*
+ * Foreground requests carry the track generation (their id). Only the
+ * newest generation matters, so submitting one drops queued foreground
+ * work, and the running lookup is aborted once it is stale.
+ */
+typedef struct worker_state {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  lyrics_request request;
+  int has_request;
+  lyrics_request prefetch[WORKER_QUEUE_SIZE];
+  size_t prefetch_head;
+  size_t prefetch_count;
+  lyrics_result results[WORKER_QUEUE_SIZE];
+  size_t result_head;
+  size_t result_count;
+  worker_current current;
+  unsigned long generation;
+  CURLM *multi;
+  int wake_fds[2];
+  int running;
+  int stopping;
+} worker_state;
+
+static worker_state g_worker = {
+    .wake_fds = {-1, -1},
+};
+
+/*
+ * Keys with a network lookup in progress on any thread. A second caller for
+ * the same key waits for the first one and then reads its result from the
+ * cache instead of fetching again.
+ */
+typedef struct flight_table {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  char keys[FLIGHT_SLOTS][WORKER_KEY_SIZE];
+  int used[FLIGHT_SLOTS];
+} flight_table;
+
+static flight_table g_flight = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+#define LOOKUP_MAX_VARIANTS 5
+
+static void add_variant(lyrics_query *queries, size_t *count,
+                        const char *artist, const char *title) {
+  size_t i;
+
+  if (!title || title[0] == '\0' || *count >= LOOKUP_MAX_VARIANTS) {
+    return;
+  }
+  for (i = 0; i < *count; i++) {
+    if (strcmp(queries[i].artist, artist) == 0 &&
+        strcmp(queries[i].title, title) == 0) {
+      return;
+    }
+  }
+  queries[*count].artist = artist;
+  queries[*count].title = title;
+  (*count)++;
+}
+
+/*
+ * Builds the artist/title variants in the order the serial fallback chain
+ * used to try them and resolves them in one parallel fetch.
+ */
+static int fetch_with_fallbacks(const lyrics_request *req, char **out_text,
+                                int *out_timed, lyrics_cancel_fn cancel,
+                                void *cancel_ctx) {
+  lyrics_query queries[LOOKUP_MAX_VARIANTS];
+  size_t count = 0;
+  char *norm_artist = NULL;
+  char *norm_title = NULL;
+  int result;
+
+  if (req->source != PLAYER_SOURCE_MPD) {
+    norm_artist = normalize_artist(req->artist);
+    norm_title = normalize_title(req->title);
+  }
+
+  add_variant(queries, &count, req->artist, req->title);
+  if (norm_title && norm_title[0] != '\0') {
+    const char *use_artist = norm_artist && norm_artist[0] != '\0'
+                                 ? norm_artist
+                                 : req->artist;
+    add_variant(queries, &count, use_artist, norm_title);
+  }
+  if (norm_artist && norm_artist[0] != '\0') {
+    add_variant(queries, &count, norm_artist, req->title);
+  }
+  if (norm_title && norm_title[0] != '\0') {
+    add_variant(queries, &count, req->artist, norm_title);
+  }
+  if (req->source == PLAYER_SOURCE_YOUTUBE || req->artist[0] == '\0') {
+    add_variant(queries, &count, "",
+                norm_title && norm_title[0] != '\0' ? norm_title : req->title);
+  }
+
+  result = lyrics_fetch_any(queries, count, req->duration, out_text, out_timed,
+                            cancel, cancel_ctx);
+
+  free(norm_artist);
+  free(norm_title);
+  return result;
+}
+
+static void request_key(const lyrics_request *req, char *out,
+                        size_t out_size) {
+  if (normalize_track_key(req->artist, req->title, out, out_size) != 0) {
+    snprintf(out, out_size, "%s\t%s", req->artist, req->title);
+  }
+}
+
+static int flight_find(const char *key) {
+  int i;
+
+  for (i = 0; i < FLIGHT_SLOTS; i++) {
+    if (g_flight.used[i] && strcmp(g_flight.keys[i], key) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Returns the slot this caller now leads, or -1 after waiting on a leader. */
+static int flight_begin(const char *key) {
+  int i;
+
+  pthread_mutex_lock(&g_flight.lock);
+  if (flight_find(key) >= 0) {
+    while (flight_find(key) >= 0) {
+      pthread_cond_wait(&g_flight.done, &g_flight.lock);
+    }
+    pthread_mutex_unlock(&g_flight.lock);
+    return -1;
+  }
+  for (i = 0; i < FLIGHT_SLOTS; i++) {
+    if (!g_flight.used[i]) {
+      g_flight.used[i] = 1;
+      snprintf(g_flight.keys[i], sizeof(g_flight.keys[i]), "%s", key);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_flight.lock);
+  return i < FLIGHT_SLOTS ? i : FLIGHT_SLOTS;
+}
+
+static void flight_end(int slot) {
+  if (slot < 0 || slot >= FLIGHT_SLOTS) {
+    return;
+  }
+  pthread_mutex_lock(&g_flight.lock);
+  g_flight.used[slot] = 0;
+  pthread_cond_broadcast(&g_flight.done);
+  pthread_mutex_unlock(&g_flight.lock);
+}
+
+static int load_cached(const lyrics_request *req, lyrics_result *out) {
+  lyrics_doc *doc = lyrics_cache_load_doc(req->artist, req->title);
+
+  if (!doc) {
+    return -1;
+  }
+  out->doc = doc;
+  out->timed = doc->has_timestamps;
+  out->found = 1;
+  return 0;
+}
+
+static int lookup_run(const lyrics_request *req, lyrics_result *out,
+                      lyrics_cancel_fn cancel, void *cancel_ctx) {
+  char key[WORKER_KEY_SIZE];
+  char *text = NULL;
+  int timed = 0;
+  int fetched;
+  int slot;
+
+  if (!req || !out) {
+    return -1;
+  }
+  memset(out, 0, sizeof(*out));
+  out->id = req->id;
+  request_key(req, key, sizeof(key));
+
+  while ((slot = flight_begin(key)) < 0) {
+    if (load_cached(req, out) == 0) {
+      return 0;
+    }
+    if (lyrics_cache_is_miss(req->artist, req->title) ||
+        (cancel && cancel(cancel_ctx))) {
+      return -1;
+    }
+  }
+
+  fetched = fetch_with_fallbacks(req, &text, &timed, cancel, cancel_ctx);
+  if (fetched != 0) {
+    if (fetched > 0) {
+      lyrics_cache_store_miss(req->artist, req->title);
+    }
+    flight_end(slot);
+    return -1;
+  }
+
+  out->doc = lyrics_parse(text);
+  if (out->doc) {
+    timed = out->doc->has_timestamps;
+  }
+  lyrics_cache_store(req->artist, req->title, text, timed);
+  lyrics_lru_put(req->artist, req->title, out->doc);
+  flight_end(slot);
+  out->text = text;
+  out->timed = timed;
+  out->found = 1;
+  return 0;
+}
+
+int lyrics_lookup(const lyrics_request *req, lyrics_result *out) {
+  return lookup_run(req, out, NULL, NULL);
+}
+
+void lyrics_result_free(lyrics_result *res) {
+  if (!res) {
+    return;
+  }
+  lyrics_free(res->doc);
+  free(res->text);
+  res->doc = NULL;
+  res->text = NULL;
+}
+
+static void worker_wake(void) {
+  char byte = 1;
+  ssize_t wrote;
+
+  if (g_worker.wake_fds[1] < 0) {
+    return;
+  }
+  do {
+    wrote = write(g_worker.wake_fds[1], &byte, 1);
+  } while (wrote < 0 && errno == EINTR);
+}
+
+static void worker_push_result(lyrics_result *res) {
+  size_t slot;
+
+  pthread_mutex_lock(&g_worker.lock);
+  if (g_worker.result_count == WORKER_QUEUE_SIZE) {
+    lyrics_result_free(&g_worker.results[g_worker.result_head]);
+    g_worker.result_head = (g_worker.result_head + 1) % WORKER_QUEUE_SIZE;
+    g_worker.result_count--;
+  }
+  slot = (g_worker.result_head + g_worker.result_count) % WORKER_QUEUE_SIZE;
+  g_worker.results[slot] = *res;
+  g_worker.result_count++;
+  pthread_mutex_unlock(&g_worker.lock);
+  worker_wake();
+}
+
+/* Held under the lock so the worker cannot tear its multi handle down. */
+static void worker_wake_multi(void) {
+  pthread_mutex_lock(&g_worker.lock);
+  if (g_worker.current.active && g_worker.multi) {
+    curl_multi_wakeup(g_worker.multi);
+  }
+  pthread_mutex_unlock(&g_worker.lock);
+}
+
+/*
+ * A foreground lookup is abandoned once a newer track generation exists; a
+ * prefetch yields as soon as foreground work is queued.
+ */
+static int worker_should_cancel(void *ctx) {
+  int cancel;
+
+  (void)ctx;
+  pthread_mutex_lock(&g_worker.lock);
+  if (g_worker.current.prefetch) {
+    cancel = g_worker.has_request;
+  } else {
+    cancel = g_worker.current.id < g_worker.generation;
+  }
+  cancel = cancel || g_worker.stopping;
+  if (cancel) {
+    g_worker.current.cancelled = 1;
+  }
+  pthread_mutex_unlock(&g_worker.lock);
+  return cancel;
+}
+
+/*
+ * Prefetches only warm the cache and produce no result, unless a foreground
+ * request for the same track joined them while they were running.
+ */
+static void worker_process(const lyrics_request *req) {
+  lyrics_result res;
+  unsigned long id;
+  int prefetch;
+  int stale;
+
+  memset(&res, 0, sizeof(res));
+  if (load_cached(req, &res) != 0 &&
+      !lyrics_cache_is_miss(req->artist, req->title)) {
+    lookup_run(req, &res, worker_should_cancel, NULL);
+  }
+
+  pthread_mutex_lock(&g_worker.lock);
+  id = g_worker.current.id;
+  prefetch = g_worker.current.prefetch;
+  stale = id < g_worker.generation;
+  g_worker.current.active = 0;
+  pthread_mutex_unlock(&g_worker.lock);
+
+  if (prefetch || stale) {
+    lyrics_result_free(&res);
+    return;
+  }
+  res.id = id;
+  worker_push_result(&res);
+}
+
+static void *worker_main(void *arg) {
+  CURLM *multi = http_multi();
+
+  (void)arg;
+  pthread_mutex_lock(&g_worker.lock);
+  g_worker.multi = multi;
+  pthread_mutex_unlock(&g_worker.lock);
+
+  for (;;) {
+    lyrics_request req;
+
+    pthread_mutex_lock(&g_worker.lock);
+    while (!g_worker.stopping && !g_worker.has_request &&
+           g_worker.prefetch_count == 0) {
+      pthread_cond_wait(&g_worker.cond, &g_worker.lock);
+    }
+    if (g_worker.stopping) {
+      g_worker.multi = NULL;
+      pthread_mutex_unlock(&g_worker.lock);
+      break;
+    }
+    if (g_worker.has_request) {
+      req = g_worker.request;
+      g_worker.has_request = 0;
+    } else {
+      req = g_worker.prefetch[g_worker.prefetch_head];
+      g_worker.prefetch_head =
+          (g_worker.prefetch_head + 1) % WORKER_QUEUE_SIZE;
+      g_worker.prefetch_count--;
+    }
+    g_worker.current.active = 1;
+    g_worker.current.id = req.id;
+    g_worker.current.prefetch = req.prefetch;
+    g_worker.current.cancelled = 0;
+    request_key(&req, g_worker.current.key, sizeof(g_worker.current.key));
+    pthread_mutex_unlock(&g_worker.lock);
+
+    worker_process(&req);
+  }
+
+  return NULL;
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int lyrics_worker_start(void) {
+  if (g_worker.running) {
+    return 0;
+  }
+
+  if (pipe(g_worker.wake_fds) != 0) {
+    log_error("lyrics: worker pipe failed");
+    g_worker.wake_fds[0] = -1;
+    g_worker.wake_fds[1] = -1;
+    return -1;
+  }
+  set_nonblocking(g_worker.wake_fds[0]);
+  set_nonblocking(g_worker.wake_fds[1]);
+
+  pthread_mutex_init(&g_worker.lock, NULL);
+  pthread_cond_init(&g_worker.cond, NULL);
+  g_worker.has_request = 0;
+  g_worker.prefetch_head = 0;
+  g_worker.prefetch_count = 0;
+  g_worker.result_head = 0;
+  g_worker.result_count = 0;
+  g_worker.current.active = 0;
+  g_worker.generation = 0;
+  g_worker.stopping = 0;
+
+  if (pthread_create(&g_worker.thread, NULL, worker_main, NULL) != 0) {
+    log_error("lyrics: worker thread failed");
+    pthread_cond_destroy(&g_worker.cond);
+    pthread_mutex_destroy(&g_worker.lock);
+    close(g_worker.wake_fds[0]);
+    close(g_worker.wake_fds[1]);
+    g_worker.wake_fds[0] = -1;
+    g_worker.wake_fds[1] = -1;
+    return -1;
+  }
+
+  g_worker.running = 1;
+  return 0;
+}
+
+void lyrics_worker_stop(void) {
+  if (!g_worker.running) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_worker.lock);
+  g_worker.stopping = 1;
+  pthread_cond_signal(&g_worker.cond);
+  pthread_mutex_unlock(&g_worker.lock);
+  worker_wake_multi();
+  pthread_join(g_worker.thread, NULL);
+
+  while (g_worker.result_count > 0) {
+    lyrics_result_free(&g_worker.results[g_worker.result_head]);
+    g_worker.result_head = (g_worker.result_head + 1) % WORKER_QUEUE_SIZE;
+    g_worker.result_count--;
+  }
+
+  pthread_cond_destroy(&g_worker.cond);
+  pthread_mutex_destroy(&g_worker.lock);
+  close(g_worker.wake_fds[0]);
+  close(g_worker.wake_fds[1]);
+  g_worker.wake_fds[0] = -1;
+  g_worker.wake_fds[1] = -1;
+  g_worker.running = 0;
+}
+
+static int prefetch_queued(const lyrics_request *req, const char *key) {
+  size_t i;
+
+  if (g_worker.current.active && strcmp(g_worker.current.key, key) == 0) {
+    return 1;
+  }
+  for (i = 0; i < g_worker.prefetch_count; i++) {
+    const lyrics_request *queued =
+        &g_worker.prefetch[(g_worker.prefetch_head + i) % WORKER_QUEUE_SIZE];
+    if (strcmp(queued->artist, req->artist) == 0 &&
+        strcmp(queued->title, req->title) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int lyrics_worker_submit(const lyrics_request *req) {
+  char key[WORKER_KEY_SIZE];
+  size_t slot;
+
+  if (!req || !g_worker.running) {
+    return -1;
+  }
+  request_key(req, key, sizeof(key));
+
+  pthread_mutex_lock(&g_worker.lock);
+  if (req->prefetch) {
+    if (g_worker.prefetch_count == WORKER_QUEUE_SIZE ||
+        prefetch_queued(req, key)) {
+      pthread_mutex_unlock(&g_worker.lock);
+      return -1;
+    }
+    slot = (g_worker.prefetch_head + g_worker.prefetch_count) %
+           WORKER_QUEUE_SIZE;
+    g_worker.prefetch[slot] = *req;
+    g_worker.prefetch_count++;
+    pthread_cond_signal(&g_worker.cond);
+    pthread_mutex_unlock(&g_worker.lock);
+    return 0;
+  }
+
+  if (req->id > g_worker.generation) {
+    g_worker.generation = req->id;
+  }
+  g_worker.has_request = 0;
+  if (g_worker.current.active && !g_worker.current.cancelled &&
+      strcmp(g_worker.current.key, key) == 0) {
+    /*
+     * Same track already running (A -> B -> A, or a prefetch): join it.
+     * A lookup that saw a cancel may return empty, so that one is queued
+     * again instead.
+     */
+    g_worker.current.id = req->id;
+    g_worker.current.prefetch = 0;
+    pthread_mutex_unlock(&g_worker.lock);
+    return 0;
+  }
+  g_worker.request = *req;
+  g_worker.has_request = 1;
+  pthread_cond_signal(&g_worker.cond);
+  pthread_mutex_unlock(&g_worker.lock);
+  worker_wake_multi();
+  return 0;
+}
+
+void lyrics_worker_set_generation(unsigned long generation) {
+  if (!g_worker.running) {
+    return;
+  }
+  pthread_mutex_lock(&g_worker.lock);
+  if (generation > g_worker.generation) {
+    g_worker.generation = generation;
+  }
+  g_worker.has_request = 0;
+  pthread_mutex_unlock(&g_worker.lock);
+  worker_wake_multi();
+}
+
+void lyrics_worker_clear_prefetch(void) {
+  if (!g_worker.running) {
+    return;
+  }
+  pthread_mutex_lock(&g_worker.lock);
+  g_worker.prefetch_head = 0;
+  g_worker.prefetch_count = 0;
+  pthread_mutex_unlock(&g_worker.lock);
+}
+
+int lyrics_worker_poll(lyrics_result *out) {
+  char drain[64];
+
+  if (!out || !g_worker.running) {
+    return 0;
+  }
+
+  while (read(g_worker.wake_fds[0], drain, sizeof(drain)) > 0) {
+  }
+
+  pthread_mutex_lock(&g_worker.lock);
+  if (g_worker.result_count == 0) {
+    pthread_mutex_unlock(&g_worker.lock);
+    return 0;
+  }
+  *out = g_worker.results[g_worker.result_head];
+  g_worker.result_head = (g_worker.result_head + 1) % WORKER_QUEUE_SIZE;
+  g_worker.result_count--;
+  pthread_mutex_unlock(&g_worker.lock);
+  return 1;
+}
+
+int lyrics_worker_get_fd(void) {
+  return g_worker.running ? g_worker.wake_fds[0] : -1;
+}
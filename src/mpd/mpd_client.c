@@ -105,10 +105,7 @@ void mpd_client_disconnect(void) {
   }
 }
 
-int mpd_client_get_current(mpd_track *out) {
-  struct mpd_status *status;
-  struct mpd_song *song;
-  enum mpd_state state;
+static void track_from_song(const struct mpd_song *song, mpd_track *out) {
   const char *tag;
   const char *uri;
   char base[256] = {0};
@@ -117,31 +114,6 @@ int mpd_client_get_current(mpd_track *out) {
   int artist_from_tag = 0;
   int title_from_tag = 0;
 
-  if (!mpd_conn || !out) {
-    return -1;
-  }
-
-  memset(out, 0, sizeof(*out));
-
-  status = mpd_run_status(mpd_conn);
-  if (!status) {
-    return -1;
-  }
-
-  state = mpd_status_get_state(status);
-  out->is_playing = (state == MPD_STATE_PLAY);
-  out->is_paused = (state == MPD_STATE_PAUSE);
-  out->is_stopped = (state == MPD_STATE_STOP);
-  out->elapsed = (double)mpd_status_get_elapsed_time(status);
-  out->duration = 0.0;
-
-  song = mpd_run_current_song(mpd_conn);
-  if (!song) {
-    out->has_song = 0;
-    mpd_status_free(status);
-    return 0;
-  }
-
   tag = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
   if (tag && tag[0] != '\0') {
     copy_tag(out->artist, sizeof(out->artist), tag);
@@ -196,11 +168,168 @@ int mpd_client_get_current(mpd_track *out) {
   if (mpd_song_get_duration(song) > 0) {
     out->duration = (double)mpd_song_get_duration(song);
   }
+}
+
+int mpd_client_get_current(mpd_track *out) {
+  struct mpd_status *status;
+  struct mpd_song *song;
+  enum mpd_state state;
+
+  if (!mpd_conn || !out) {
+    return -1;
+  }
+
+  memset(out, 0, sizeof(*out));
+
+  status = mpd_run_status(mpd_conn);
+  if (!status) {
+    return -1;
+  }
+
+  state = mpd_status_get_state(status);
+  out->is_playing = (state == MPD_STATE_PLAY);
+  out->is_paused = (state == MPD_STATE_PAUSE);
+  out->is_stopped = (state == MPD_STATE_STOP);
+  out->elapsed = (double)mpd_status_get_elapsed_time(status);
+  out->duration = 0.0;
+
+  song = mpd_run_current_song(mpd_conn);
+  if (!song) {
+    out->has_song = 0;
+    mpd_status_free(status);
+    return 0;
+  }
+
+  track_from_song(song, out);
   mpd_song_free(song);
   mpd_status_free(status);
   return 0;
 }
 
+static int read_upcoming(struct mpd_connection *conn, mpd_track *out,
+                         size_t max, size_t *out_count) {
+  struct mpd_status *status;
+  struct mpd_song *song;
+  int next_pos;
+  unsigned int queue_len;
+  unsigned int end;
+  size_t count = 0;
+
+  status = mpd_run_status(conn);
+  if (!status) {
+    return -1;
+  }
+  next_pos = mpd_status_get_next_song_pos(status);
+  queue_len = mpd_status_get_queue_length(status);
+  if (mpd_status_get_random(status)) {
+    max = 1;
+  }
+  mpd_status_free(status);
+
+  if (next_pos < 0 || (unsigned int)next_pos >= queue_len) {
+    return 0;
+  }
+  end = (unsigned int)next_pos + (unsigned int)max;
+  if (end > queue_len) {
+    end = queue_len;
+  }
+
+  if (!mpd_send_list_queue_range_meta(conn, (unsigned int)next_pos, end)) {
+    mpd_connection_clear_error(conn);
+    return -1;
+  }
+  while ((song = mpd_recv_song(conn)) != NULL) {
+    if (count < max) {
+      memset(&out[count], 0, sizeof(out[count]));
+      track_from_song(song, &out[count]);
+      count++;
+    }
+    mpd_song_free(song);
+  }
+  if (!mpd_response_finish(conn)) {
+    mpd_connection_clear_error(conn);
+    return -1;
+  }
+
+  *out_count = count;
+  return 0;
+}
+
+/*
+ * Reads the queue over a private connection, so it can run on another
+ * thread while the main connection sits in idle.
+ */
+int mpd_client_read_upcoming(const char *host, int port, mpd_track *out,
+                             size_t max, size_t *out_count) {
+  struct mpd_connection *conn;
+  int result;
+
+  if (!out || !out_count) {
+    return -1;
+  }
+  *out_count = 0;
+  if (max == 0) {
+    return 0;
+  }
+
+  conn = mpd_connection_new(host, port, 5000);
+  if (!conn) {
+    return -1;
+  }
+  if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
+    log_error(mpd_connection_get_error_message(conn));
+    mpd_connection_free(conn);
+    return -1;
+  }
+  result = read_upcoming(conn, out, max, out_count);
+  mpd_connection_free(conn);
+  return result;
+}
+
+int mpd_client_list_library(mpd_track **out, size_t *out_count) {
+  struct mpd_song *song;
+  mpd_track *tracks = NULL;
+  size_t count = 0;
+  size_t cap = 0;
+
+  if (!mpd_conn || !out || !out_count) {
+    return -1;
+  }
+  *out = NULL;
+  *out_count = 0;
+
+  if (!mpd_send_list_all_meta(mpd_conn, "")) {
+    mpd_connection_clear_error(mpd_conn);
+    return -1;
+  }
+  while ((song = mpd_recv_song(mpd_conn)) != NULL) {
+    if (count == cap) {
+      size_t next_cap = cap ? cap * 2 : 1024;
+      mpd_track *next = (mpd_track *)realloc(tracks, next_cap * sizeof(*next));
+      if (!next) {
+        mpd_song_free(song);
+        break;
+      }
+      tracks = next;
+      cap = next_cap;
+    }
+    memset(&tracks[count], 0, sizeof(tracks[count]));
+    track_from_song(song, &tracks[count]);
+    tracks[count].has_song = 1;
+    count++;
+    mpd_song_free(song);
+  }
+  if (!mpd_response_finish(mpd_conn)) {
+    mpd_connection_clear_error(mpd_conn);
+    free(tracks);
+    return -1;
+  }
+
+  *out = tracks;
+  *out_count = count;
+  return 0;
+}
+
 int mpd_client_get_fd(void) {
   if (!mpd_conn) {
     return -1;
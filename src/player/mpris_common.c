@@ -25,15 +25,18 @@ static char *dup_string(const char *s) {
   return out;
 }
 
+#define MPRIS_PLAYER_IFACE "org.mpris.MediaPlayer2.Player"
+#define MPRIS_TRACKLIST_IFACE "org.mpris.MediaPlayer2.TrackList"
+
 static DBusMessage *get_property_reply(DBusConnection *conn, const char *bus_name,
-                                       const char *prop, DBusError *dbus_err) {
+                                       const char *iface, const char *prop,
+                                       DBusError *dbus_err) {
   DBusMessage *msg = dbus_message_new_method_call(
       bus_name, "/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties",
       "Get");
   if (!msg) {
     return NULL;
   }
-  const char *iface = "org.mpris.MediaPlayer2.Player";
   if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING,
                                 &prop, DBUS_TYPE_INVALID)) {
     dbus_message_unref(msg);
@@ -50,7 +53,8 @@ static mpris_status get_string_property(DBusConnection *conn, const char *bus_na
                                         size_t err_cap) {
   DBusError dbus_err;
   dbus_error_init(&dbus_err);
-  DBusMessage *reply = get_property_reply(conn, bus_name, prop, &dbus_err);
+  DBusMessage *reply =
+      get_property_reply(conn, bus_name, MPRIS_PLAYER_IFACE, prop, &dbus_err);
   if (!reply) {
     if (dbus_error_is_set(&dbus_err)) {
       set_err(err, err_cap, dbus_err.message);
@@ -89,7 +93,8 @@ static mpris_status get_int64_property(DBusConnection *conn, const char *bus_nam
                                        size_t err_cap) {
   DBusError dbus_err;
   dbus_error_init(&dbus_err);
-  DBusMessage *reply = get_property_reply(conn, bus_name, prop, &dbus_err);
+  DBusMessage *reply =
+      get_property_reply(conn, bus_name, MPRIS_PLAYER_IFACE, prop, &dbus_err);
   if (!reply) {
     if (dbus_error_is_set(&dbus_err)) {
       set_err(err, err_cap, dbus_err.message);
@@ -131,51 +136,20 @@ static mpris_status get_int64_property(DBusConnection *conn, const char *bus_nam
   return MPRIS_OK;
 }
 
-static mpris_status get_metadata(DBusConnection *conn, const char *bus_name,
-                                 char **artist, char **title, int64_t *duration_ms,
-                                 char *err, size_t err_cap) {
-  DBusError dbus_err;
-  dbus_error_init(&dbus_err);
-  DBusMessage *reply = get_property_reply(conn, bus_name, "Metadata", &dbus_err);
-  if (!reply) {
-    if (dbus_error_is_set(&dbus_err)) {
-      set_err(err, err_cap, dbus_err.message);
-      dbus_error_free(&dbus_err);
-    } else {
-      set_err(err, err_cap, "Failed to read MPRIS metadata");
-    }
-    return MPRIS_ERROR;
-  }
-
-  DBusMessageIter iter;
-  if (!dbus_message_iter_init(reply, &iter) ||
-      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
-    dbus_message_unref(reply);
-    set_err(err, err_cap, "Unexpected DBus response");
-    return MPRIS_ERROR;
-  }
-
-  DBusMessageIter variant;
-  dbus_message_iter_recurse(&iter, &variant);
-  if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_ARRAY) {
-    dbus_message_unref(reply);
-    set_err(err, err_cap, "Unexpected DBus response");
-    return MPRIS_ERROR;
-  }
-
-  DBusMessageIter array;
-  dbus_message_iter_recurse(&variant, &array);
-  while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY) {
+static void read_metadata_dict(DBusMessageIter *array, char **artist,
+                               char **title, int64_t *duration_ms,
+                               char **trackid) {
+  while (dbus_message_iter_get_arg_type(array) == DBUS_TYPE_DICT_ENTRY) {
     DBusMessageIter dict;
-    dbus_message_iter_recurse(&array, &dict);
+    dbus_message_iter_recurse(array, &dict);
     if (dbus_message_iter_get_arg_type(&dict) != DBUS_TYPE_STRING) {
-      dbus_message_iter_next(&array);
+      dbus_message_iter_next(array);
       continue;
     }
     const char *key = NULL;
     dbus_message_iter_get_basic(&dict, &key);
     if (!dbus_message_iter_next(&dict)) {
-      dbus_message_iter_next(&array);
+      dbus_message_iter_next(array);
       continue;
     }
     if (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_VARIANT) {
@@ -214,11 +188,58 @@ static mpris_status get_metadata(DBusConnection *conn, const char *bus_name,
             *duration_ms = (int64_t)(len / 1000);
           }
         }
+      } else if (key && trackid && strcmp(key, "mpris:trackid") == 0) {
+        int type = dbus_message_iter_get_arg_type(&val);
+        if (type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_STRING) {
+          const char *id = NULL;
+          dbus_message_iter_get_basic(&val, &id);
+          if (id && !*trackid) {
+            *trackid = dup_string(id);
+          }
+        }
       }
     }
-    dbus_message_iter_next(&array);
+    dbus_message_iter_next(array);
+  }
+}
+
+static mpris_status get_metadata(DBusConnection *conn, const char *bus_name,
+                                 char **artist, char **title, int64_t *duration_ms,
+                                 char **trackid, char *err, size_t err_cap) {
+  DBusError dbus_err;
+  dbus_error_init(&dbus_err);
+  DBusMessage *reply = get_property_reply(conn, bus_name, MPRIS_PLAYER_IFACE,
+                                         "Metadata", &dbus_err);
+  if (!reply) {
+    if (dbus_error_is_set(&dbus_err)) {
+      set_err(err, err_cap, dbus_err.message);
+      dbus_error_free(&dbus_err);
+    } else {
+      set_err(err, err_cap, "Failed to read MPRIS metadata");
+    }
+    return MPRIS_ERROR;
   }
 
+  DBusMessageIter iter;
+  if (!dbus_message_iter_init(reply, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+    dbus_message_unref(reply);
+    set_err(err, err_cap, "Unexpected DBus response");
+    return MPRIS_ERROR;
+  }
+
+  DBusMessageIter variant;
+  dbus_message_iter_recurse(&iter, &variant);
+  if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_ARRAY) {
+    dbus_message_unref(reply);
+    set_err(err, err_cap, "Unexpected DBus response");
+    return MPRIS_ERROR;
+  }
+
+  DBusMessageIter array;
+  dbus_message_iter_recurse(&variant, &array);
+  read_metadata_dict(&array, artist, title, duration_ms, trackid);
+
   dbus_message_unref(reply);
   if (!*artist || !*title) {
     set_err(err, err_cap, "MPRIS metadata incomplete");
@@ -298,7 +319,8 @@ mpris_status mpris_get_current(const char *bus_name, player_track *out, char *er
     }
   }
 
-  st = get_metadata(conn, bus_name, &artist, &title, &duration_ms, err, err_cap);
+  st = get_metadata(conn, bus_name, &artist, &title, &duration_ms, NULL, err,
+                    err_cap);
   if (st != MPRIS_OK) {
     free(artist);
     free(title);
@@ -324,6 +346,196 @@ mpris_status mpris_get_current(const char *bus_name, player_track *out, char *er
   return MPRIS_OK;
 }
 
+static char *get_next_track_path(DBusConnection *conn, const char *bus_name,
+                                 const char *current_id) {
+  DBusError dbus_err;
+  dbus_error_init(&dbus_err);
+  DBusMessage *reply = get_property_reply(conn, bus_name, MPRIS_TRACKLIST_IFACE,
+                                         "Tracks", &dbus_err);
+  char *next = NULL;
+  int take_next = 0;
+
+  if (!reply) {
+    if (dbus_error_is_set(&dbus_err)) {
+      dbus_error_free(&dbus_err);
+    }
+    return NULL;
+  }
+
+  DBusMessageIter iter;
+  if (!dbus_message_iter_init(reply, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+    dbus_message_unref(reply);
+    return NULL;
+  }
+  DBusMessageIter variant;
+  dbus_message_iter_recurse(&iter, &variant);
+  if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_ARRAY) {
+    dbus_message_unref(reply);
+    return NULL;
+  }
+
+  DBusMessageIter tracks;
+  dbus_message_iter_recurse(&variant, &tracks);
+  while (dbus_message_iter_get_arg_type(&tracks) == DBUS_TYPE_OBJECT_PATH) {
+    const char *path = NULL;
+    dbus_message_iter_get_basic(&tracks, &path);
+    if (path && take_next) {
+      next = dup_string(path);
+      break;
+    }
+    if (path && strcmp(path, current_id) == 0) {
+      take_next = 1;
+    }
+    dbus_message_iter_next(&tracks);
+  }
+
+  dbus_message_unref(reply);
+  return next;
+}
+
+static mpris_status get_track_metadata(DBusConnection *conn,
+                                       const char *bus_name, const char *path,
+                                       char **artist, char **title,
+                                       int64_t *duration_ms, char *err,
+                                       size_t err_cap) {
+  DBusMessage *msg = dbus_message_new_method_call(
+      bus_name, "/org/mpris/MediaPlayer2", MPRIS_TRACKLIST_IFACE,
+      "GetTracksMetadata");
+  if (!msg) {
+    return MPRIS_ERROR;
+  }
+
+  DBusMessageIter args;
+  DBusMessageIter paths;
+  dbus_message_iter_init_append(msg, &args);
+  if (!dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY,
+                                        DBUS_TYPE_OBJECT_PATH_AS_STRING,
+                                        &paths) ||
+      !dbus_message_iter_append_basic(&paths, DBUS_TYPE_OBJECT_PATH, &path) ||
+      !dbus_message_iter_close_container(&args, &paths)) {
+    dbus_message_unref(msg);
+    return MPRIS_ERROR;
+  }
+
+  DBusError dbus_err;
+  dbus_error_init(&dbus_err);
+  DBusMessage *reply =
+      dbus_connection_send_with_reply_and_block(conn, msg, 1000, &dbus_err);
+  dbus_message_unref(msg);
+  if (!reply) {
+    if (dbus_error_is_set(&dbus_err)) {
+      set_err(err, err_cap, dbus_err.message);
+      dbus_error_free(&dbus_err);
+    }
+    return MPRIS_ERROR;
+  }
+
+  DBusMessageIter iter;
+  if (!dbus_message_iter_init(reply, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+    dbus_message_unref(reply);
+    set_err(err, err_cap, "Unexpected DBus response");
+    return MPRIS_ERROR;
+  }
+  DBusMessageIter list;
+  dbus_message_iter_recurse(&iter, &list);
+  if (dbus_message_iter_get_arg_type(&list) == DBUS_TYPE_ARRAY) {
+    DBusMessageIter array;
+    dbus_message_iter_recurse(&list, &array);
+    read_metadata_dict(&array, artist, title, duration_ms, NULL);
+  }
+
+  dbus_message_unref(reply);
+  if (!*artist || !*title) {
+    set_err(err, err_cap, "MPRIS metadata incomplete");
+    return MPRIS_ERROR;
+  }
+  return MPRIS_OK;
+}
+
+mpris_status mpris_get_next(const char *bus_name, player_track *out, char *err,
+                            size_t err_cap) {
+  char *artist = NULL;
+  char *title = NULL;
+  char *trackid = NULL;
+  char *next_path = NULL;
+  int64_t duration_ms = -1;
+
+  if (!bus_name || !out) {
+    set_err(err, err_cap, "Invalid output pointer");
+    return MPRIS_ERROR;
+  }
+  player_track_reset(out);
+
+  DBusError dbus_err;
+  dbus_error_init(&dbus_err);
+  DBusConnection *conn = dbus_bus_get(DBUS_BUS_SESSION, &dbus_err);
+  if (!conn) {
+    if (dbus_error_is_set(&dbus_err)) {
+      set_err(err, err_cap, dbus_err.message);
+      dbus_error_free(&dbus_err);
+    } else {
+      set_err(err, err_cap, "Failed to connect to session bus");
+    }
+    return MPRIS_ERROR;
+  }
+
+  dbus_bool_t has_owner = dbus_bus_name_has_owner(conn, bus_name, &dbus_err);
+  if (dbus_error_is_set(&dbus_err)) {
+    set_err(err, err_cap, dbus_err.message);
+    dbus_error_free(&dbus_err);
+    dbus_connection_unref(conn);
+    return MPRIS_ERROR;
+  }
+  if (!has_owner) {
+    dbus_connection_unref(conn);
+    return MPRIS_NO_SESSION;
+  }
+
+  /* Players without the optional TrackList interface have no next track. */
+  if (get_metadata(conn, bus_name, &artist, &title, NULL, &trackid, NULL, 0) !=
+          MPRIS_OK ||
+      !trackid) {
+    free(artist);
+    free(title);
+    free(trackid);
+    dbus_connection_unref(conn);
+    return MPRIS_NO_TRACK;
+  }
+  free(artist);
+  free(title);
+  artist = NULL;
+  title = NULL;
+
+  next_path = get_next_track_path(conn, bus_name, trackid);
+  free(trackid);
+  if (!next_path) {
+    dbus_connection_unref(conn);
+    return MPRIS_NO_TRACK;
+  }
+
+  mpris_status st = get_track_metadata(conn, bus_name, next_path, &artist,
+                                       &title, &duration_ms, err, err_cap);
+  free(next_path);
+  if (st != MPRIS_OK) {
+    free(artist);
+    free(title);
+    dbus_connection_unref(conn);
+    return st;
+  }
+
+  snprintf(out->artist, sizeof(out->artist), "%s", artist);
+  snprintf(out->title, sizeof(out->title), "%s", title);
+  out->duration = duration_ms > 0 ? (double)duration_ms / 1000.0 : 0.0;
+  out->has_song = 1;
+
+  free(artist);
+  free(title);
+  dbus_connection_unref(conn);
+  return MPRIS_OK;
+}
+
 #else
 
 mpris_status mpris_get_current(const char *bus_name, player_track *out, char *err,
@@ -335,4 +547,13 @@ mpris_status mpris_get_current(const char *bus_name, player_track *out, char *er
   return MPRIS_NO_SESSION;
 }
 
+mpris_status mpris_get_next(const char *bus_name, player_track *out, char *err,
+                            size_t err_cap) {
+  (void)bus_name;
+  (void)out;
+  (void)err;
+  (void)err_cap;
+  return MPRIS_NO_SESSION;
+}
+
 #endif
@@ -13,5 +13,7 @@ typedef enum {
 
 mpris_status mpris_get_current(const char *bus_name, player_track *out, char *err,
                                size_t err_cap);
+mpris_status mpris_get_next(const char *bus_name, player_track *out, char *err,
+                            size_t err_cap);
 
 #endif
@@ -6,6 +6,8 @@ spotify_status spotify_win_get_current(player_track *out, char *err,
 #else
 spotify_status spotify_mpris_get_current(player_track *out, char *err,
                                          size_t err_cap);
+spotify_status spotify_mpris_get_next(player_track *out, char *err,
+                                      size_t err_cap);
 #endif
 
 spotify_status spotify_get_current(player_track *out, char *err, size_t err_cap) {
@@ -15,3 +17,14 @@ spotify_status spotify_get_current(player_track *out, char *err, size_t err_cap)
   return spotify_mpris_get_current(out, err, err_cap);
 #endif
 }
+
+spotify_status spotify_get_next(player_track *out, char *err, size_t err_cap) {
+#ifdef _WIN32
+  (void)out;
+  (void)err;
+  (void)err_cap;
+  return SPOTIFY_NO_TRACK;
+#else
+  return spotify_mpris_get_next(out, err, err_cap);
+#endif
+}
@@ -13,4 +13,14 @@ spotify_status spotify_mpris_get_current(player_track *out, char *err,
   return (spotify_status)st;
 }
 
+spotify_status spotify_mpris_get_next(player_track *out, char *err,
+                                      size_t err_cap) {
+  mpris_status st = mpris_get_next("org.mpris.MediaPlayer2.spotify", out, err,
+                                   err_cap);
+  if (st == MPRIS_OK) {
+    out->source = PLAYER_SOURCE_SPOTIFY;
+  }
+  return (spotify_status)st;
+}
+
 #endif
@@ -6,6 +6,8 @@ ytmusic_status ytmusic_win_get_current(player_track *out, char *err,
 #else
 ytmusic_status ytmusic_mpris_get_current(player_track *out, char *err,
                                          size_t err_cap);
+ytmusic_status ytmusic_mpris_get_next(player_track *out, char *err,
+                                      size_t err_cap);
 #endif
 
 ytmusic_status ytmusic_get_current(player_track *out, char *err, size_t err_cap) {
@@ -15,3 +17,14 @@ ytmusic_status ytmusic_get_current(player_track *out, char *err, size_t err_cap)
   return ytmusic_mpris_get_current(out, err, err_cap);
 #endif
 }
+
+ytmusic_status ytmusic_get_next(player_track *out, char *err, size_t err_cap) {
+#ifdef _WIN32
+  (void)out;
+  (void)err;
+  (void)err_cap;
+  return YTMUSIC_NO_TRACK;
+#else
+  return ytmusic_mpris_get_next(out, err, err_cap);
+#endif
+}
@@ -55,4 +55,19 @@ ytmusic_status ytmusic_mpris_get_current(player_track *out, char *err,
   return YTMUSIC_NO_SESSION;
 }
 
+ytmusic_status ytmusic_mpris_get_next(player_track *out, char *err,
+                                      size_t err_cap) {
+  for (size_t i = 0; ytmusic_bus_names[i]; i++) {
+    mpris_status st = mpris_get_next(ytmusic_bus_names[i], out, err, err_cap);
+    if (st == MPRIS_OK) {
+      out->source = PLAYER_SOURCE_YOUTUBE;
+      return YTMUSIC_OK;
+    }
+    if (st != MPRIS_NO_SESSION) {
+      return (ytmusic_status)st;
+    }
+  }
+  return YTMUSIC_NO_SESSION;
+}
+
 #endif
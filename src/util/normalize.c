@@ -1,9 +1,53 @@
 #include "app/normalize.h"
+#include "app/unicode.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * U+00C0..U+017F decomposed (NFD) and case folded, so precomposed and
+ * combining-mark spellings of the same name produce the same key.
+ */
+static const char *const latin_fold[0x180 - 0xC0] = {
+    "a\xcc\x80", "a\xcc\x81", "a\xcc\x82", "a\xcc\x83", "a\xcc\x88",
+    "a\xcc\x8a", "\xc3\xa6", "c\xcc\xa7", "e\xcc\x80", "e\xcc\x81", "e\xcc\x82",
+    "e\xcc\x88", "i\xcc\x80", "i\xcc\x81", "i\xcc\x82", "i\xcc\x88", "\xc3\xb0",
+    "n\xcc\x83", "o\xcc\x80", "o\xcc\x81", "o\xcc\x82", "o\xcc\x83",
+    "o\xcc\x88", "\xc3\x97", "\xc3\xb8", "u\xcc\x80", "u\xcc\x81", "u\xcc\x82",
+    "u\xcc\x88", "y\xcc\x81", "\xc3\xbe", "ss", "a\xcc\x80", "a\xcc\x81",
+    "a\xcc\x82", "a\xcc\x83", "a\xcc\x88", "a\xcc\x8a", "\xc3\xa6", "c\xcc\xa7",
+    "e\xcc\x80", "e\xcc\x81", "e\xcc\x82", "e\xcc\x88", "i\xcc\x80",
+    "i\xcc\x81", "i\xcc\x82", "i\xcc\x88", "\xc3\xb0", "n\xcc\x83", "o\xcc\x80",
+    "o\xcc\x81", "o\xcc\x82", "o\xcc\x83", "o\xcc\x88", "\xc3\xb7", "\xc3\xb8",
+    "u\xcc\x80", "u\xcc\x81", "u\xcc\x82", "u\xcc\x88", "y\xcc\x81", "\xc3\xbe",
+    "y\xcc\x88", "a\xcc\x84", "a\xcc\x84", "a\xcc\x86", "a\xcc\x86",
+    "a\xcc\xa8", "a\xcc\xa8", "c\xcc\x81", "c\xcc\x81", "c\xcc\x82",
+    "c\xcc\x82", "c\xcc\x87", "c\xcc\x87", "c\xcc\x8c", "c\xcc\x8c",
+    "d\xcc\x8c", "d\xcc\x8c", "\xc4\x91", "\xc4\x91", "e\xcc\x84", "e\xcc\x84",
+    "e\xcc\x86", "e\xcc\x86", "e\xcc\x87", "e\xcc\x87", "e\xcc\xa8",
+    "e\xcc\xa8", "e\xcc\x8c", "e\xcc\x8c", "g\xcc\x82", "g\xcc\x82",
+    "g\xcc\x86", "g\xcc\x86", "g\xcc\x87", "g\xcc\x87", "g\xcc\xa7",
+    "g\xcc\xa7", "h\xcc\x82", "h\xcc\x82", "\xc4\xa7", "\xc4\xa7", "i\xcc\x83",
+    "i\xcc\x83", "i\xcc\x84", "i\xcc\x84", "i\xcc\x86", "i\xcc\x86",
+    "i\xcc\xa8", "i\xcc\xa8", "i\xcc\x87", "\xc4\xb1", "\xc4\xb3", "\xc4\xb3",
+    "j\xcc\x82", "j\xcc\x82", "k\xcc\xa7", "k\xcc\xa7", "\xc4\xb8", "l\xcc\x81",
+    "l\xcc\x81", "l\xcc\xa7", "l\xcc\xa7", "l\xcc\x8c", "l\xcc\x8c", "\xc5\x80",
+    "\xc5\x80", "\xc5\x82", "\xc5\x82", "n\xcc\x81", "n\xcc\x81", "n\xcc\xa7",
+    "n\xcc\xa7", "n\xcc\x8c", "n\xcc\x8c", "\xca\xbcn", "\xc5\x8b", "\xc5\x8b",
+    "o\xcc\x84", "o\xcc\x84", "o\xcc\x86", "o\xcc\x86", "o\xcc\x8b",
+    "o\xcc\x8b", "\xc5\x93", "\xc5\x93", "r\xcc\x81", "r\xcc\x81", "r\xcc\xa7",
+    "r\xcc\xa7", "r\xcc\x8c", "r\xcc\x8c", "s\xcc\x81", "s\xcc\x81",
+    "s\xcc\x82", "s\xcc\x82", "s\xcc\xa7", "s\xcc\xa7", "s\xcc\x8c",
+    "s\xcc\x8c", "t\xcc\xa7", "t\xcc\xa7", "t\xcc\x8c", "t\xcc\x8c", "\xc5\xa7",
+    "\xc5\xa7", "u\xcc\x83", "u\xcc\x83", "u\xcc\x84", "u\xcc\x84", "u\xcc\x86",
+    "u\xcc\x86", "u\xcc\x8a", "u\xcc\x8a", "u\xcc\x8b", "u\xcc\x8b",
+    "u\xcc\xa8", "u\xcc\xa8", "w\xcc\x82", "w\xcc\x82", "y\xcc\x82",
+    "y\xcc\x82", "y\xcc\x88", "z\xcc\x81", "z\xcc\x81", "z\xcc\x87",
+    "z\xcc\x87", "z\xcc\x8c", "z\xcc\x8c", "s",
+};
+
 static int is_space(char c) {
   return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
@@ -136,11 +180,25 @@ static char *strip_brackets_if_keyword(const char *s) {
   return out;
 }
 
+/* Only whole words count, so "Defeated" or "Loft." are left alone. */
+static const char *find_word_ci(const char *s, const char *word) {
+  size_t len = strlen(word);
+  for (const char *pos = s; (pos = strcasestr_ascii(pos, word)) != NULL;
+       ++pos) {
+    int starts = pos == s || !isalnum((unsigned char)pos[-1]);
+    int ends = word[len - 1] == '.' || !isalpha((unsigned char)pos[len]);
+    if (starts && ends) {
+      return pos;
+    }
+  }
+  return NULL;
+}
+
 static void truncate_after_keyword(char *s) {
   const char *keywords[] = {"feat", "ft.", "featuring"};
   char *cut = NULL;
   for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i) {
-    const char *pos = strcasestr_ascii(s, keywords[i]);
+    const char *pos = find_word_ci(s, keywords[i]);
     if (pos && (!cut || pos < cut)) {
       cut = (char *)pos;
     }
@@ -205,3 +263,125 @@ char *normalize_artist(const char *artist) {
   collapse_spaces(out);
   return out;
 }
+
+static int is_space_cp(uint32_t cp) {
+  return cp == ' ' || cp == '\t' || cp == '\n' || cp == '\r' || cp == 0xA0 ||
+         (cp >= 0x2000 && cp <= 0x200A) || cp == 0x202F || cp == 0x205F ||
+         cp == 0x3000;
+}
+
+/* Punctuation, quotes, dashes and invisible marks do not name a track. */
+static int is_punct_cp(uint32_t cp) {
+  return (cp < 0x80 && ispunct((int)cp)) || (cp >= 0xA1 && cp <= 0xBF) ||
+         (cp >= 0x200B && cp <= 0x200F) || (cp >= 0x2010 && cp <= 0x205E) ||
+         (cp >= 0x3001 && cp <= 0x3003) || (cp >= 0x3008 && cp <= 0x3011) ||
+         (cp >= 0x3014 && cp <= 0x301F) || cp == 0xFEFF;
+}
+
+static uint32_t fold_cp(uint32_t cp) {
+  if (cp >= 0xFF01 && cp <= 0xFF5E) {
+    cp -= 0xFEE0;
+  }
+  if (cp >= 'A' && cp <= 'Z') {
+    return cp + 0x20;
+  }
+  if ((cp >= 0x391 && cp <= 0x3A9 && cp != 0x3A2) ||
+      (cp >= 0x410 && cp <= 0x42F)) {
+    return cp + 0x20;
+  }
+  if (cp >= 0x400 && cp <= 0x40F) {
+    return cp + 0x50;
+  }
+  return cp;
+}
+
+static void append_bytes(char *out, size_t out_size, size_t *len,
+                         const char *bytes, size_t count) {
+  if (*len + count < out_size) {
+    memcpy(out + *len, bytes, count);
+    *len += count;
+  }
+}
+
+/*
+ * Appends a case-folded, decomposed form of part. Runs of whitespace become
+ * one space; punctuation is dropped unless keep_punct is set. Bytes that are
+ * not valid UTF-8 are copied through unchanged.
+ */
+static void append_key_part(char *out, size_t out_size, size_t *len,
+                            const char *part, int keep_punct) {
+  size_t start = *len;
+  size_t i = 0;
+  size_t n = strlen(part);
+  int space = 0;
+
+  while (i < n) {
+    uint32_t cp;
+    size_t used;
+    char bytes[4];
+    size_t count;
+
+    if (unicode_decode_utf8(part + i, n - i, &cp, &used) != 0) {
+      space = 0;
+      append_bytes(out, out_size, len, part + i, 1);
+      i++;
+      continue;
+    }
+    i += used;
+    cp = fold_cp(cp);
+    if (is_space_cp(cp)) {
+      space = *len > start;
+      continue;
+    }
+    if (!keep_punct && is_punct_cp(cp)) {
+      continue;
+    }
+    if (space) {
+      append_bytes(out, out_size, len, " ", 1);
+      space = 0;
+    }
+    if (cp >= 0xC0 && cp < 0x180) {
+      const char *folded = latin_fold[cp - 0xC0];
+      append_bytes(out, out_size, len, folded, strlen(folded));
+    } else if (unicode_encode_utf8(cp, bytes, &count) == 0) {
+      append_bytes(out, out_size, len, bytes, count);
+    }
+  }
+  out[*len] = '\0';
+}
+
+int normalize_track_key(const char *artist, const char *title, char *out,
+                        size_t out_size) {
+  char *norm_artist;
+  char *norm_title;
+  size_t title_start;
+  size_t len = 0;
+
+  if (!title || !out || out_size == 0) {
+    return -1;
+  }
+  norm_artist = normalize_artist(artist ? artist : "");
+  norm_title = normalize_title(title);
+  if (!norm_artist || !norm_title) {
+    free(norm_artist);
+    free(norm_title);
+    return -1;
+  }
+
+  out[0] = '\0';
+  append_key_part(out, out_size, &len, norm_artist, 0);
+  if (len + 1 < out_size) {
+    out[len++] = '\t';
+    out[len] = '\0';
+  }
+  title_start = len;
+  append_key_part(out, out_size, &len,
+                  norm_title[0] != '\0' ? norm_title : title, 0);
+  if (len == title_start) {
+    /* A title made only of punctuation ("?", "...") keeps it. */
+    append_key_part(out, out_size, &len, title, 1);
+  }
+  free(norm_artist);
+  free(norm_title);
+  return 0;
+}
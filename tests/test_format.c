@@ -0,0 +1,148 @@
+#include "app/lyrics.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * lyrics_parse tag scanning and lyrics_cursor_find. Prints each failed
+ * check and exits non-zero when any failed.
+ */
+
+static int g_failed;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+      g_failed++;                                                    \
+    }                                                                \
+  } while (0)
+
+/* Start of the only line of a one-line doc, or -1. */
+static int32_t single_time(const char *text) {
+  lyrics_doc *doc = lyrics_parse(text);
+  int32_t ms = -1;
+
+  if (doc && doc->has_timestamps && doc->count == 1) {
+    ms = doc->times[0];
+  }
+  lyrics_free(doc);
+  return ms;
+}
+
+static void test_time_tags(void) {
+  CHECK(single_time("[00:07]a") == 7000);
+  CHECK(single_time("[01:02.5]a") == 62500);
+  CHECK(single_time("[01:02.25]a") == 62250);
+  CHECK(single_time("[01:02.125]a") == 62125);
+  /* Digits past milliseconds are dropped, not rounded. */
+  CHECK(single_time("[01:02.1239]a") == 62123);
+  CHECK(single_time("[01:02:03.45]a") == 3723450);
+  CHECK(single_time("[1:2]a") == 62000);
+}
+
+static void test_multiple_tags(void) {
+  lyrics_doc *doc = lyrics_parse("[00:03.00][00:01.00]chorus\n[00:02.00]verse");
+
+  CHECK(doc && doc->has_timestamps && doc->count == 3);
+  if (doc && doc->count == 3) {
+    CHECK(doc->times[0] == 1000 && strcmp(doc->lines[0].text, "chorus") == 0);
+    CHECK(doc->times[1] == 2000 && strcmp(doc->lines[1].text, "verse") == 0);
+    CHECK(doc->times[2] == 3000 && strcmp(doc->lines[2].text, "chorus") == 0);
+  }
+  lyrics_free(doc);
+}
+
+static void test_offset(void) {
+  lyrics_doc *doc;
+
+  CHECK(single_time("[offset:+250]\n[00:01.00]a") == 1250);
+  CHECK(single_time("[offset:-250]\n[00:01.00]a") == 750);
+  /* The first offset tag of a line counts; a later line overrides it. */
+  CHECK(single_time("[offset:100][offset:900]\n[00:01.00]a") == 1100);
+  CHECK(single_time("[offset:100]\n[offset:900]\n[00:01.00]a") == 1900);
+  /* Too many digits to be a sane offset: ignored. */
+  CHECK(single_time("[offset:+9999999999]\n[00:01.00]a") == 1000);
+  /* Shifted times clamp at both ends. */
+  CHECK(single_time("[offset:-5000]\n[00:01.00]a") == 0);
+  CHECK(single_time("[offset:+99999999]\n[590:00:00]a") == INT32_MAX);
+
+  doc = lyrics_parse("[offset:-1500]\n[00:01.00]a\n[00:03.00]b");
+  CHECK(doc && doc->count == 2);
+  if (doc && doc->count == 2) {
+    CHECK(doc->times[0] == 0 && doc->times[1] == 1500);
+  }
+  lyrics_free(doc);
+}
+
+static void test_plain(void) {
+  lyrics_doc *doc = lyrics_parse("we met at [00:01] sharp\nsecond line\n");
+
+  /* A time tag inside the text does not make the doc synced. */
+  CHECK(doc && !doc->has_timestamps && doc->count == 2);
+  if (doc && doc->count == 2) {
+    CHECK(strcmp(doc->lines[0].text, "we met at [00:01] sharp") == 0);
+  }
+  lyrics_free(doc);
+
+  doc = lyrics_parse("[ar:Someone]\n[00:0x]not a tag\nplain");
+  CHECK(doc && !doc->has_timestamps);
+  lyrics_free(doc);
+}
+
+static void test_cursor(void) {
+  lyrics_doc *doc = lyrics_parse("[00:01]a\n[00:02]b\n[00:03]c\n[00:04]d\n"
+                                 "[00:05]e\n[00:06]f\n[00:07]g\n[00:08]h\n"
+                                 "[00:09]i\n[00:10]j");
+  lyrics_cursor cursor;
+  double until = 0.0;
+
+  CHECK(doc && doc->count == 10);
+  if (!doc) {
+    return;
+  }
+  lyrics_cursor_reset(&cursor);
+  CHECK(lyrics_cursor_find(&cursor, doc, 0.5, &until) == -1);
+  CHECK(until > 0.49 && until < 0.51);
+  CHECK(lyrics_cursor_find(&cursor, doc, 1.0, NULL) == 0);
+  CHECK(lyrics_cursor_find(&cursor, doc, 2.5, NULL) == 1);
+  CHECK(lyrics_cursor_find(&cursor, doc, 2.9, NULL) == 1);
+  /* More lines than the cursor steps through: a forward seek. */
+  CHECK(lyrics_cursor_find(&cursor, doc, 8.2, NULL) == 7);
+  /* Backward jumps search again. */
+  CHECK(lyrics_cursor_find(&cursor, doc, 3.0, NULL) == 2);
+  CHECK(lyrics_cursor_find(&cursor, doc, 0.0, NULL) == -1);
+  CHECK(lyrics_cursor_find(&cursor, doc, 4.5, NULL) == 3);
+  CHECK(lyrics_cursor_find(&cursor, doc, 60.0, &until) == 9);
+  CHECK(until == -1.0);
+
+  /* Every answer matches the plain search, whatever the cursor held. */
+  {
+    static const double seq[] = {0.0, 9.5, 1.2, 1.2, 6.0, 5.99, 10.0, 0.99};
+    size_t i;
+
+    for (i = 0; i < sizeof(seq) / sizeof(seq[0]); i++) {
+      CHECK(lyrics_cursor_find(&cursor, doc, seq[i], NULL) ==
+            lyrics_find_current(doc, seq[i]));
+    }
+  }
+
+  /* A cursor left over from a longer doc is not trusted. */
+  cursor.reached = 50;
+  CHECK(lyrics_cursor_find(&cursor, doc, 2.0, NULL) == 1);
+  lyrics_free(doc);
+}
+
+int main(void) {
+  test_time_tags();
+  test_multiple_tags();
+  test_offset();
+  test_plain();
+  test_cursor();
+  if (g_failed) {
+    fprintf(stderr, "test_format: %d failed\n", g_failed);
+    return 1;
+  }
+  printf("test_format: ok\n");
+  return 0;
+}
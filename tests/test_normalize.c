@@ -0,0 +1,105 @@
+#include "app/normalize.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * normalize_track_key folding: spellings of one track share a key and
+ * different tracks keep different keys. Exits non-zero on any failure.
+ */
+
+static int g_failed;
+
+static int same_key(const char *artist_a, const char *title_a,
+                    const char *artist_b, const char *title_b) {
+  char a[512];
+  char b[512];
+
+  if (normalize_track_key(artist_a, title_a, a, sizeof(a)) != 0 ||
+      normalize_track_key(artist_b, title_b, b, sizeof(b)) != 0) {
+    return -1;
+  }
+  return strcmp(a, b) == 0;
+}
+
+static void expect(int line, int got, int want, const char *title_a,
+                   const char *title_b) {
+  if (got != want) {
+    fprintf(stderr, "%s:%d: \"%s\" and \"%s\" should %sshare a key\n",
+            __FILE__, line, title_a, title_b, want ? "" : "not ");
+    g_failed++;
+  }
+}
+
+#define SAME(a1, t1, a2, t2) \
+  expect(__LINE__, same_key(a1, t1, a2, t2), 1, t1, t2)
+#define DIFFERENT(a1, t1, a2, t2) \
+  expect(__LINE__, same_key(a1, t1, a2, t2), 0, t1, t2)
+
+static void test_key_format(void) {
+  char key[64];
+
+  if (normalize_track_key("The Band", "A Song!", key, sizeof(key)) != 0 ||
+      strcmp(key, "the band\ta song") != 0) {
+    fprintf(stderr, "%s:%d: unexpected key \"%s\"\n", __FILE__, __LINE__,
+            key);
+    g_failed++;
+  }
+  if (normalize_track_key("x", NULL, key, sizeof(key)) != -1) {
+    fprintf(stderr, "%s:%d: a missing title must fail\n", __FILE__,
+            __LINE__);
+    g_failed++;
+  }
+}
+
+static void test_latin(void) {
+  /* Precomposed and combining-mark spellings. */
+  SAME("Beyonc\xc3\xa9", "D\xc3\xa9j\xc3\xa0 Vu", "Beyonce\xcc\x81",
+       "De\xcc\x81ja\xcc\x80 Vu");
+  SAME("", "\xc3\x89T\xc3\x89", "", "\xc3\xa9t\xc3\xa9");
+  SAME("", "\xc5\xbd" "al", "", "z\xcc\x8c" "al");
+  SAME("", "Stra\xc3\x9f" "e", "", "strasse");
+  /* The accent still tells words apart. */
+  DIFFERENT("", "R\xc3\xa9sum\xc3\xa9", "", "Resume");
+  DIFFERENT("", "\xc3\x86on", "", "AEon");
+  DIFFERENT("", "\xc3\x98ya", "", "Oya");
+}
+
+static void test_fullwidth(void) {
+  SAME("\xef\xbc\xa1\xef\xbc\xa2\xef\xbc\xa1",
+       "\xef\xbc\xb3\xef\xbd\x8f\xef\xbd\x8e\xef\xbd\x87", "ABA", "song");
+  /* Fullwidth punctuation and the ideographic space fold too. */
+  SAME("", "Hi\xef\xbc\x81\xe3\x80\x80there", "", "hi there");
+}
+
+static void test_greek_cyrillic(void) {
+  SAME("", "\xce\x91\xce\x92\xce\x93", "", "\xce\xb1\xce\xb2\xce\xb3");
+  SAME("", "\xd0\x81\xd0\x96", "", "\xd1\x91\xd0\xb6");
+  /* Look-alike letters from other scripts are other tracks. */
+  DIFFERENT("", "\xce\x91\xce\x92", "", "AB");
+  DIFFERENT("", "\xd0\xa0\xd0\x9e", "", "PO");
+}
+
+static void test_descriptors(void) {
+  SAME("Artist feat. Guest", "Track (Remastered 2011)", "artist", "track");
+  SAME("A & B", "Track - Live", "A", "Track");
+  SAME("", "Don\xe2\x80\x99t Stop", "", "Dont Stop");
+  /* Punctuation-only titles keep their punctuation. */
+  DIFFERENT("", "?", "", "...");
+  /* "feat" and "ft." only cut at whole words. */
+  DIFFERENT("Defeated", "x", "De", "x");
+  DIFFERENT("", "Loft.", "", "Lo");
+}
+
+int main(void) {
+  test_key_format();
+  test_latin();
+  test_fullwidth();
+  test_greek_cyrillic();
+  test_descriptors();
+  if (g_failed) {
+    fprintf(stderr, "test_normalize: %d failed\n", g_failed);
+    return 1;
+  }
+  printf("test_normalize: ok\n");
+  return 0;
+}